@@ -0,0 +1,55 @@
+#!/usr/bin/python3
+
+"""
+
+This script runs a pipeline described in a JSON file
+on the expression matrix stored in a given directory,
+using ExpressionMatrix.runPipeline.
+If the directory does not exist, a new expression matrix is created there.
+
+Stages that completed in a previous run with the same parameters are skipped,
+so after a failure the script can be invoked again
+to resume the pipeline from the stage that failed.
+See the documentation of ExpressionMatrix.runPipeline for more information.
+
+"""
+
+import argparse
+import os
+from ExpressionMatrix2 import ExpressionMatrix, setThreadCount
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=
+        'Runs a pipeline described in a JSON file on an expression matrix.')
+    parser.add_argument('directory', help=
+        'The directory containing the expression matrix. It is created if it does not exist.')
+    parser.add_argument('pipeline', help='The JSON file describing the pipeline.')
+    parser.add_argument('--force', action='store_true', help=
+        'Run all stages, even those that already completed with the same parameters.')
+    parser.add_argument('--threads', type=int, default=0, help=
+        'The number of threads to use. The default uses all hardware threads.')
+    parser.add_argument('--gene-capacity', type=int, default=1<<18, help=
+        'Gene capacity of a new expression matrix.')
+    parser.add_argument('--cell-capacity', type=int, default=1<<24, help=
+        'Cell capacity of a new expression matrix.')
+    parser.add_argument('--cell-meta-data-name-capacity', type=int, default=1<<16, help=
+        'Cell meta data name capacity of a new expression matrix.')
+    parser.add_argument('--cell-meta-data-value-capacity', type=int, default=1<<28, help=
+        'Cell meta data value capacity of a new expression matrix.')
+    arguments = parser.parse_args()
+
+    if arguments.threads:
+        setThreadCount(arguments.threads)
+
+    if os.path.exists(arguments.directory):
+        e = ExpressionMatrix(directoryName = arguments.directory)
+    else:
+        e = ExpressionMatrix(
+            directoryName = arguments.directory,
+            geneCapacity = arguments.gene_capacity,
+            cellCapacity = arguments.cell_capacity,
+            cellMetaDataNameCapacity = arguments.cell_meta_data_name_capacity,
+            cellMetaDataValueCapacity = arguments.cell_meta_data_value_capacity)
+
+    e.runPipeline(fileName = arguments.pipeline, force = arguments.force)
@@ -17,6 +17,7 @@ namespace ChanZuckerberg {
         class BitSet;
         class BitSets;
         uint64_t countMismatches(const BitSetPointer&, const BitSetPointer&);
+        uint64_t countMismatches(const BitSetPointer&, const BitSetPointer&, uint64_t bitCount);
         uint64_t commonPrefixLength(const BitSetPointer&, const BitSetPointer&);
     }
 }
@@ -287,6 +288,27 @@ inline uint64_t ChanZuckerberg::ExpressionMatrix2::countMismatches(
     return mismatchCount;
 }
 
+// Count the number of mismatching bits between the first bitCount bits
+// of two bit vectors. Because the first bit is in the most significant position
+// of the first word, the bits of the last partial word are its most significant bits.
+inline uint64_t ChanZuckerberg::ExpressionMatrix2::countMismatches(
+    const BitSetPointer& x,
+    const BitSetPointer& y,
+    uint64_t bitCount)
+{
+    const uint64_t fullWordCount = bitCount >> 6;
+    const uint64_t remainingBitCount = bitCount & 63ULL;
+    uint64_t mismatchCount = 0;
+    for(uint64_t i = 0; i < fullWordCount; i++) {
+        mismatchCount += __builtin_popcountll(x.begin[i] ^ y.begin[i]);
+    }
+    if(remainingBitCount) {
+        const uint64_t mask = ~0ULL << (64ULL - remainingBitCount);
+        mismatchCount += __builtin_popcountll((x.begin[fullWordCount] ^ y.begin[fullWordCount]) & mask);
+    }
+    return mismatchCount;
+}
+
 
 // Return the number of bits in the common prefix of two bit vectors.
 // This is the number of bits, starting at zero, that are identical
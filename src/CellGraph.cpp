@@ -1,6 +1,7 @@
 // CZI.
 #include "CellGraph.hpp"
 #include "color.hpp"
+#include "CounterBasedRandom.hpp"
 #include "CZI_ASSERT.hpp"
 #include "deduplicate.hpp"
 #include "iostream.hpp"
@@ -469,7 +470,10 @@ void CellGraph::labelPropagationClustering(
 
 
     // Create the random number generator using the specified seed.
-    std::mt19937 randomGenerator(seed);
+    // Each iteration uses its own stream, derived from the iteration number,
+    // so the random order of each iteration does not depend on the previous
+    // iterations or on the number of threads used to compute it.
+    const CounterBasedRandom random(seed);
 
     // Vector with all the vertices in the graph, in the same order as in the vertex table.
     vector<vertex_descriptor> allVertices;
@@ -499,7 +503,7 @@ void CellGraph::labelPropagationClustering(
 
         // Create a random shuffle of the vertices, to be used for this iteration.
         shuffledVertices = allVertices;
-        std::shuffle(shuffledVertices.begin(), shuffledVertices.end(), randomGenerator);
+        parallelShuffle(shuffledVertices, random.split(iteration));
 
         // Process the vertices in the order determined by the random shuffle.
         for(const vertex_descriptor v0: shuffledVertices) {
@@ -31,7 +31,7 @@ void CellSets::createNew(const string& directoryNameArgument)
 }
 
 // Access existing CellSets in the specified directory.
-void CellSets::accessExisting(const string& directoryNameArgument, bool allowReadOnly)
+void CellSets::accessExisting(const string& directoryNameArgument, bool allowReadOnly, bool readWriteAccess)
 {
 
     // Store the directory name.
@@ -51,7 +51,11 @@ void CellSets::accessExisting(const string& directoryNameArgument, bool allowRea
 
         // We found a file containing a CellSet. Access it.
         shared_ptr<CellSet> mappedCellSet = make_shared<CellSet>();
-        mappedCellSet->accessExistingReadWrite(fileName, allowReadOnly);
+        if(readWriteAccess) {
+            mappedCellSet->accessExistingReadWrite(fileName, allowReadOnly);
+        } else {
+            mappedCellSet->accessExistingReadOnly(fileName);
+        }
 
         // Store it in our table of known cell sets.
         const string cellSetName = fileName.substr((directoryName + "/CellSet-").size());
@@ -28,7 +28,9 @@ public:
     void createNew(const string& directoryName);
 
     // Access existing CellSets in the specified directory.
-    void accessExisting(const string& directoryName, bool allowReadOnly);
+    // If readWriteAccess is false, they are accessed read-only
+    // and allowReadOnly is ignored.
+    void accessExisting(const string& directoryName, bool allowReadOnly, bool readWriteAccess=true);
 
     // Add a new cell set.
     void addCellSet(
@@ -0,0 +1,227 @@
+// Class CounterBasedRandom is a splittable random number generator
+// that produces results independent of the number of threads used.
+
+#ifndef CZI_EXPRESSION_MATRIX2_COUNTER_BASED_RANDOM_HPP
+#define CZI_EXPRESSION_MATRIX2_COUNTER_BASED_RANDOM_HPP
+
+/*******************************************************************************
+
+A conventional generator such as std::mt19937 produces a single sequence
+that must be consumed in order. A computation that uses it
+cannot be parallelized without changing its results,
+because the numbers each thread gets depend on scheduling.
+
+A counter-based generator instead computes the i-th number of a stream
+as a pure function of (seed, stream id, i). We use Philox4x32-10
+(Salmon et al., Parallel Random Numbers: As Easy as 1, 2, 3, SC11),
+which passes the BigCrush statistical tests and is fast enough
+to be used as a general purpose generator.
+
+This gives two ways to write parallel computations
+whose results don't depend on the number of threads:
+- Derive one stream per unit of work using split(workId),
+  for example one stream per gene, per permutation, or per iteration,
+  and consume each stream sequentially.
+- Use random access functions at(i) and uniform01At(i) to get
+  the random number associated with element i.
+
+A CounterBasedRandom object can also be used sequentially,
+as a drop-in replacement for std::mt19937 or boost::mt19937,
+including with std:: and boost:: distributions.
+
+*******************************************************************************/
+
+#include "CZI_ASSERT.hpp"
+#include "TaskScheduler.hpp"
+
+#include <algorithm>
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include <iterator>
+#include <limits>
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class CounterBasedRandom;
+
+        // Randomly shuffle a vector using multiple threads.
+        // Each element gets a random key from the given stream (keyed by its
+        // position) and the vector is sorted by key. The result only depends
+        // on the stream and on the initial contents of the vector.
+        template<class T> void parallelShuffle(vector<T>&, const CounterBasedRandom&);
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::CounterBasedRandom {
+public:
+
+    // Type required to use this as a UniformRandomBitGenerator.
+    using result_type = uint32_t;
+    static constexpr result_type min()
+    {
+        return 0;
+    }
+    static constexpr result_type max()
+    {
+        return std::numeric_limits<uint32_t>::max();
+    }
+
+    // Construct the stream with the given id for the given seed.
+    explicit CounterBasedRandom(uint64_t seed, uint64_t streamId = 0) :
+        seed(seed),
+        streamId(streamId)
+    {
+    }
+
+    // Return a new, independent stream identified by childId.
+    // The same childId always gives the same stream, so
+    // child streams can be created independently by each thread.
+    CounterBasedRandom split(uint64_t childId) const
+    {
+        return CounterBasedRandom(seed, mix(streamId, childId));
+    }
+
+    // Random access to the stream.
+    // Return the i-th 64 bit random value of the stream.
+    uint64_t at(uint64_t i) const
+    {
+        uint32_t block[4];
+        generateBlock(i >> 1, block);
+        const size_t j = 2 * (i & 1);
+        return (uint64_t(block[j]) << 32) | block[j+1];
+    }
+
+    // Return the i-th random value of the stream, as a double in [0, 1).
+    double uniform01At(uint64_t i) const
+    {
+        return toUniform01(at(i));
+    }
+
+    // Sequential use.
+    // Each call consumes the next 32 bits of the stream.
+    uint32_t operator()()
+    {
+        if(bufferPosition == 4) {
+            generateBlock(nextBlock++, buffer);
+            bufferPosition = 0;
+        }
+        return buffer[bufferPosition++];
+    }
+
+    // Return the next random value as a double in [0, 1).
+    double uniform01()
+    {
+        const uint64_t high = (*this)();
+        const uint64_t low = (*this)();
+        return toUniform01((high << 32) | low);
+    }
+
+    // Return the next random integer, uniformly distributed in [0, n).
+    uint64_t uniformInteger(uint64_t n)
+    {
+        CZI_ASSERT(n > 0);
+
+        // Reject values in the incomplete last copy of [0, n)
+        // to avoid introducing a bias.
+        const uint64_t limit = std::numeric_limits<uint64_t>::max() -
+            std::numeric_limits<uint64_t>::max() % n;
+        while(true) {
+            const uint64_t high = (*this)();
+            const uint64_t low = (*this)();
+            const uint64_t x = (high << 32) | low;
+            if(x < limit) {
+                return x % n;
+            }
+        }
+    }
+
+    // Sequential Fisher-Yates shuffle.
+    // Unlike std::shuffle, the result does not depend on the standard library implementation.
+    template<class Iterator> void shuffle(Iterator begin, Iterator end)
+    {
+        const uint64_t n = uint64_t(std::distance(begin, end));
+        for(uint64_t i=n; i>1; i--) {
+            std::swap(begin[i-1], begin[uniformInteger(i)]);
+        }
+    }
+
+private:
+    uint64_t seed;
+    uint64_t streamId;
+
+    // State used for sequential access.
+    uint64_t nextBlock = 0;
+    uint32_t buffer[4];
+    size_t bufferPosition = 4;
+
+    // The Philox4x32-10 function.
+    // The counter is (block number, stream id) and the key is the seed.
+    void generateBlock(uint64_t blockNumber, uint32_t* x) const
+    {
+        x[0] = uint32_t(blockNumber);
+        x[1] = uint32_t(blockNumber >> 32);
+        x[2] = uint32_t(streamId);
+        x[3] = uint32_t(streamId >> 32);
+        uint32_t key0 = uint32_t(seed);
+        uint32_t key1 = uint32_t(seed >> 32);
+        for(int round=0; round<10; round++) {
+            const uint64_t product0 = uint64_t(0xD2511F53U) * x[0];
+            const uint64_t product1 = uint64_t(0xCD9E8D57U) * x[2];
+            const uint32_t y0 = uint32_t(product1 >> 32) ^ x[1] ^ key0;
+            const uint32_t y1 = uint32_t(product1);
+            const uint32_t y2 = uint32_t(product0 >> 32) ^ x[3] ^ key1;
+            const uint32_t y3 = uint32_t(product0);
+            x[0] = y0;
+            x[1] = y1;
+            x[2] = y2;
+            x[3] = y3;
+            key0 += 0x9E3779B9U;
+            key1 += 0xBB67AE85U;
+        }
+    }
+
+    // Use the 53 most significant bits to get a double in [0, 1).
+    static double toUniform01(uint64_t x)
+    {
+        return double(x >> 11) * (1. / double(uint64_t(1) << 53));
+    }
+
+    // Combine a stream id and a child id into a new stream id
+    // (SplitMix64 finalizer).
+    static uint64_t mix(uint64_t streamId, uint64_t childId)
+    {
+        uint64_t z = streamId * 0x9E3779B97F4A7C15ULL + childId + 1;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+};
+
+
+
+template<class T> void ChanZuckerberg::ExpressionMatrix2::parallelShuffle(
+    vector<T>& v,
+    const CounterBasedRandom& random)
+{
+    // Pair each position with its random key. Ties are broken by position,
+    // so the sort result is fully determined.
+    vector< pair<uint64_t, size_t> > keys(v.size());
+    parallelFor(0, v.size(), [&](size_t i)
+        {
+            keys[i] = make_pair(random.at(i), i);
+        });
+    parallelSort(keys.begin(), keys.end());
+
+    vector<T> shuffled(v.size());
+    parallelFor(0, v.size(), [&](size_t i)
+        {
+            shuffled[i] = v[keys[i].second];
+        });
+    v.swap(shuffled);
+}
+
+#endif
@@ -0,0 +1,179 @@
+#include "ExpressionLayer.hpp"
+#include "CZI_ASSERT.hpp"
+#include "float16.hpp"
+#include "normalizationKernels.hpp"
+#include "stdexcept.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <algorithm>
+#include <cmath>
+
+
+
+string ChanZuckerberg::ExpressionMatrix2::expressionLayerPrecisionToString(ExpressionLayerPrecision precision)
+{
+    switch(precision) {
+    case ExpressionLayerPrecision::float32:
+        return "float32";
+    case ExpressionLayerPrecision::float16:
+        return "float16";
+    case ExpressionLayerPrecision::bfloat16:
+        return "bfloat16";
+    default:
+        return "Invalid";
+    }
+}
+
+ExpressionLayerPrecision ChanZuckerberg::ExpressionMatrix2::expressionLayerPrecisionFromString(const string& s)
+{
+    for(const ExpressionLayerPrecision precision: {
+        ExpressionLayerPrecision::float32,
+        ExpressionLayerPrecision::float16,
+        ExpressionLayerPrecision::bfloat16}) {
+        if(s == expressionLayerPrecisionToString(precision)) {
+            return precision;
+        }
+    }
+    return ExpressionLayerPrecision::Invalid;
+}
+
+
+
+void ExpressionLayer::createNew(
+    const string& name,
+    NormalizationMethod normalizationMethod,
+    ExpressionLayerPrecision precision)
+{
+    CZI_ASSERT(normalizationMethodPreservesZero(normalizationMethod));
+    CZI_ASSERT(precision != ExpressionLayerPrecision::Invalid);
+    info.createNew(name + "-Info");
+    info->normalizationMethod = normalizationMethod;
+    info->precision = precision;
+    if(precision == ExpressionLayerPrecision::float32) {
+        floatValues.createNew(name + "-Values");
+    } else {
+        halfValues.createNew(name + "-Values");
+    }
+}
+
+
+
+void ExpressionLayer::accessExisting(const string& name, bool allowReadOnly, bool readWriteAccess)
+{
+    info.accessExistingReadOnly(name + "-Info");
+    if(info->precision == ExpressionLayerPrecision::float32) {
+        if(readWriteAccess) {
+            floatValues.accessExistingReadWrite(name + "-Values", allowReadOnly);
+        } else {
+            floatValues.accessExistingReadOnly(name + "-Values");
+        }
+    } else {
+        if(readWriteAccess) {
+            halfValues.accessExistingReadWrite(name + "-Values", allowReadOnly);
+        } else {
+            halfValues.accessExistingReadOnly(name + "-Values");
+        }
+    }
+}
+
+
+
+void ExpressionLayer::remove()
+{
+    if(info->precision == ExpressionLayerPrecision::float32) {
+        floatValues.remove();
+    } else {
+        halfValues.remove();
+    }
+    info.remove();
+}
+
+
+
+void ExpressionLayer::resize(size_t n)
+{
+    if(info->precision == ExpressionLayerPrecision::float32) {
+        floatValues.resize(n);
+    } else {
+        halfValues.resize(n);
+    }
+}
+
+
+
+void ExpressionLayer::store(size_t position, const float* values, size_t n)
+{
+    switch(info->precision) {
+    case ExpressionLayerPrecision::float32:
+        std::copy(values, values + n, floatValues.begin() + position);
+        break;
+    case ExpressionLayerPrecision::float16:
+        for(size_t i=0; i<n; i++) {
+            halfValues[position + i] = floatToFloat16(values[i]);
+        }
+        break;
+    case ExpressionLayerPrecision::bfloat16:
+        for(size_t i=0; i<n; i++) {
+            halfValues[position + i] = floatToBfloat16(values[i]);
+        }
+        break;
+    default:
+        CZI_ASSERT(0);
+    }
+}
+
+
+
+void ExpressionLayer::storeCell(
+    size_t position,
+    const pair<GeneId, float>* begin,
+    const pair<GeneId, float>* end,
+    const Cell& cell)
+{
+    const size_t n = size_t(end - begin);
+    vector<float> values(n);
+    for(size_t i=0; i<n; i++) {
+        values[i] = begin[i].second;
+    }
+    normalizeValues(normalizationMethod(), values.data(), n, cell.sum1, cell.sum2);
+    store(position, values.data(), n);
+}
+
+
+
+void ExpressionLayer::appendCell(
+    const pair<GeneId, float>* begin,
+    const pair<GeneId, float>* end,
+    const Cell& cell)
+{
+    const size_t position = size();
+    resize(position + size_t(end - begin));
+    storeCell(position, begin, end, cell);
+}
+
+
+
+// The loop over values is done separately for each precision,
+// so the conversion is inlined in a tight loop.
+void ExpressionLayer::getValues(size_t begin, size_t end, float* values) const
+{
+    CZI_ASSERT(end <= size());
+    switch(info->precision) {
+    case ExpressionLayerPrecision::float32:
+        std::copy(floatValues.begin() + begin, floatValues.begin() + end, values);
+        break;
+    case ExpressionLayerPrecision::float16:
+        for(size_t i=begin; i!=end; ++i) {
+            *values++ = float16ToFloat(halfValues[i]);
+        }
+        break;
+    case ExpressionLayerPrecision::bfloat16:
+        for(size_t i=begin; i!=end; ++i) {
+            *values++ = bfloat16ToFloat(halfValues[i]);
+        }
+        break;
+    default:
+        CZI_ASSERT(0);
+    }
+}
@@ -0,0 +1,150 @@
+#ifndef CZI_EXPRESSION_MATRIX2_EXPRESSION_LAYER_HPP
+#define CZI_EXPRESSION_MATRIX2_EXPRESSION_LAYER_HPP
+
+
+
+/*******************************************************************************
+
+Class ExpressionLayer stores normalized expression counts for all cells,
+for example L2 normalized counts or log1p of counts per 10 thousand.
+Normalization uses the counts for all genes.
+
+A layer stores one value for each stored expression count
+in ExpressionMatrix::cellExpressionCounts, in the same order.
+It does not store gene ids or a table of contents:
+the values for a cell are in the same positions as its
+expression counts in cellExpressionCounts, so the gene ids
+and cell boundaries are obtained from there.
+Only normalization methods that map zero to zero can be used,
+so the layer stays sparse.
+
+Values can be stored as float (4 bytes) or, to halve memory usage
+and bandwidth, as float16 or bfloat16 (2 bytes). See float16.hpp.
+
+Layers are persistent, and are kept up to date as cells are added
+to the expression matrix.
+
+Currently the only computation that uses the values of a layer
+is ExpressionMatrix::computeLshSignatures. All other computations
+normalize the expression counts as they use them.
+
+*******************************************************************************/
+
+#include "Cell.hpp"
+#include "CZI_ASSERT.hpp"
+#include "float16.hpp"
+#include "Ids.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedVector.hpp"
+#include "NormalizationMethod.hpp"
+
+#include "cstdint.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class ExpressionLayer;
+
+        // The precisions that can be used to store the values of an expression layer.
+        enum class ExpressionLayerPrecision {
+            float32,
+            float16,
+            bfloat16,
+            Invalid
+        };
+        string expressionLayerPrecisionToString(ExpressionLayerPrecision);
+        ExpressionLayerPrecision expressionLayerPrecisionFromString(const string&);
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::ExpressionLayer {
+public:
+
+    // Create a new, empty layer.
+    void createNew(const string& name, NormalizationMethod, ExpressionLayerPrecision);
+
+    // Access an existing layer.
+    // If readWriteAccess is false, it is accessed read-only
+    // and allowReadOnly is ignored.
+    void accessExisting(const string& name, bool allowReadOnly, bool readWriteAccess=true);
+
+    // Close and remove the supporting files.
+    void remove();
+
+    NormalizationMethod normalizationMethod() const
+    {
+        return info->normalizationMethod;
+    }
+    ExpressionLayerPrecision precision() const
+    {
+        return info->precision;
+    }
+
+    // The total number of values stored.
+    // This must equal the total number of expression counts
+    // stored in ExpressionMatrix::cellExpressionCounts.
+    size_t size() const
+    {
+        return (info->precision == ExpressionLayerPrecision::float32) ? floatValues.size() : halfValues.size();
+    }
+
+    // Resize, in preparation for a call to storeCell for each cell.
+    void resize(size_t);
+
+    // Normalize and store the expression counts of a cell, starting at the given position.
+    void storeCell(size_t position, const pair<GeneId, float>* begin, const pair<GeneId, float>* end, const Cell&);
+
+    // Normalize and append the expression counts of a cell.
+    void appendCell(const pair<GeneId, float>* begin, const pair<GeneId, float>* end, const Cell&);
+
+    // Get the values in [begin, end) of the layer, converted to float.
+    void getValues(size_t begin, size_t end, float* values) const;
+
+    // Call f(i, value) for each i in [begin, end), with the value
+    // at position i converted to float. This avoids storing
+    // the values in a temporary buffer.
+    template<class F> void forEachValue(size_t begin, size_t end, const F& f) const
+    {
+        CZI_ASSERT(end <= size());
+        switch(info->precision) {
+        case ExpressionLayerPrecision::float32:
+            for(size_t i=begin; i!=end; ++i) {
+                f(i, floatValues[i]);
+            }
+            break;
+        case ExpressionLayerPrecision::float16:
+            for(size_t i=begin; i!=end; ++i) {
+                f(i, float16ToFloat(halfValues[i]));
+            }
+            break;
+        case ExpressionLayerPrecision::bfloat16:
+            for(size_t i=begin; i!=end; ++i) {
+                f(i, bfloat16ToFloat(halfValues[i]));
+            }
+            break;
+        default:
+            CZI_ASSERT(0);
+        }
+    }
+
+private:
+
+    class Info {
+    public:
+        NormalizationMethod normalizationMethod;
+        ExpressionLayerPrecision precision;
+    };
+    MemoryMapped::Object<Info> info;
+
+    // The values. Only one of these is used, depending on the precision.
+    MemoryMapped::Vector<float> floatValues;
+    MemoryMapped::Vector<uint16_t> halfValues;
+
+    // Convert and store values.
+    void store(size_t position, const float* values, size_t n);
+};
+
+#endif
@@ -1,10 +1,14 @@
 #include "ExpressionMatrix.hpp"
 #include "CellGraph.hpp"
 #include "ClusterGraph.hpp"
+#include "CounterBasedRandom.hpp"
 #include "filesystem.hpp"
+#include "normalizationKernels.hpp"
 #include "orderPairs.hpp"
 #include "randIndex.hpp"
 #include "SimilarPairs.hpp"
+#include "similarityKernels.hpp"
+#include "TaskScheduler.hpp"
 #include "timestamp.hpp"
 #include "tokenize.hpp"
 using namespace ChanZuckerberg;
@@ -14,14 +18,12 @@ using namespace ExpressionMatrix2;
 #include <boost/graph/iteration_macros.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
-#include <boost/random/mersenne_twister.hpp>
-#include <boost/random/uniform_01.hpp>
-#include <boost/random/variate_generator.hpp>
 
 #include "fstream.hpp"
 #include "iostream.hpp"
 #include "utility.hpp"
 #include "vector.hpp"
+#include <limits>
 #include <numeric>
 #include <regex>
 #include <sstream>
@@ -118,27 +120,50 @@ ExpressionMatrixCreationParameters::ExpressionMatrixCreationParameters(
 
 
 
+// Access an existing memory mapped data structure of an expression matrix
+// with the access requested in the ExpressionMatrix constructor.
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace {
+            template<class Container> void accessExistingContainer(
+                Container& container,
+                const string& name,
+                bool allowReadOnly,
+                bool readWriteAccess)
+            {
+                if(readWriteAccess) {
+                    container.accessExistingReadWrite(name, allowReadOnly);
+                } else {
+                    container.accessExistingReadOnly(name);
+                }
+            }
+        }
+    }
+}
+
+
+
 // Access a previously created expression matrix stored in the specified directory.
-ExpressionMatrix::ExpressionMatrix(const string& directoryName, bool allowReadOnly) :
+ExpressionMatrix::ExpressionMatrix(const string& directoryName, bool allowReadOnly, bool readWriteAccess) :
     directoryName(directoryName)
 {
-    // Access the binary data with read-write access, so we can add new cells
-    // and perform other operations that change the state on disk.
-
-    geneNames.accessExistingReadWrite(directoryName + "/" + "GeneNames", allowReadOnly);
-    geneMetaData.accessExistingReadWrite(directoryName + "/" + "GeneMetaData", allowReadOnly);
-    geneMetaDataNames.accessExistingReadWrite(directoryName + "/" + "GeneMetaDataNames", allowReadOnly);
-    geneMetaDataValues.accessExistingReadWrite(directoryName + "/" + "GeneMetaDataValues", allowReadOnly);
-    geneMetaDataNamesUsageCount.accessExistingReadWrite(directoryName + "/" + "GeneMetaDataNamesUsageCount", allowReadOnly);
-
-    cells.accessExistingReadWrite(directoryName + "/" + "Cells", allowReadOnly);
-    cellNames.accessExistingReadWrite(directoryName + "/" + "CellNames", allowReadOnly);
-    cellMetaData.accessExistingReadWrite(directoryName + "/" + "CellMetaData", allowReadOnly);
-    cellMetaDataNames.accessExistingReadWrite(directoryName + "/" + "CellMetaDataNames", allowReadOnly);
-    cellMetaDataValues.accessExistingReadWrite(directoryName + "/" + "CellMetaDataValues", allowReadOnly);
-    cellMetaDataNamesUsageCount.accessExistingReadWrite(directoryName + "/" + "CellMetaDataNamesUsageCount", allowReadOnly);
-    cellExpressionCounts.accessExistingReadWrite(directoryName + "/" + "CellExpressionCounts", allowReadOnly);
-    cellSets.accessExisting(directoryName, allowReadOnly);
+    // Unless read-only access was requested, access the binary data with read-write access,
+    // so we can add new cells and perform other operations that change the state on disk.
+
+    accessExistingContainer(geneNames, directoryName + "/" + "GeneNames", allowReadOnly, readWriteAccess);
+    accessExistingContainer(geneMetaData, directoryName + "/" + "GeneMetaData", allowReadOnly, readWriteAccess);
+    accessExistingContainer(geneMetaDataNames, directoryName + "/" + "GeneMetaDataNames", allowReadOnly, readWriteAccess);
+    accessExistingContainer(geneMetaDataValues, directoryName + "/" + "GeneMetaDataValues", allowReadOnly, readWriteAccess);
+    accessExistingContainer(geneMetaDataNamesUsageCount, directoryName + "/" + "GeneMetaDataNamesUsageCount", allowReadOnly, readWriteAccess);
+
+    accessExistingContainer(cells, directoryName + "/" + "Cells", allowReadOnly, readWriteAccess);
+    accessExistingContainer(cellNames, directoryName + "/" + "CellNames", allowReadOnly, readWriteAccess);
+    accessExistingContainer(cellMetaData, directoryName + "/" + "CellMetaData", allowReadOnly, readWriteAccess);
+    accessExistingContainer(cellMetaDataNames, directoryName + "/" + "CellMetaDataNames", allowReadOnly, readWriteAccess);
+    accessExistingContainer(cellMetaDataValues, directoryName + "/" + "CellMetaDataValues", allowReadOnly, readWriteAccess);
+    accessExistingContainer(cellMetaDataNamesUsageCount, directoryName + "/" + "CellMetaDataNamesUsageCount", allowReadOnly, readWriteAccess);
+    accessExistingContainer(cellExpressionCounts, directoryName + "/" + "CellExpressionCounts", allowReadOnly, readWriteAccess);
+    cellSets.accessExisting(directoryName, allowReadOnly, readWriteAccess);
     if(!cellSets.exists("AllCells")) {
         throw runtime_error("Cell set \"AllCells\" is missing.");
     }
@@ -153,7 +178,7 @@ ExpressionMatrix::ExpressionMatrix(const string& directoryName, bool allowReadOn
         // Here, name is the entire file name.
         if(stripPrefixAndSuffix(fileNamePrefix, fileNameSuffix, name)) {
             // Here, name contains just the gene set name.
-            geneSets[name].accessExisting(directoryName + "/GeneSet-" + name, allowReadOnly);
+            geneSets[name].accessExisting(directoryName + "/GeneSet-" + name, allowReadOnly, readWriteAccess);
         }
     }
     if(geneSets.find("AllGenes") == geneSets.end()) {
@@ -162,12 +187,30 @@ ExpressionMatrix::ExpressionMatrix(const string& directoryName, bool allowReadOn
 
 
 
+    // Access the expression layers.
+    const string layerFileNamePrefix = directoryName + "/ExpressionLayer-";
+    const string layerFileNameSuffix = "-Info";
+    for(string name: directoryContents) {
+        if(stripPrefixAndSuffix(layerFileNamePrefix, layerFileNameSuffix, name)) {
+            expressionLayers[name].accessExisting(directoryName + "/ExpressionLayer-" + name, allowReadOnly, readWriteAccess);
+        }
+    }
+
+
+
+    // Read the checkpoint marker, if any.
+    readCheckpoint();
+
+
+
     // Sanity checks.
-    CZI_ASSERT(cellNames.size() == cells.size());
-    CZI_ASSERT(cellMetaData.size() == cells.size());
-    CZI_ASSERT(cellExpressionCounts.size() == cells.size());
-    CZI_ASSERT(cellSets.cellSets["AllCells"]->size() == cells.size());
-    CZI_ASSERT(cellMetaDataNamesUsageCount.size() == cellMetaDataNames.size());
+    // If the expression matrix changed after its last checkpoint,
+    // the process that changed it terminated abnormally and the data structures
+    // for the cells can be inconsistent. We still allow access so
+    // recoverFromCheckpoint can be used, but cells cannot be added.
+    if(!checkpointMismatch) {
+        CZI_ASSERT(cellDataStructuresAreConsistent());
+    }
     CZI_ASSERT(geneSets["AllGenes"].size() == geneCount());
 
     // Fill the table containing commands known to the http server.
@@ -185,8 +228,32 @@ ExpressionMatrix::ExpressionMatrix(const string& directoryName, bool allowReadOn
 // This changes the metaData vector so the CellName entry is the first entry.
 // It also changes the expression counts - it sorts them by decreasing count.
 CellId ExpressionMatrix::addCell(
-    const vector< pair<string, string> >& metaDataArgument,
+    const vector< pair<string, string> >& metaData,
     const vector< pair<string, float> >& expressionCounts)
+{
+    // Convert gene names to gene ids, adding genes as necessary.
+    vector< pair<GeneId, float> > expressionCountsByGeneId;
+    expressionCountsByGeneId.reserve(expressionCounts.size());
+    for(const auto& p: expressionCounts) {
+        const string& geneName = p.first;
+        addGene(geneName);
+        const GeneId geneId = geneNames(geneName);
+        CZI_ASSERT(geneId != geneNames.invalidStringId);
+        expressionCountsByGeneId.push_back(make_pair(geneId, p.second));
+    }
+
+    return addCellWithGeneIds(metaData, expressionCountsByGeneId);
+}
+
+
+
+// Version of addCell that takes expression counts by GeneId
+// instead of gene name. Used by the bulk loaders, which map gene names
+// to gene ids once, instead of once for each expression count.
+// All gene ids must be valid, and zero expression counts are skipped.
+CellId ExpressionMatrix::addCellWithGeneIds(
+    const vector< pair<string, string> >& metaDataArgument,
+    const vector< pair<GeneId, float> >& expressionCounts)
 {
 #if 0
     cout << "ExpressionMatrix::addCell called." << endl;
@@ -207,6 +274,14 @@ CellId ExpressionMatrix::addCell(
     // Check that we don't overflow the CellId type.
     CZI_ASSERT(CellId(cells.size()) < std::numeric_limits<CellId>::max());
 
+    // We cannot add cells after an abnormal termination
+    // left the cell data structures inconsistent (see readCheckpoint).
+    if(checkpointMismatch && !cellDataStructuresAreConsistent()) {
+        throw runtime_error("Cannot add cells to expression matrix " + directoryName +
+            " because a process adding cells terminated abnormally. "
+            "Use recoverFromCheckpoint.");
+    }
+
     // Make sure the cellName entry exists and place it at the beginning
     // of the meta data.
     bool cellNameWasFound = false;
@@ -233,6 +308,9 @@ CellId ExpressionMatrix::addCell(
     const string& cellName = metaData.front().second;
     StringId cellNameStringId = cellNames(cellName);
     if(cellNameStringId != invalidCellId) {
+        if(pipelineResumeCellCount != invalidCellId && cellNameStringId >= pipelineResumeCellCount) {
+            return cellNameStringId;
+        }
         throw runtime_error("Cell name " + cellName + " already exists.");
     }
 
@@ -265,10 +343,8 @@ CellId ExpressionMatrix::addCell(
     cell.sum2 = 0.;
     cellExpressionCounts.appendVector();
     for(const auto& p: expressionCounts) {
-        const string& geneName = p.first;
-        addGene(geneName);
-        const StringId geneId = geneNames(geneName);
-        CZI_ASSERT(geneId != geneNames.invalidStringId);
+        const GeneId geneId = p.first;
+        CZI_ASSERT(geneId < geneCount());
         const float value = p.second;
         if(value < 0.) {
             throw runtime_error("Negative expression count encountered.");
@@ -298,6 +374,16 @@ CellId ExpressionMatrix::addCell(
         }
     }
 
+    // Append the transformed expression counts of this cell to the expression layers.
+    // A layer that was already out of date is left alone.
+    const size_t previousTotalSize = cellExpressionCounts.totalSize() - storedExpressionCounts.size();
+    for(auto& p: expressionLayers) {
+        ExpressionLayer& layer = p.second;
+        if(layer.size() == previousTotalSize) {
+            layer.appendCell(storedExpressionCounts.begin(), storedExpressionCounts.end(), cell);
+        }
+    }
+
     // Add this cell to the AllCells set.
     cellSets.cellSets["AllCells"]->push_back(CellId(cells.size()));
 
@@ -943,6 +1029,143 @@ vector< vector< pair<string, string> > > ExpressionMatrix::getCellMetaData(
 }
 
 
+
+// Batched access to cell meta data by StringId.
+// For each cell we scan its meta data once,
+// comparing each name to all of the requested names.
+void ExpressionMatrix::getCellMetaDataValueIds(
+    const string& cellSetName,
+    const vector<string>& metaDataNames,
+    StringId* valueIds) const
+{
+    // Locate the cell set.
+    const auto it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " not found.");
+    }
+    const CellSet& cellSet = *(it->second);
+
+    // Find the StringId of each meta data name.
+    // Names that don't exist get invalidStringId and are never found.
+    const size_t nameCount = metaDataNames.size();
+    vector<StringId> nameIds(nameCount);
+    for(size_t j=0; j<nameCount; j++) {
+        nameIds[j] = cellMetaDataNames(metaDataNames[j]);
+    }
+
+    parallelForChunks(0, cellSet.size(), [&](size_t chunkBegin, size_t chunkEnd)
+    {
+        for(size_t i=chunkBegin; i!=chunkEnd; ++i) {
+            StringId* row = valueIds + i * nameCount;
+            fill(row, row + nameCount, cellMetaDataValues.invalidStringId);
+            for(const auto& metaDataPair: cellMetaData[cellSet[i]]) {
+                for(size_t j=0; j<nameCount; j++) {
+                    if(metaDataPair.first == nameIds[j]) {
+                        row[j] = metaDataPair.second;
+                    }
+                }
+            }
+        }
+    });
+}
+
+
+
+// Categorical codes for one meta data field.
+// The distinct value ids are found by sorting,
+// so memory use does not depend on the size of cellMetaDataValues.
+void ExpressionMatrix::getCellMetaDataCodes(
+    const string& cellSetName,
+    const string& metaDataName,
+    int32_t* codes,
+    vector<string>& categories) const
+{
+    const auto it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " not found.");
+    }
+    const size_t n = it->second->size();
+
+    // Get the value id of each cell.
+    vector<StringId> valueIds(n);
+    getCellMetaDataValueIds(cellSetName, vector<string>(1, metaDataName), valueIds.data());
+
+    // Find the distinct value ids. Missing values sort last.
+    vector<StringId> distinctValueIds = valueIds;
+    parallelSort(distinctValueIds.begin(), distinctValueIds.end());
+    distinctValueIds.erase(
+        unique(distinctValueIds.begin(), distinctValueIds.end()),
+        distinctValueIds.end());
+    if(!distinctValueIds.empty() && distinctValueIds.back() == cellMetaDataValues.invalidStringId) {
+        distinctValueIds.pop_back();
+    }
+    if(distinctValueIds.size() > size_t(std::numeric_limits<int32_t>::max())) {
+        throw runtime_error("Too many distinct values for meta data field " + metaDataName);
+    }
+
+    // The categories are sorted numerically if all values are numbers,
+    // lexicographically otherwise, as in exportToH5ad.
+    // code[k] is the code for distinctValueIds[k].
+    const size_t categoryCount = distinctValueIds.size();
+    vector< pair<string, size_t> > sortedValues(categoryCount);
+    bool allNumeric = true;
+    for(size_t k=0; k<categoryCount; k++) {
+        sortedValues[k] = make_pair(cellMetaDataValues[distinctValueIds[k]], k);
+        if(allNumeric) {
+            try {
+                lexical_cast<double>(sortedValues[k].first);
+            } catch(bad_lexical_cast&) {
+                allNumeric = false;
+            }
+        }
+    }
+    if(allNumeric) {
+        sort(sortedValues.begin(), sortedValues.end(),
+            [](const pair<string, size_t>& x, const pair<string, size_t>& y)
+            {
+                return lexical_cast<double>(x.first) < lexical_cast<double>(y.first);
+            });
+    } else {
+        sort(sortedValues.begin(), sortedValues.end());
+    }
+    categories.resize(categoryCount);
+    vector<int32_t> code(categoryCount);
+    for(size_t c=0; c<categoryCount; c++) {
+        categories[c] = sortedValues[c].first;
+        code[sortedValues[c].second] = int32_t(c);
+    }
+
+    // Store the codes. Missing values get -1.
+    parallelFor(0, n, [&](size_t i)
+    {
+        const StringId valueId = valueIds[i];
+        if(valueId == cellMetaDataValues.invalidStringId) {
+            codes[i] = -1;
+        } else {
+            const auto jt = std::lower_bound(distinctValueIds.begin(), distinctValueIds.end(), valueId);
+            codes[i] = code[jt - distinctValueIds.begin()];
+        }
+    });
+}
+
+
+
+vector<string> ExpressionMatrix::getCellMetaDataValueStrings(const vector<StringId>& valueIds) const
+{
+    vector<string> values(valueIds.size());
+    for(size_t i=0; i<valueIds.size(); i++) {
+        const StringId valueId = valueIds[i];
+        if(valueId != cellMetaDataValues.invalidStringId) {
+            if(valueId >= cellMetaDataValues.size()) {
+                throw runtime_error("Invalid cell meta data value id " + lexical_cast<string>(valueId));
+            }
+            values[i] = cellMetaDataValues[valueId];
+        }
+    }
+    return values;
+}
+
+
 // Set a meta data (name, value) pair for a given cell.
 // If the name already exists for that cell, the value is replaced.
 void ExpressionMatrix::setCellMetaData(CellId cellId, const string& name, const string& value)
@@ -1178,10 +1401,7 @@ vector< vector< pair<GeneId, float> > > ExpressionMatrix::getCellsExpressionCoun
 // Compute the average expression vector for a given gene set
 // and for a given vector of cells (which is not the same type as a CellSet).
 // The last parameter controls the normalization used for the expression counts
-// for averaging:
-// 0: no normalization (raw read counts).
-// 1: L1 normalization (fractional read counts).
-// 2: L2 normalization.
+// for averaging. For L1 and L2 normalization, the average is also normalized.
 void ExpressionMatrix::computeAverageExpression(
     const GeneSet& geneSet,
     const vector<CellId> cellIds,
@@ -1191,6 +1411,8 @@ void ExpressionMatrix::computeAverageExpression(
 
     // Vector to contain the normalized expression vector for a single cell.
     vector< pair<GeneId, float> > cellExpressionVector;
+    PearsonResidualsParameters pearsonResidualsParameters;
+    getPearsonResidualsParameters(geneSet, normalizationMethod, pearsonResidualsParameters);
 
     // Initialize the average expression to zero.
     averageExpression.resize(geneSet.size());
@@ -1200,7 +1422,8 @@ void ExpressionMatrix::computeAverageExpression(
     for(const CellId cellId : cellIds) {
 
         // Compute the normalized expression vector for this cell.
-        computeExpressionVector(cellId, geneSet, normalizationMethod, cellExpressionVector);
+        computeExpressionVector(cellId, geneSet, normalizationMethod, cellExpressionVector,
+            &pearsonResidualsParameters);
 
         // Add all of the expression counts for this cell.
         for(const auto& p : cellExpressionVector) {
@@ -1245,6 +1468,14 @@ void ExpressionMatrix::computeAverageExpression(
         }
         break;
     }
+    case NormalizationMethod::log1p:
+    case NormalizationMethod::CPM:
+    case NormalizationMethod::log1pCPM:
+    case NormalizationMethod::CP10k:
+    case NormalizationMethod::log1pCP10k:
+    case NormalizationMethod::PearsonResiduals:
+        // The average of the normalized expression vectors is used as is.
+        break;
     default:
         CZI_ASSERT(0);
     }
@@ -1260,44 +1491,94 @@ void ExpressionMatrix::computeExpressionVector(
     CellId cellId,
     const GeneSet& geneSet,
     NormalizationMethod normalizationMethod,
-    vector< pair<GeneId, float> >& expressionVector // The computed expression vector.
+    vector< pair<GeneId, float> >& expressionVector, // The computed expression vector.
+    const PearsonResidualsParameters* pearsonResidualsParameters
     ) const
 {
     // Copy the expression vector for the cell into the vector passed as an argument.
     expressionVector.clear();
+    double sum1 = 0.;
+    double sum2 = 0.;
     for(const auto& p: cellExpressionCounts[cellId]) {
         const GeneId globalGeneId = p.first;
         const GeneId localGeneId = geneSet.getLocalGeneId(globalGeneId);
         if(localGeneId != invalidGeneId) {
             expressionVector.push_back(make_pair(localGeneId, p.second));
+            sum1 += p.second;
+            sum2 += p.second * p.second;
         }
     }
 
 
 
     // Normalize it as requested.
-    float factor;
-    double sum = 0.;
-    switch(normalizationMethod) {
-    case NormalizationMethod::none:
+    CZI_ASSERT(normalizationMethod != NormalizationMethod::Invalid);
+    if(normalizationMethodPreservesZero(normalizationMethod)) {
+        normalizeExpressionCounts(normalizationMethod,
+            expressionVector.data(), expressionVector.data() + expressionVector.size(), sum1, sum2);
         return;
-    case NormalizationMethod::L1:
-        for(const auto& p: expressionVector) {
-            sum += p.second;
-        }
-        factor = float(1./sum);
-        break;
-    case NormalizationMethod::L2:
-        for(const auto& p: expressionVector) {
-            sum += p.second * p.second;
+    }
+
+
+
+    // Analytic Pearson residuals. The expression vector becomes dense.
+    CZI_ASSERT(normalizationMethod == NormalizationMethod::PearsonResiduals);
+    PearsonResidualsParameters localPearsonResidualsParameters;
+    if(!pearsonResidualsParameters) {
+        getPearsonResidualsParameters(geneSet, normalizationMethod, localPearsonResidualsParameters);
+        pearsonResidualsParameters = &localPearsonResidualsParameters;
+    }
+    CZI_ASSERT(pearsonResidualsParameters->geneFractions.size() == geneSet.size());
+    vector<float> counts(geneSet.size(), 0.f);
+    for(const auto& p: expressionVector) {
+        counts[p.first] = p.second;
+    }
+    computePearsonResiduals(counts.data(), pearsonResidualsParameters->geneFractions.data(),
+        counts.data(), counts.size(), float(sum1), pearsonResidualsParameters->clip);
+    expressionVector.resize(counts.size());
+    for(GeneId localGeneId=0; localGeneId!=GeneId(counts.size()); localGeneId++) {
+        expressionVector[localGeneId] = make_pair(localGeneId, counts[localGeneId]);
+    }
+}
+
+
+
+// Compute the fraction of the total count for the genes of a gene set
+// that belongs to each gene of the gene set, using all cells,
+// and the clipping value for the residuals.
+// The total count for each gene is cached and only computed again
+// if cells or genes were added.
+void ExpressionMatrix::getPearsonResidualsParameters(
+    const GeneSet& geneSet,
+    NormalizationMethod normalizationMethod,
+    PearsonResidualsParameters& pearsonResidualsParameters) const
+{
+    if(normalizationMethod != NormalizationMethod::PearsonResiduals) {
+        return;
+    }
+    pearsonResidualsParameters.clip = float(std::sqrt(double(cellCount())));
+
+    std::lock_guard<std::mutex> lock(geneTotalCountsMutex);
+    if(geneTotalCounts.size() != geneCount() ||
+        geneTotalCountsExpressionCount != cellExpressionCounts.totalSize()) {
+        geneTotalCounts.assign(geneCount(), 0.);
+        const pair<GeneId, float>* const begin = cellExpressionCounts.begin();
+        const pair<GeneId, float>* const end = begin + cellExpressionCounts.totalSize();
+        for(auto it=begin; it!=end; ++it) {
+            geneTotalCounts[it->first] += it->second;
         }
-        factor = float(1./sqrt(sum));
-        break;
-    default:
-        CZI_ASSERT(0);
+        geneTotalCountsExpressionCount = cellExpressionCounts.totalSize();
     }
-    for(auto& p: expressionVector) {
-        p.second *= factor;
+
+    double total = 0.;
+    for(const GeneId globalGeneId: geneSet) {
+        total += geneTotalCounts[globalGeneId];
+    }
+    const double inverseTotal = (total == 0.) ? 0. : 1./total;
+    vector<float>& geneFractions = pearsonResidualsParameters.geneFractions;
+    geneFractions.clear();
+    for(const GeneId globalGeneId: geneSet) {
+        geneFractions.push_back(float(geneTotalCounts[globalGeneId] * inverseTotal));
     }
 }
 
@@ -1404,142 +1685,262 @@ pair<double, double> ExpressionMatrix::computeMetaDataRandIndex(
 double ExpressionMatrix::computeCellSimilarity(CellId cellId0, CellId cellId1) const
 {
     // Compute the scalar product of the expression counts for the two cells.
-    typedef pair<GeneId, float>const* Iterator;
-    const Iterator begin0 = cellExpressionCounts.begin(cellId0);
-    const Iterator end0 = cellExpressionCounts.end(cellId0);
-    const Iterator begin1 = cellExpressionCounts.begin(cellId1);
-    const Iterator end1 = cellExpressionCounts.end(cellId1);
-    Iterator it0 = begin0;
-    Iterator it1 = begin1;
-    double scalarProduct = 0.;
-    while((it0 != end0) && (it1 != end1)) {
-        const GeneId geneId0 = it0->first;
-        const GeneId geneId1 = it1->first;
-
-        if(geneId0 < geneId1) {
-            ++it0;
-        } else if(geneId1 < geneId0) {
-            ++it1;
-        } else {
-            scalarProduct += it0->second * it1->second;
-            ++it0;
-            ++it1;
-        }
-    }
+    const SparseIntersectionSums sums = computeSparseIntersectionSums(
+        cellExpressionCounts.begin(cellId0), cellExpressionCounts.end(cellId0),
+        cellExpressionCounts.begin(cellId1), cellExpressionCounts.end(cellId1),
+        0, 0);
 
     // Compute the correlation coefficient.
-    // See, for example, https://en.wikipedia.org/wiki/Correlation_and_dependence
-    const double n = geneCount();
     const Cell& cell0 = cells[cellId0];
     const Cell& cell1 = cells[cellId1];
-    const double numerator = n*scalarProduct - cell0.sum1*cell1.sum1;
-    const double denominator = sqrt(
-            (n*cell0.sum2 - cell0.sum1*cell0.sum1) *
-            (n*cell1.sum2 - cell1.sum1*cell1.sum1)
-            );
-
-#if 0
-    cout << "ExpressionMatrix::computeCellSimilarity" << endl;
-    cout << "n " << n << endl;
-    cout << "scalarProduct " << scalarProduct << endl;
-    cout << "cell0.sum1 " << cell0.sum1 << endl;
-    cout << "cell1.sum1 " << cell1.sum1 << endl;
-    cout << "cell0.sum2 " << cell0.sum2 << endl;
-    cout << "cell1.sum2 " << cell1.sum2 << endl;
-    cout << "numerator " << numerator << endl;
-    cout << "denominator " << denominator << endl;
-#endif
-
-    return numerator / denominator;
+    return computeSimilarityFromSums(SimilarityMetric::Pearson, double(geneCount()),
+        cell0.sum1, cell0.sum2, cell1.sum1, cell1.sum2, sums);
 }
 
 
-// Compute the similarity between two cells given their CellId.
-// The similarity is the correlation coefficient of their
-// expression counts. This takes into account
+// Compute the similarity between two cells given their CellId,
+// using the specified similarity metric. This takes into account
 // only the genes in the specified gene set.
 // This is done without creating an ExpressionMatrixSubset.
 double ExpressionMatrix::computeCellSimilarity(
     const string& geneSetName,
     CellId cellId0,
-    CellId cellId1) const
+    CellId cellId1,
+    SimilarityMetric similarityMetric) const
 {
     const auto it = geneSets.find(geneSetName);
     if(it == geneSets.end()) {
         throw runtime_error("Gene set " + geneSetName + " does not exist.");
     }
     const GeneSet& geneSet = it->second;
-    return computeCellSimilarity(geneSet, cellId0, cellId1);
+    return computeCellSimilarity(geneSet, cellId0, cellId1, similarityMetric);
 }
 double ExpressionMatrix::computeCellSimilarity(
     const GeneSet& geneSet,
     CellId cellId0,
-    CellId cellId1) const
+    CellId cellId1,
+    SimilarityMetric similarityMetric) const
 {
-    // Compute the scalar product of the expression counts for the two cells,
+    GeneSet::CellSimilarityData cellSimilarityData;
+    prepareCellSimilarity(geneSet, similarityMetric, cellSimilarityData);
+    return computeCellSimilarity(geneSet, cellId0, cellId1, similarityMetric, cellSimilarityData);
+}
+double ExpressionMatrix::computeCellSimilarity(
+    const GeneSet& geneSet,
+    CellId cellId0,
+    CellId cellId1,
+    SimilarityMetric similarityMetric,
+    const GeneSet::CellSimilarityData& cellSimilarityData) const
+{
+    const double n = geneSet.size();
+
+    // For Spearman, use the correlation coefficient of the ranks.
+    // They only contain genes in the gene set.
+    if(similarityMetric == SimilarityMetric::Spearman) {
+        const vector<GeneSet::CellRanks>& cellRanks = *cellSimilarityData.cellRanks;
+        const GeneSet::CellRanks& ranks0 = cellRanks[cellId0];
+        const GeneSet::CellRanks& ranks1 = cellRanks[cellId1];
+        const SparseIntersectionSums sums = computeSparseIntersectionSums(
+            ranks0.ranks.data(), ranks0.ranks.data() + ranks0.ranks.size(),
+            ranks1.ranks.data(), ranks1.ranks.data() + ranks1.ranks.size(),
+            0, 0);
+        return computeSimilarityFromSums(similarityMetric, n,
+            ranks0.sums.sum1, ranks0.sums.sum2, ranks1.sums.sum1, ranks1.sums.sum2, sums);
+    }
+
+    // Intersect the expression counts for the two cells,
     // taking into account only genes in this gene set.
-    typedef pair<GeneId, float>const* Iterator;
-    const Iterator begin0 = cellExpressionCounts.begin(cellId0);
-    const Iterator end0 = cellExpressionCounts.end(cellId0);
-    const Iterator begin1 = cellExpressionCounts.begin(cellId1);
-    const Iterator end1 = cellExpressionCounts.end(cellId1);
-    Iterator it0 = begin0;
-    Iterator it1 = begin1;
-    double sum01 = 0.;
-    while((it0 != end0) && (it1 != end1)) {
-        const GeneId geneId0 = it0->first;
-        const GeneId geneId1 = it1->first;
-
-        if(geneId0 < geneId1) {
-            ++it0;
-        } else if(geneId1 < geneId0) {
-            ++it1;
-        } else {
-            // Here, geneId0==geneId1.
-            if(geneSet.contains(geneId0)) {
-                sum01 += it0->second * it1->second;
-            }
-            ++it0;
-            ++it1;
-        }
+    // The membership check is skipped if the gene set contains all genes.
+    const bool useMembership = (geneSet.size() != geneCount());
+    const SparseIntersectionSums sums = computeSparseIntersectionSums(
+        cellExpressionCounts.begin(cellId0), cellExpressionCounts.end(cellId0),
+        cellExpressionCounts.begin(cellId1), cellExpressionCounts.end(cellId1),
+        useMembership ? geneSet.membership.data() : 0, geneSet.membership.size());
+
+    const vector<GeneSet::CellSums>& cellSums = *cellSimilarityData.cellSums;
+    const GeneSet::CellSums& cellSums0 = cellSums[cellId0];
+    const GeneSet::CellSums& cellSums1 = cellSums[cellId1];
+    return computeSimilarityFromSums(similarityMetric, n,
+        cellSums0.sum1, cellSums0.sum2, cellSums1.sum1, cellSums1.sum2, sums);
+}
+
+
+
+void ExpressionMatrix::prepareCellSimilarity(
+    const GeneSet& geneSet,
+    SimilarityMetric similarityMetric,
+    GeneSet::CellSimilarityData& cellSimilarityData) const
+{
+    if(similarityMetric == SimilarityMetric::Invalid) {
+        throw runtime_error("Invalid similarity metric.");
+    }
+    cellSimilarityData.cellSums = getGeneSetCellSums(geneSet);
+    cellSimilarityData.cellRanks.reset();
+    if(similarityMetric == SimilarityMetric::Spearman) {
+        cellSimilarityData.cellRanks = getGeneSetCellRanks(geneSet);
     }
+}
 
 
 
-    // Compute the other sums we need to compute the correlation coefficient.
-    double sum0 = 0.;
-    double sum00 = 0.;
-    for(it0=begin0; it0!=end0; ++it0) {
-        const GeneId geneId0 = it0->first;
-        if(geneSet.contains(geneId0)) {
-            const auto& count = it0->second;
-            sum0 += count;
-            sum00 += count*count;
+// Compute the similarity of many pairs of cells, in parallel.
+// The pairs are sorted by first cell, then by second cell,
+// and each thread processes a contiguous range of the sorted pairs,
+// so the expression counts of the first cell are reused from cache.
+void ExpressionMatrix::computeCellSimilarities(
+    const string& geneSetName,
+    const vector< pair<CellId, CellId> >& cellPairs,
+    SimilarityMetric similarityMetric,
+    vector<float>& similarities) const
+{
+    // Check the arguments.
+    const auto it = geneSets.find(geneSetName);
+    if(it == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = it->second;
+    for(const auto& cellPair: cellPairs) {
+        if(cellPair.first >= cellCount() || cellPair.second >= cellCount()) {
+            throw runtime_error("Invalid cell id.");
         }
     }
-    double sum1 = 0.;
-    double sum11 = 0.;
-    for(it1=begin1; it1!=end1; ++it1) {
-        const GeneId geneId1 = it1->first;
-        if(geneSet.contains(geneId1)) {
-            const auto& count = it1->second;
-            sum1 += count;
-            sum11 += count*count;
+
+    // Get the cached sums and ranks for the gene set before entering the parallel loop.
+    GeneSet::CellSimilarityData cellSimilarityData;
+    prepareCellSimilarity(geneSet, similarityMetric, cellSimilarityData);
+
+    // Sort the pairs. Each entry of the sorted vector contains
+    // the two cell ids packed in 64 bits, and the index of the pair.
+    vector< pair<uint64_t, size_t> > sortedPairs(cellPairs.size());
+    for(size_t i=0; i<cellPairs.size(); i++) {
+        const auto& cellPair = cellPairs[i];
+        sortedPairs[i] = make_pair((uint64_t(cellPair.first) << 32) | uint64_t(cellPair.second), i);
+    }
+    sort(sortedPairs.begin(), sortedPairs.end());
+
+    // Compute the similarities.
+    similarities.resize(cellPairs.size());
+    parallelForChunks(0, sortedPairs.size(), [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t j=chunkBegin; j!=chunkEnd; j++) {
+                const CellId cellId0 = CellId(sortedPairs[j].first >> 32);
+                const CellId cellId1 = CellId(sortedPairs[j].first & 0xffffffffULL);
+                similarities[sortedPairs[j].second] = float(computeCellSimilarity(
+                    geneSet, cellId0, cellId1, similarityMetric, cellSimilarityData));
+            }
+        });
+}
+
+
+
+// Return the sums of the expression counts of each cell for the genes
+// in a gene set. They are cached in the GeneSet.
+// If genes were added to the gene set, they are all recomputed.
+// If only cells were added, they are computed for the new cells only.
+// The computation is done without holding the mutex of the cache:
+// while waiting in parallelForChunks, this thread can run tasks
+// of other task groups, which could also need the CellSums.
+// The result is then published by replacing the cached vector.
+shared_ptr<const vector<GeneSet::CellSums> > ExpressionMatrix::getGeneSetCellSums(const GeneSet& geneSet) const
+{
+    // Get the cached CellSums, if they are for the current genes.
+    const GeneId geneCount = geneSet.size();
+    shared_ptr<const vector<GeneSet::CellSums> > oldCellSums;
+    {
+        std::lock_guard<std::mutex> lock(geneSet.cellSumsMutex);
+        if(geneSet.cellSums && geneSet.cellSumsGeneCount == geneCount) {
+            oldCellSums = geneSet.cellSums;
         }
     }
+    const CellId oldCellCount = oldCellSums ? CellId(oldCellSums->size()) : 0;
+    if(oldCellSums && oldCellCount == cellCount()) {
+        return oldCellSums;
+    }
 
+    // Compute the CellSums of the cells that don't have them.
+    const shared_ptr< vector<GeneSet::CellSums> > cellSums =
+        make_shared< vector<GeneSet::CellSums> >(cellCount());
+    if(oldCellSums) {
+        copy(oldCellSums->begin(), oldCellSums->end(), cellSums->begin());
+    }
+    parallelForChunks(oldCellCount, cellCount(), [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            for(CellId cellId=CellId(chunkBegin); cellId!=CellId(chunkEnd); cellId++) {
+                double sum1 = 0.;
+                double sum2 = 0.;
+                for(const auto& p: cellExpressionCounts[cellId]) {
+                    if(geneSet.contains(p.first)) {
+                        sum1 += p.second;
+                        sum2 += p.second * p.second;
+                    }
+                }
+                (*cellSums)[cellId].sum1 = sum1;
+                (*cellSums)[cellId].sum2 = sum2;
+            }
+        });
 
+    // Publish them, unless another thread published a more complete version meanwhile.
+    std::lock_guard<std::mutex> lock(geneSet.cellSumsMutex);
+    if(!geneSet.cellSums || geneSet.cellSumsGeneCount != geneCount ||
+        geneSet.cellSums->size() < cellSums->size()) {
+        geneSet.cellSums = cellSums;
+        geneSet.cellSumsGeneCount = geneCount;
+    }
+    return cellSums;
+}
 
-    // Compute the correlation coefficient.
-    // See, for example, https://en.wikipedia.org/wiki/Correlation_and_dependence
-    const double n = geneSet.size();
-    const double numerator = n*sum01 - sum0*sum1;
-    const double denominator = sqrt(
-            (n*sum00 - sum0*sum0) *
-            (n*sum11 - sum1*sum1)
-            );
-    return numerator / denominator;
 
+
+// Return the ranks of the expression counts of each cell for the genes
+// in a gene set, used for SimilarityMetric::Spearman.
+// They are cached in the GeneSet and updated in the same way as the CellSums.
+shared_ptr<const vector<GeneSet::CellRanks> > ExpressionMatrix::getGeneSetCellRanks(const GeneSet& geneSet) const
+{
+    // Get the cached CellRanks, if they are for the current genes.
+    const GeneId geneCount = geneSet.size();
+    shared_ptr<const vector<GeneSet::CellRanks> > oldCellRanks;
+    {
+        std::lock_guard<std::mutex> lock(geneSet.cellRanksMutex);
+        if(geneSet.cellRanks && geneSet.cellRanksGeneCount == geneCount) {
+            oldCellRanks = geneSet.cellRanks;
+        }
+    }
+    const CellId oldCellCount = oldCellRanks ? CellId(oldCellRanks->size()) : 0;
+    if(oldCellRanks && oldCellCount == cellCount()) {
+        return oldCellRanks;
+    }
+
+    // Compute the CellRanks of the cells that don't have them.
+    const shared_ptr< vector<GeneSet::CellRanks> > cellRanks =
+        make_shared< vector<GeneSet::CellRanks> >(cellCount());
+    if(oldCellRanks) {
+        copy(oldCellRanks->begin(), oldCellRanks->end(), cellRanks->begin());
+    }
+    parallelForChunks(oldCellCount, cellCount(), [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            vector< pair<GeneId, float> > counts;
+            for(CellId cellId=CellId(chunkBegin); cellId!=CellId(chunkEnd); cellId++) {
+                counts.clear();
+                for(const auto& p: cellExpressionCounts[cellId]) {
+                    if(geneSet.contains(p.first)) {
+                        counts.push_back(p);
+                    }
+                }
+                GeneSet::CellRanks& ranks = (*cellRanks)[cellId];
+                computeSparseRanks(counts.data(), counts.data() + counts.size(), geneCount,
+                    ranks.ranks, ranks.sums.sum1, ranks.sums.sum2);
+                ranks.ranks.shrink_to_fit();
+            }
+        });
+
+    // Publish them, unless another thread published a more complete version meanwhile.
+    std::lock_guard<std::mutex> lock(geneSet.cellRanksMutex);
+    if(!geneSet.cellRanks || geneSet.cellRanksGeneCount != geneCount ||
+        geneSet.cellRanks->size() < cellRanks->size()) {
+        geneSet.cellRanks = cellRanks;
+        geneSet.cellRanksGeneCount = geneCount;
+    }
+    return cellRanks;
 }
 
 
@@ -1759,21 +2160,28 @@ void ExpressionMatrix::downsampleCellSet(
     }
     const CellSet& inputCellSet = *(it->second);
 
+    // Decide in parallel which cells to keep.
+    // Each cell in the input cell set is kept with the specified probability.
+    // The random number used for each cell only depends on the seed and
+    // on the position of the cell in the input cell set,
+    // so the result does not depend on the number of threads.
+    // This uses vector<char> rather than vector<bool>, whose bits
+    // cannot be written concurrently by different threads.
+    const CounterBasedRandom random = CounterBasedRandom(uint64_t(seed));
+    const size_t inputCellCount = inputCellSet.size();
+    vector<char> keep(inputCellCount);
+    parallelForChunks(0, inputCellCount, [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t i=chunkBegin; i!=chunkEnd; ++i) {
+                keep[i] = char(random.uniform01At(i) < probability);
+            }
+        }, 1<<16);
+
     // Create the new cell set.
     vector<CellId> outputCellSet;
-
-    // Prepare to generate uniformly distributed numbers between 0 and 1.
-    using RandomSource = boost::mt19937;
-    using UniformDistribution = boost::uniform_01<>;
-    RandomSource randomSource(seed);
-    UniformDistribution uniformDistribution;
-    boost::variate_generator<RandomSource, UniformDistribution> uniformGenerator(randomSource, uniformDistribution);
-
-    // Loop over all cells in the input cell set.
-    // Add each one of them to the output cell set with the specified probability.
-    for(const CellId cellId : inputCellSet) {
-        if(uniformGenerator() < probability) {
-            outputCellSet.push_back(cellId);
+    for(size_t i=0; i<inputCellCount; i++) {
+        if(keep[i]) {
+            outputCellSet.push_back(inputCellSet[i]);
         }
     }
 
@@ -1971,6 +2379,11 @@ float ExpressionMatrix::computeGeneInformationContent(
     NormalizationMethod normalizationMethod) const
 {
 
+    if(!normalizationMethodPreservesZero(normalizationMethod)) {
+        throw runtime_error("Normalization method " + normalizationMethodToShortString(normalizationMethod) +
+            " cannot be used to compute gene information content.");
+    }
+
     // Create a vector of expression counts for this gene and for all cells in the cell set,
     // using the requested normalization.
     // Note that we use the normalization defined using all genes.
@@ -1978,18 +2391,11 @@ float ExpressionMatrix::computeGeneInformationContent(
     count.reserve(cellSet.size());
     for(const CellId cellId : cellSet) {
         const Cell& cell = cells[cellId];
-        float c = getCellExpressionCount(cellId, geneId);
-        switch(normalizationMethod) {
-        case NormalizationMethod::L1:
-            c *= float(cell.norm1Inverse);
-            break;
-        case NormalizationMethod::L2:
-            c *= float(cell.norm2Inverse);
-            break;
-        default:
-            break;
-        }
-        count.push_back(c);
+        const float c = getCellExpressionCount(cellId, geneId);
+        count.push_back(c * float(normalizationMethodScale(normalizationMethod, cell.sum1, cell.sum2)));
+    }
+    if(normalizationMethodUsesLog1p(normalizationMethod)) {
+        log1pValues(count.data(), count.size(), 1.f);
     }
 
 
@@ -7,17 +7,23 @@
 #include "Cell.hpp"
 #include "CellGraph.hpp"
 #include "CellSets.hpp"
+#include "ExpressionLayer.hpp"
 #include "GeneSet.hpp"
 #include "HttpServer.hpp"
+#include "LshAccuracy.hpp"
+#include "LshTuning.hpp"
 #include "Ids.hpp"
 #include "MemoryMappedVector.hpp"
 #include "MemoryMappedVectorOfLists.hpp"
 #include "MemoryMappedVectorOfVectors.hpp"
 #include "MemoryMappedStringTable.hpp"
 #include "NormalizationMethod.hpp"
+#include "numa.hpp"
+#include "SimilarityMetric.hpp"
 
 // Standard library.
 #include <limits>
+#include <mutex>
 #include "map.hpp"
 #include "memory.hpp"
 #include "string.hpp"
@@ -34,8 +40,11 @@ namespace ChanZuckerberg {
         class ExpressionMatrix;
         class ExpressionMatrixCreationParameters;
         class ExpressionMatrixSubset;
+        class FederatedExpressionMatrix;
         class GeneGraph;
         class Lsh;
+        class PearsonResidualsParameters;
+        class PipelineStage;
         class ServerParameters;
         class SimilarPairs;
         class SignatureGraph;
@@ -48,6 +57,12 @@ namespace ChanZuckerberg {
 namespace pybind11 {
     class array;
     class buffer;
+    class tuple;
+}
+
+// Forward declaration necessary for functions that write hdf5 files.
+namespace H5 {
+    class Group;
 }
 
 
@@ -104,13 +119,19 @@ class ChanZuckerberg::ExpressionMatrix2::ServerParameters {
 public:
     uint16_t port = 17100;  // The port number to listen to.
     string docDirectory;    // The directory containing the documentation (optional).
+    size_t threadCount = 0; // The number of threads for parallel computations (0 = don't change).
     ServerParameters() {}
-    ServerParameters(uint16_t port, string docDirectory);
+    ServerParameters(uint16_t port, string docDirectory, size_t threadCount = 0);
 };
 
 
 
 class ChanZuckerberg::ExpressionMatrix2::ExpressionMatrix : public HttpServer {
+
+    // A FederatedExpressionMatrix reads the expression counts
+    // and string tables of its members directly, without copying.
+    friend class FederatedExpressionMatrix;
+
 public:
 
 
@@ -130,7 +151,14 @@ public:
     );
 
     // Access a previously created expression matrix stored in the specified directory.
-    ExpressionMatrix(const string& directoryName, bool allowReadOnly);
+    // If readWriteAccess is false, all data are accessed read-only
+    // and allowReadOnly is ignored. In that case nothing is ever written
+    // to the directory, not even a checkpoint.
+    ExpressionMatrix(const string& directoryName, bool allowReadOnly, bool readWriteAccess=true);
+
+    // If the durability mode is not strict, the destructor writes a checkpoint
+    // (see setDurabilityMode).
+    ~ExpressionMatrix();
 
     // Add a gene.
     // Returns true if the gene was added, false if it was already present.
@@ -149,6 +177,15 @@ public:
         const vector< pair<string, float> >& expressionCounts
         );
 
+    // Version of addCell that takes expression counts by GeneId
+    // instead of gene name. All gene ids must be valid.
+    // This avoids one gene name lookup for each expression count,
+    // and is used by functions that add cells in bulk.
+    CellId addCellWithGeneIds(
+        const vector< pair<string, string> >& metaData,
+        const vector< pair<GeneId, float> >& expressionCounts
+        );
+
     // Version of addCell that takes JSON as input.
     // The expected JSON can be constructed using Python code modeled from the following:
     // import json
@@ -254,6 +291,67 @@ public:
         const string& cellNamePrefix,
         const vector< pair<string, string> > cellMetaData,  // Added to all cells.
         double totalExpressionCountThreshold);
+
+    // Write the expression counts for the specified gene set and cell set
+    // to an hdf5 file, in the same format read by addCellsFromHdf5.
+    // The file contains a single group with the given name.
+    // Data sets are chunked and compressed using the shuffle and gzip filters
+    // with the given compression level (0 to 9, 0 means no compression).
+    // The expression counts must be non-negative integers.
+    void exportToHdf5(
+        const string& fileName,
+        const string& geneSetName,
+        const string& cellSetName,
+        const string& groupName,
+        int compressionLevel);
+
+    // Add cells from an AnnData h5ad file, as created by the scanpy/anndata
+    // Python packages. The expression matrix can be stored in compressed
+    // sparse row or column format, or as a dense matrix.
+    // matrixName selects the matrix to be used: X (the default), raw/X,
+    // or layers/<layerName>. Cell names are taken from the obs index,
+    // prefixed with cellNamePrefix if not empty, and each obs column
+    // becomes a cell meta data field. Gene names are taken from the var index,
+    // and each var column becomes a gene meta data field.
+    // See ExpressionMatrixH5ad.cpp for more information.
+    void addCellsFromH5ad(
+        const string& fileName,
+        const string& matrixName,
+        const string& cellNamePrefix,
+        const vector< pair<string, string> >& cellMetaData,  // Added to all cells.
+        double totalExpressionCountThreshold);
+
+    // Write the expression counts for the specified gene set and cell set
+    // to an AnnData h5ad file, in compressed sparse row format.
+    // The specified cell meta data fields are written as obs columns
+    // (if metaDataNames is empty, all cell meta data fields are written).
+    // The layouts of the specified cell graphs are written as
+    // two-dimensional embeddings in obsm.
+    void exportToH5ad(
+        const string& fileName,
+        const string& geneSetName,
+        const string& cellSetName,
+        const vector<string>& metaDataNames,
+        const vector<string>& cellGraphNames,
+        int compressionLevel);
+
+    // Add cells from a loom file, as created by the loompy Python package.
+    // The expression matrix is the dense matrix in /matrix,
+    // with one row per gene and one column per cell,
+    // or the one in /layers/<layerName> if layerName is not empty.
+    // Cell names are taken from the specified column attribute,
+    // prefixed with cellNamePrefix if not empty, and gene names
+    // from the specified row attribute. The other column and row attributes
+    // become cell and gene meta data.
+    // See ExpressionMatrixLoom.cpp for more information.
+    void addCellsFromLoom(
+        const string& fileName,
+        const string& layerName,
+        const string& cellNameAttribute,
+        const string& geneNameAttribute,
+        const string& cellNamePrefix,
+        const vector< pair<string, string> >& cellMetaData,  // Added to all cells.
+        double totalExpressionCountThreshold);
 #endif
 
 
@@ -300,6 +398,47 @@ public:
 
 
 
+    // Create a new expression matrix in the specified directory,
+    // containing only the cells of the specified cell set
+    // and the genes of the specified gene set.
+    // Cell ids and gene ids in the new expression matrix are the positions
+    // of the cells in the cell set and of the genes in the (sorted) gene set.
+    // Only the cell meta data with the specified names are copied
+    // (CellName is always copied). If metaDataNames is empty,
+    // all cell meta data are copied. All gene meta data are copied.
+    // Cell sums and norms are recomputed using only the genes in the gene set.
+    // The new expression matrix can be accessed with the usual constructor.
+    void createExpressionMatrixFromSubset(
+        const string& newDirectoryName,
+        const string& geneSetName,
+        const string& cellSetName,
+        const vector<string>& metaDataNames);
+
+    // Create a new expression matrix in the specified directory,
+    // containing all the cells of the expression matrices in the input directories.
+    // Genes and cell and gene meta data are the union of those of the inputs.
+    // Cells are numbered in input order, and cell names must be unique across inputs.
+    // If metaDataTag is not empty, each cell also gets a meta data field
+    // with that name, set to the name of its input directory.
+    // The inputs are accessed read-only and are not modified.
+    // The new expression matrix can be accessed with the usual constructor.
+    static void mergeExpressionMatrices(
+        const string& outputDirectoryName,
+        const vector<string>& inputDirectoryNames,
+        const string& metaDataTag);
+
+    // Run the stages of a pipeline described in a JSON file.
+    // See Pipeline.hpp for the format of the file.
+    // Independent stages that don't modify the expression matrix run concurrently.
+    // Stages that completed in a previous run with the same parameters
+    // are skipped if their outputs still exist, unless force is true.
+    // A stage that adds cells and was interrupted resumes
+    // after the cells it already added. If it was interrupted
+    // while adding a cell, recoverFromCheckpoint must be used first.
+    void runPipeline(const string& fileName, bool force);
+
+
+
     // Return the number of genes.
     GeneId geneCount() const
     {
@@ -325,6 +464,48 @@ public:
     // for a given set of cells.
     vector< vector< pair<string, string> > > getCellMetaData(const vector<CellId>&) const;
 
+    // Batched, id-based access to cell meta data, which avoids
+    // creating strings for each cell. For each cell of a cell set (rows)
+    // and each of the given meta data names (columns), store in valueIds
+    // the StringId in cellMetaDataValues of the value, or invalidStringId if
+    // the cell does not have that meta data field. valueIds is a preallocated buffer
+    // with room for the number of cells in the cell set times the number of names,
+    // filled in row-major order. This uses multiple threads.
+    void getCellMetaDataValueIds(
+        const string& cellSetName,
+        const vector<string>& metaDataNames,
+        StringId* valueIds) const;
+
+    // Same as above, but for a single meta data field, returning categorical codes.
+    // On return, categories contains the distinct values, sorted numerically if they are
+    // all numbers and lexicographically otherwise, as in exportToH5ad, and codes[i] is the index
+    // in categories of the value for the i-th cell of the cell set, or -1 if the cell
+    // does not have that meta data field. codes is a preallocated buffer with room
+    // for the number of cells in the cell set.
+    // This is the representation used by pandas.Categorical.from_codes.
+    void getCellMetaDataCodes(
+        const string& cellSetName,
+        const string& metaDataName,
+        int32_t* codes,
+        vector<string>& categories) const;
+
+    // Return the cell meta data values corresponding to the given StringIds,
+    // as returned by getCellMetaDataValueIds. An empty string
+    // is returned for invalidStringId.
+    vector<string> getCellMetaDataValueStrings(const vector<StringId>&) const;
+
+    // Python versions of getCellMetaDataValueIds and getCellMetaDataCodes.
+    // They return a two-dimensional numpy array of uint32 with one row per cell
+    // and one column per meta data name, and a tuple (codes, categories)
+    // with codes a numpy array of int32.
+    // The Python global interpreter lock is released while the arrays are filled.
+    pybind11::array getCellMetaDataValueIdsPython(
+        const string& cellSetName,
+        const vector<string>& metaDataNames) const;
+    pybind11::tuple getCellMetaDataCodesPython(
+        const string& cellSetName,
+        const string& metaDataName) const;
+
     // Set a meta data (name, value) pair for a given cell.
     // If the name already exists for that cell, the value is replaced.
     void setCellMetaData(CellId, const string& name, const string& value);
@@ -348,18 +529,41 @@ public:
         const string& metaDataName1);
 
     // Compute the similarity between two cells given their CellId.
-    // The similarity is the correlation coefficient of their
-    // expression counts.
+    // The version without a gene set uses all genes and
+    // computes the correlation coefficient of their expression counts.
+    // When a gene set is specified, only genes in the gene set are used,
+    // and the similarity is computed using the specified SimilarityMetric.
+    // The sums of the expression counts of each cell for the genes
+    // in the gene set are cached in the GeneSet (see getGeneSetCellSums),
+    // and so are the ranks used for SimilarityMetric::Spearman (see getGeneSetCellRanks).
     double computeCellSimilarity(CellId, CellId) const;
-    double computeCellSimilarity(const string& geneSetName, CellId, CellId) const;
-    double computeCellSimilarity(const GeneSet&, CellId, CellId) const;
+    double computeCellSimilarity(const string& geneSetName, CellId, CellId, SimilarityMetric) const;
+    double computeCellSimilarity(const GeneSet&, CellId, CellId, SimilarityMetric) const;
+
+    // Compute the similarity of many pairs of cells, in parallel,
+    // for the genes in a gene set. The pairs are processed grouped
+    // by their first cell, so the expression counts of that cell
+    // stay in cache while it is compared to its partners.
+    // On return, similarities[i] is the similarity of cellPairs[i].
+    void computeCellSimilarities(
+        const string& geneSetName,
+        const vector< pair<CellId, CellId> >& cellPairs,
+        SimilarityMetric,
+        vector<float>& similarities) const;
+
+    // Python version of the above. The cell pairs are
+    // a numpy array with two columns and one row for each pair,
+    // and the returned similarities are a one-dimensional numpy array of float32.
+    // The Python global interpreter lock is released during the computation.
+    pybind11::array computeCellSimilaritiesPython(
+        const string& geneSetName,
+        pybind11::array cellPairs,
+        SimilarityMetric) const;
 
     // Compute the average expression vector for a given set of cells.
     // The last parameter controls the normalization used for the expression counts
-    // for averaging:
-    // 0: no normalization (raw read counts).
-    // 1: L1 normalization (fractional read counts).
-    // 2: L2 normalization.
+    // for averaging. For L1 and L2 normalization, the average
+    // is also normalized.
     void computeAverageExpression(
         const GeneSet& geneSet,
         const vector<CellId> cells,
@@ -414,7 +618,8 @@ public:
         const string& cellSetName,  // The name of the cell set to be used.
         const string& name,         // The name of the SimilarPairs object to be created.
         size_t k,                   // The maximum number of similar pairs to be stored for each cell.
-        double similarityThreshold
+        double similarityThreshold,
+        SimilarityMetric
         );
     void findSimilarPairs0(
         ostream& out,
@@ -422,7 +627,8 @@ public:
         const string& cellSetName,  // The name of the cell set to be used.
         const string& name,         // The name of the SimilarPairs object to be created.
         size_t k,                   // The maximum number of similar pairs to be stored for each cell.
-        double similarityThreshold
+        double similarityThreshold,
+        SimilarityMetric
         );
 
 
@@ -464,7 +670,8 @@ public:
         size_t lshCount,                // The number of LSH vectors to use.
         unsigned int seed,              // The seed used to generate the LSH vectors.
         unsigned int kernel,            // The GPU kernel (algorithm) to use.
-        CellId blockSize                // The number of cells processed by each kernel instance.
+        CellId blockSize,               // The number of cells processed by each kernel instance.
+        size_t lshBitCount              // The number of LSH signature bits to use (a prefix), or 0 to use all.
         );
     void findSimilarPairs4GpuKernel0(
         size_t k,                       // The maximum number of similar pairs to be stored for each cell.
@@ -495,7 +702,8 @@ public:
         size_t k,                       // The maximum number of similar pairs to be stored for each cell.
         double similarityThreshold,     // The minimum similarity for a pair to be stored.
         size_t lshSliceLength,          // The number of bits in each LSH signature slice, or 0 for automatic selection.
-        size_t bucketOverflow           // If not zero, ignore buckets larger than this.
+        size_t bucketOverflow,          // If not zero, ignore buckets larger than this.
+        size_t lshBitCount              // The number of LSH signature bits to use (a prefix), or 0 to use all.
         );
 
     // Find similar cell pairs using LSH and the Charikar algorithm.
@@ -519,7 +727,8 @@ public:
         size_t permutationCount,        // The number of bit permutations for the Charikar algorithm.
         size_t searchCount,             // The number of cells checked for each cell, in the Charikar algorithm.
         size_t permutedBitCount,        // The number of most significant bits stored for each permuted signature.
-        int seed                        // The seed used to randomly generate the bit permutations.
+        int seed,                       // The seed used to randomly generate the bit permutations.
+        size_t lshBitCount              // The number of LSH signature bits to use (a prefix), or 0 to use all.
         );
 
     // Find similar cell pairs using the full LSH algorithm, without looping over all pairs.
@@ -534,9 +743,24 @@ public:
         double similarityThreshold,     // The minimum similarity for a pair to be stored.
         const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
         CellId maxCheck,                // Maximum number of cells to consider for each cell.
+        size_t log2BucketCount,
+        size_t lshBitCount              // The number of LSH signature bits to use (a prefix), or 0 to use all.
+    );
+
+    // The core of findSimilarPairs7, operating on an existing Lsh object
+    // and storing its results in the given SimilarPairs object.
+    // The Lsh and SimilarPairs objects must use the same cells.
+    // This is also used by FederatedExpressionMatrix.
+    static void findSimilarPairs7(
+        Lsh&,
+        SimilarPairs&,
+        size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+        double similarityThreshold,     // The minimum similarity for a pair to be stored.
+        const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
+        CellId maxCheck,                // Maximum number of cells to consider for each cell.
         size_t log2BucketCount
     );
-    void findSimilarPairs7AssignCellsToBuckets(
+    static void findSimilarPairs7AssignCellsToBuckets(
         Lsh&,
         const vector<int>& lshSliceLengths,                     // The number of signature slice bits, in decreasing order.
         vector< vector< vector< size_t > > >& sliceBits3,       // The bits of each slice.
@@ -555,7 +779,8 @@ public:
         const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
         CellId maxCheck,                    // Maximum number of candidate neighbors to consider for each cell.
         size_t log2BucketCount,
-        CellId blockSize                    // The number of cells processed by each kernel instance on the GPU.
+        CellId blockSize,                   // The number of cells processed by each kernel instance on the GPU.
+        size_t lshBitCount                  // The number of LSH signature bits to use (a prefix), or 0 to use all.
         );
     void findSimilarPairs7GpuKernel3(
         size_t k,                       // The maximum number of similar pairs to be stored for each cell.
@@ -568,14 +793,68 @@ public:
         size_t log2BucketCount);
 #endif
     // Compute cell LSH signatures and store them.
+    // If layerName is not empty, the signatures are computed using
+    // the values stored in that expression layer instead of the raw expression counts.
+    // Otherwise, cell expression vectors are normalized as requested.
+    // Because LSH only uses the direction of the expression vectors,
+    // L1, L2, CPM, and CP10k give the same signatures as no normalization.
     void computeLshSignatures(
         const string& geneSetName,      // The name of the gene set to be used.
         const string& cellSetName,      // The name of the cell set to be used.
         const string& lshName,          // The name of the Lsh object to be created.
         size_t lshCount,                // The number of LSH vectors to use.
-        unsigned int seed               // The seed used to generate the LSH vectors.
+        unsigned int seed,              // The seed used to generate the LSH vectors.
+        const string& layerName,        // The name of the expression layer to be used, if any.
+        NormalizationMethod normalizationMethod
         );
 
+    // Create a new Lsh object containing a contiguous copy of the signatures
+    // that an existing Lsh object has for the cells of a cell set.
+    // The cell set must be contained in the cell set used to create
+    // the existing Lsh object. The new Lsh object gives the same results
+    // as accessing the existing one for that cell set (see accessLsh),
+    // but with better locality when the cell set is a small fraction of the cells.
+    void gatherLshSignatures(
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& lshName,          // The name of the existing Lsh object.
+        const string& newLshName        // The name of the Lsh object to be created.
+        );
+private:
+    // Access an existing Lsh object for use with a cell set.
+    // If the Lsh object was created for that cell set, it is returned directly.
+    // If it was created for a cell set that contains all the cells
+    // of the cell set (for example AllCells), a view of the Lsh object
+    // for the cells of the cell set is returned. This gives the same signatures
+    // that computeLshSignatures would compute for the cell set,
+    // using the same gene set and seed, without recomputing them.
+    // Lsh objects created before their CellIds were stored
+    // can only be used for a cell set with the same number of cells.
+    shared_ptr<Lsh> accessLsh(
+        const string& lshName,
+        const string& cellSetName,
+        const MemoryMapped::Vector<CellId>& cellSet);
+public:
+
+    // Create a new expression layer containing normalized expression counts
+    // for all cells. See ExpressionLayer.hpp.
+    // All normalization methods except PearsonResiduals can be used.
+    // Valid precisions are float32, float16, bfloat16.
+    // The layer is persistent and is kept up to date as cells are added.
+    void createExpressionLayer(
+        const string& layerName,
+        NormalizationMethod,
+        const string& precision);
+
+    // Remove an expression layer.
+    void removeExpressionLayer(const string& layerName);
+
+    // Return the names of the existing expression layers.
+    vector<string> getExpressionLayerNames() const;
+
+    // Return the values stored for a cell in an expression layer,
+    // each with its global GeneId, sorted by GeneId.
+    vector< pair<GeneId, float> > getCellExpressionLayerValues(CellId, const string& layerName) const;
+
 
     // Analyze the quality of the LSH computation of cell similarity.
     void analyzeLsh(
@@ -594,6 +873,41 @@ public:
         unsigned int seed              // The seed used to generate the LSH vectors and to downsample.
         );
 
+    // Estimate the accuracy of the similarities computed by an existing Lsh object,
+    // by comparing them with exact Pearson similarities on a sample of cell pairs.
+    // This only looks at a sample of pairs, so it is fast also for large cell sets.
+    // See LshAccuracy.hpp for more information.
+    LshAccuracy estimateLshAccuracy(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& lshName,          // The name of the Lsh object to be used.
+        size_t lshBitCount,             // The number of LSH signature bits to use (0 = all).
+        size_t randomPairCount,         // The number of random pairs.
+        size_t queryCellCount,          // The number of cells for which we look for neighbors.
+        size_t referenceCellCount,      // The number of cells where neighbors are looked for (0 = all).
+        size_t k,                       // The number of neighbors of each query cell.
+        size_t binCount,                // The number of bins of exact similarity.
+        unsigned int seed               // The seed used to sample cells and pairs.
+        );
+
+    // Choose parameters for findSimilarPairs5 and findSimilarPairs7 that achieve
+    // a target recall@k at the lowest predicted cost, using an existing Lsh object.
+    // Recall and candidate counts are predicted using a sample of cells.
+    // See LshTuning.hpp for more information.
+    LshTuning tuneLsh(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& lshName,          // The name of the Lsh object to be used.
+        size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+        double similarityThreshold,     // The minimum similarity for a pair to be stored.
+        double targetRecall,            // The required recall@k.
+        size_t queryCellCount,          // The number of cells used to estimate recall and cost.
+        size_t exactCheckCount,         // For each query cell, the number of cells checked to find the exact neighbors (0 = all).
+                                        // If not all, recall is overestimated (see LshTuning.hpp).
+        size_t referenceCellCount,      // The number of cells used to estimate bucket sizes (0 = all).
+        unsigned int seed               // The seed used to sample cells.
+        );
+
     // Dump cell to csv file a set of similar cell pairs.
     void writeSimilarPairs(const string& name) const;
 
@@ -605,7 +919,8 @@ public:
     // Compare two SimilarPairs objects computed using LSH,
     // assuming that the first one was computed using a complete
     // loop on all pairs (findSimilarPairs4).
-    void compareSimilarPairs(
+    // Returns true if all cells have identical similarities in the two.
+    bool compareSimilarPairs(
         const string& similarPairsName0,
         const string& similarPairsName1);
 
@@ -744,6 +1059,15 @@ private:
     // This is indexed by the CellId.
     MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t> cellExpressionCounts;
 
+    // Expression layers, keyed by name. See ExpressionLayer.hpp.
+    // Each layer stores normalized values for all of the cellExpressionCounts.
+    map<string, ExpressionLayer> expressionLayers;
+
+    // Return the expression layer with the given name,
+    // throwing an exception if it does not exist or is not
+    // up to date with cellExpressionCounts.
+    const ExpressionLayer& getExpressionLayer(const string& layerName) const;
+
 
 
 public:
@@ -808,13 +1132,65 @@ private:
     // normalizing it as requested.
     // The expression vector contains pairs(local gene id, count).
     // The local gene id is an index in the GeneSet.
+    // Normalization uses the counts for the genes in the GeneSet.
+    // For NormalizationMethod::PearsonResiduals the expression vector is dense,
+    // with an entry for every gene in the GeneSet. When computing expression vectors
+    // for many cells, pass the PearsonResidualsParameters for the GeneSet,
+    // so they are not computed again for each cell.
     void computeExpressionVector(
         CellId,
         const GeneSet&,
         NormalizationMethod,
-        vector< pair<GeneId, float> >& expressionVector // The computed expression vector.
+        vector< pair<GeneId, float> >& expressionVector, // The computed expression vector.
+        const PearsonResidualsParameters* = 0
         ) const;
 
+    // Return the sums of the expression counts of each cell for the genes
+    // in a gene set, computing them in parallel if they are not available
+    // or not up to date. This is thread safe. The returned vector
+    // is never modified, and remains valid as long as it is held,
+    // even if cells or genes are added.
+    shared_ptr<const vector<GeneSet::CellSums> > getGeneSetCellSums(const GeneSet&) const;
+
+    // Same, for the ranks of the expression counts of each cell
+    // used for SimilarityMetric::Spearman.
+    shared_ptr<const vector<GeneSet::CellRanks> > getGeneSetCellRanks(const GeneSet&) const;
+
+    // Compute the similarity of two cells for the genes in a gene set,
+    // given the CellSimilarityData for that gene set,
+    // as returned by prepareCellSimilarity for the same SimilarityMetric.
+    double computeCellSimilarity(
+        const GeneSet&,
+        CellId, CellId,
+        SimilarityMetric,
+        const GeneSet::CellSimilarityData&) const;
+
+    // Check that a SimilarityMetric is valid, and get the CellSums and,
+    // for SimilarityMetric::Spearman, the CellRanks for a gene set.
+    // This is used before computing similarities in parallel,
+    // so the caches are not computed inside the parallel loop.
+    void prepareCellSimilarity(
+        const GeneSet&,
+        SimilarityMetric,
+        GeneSet::CellSimilarityData&) const;
+
+    // The total count for each gene over all cells, used to compute
+    // analytic Pearson residuals. It is computed when first needed
+    // and computed again after cells or genes are added.
+    mutable vector<double> geneTotalCounts;
+    mutable uint64_t geneTotalCountsExpressionCount = std::numeric_limits<uint64_t>::max();
+    mutable std::mutex geneTotalCountsMutex;
+
+    // Get the PearsonResidualsParameters for a gene set.
+    // Analytic Pearson residuals always use the gene fractions over all cells
+    // and clip at the square root of the number of cells, whether they are
+    // computed one cell at a time or for an ExpressionMatrixSubset.
+    // Does nothing if the normalization method is not PearsonResiduals.
+    void getPearsonResidualsParameters(
+        const GeneSet&,
+        NormalizationMethod,
+        PearsonResidualsParameters&) const;
+
 
 
     // Functions used to implement HttpServer functionality.
@@ -824,6 +1200,7 @@ public:
 private:
     ServerParameters serverParameters;
     void processRequest(const vector<string>& request, ostream& html);
+    string getStaticFileName(const vector<string>& request);
     typedef void (ExpressionMatrix::*ServerFunction)(const vector<string>& request, ostream& html);
     map<string, ServerFunction> serverFunctionTable;
     set<string> nonHtmlKeywords;
@@ -871,6 +1248,8 @@ private:
     ostream& writeNormalizationSelection(ostream& html, NormalizationMethod selectedNormalizationMethod) const;
     ostream& writeSimilarGenePairsSelection(ostream& html, const string& selectName) const;
     NormalizationMethod getNormalizationMethod(const vector<string>& request, NormalizationMethod defaultValue);
+    ostream& writeSimilarityMetricSelection(ostream& html, SimilarityMetric selectedSimilarityMetric) const;
+    SimilarityMetric getSimilarityMetric(const vector<string>& request, SimilarityMetric defaultValue);
     void removeCellSet(const vector<string>& request, ostream& html);
     void similarPairs(const vector<string>& request, ostream& html);
     void createSimilarPairs(const vector<string>& request, ostream& html);
@@ -983,6 +1362,9 @@ public:
 
     // Compute gene information content in bits for a given gene set and cell set,
     // using the specified normalization method.
+    // Normalization uses the counts for all genes.
+    // NormalizationMethod::PearsonResiduals is not supported, because it
+    // generates negative values.
     void computeGeneInformationContent(
         const GeneSet&,
         const CellSet&,
@@ -1188,6 +1570,150 @@ public:
     string getGeneMetaData(GeneId, const string& name) const;
     string getGeneMetaData(GeneId, StringId) const;
 
+
+
+public:
+
+    // Set the NUMA placement policy for a large data structure (see numa.hpp).
+    // Valid container names are Cells, CellExpressionCounts,
+    // and Lsh-<lshName> for the signatures of an Lsh object.
+    // Valid policy names are none, interleave, partitioned.
+    // The policy is applied immediately if the container exists.
+    // It is remembered for the lifetime of the ExpressionMatrix object,
+    // so it is also applied to an Lsh object later created by computeLshSignatures.
+    // This has no effect on systems with a single NUMA node.
+    void setNumaPolicy(const string& containerName, const string& policyName);
+private:
+    map<string, numa::Policy> numaPolicies;
+    numa::Policy getNumaPolicy(const string& containerName) const;
+
+
+
+public:
+
+    // Set the durability mode for the files of this expression matrix
+    // (see MemoryMappedDurability.hpp). Valid modes are:
+    // - strict: sync each data structure to disk when it is closed or resized (the default).
+    // - async: start write-back when a data structure is closed or resized, without waiting for it.
+    // - bulk: don't sync, except in checkpoint.
+    // The mode is remembered for the lifetime of the ExpressionMatrix object.
+    void setDurabilityMode(const string& modeName);
+
+    // Sync all the data structures of this expression matrix to disk,
+    // then atomically write a checkpoint marker containing the number of cells.
+    // If the process or the system crashes, all cells up to the
+    // last checkpoint are safely on disk.
+    void checkpoint();
+
+    // Return the number of cells at the last checkpoint, or invalidCellId
+    // if a checkpoint was never written. When accessing an existing
+    // expression matrix, if this is different from cellCount(),
+    // the process that created the cells after the last checkpoint
+    // did not terminate normally, and those cells may be incomplete.
+    // Their input should be processed again, starting from this cell,
+    // after calling recoverFromCheckpoint.
+    CellId getCheckpointCellCount() const
+    {
+        return checkpointCellCount;
+    }
+
+    // Discard the cells added after the last checkpoint, in place,
+    // then write a new checkpoint. Cells can then be added again.
+    // Genes and meta data values added after the checkpoint are kept.
+    // Cell graphs and other objects kept in memory
+    // that refer to the discarded cells must be recreated.
+    void recoverFromCheckpoint();
+private:
+    CellId checkpointCellCount = invalidCellId;
+    void readCheckpoint();
+
+    // Set if, when accessing an existing expression matrix, the number of cells
+    // did not match the last checkpoint. In that case the destructor
+    // does not write a checkpoint, which would hide the inconsistency.
+    bool checkpointMismatch = false;
+    bool cellDataStructuresAreConsistent();
+
+
+
+public:
+
+    // Create a snapshot of this expression matrix in directory
+    // Snapshots/snapshotName of the expression matrix directory.
+    // This is fast and initially uses almost no disk space, because
+    // the snapshot shares unchanged data structures with this expression matrix
+    // (see MemoryMappedCopyOnWrite.hpp).
+    void createSnapshot(const string& snapshotName);
+
+    // Return the names of the existing snapshots.
+    vector<string> getSnapshotNames() const;
+
+    // Return the directory containing a snapshot.
+    string getSnapshotDirectoryName(const string& snapshotName) const;
+
+    // Access a snapshot with write access, as a separate expression matrix.
+    // Changes made to the branch don't affect this expression matrix,
+    // and vice versa. Only the data structures that are modified use disk space.
+    unique_ptr<ExpressionMatrix> openBranch(const string& snapshotName) const;
+
+    // Remove a snapshot. It must not be open as a branch.
+    void removeSnapshot(const string& snapshotName);
+
+
+
+public:
+
+    // Return the fragmentation of the cell or gene meta data, between 0 and 1
+    // (see MemoryMapped::VectorOfLists::fragmentation).
+    // Fragmentation increases as meta data are set and removed,
+    // and makes all operations that scan the meta data slower.
+    double getCellMetaDataFragmentation() const;
+    double getGeneMetaDataFragmentation() const;
+
+    // Rewrite the cell and gene meta data so the meta data of each cell
+    // (or gene) are contiguous and in cell (or gene) order,
+    // and discard unused space. This uses multiple threads,
+    // and no other operations can run at the same time.
+    void compactMetaData();
+
+    // Compact the cell and/or gene meta data if their fragmentation
+    // is greater than the given threshold.
+    // Returns true if any compaction was done.
+    // This is also available as pipeline stage compactMetaData.
+    bool compactMetaDataIfFragmented(double threshold);
+
+
+
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+    // Write the expression counts for a gene set and cell set
+    // to data sets data, indices, and indptr of an hdf5 group,
+    // in compressed sparse row format (one row per cell).
+    // This is the format used by both 10X Genomics and AnnData files,
+    // so this is shared by exportToHdf5 and exportToH5ad.
+    // Data is the type used to store expression counts,
+    // and Index the type used for indices and indptr.
+    // If Data is an integer type, all expression counts must be non-negative integers.
+    // Returns the total number of expression counts written.
+    template<class Data, class Index> uint64_t writeHdf5ExpressionCounts(
+        H5::Group&,
+        GeneSet&,
+        const string& cellSetName,
+        uint64_t chunkSize,
+        int compressionLevel);
+#endif
+
+
+
+    // Functions used by runPipeline.
+    void runPipelineStage(const PipelineStage&);
+    bool pipelineStageOutputsExist(const PipelineStage&) const;
+
+    // When runPipeline resumes a stage that adds cells after an interruption,
+    // the number of cells when the interrupted run of the stage began.
+    // While this is set, addCellWithGeneIds skips cells with a name
+    // that was added after that, instead of throwing,
+    // so the cells the interrupted run added are not added again.
+    CellId pipelineResumeCellCount = invalidCellId;
+
 };
 
 
@@ -0,0 +1,182 @@
+// This file contains the implementation of
+// ExpressionMatrix::createExpressionMatrixFromSubset.
+
+#include "ExpressionMatrix.hpp"
+#include "TaskScheduler.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <chrono>
+#include <cmath>
+#include <numeric>
+
+
+
+// Create a new expression matrix in the specified directory,
+// containing only the cells of the specified cell set
+// and the genes of the specified gene set.
+void ExpressionMatrix::createExpressionMatrixFromSubset(
+    const string& newDirectoryName,
+    const string& geneSetName,
+    const string& cellSetName,
+    const vector<string>& metaDataNames)
+{
+    cout << timestamp << "ExpressionMatrix::createExpressionMatrixFromSubset begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Locate the gene set and the cell set.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    GeneSet& geneSet = itGeneSet->second;
+    const CellSet& cellSet = this->cellSet(cellSetName);
+
+    // The local gene ids of the gene set must be in the same order
+    // as the global gene ids, so the expression counts of each cell
+    // remain sorted by GeneId after renumbering.
+    geneSet.genes();
+    geneSet.assertIsSorted();
+    const GeneId newGeneCount = geneSet.size();
+    const CellId newCellCount = CellId(cellSet.size());
+
+    // Create the new expression matrix, with the same capacities as this one.
+    // This throws if the directory already exists.
+    const ExpressionMatrixCreationParameters parameters(
+        geneNames.capacity(),
+        cellNames.capacity(),
+        cellMetaDataNames.capacity(),
+        cellMetaDataValues.capacity(),
+        geneMetaDataNames.capacity(),
+        geneMetaDataValues.capacity());
+    ExpressionMatrix newExpressionMatrix(newDirectoryName, parameters);
+
+
+
+    // Copy the genes and their meta data.
+    // Genes are added in the order of the gene set, so the new GeneId
+    // of each gene is its local GeneId in the gene set.
+    cout << timestamp << "Copying " << newGeneCount << " genes." << endl;
+    for(GeneId localGeneId=0; localGeneId!=newGeneCount; localGeneId++) {
+        const GeneId geneId = geneSet.getGlobalGeneId(localGeneId);
+        newExpressionMatrix.addGene(geneNames[geneId]);
+        for(const auto& p: geneMetaData[geneId]) {
+            newExpressionMatrix.setGeneMetaData(localGeneId,
+                geneMetaDataNames[p.first], geneMetaDataValues[p.second]);
+        }
+    }
+    CZI_ASSERT(newExpressionMatrix.geneCount() == newGeneCount);
+
+
+
+    // Find the cell meta data names to be copied.
+    // CellName is always copied.
+    vector<bool> copyMetaDataName(cellMetaDataNames.size(), metaDataNames.empty());
+    const StringId cellNameId = cellMetaDataNames("CellName");
+    CZI_ASSERT(cellNameId != cellMetaDataNames.invalidStringId);
+    copyMetaDataName[cellNameId] = true;
+    for(const string& metaDataName: metaDataNames) {
+        const StringId nameId = cellMetaDataNames(metaDataName);
+        if(nameId == cellMetaDataNames.invalidStringId) {
+            throw runtime_error("Cell meta data name " + metaDataName + " does not exist.");
+        }
+        copyMetaDataName[nameId] = true;
+    }
+
+    // Copy the cell names and meta data.
+    // The string tables and lists of meta data of the new expression matrix
+    // must be updated sequentially. To keep this fast, each distinct name and value
+    // is looked up only once, the first time it is encountered.
+    cout << timestamp << "Copying cell names and meta data for " << newCellCount << " cells." << endl;
+    vector<StringId> newNameIds(cellMetaDataNames.size(), cellMetaDataNames.invalidStringId);
+    vector<StringId> newValueIds(cellMetaDataValues.size(), cellMetaDataValues.invalidStringId);
+    for(CellId newCellId=0; newCellId!=newCellCount; newCellId++) {
+        const CellId cellId = cellSet[newCellId];
+        const StringId newCellNameId = newExpressionMatrix.cellNames[cellNames[cellId]];
+        CZI_ASSERT(newCellNameId == newCellId);
+
+        newExpressionMatrix.cellMetaData.push_back();
+        for(const auto& p: cellMetaData[cellId]) {
+            if(!copyMetaDataName[p.first]) {
+                continue;
+            }
+            StringId& newNameId = newNameIds[p.first];
+            if(newNameId == cellMetaDataNames.invalidStringId) {
+                newNameId = newExpressionMatrix.cellMetaDataNames[cellMetaDataNames[p.first]];
+            }
+            StringId& newValueId = newValueIds[p.second];
+            if(newValueId == cellMetaDataValues.invalidStringId) {
+                newValueId = newExpressionMatrix.cellMetaDataValues[cellMetaDataValues[p.second]];
+            }
+            newExpressionMatrix.cellMetaData.push_back(make_pair(newNameId, newValueId));
+            newExpressionMatrix.incrementCellMetaDataNameUsageCount(newNameId);
+        }
+    }
+
+
+
+    // Copy the expression counts in two passes, in parallel.
+    // In pass 1 we count the expression counts of each cell for genes in the gene set.
+    // In pass 2 we store them, with renumbered gene ids, and compute the cell sums.
+    // Each cell is processed by a single thread, so no synchronization is needed.
+    cout << timestamp << "Copying expression counts using " <<
+        getEffectiveThreadCount() << " threads." << endl;
+    auto& newCellExpressionCounts = newExpressionMatrix.cellExpressionCounts;
+    newCellExpressionCounts.beginPass1(newCellCount);
+    parallelFor(0, newCellCount, [&](size_t newCellId)
+        {
+            uint64_t count = 0;
+            for(const auto& p: cellExpressionCounts[cellSet[newCellId]]) {
+                if(geneSet.getLocalGeneId(p.first) != invalidGeneId) {
+                    ++count;
+                }
+            }
+            newCellExpressionCounts.incrementCount(newCellId, count);
+        });
+    newCellExpressionCounts.beginPass2();
+    newExpressionMatrix.cells.resize(newCellCount);
+    parallelFor(0, newCellCount, [&](size_t newCellId)
+        {
+            Cell& cell = newExpressionMatrix.cells[newCellId];
+            cell.sum1 = 0.;
+            cell.sum2 = 0.;
+            cell.sum1LargeExpressionCounts = 0.;
+            cell.sum2LargeExpressionCounts = 0.;
+
+            // Store fills each vector starting at the end,
+            // so we loop backward to preserve the order.
+            const auto counts = cellExpressionCounts[cellSet[newCellId]];
+            for(auto it=counts.end(); it!=counts.begin(); ) {
+                --it;
+                const GeneId localGeneId = geneSet.getLocalGeneId(it->first);
+                if(localGeneId != invalidGeneId) {
+                    const float value = it->second;
+                    newCellExpressionCounts.store(newCellId, make_pair(localGeneId, value));
+                    cell.sum1 += value;
+                    cell.sum2 += value*value;
+                }
+            }
+            cell.norm2 = sqrt(cell.sum2);
+            cell.norm1Inverse = 1./cell.norm1();
+            cell.norm2Inverse = 1./cell.norm2;
+        });
+    newCellExpressionCounts.endPass2();
+
+    // All cells go in the AllCells cell set of the new expression matrix.
+    CellSet& allCells = *newExpressionMatrix.cellSets.cellSets["AllCells"];
+    allCells.resize(newCellCount);
+    std::iota(allCells.begin(), allCells.end(), CellId(0));
+
+    // Sanity checks.
+    CZI_ASSERT(newExpressionMatrix.cellNames.size() == newCellCount);
+    CZI_ASSERT(newExpressionMatrix.cellMetaData.size() == newCellCount);
+    CZI_ASSERT(newExpressionMatrix.cellExpressionCounts.size() == newCellCount);
+    CZI_ASSERT(newExpressionMatrix.cells.size() == newCellCount);
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "Created expression matrix " << newDirectoryName << " with " <<
+        newGeneCount << " genes, " << newCellCount << " cells, and " <<
+        newCellExpressionCounts.totalSize() << " expression counts in " << t01 << " s." << endl;
+}
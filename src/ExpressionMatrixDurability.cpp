@@ -0,0 +1,319 @@
+// This file contains portions of the implementation of class ExpressionMatrix
+// that control when data are synced to disk and create checkpoints.
+// See MemoryMappedDurability.hpp for more information.
+
+#include "ExpressionMatrix.hpp"
+#include "ExpressionMatrixTest.hpp"
+#include "MemoryMappedDurability.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include "fstream.hpp"
+#include "stdexcept.hpp"
+
+#include <cstdio>
+
+
+
+void ExpressionMatrix::setDurabilityMode(const string& modeName)
+{
+    const MemoryMapped::DurabilityMode mode = MemoryMapped::durabilityModeFromString(modeName);
+    MemoryMapped::setDurabilityMode(directoryName, mode);
+    cout << timestamp << "Durability mode for " << directoryName << " set to " << modeName << "." << endl;
+}
+
+
+
+// Sync all data structures, then write the checkpoint marker.
+// The marker is written to a temporary file which is then renamed,
+// so the marker on disk is always complete.
+void ExpressionMatrix::checkpoint()
+{
+    if(!cells.isOpenWithWriteAccess) {
+        throw runtime_error("Cannot write a checkpoint for an expression matrix accessed read-only.");
+    }
+
+    // Sync all the data structures of this expression matrix.
+    const size_t mappingCount = MemoryMapped::syncDirectory(directoryName);
+
+    // Write the marker to a temporary file and sync it.
+    const string fileName = directoryName + "/Checkpoint";
+    const string temporaryFileName = fileName + "-tmp";
+    {
+        ofstream file(temporaryFileName);
+        file << "cellCount " << cellCount() << "\n";
+        file << "geneCount " << geneCount() << "\n";
+        if(!file) {
+            throw runtime_error("Error writing " + temporaryFileName);
+        }
+    }
+    MemoryMapped::syncFile(temporaryFileName);
+
+    // Atomically replace the previous marker, then sync the directory
+    // so the new directory entries (including those of any
+    // newly created data structures) are also on disk.
+    if(std::rename(temporaryFileName.c_str(), fileName.c_str()) != 0) {
+        throw runtime_error("Error renaming " + temporaryFileName);
+    }
+    MemoryMapped::syncDirectoryEntry(fileName);
+
+    checkpointCellCount = cellCount();
+    checkpointMismatch = false;
+    cout << timestamp << "Checkpoint written for " << cellCount() << " cells, " <<
+        mappingCount << " data structures synced." << endl;
+}
+
+
+
+// Read the checkpoint marker, if one exists, when accessing
+// an existing expression matrix, and warn if the expression matrix
+// changed after the last checkpoint.
+// An invalid marker is ignored with a warning.
+void ExpressionMatrix::readCheckpoint()
+{
+    const string fileName = directoryName + "/Checkpoint";
+    if(!filesystem::exists(fileName)) {
+        return;
+    }
+    ifstream file(fileName);
+    string keyword;
+    uint64_t value;
+    while(file >> keyword >> value) {
+        if(keyword == "cellCount" && value < uint64_t(invalidCellId)) {
+            checkpointCellCount = CellId(value);
+        }
+    }
+    if(checkpointCellCount == invalidCellId) {
+        cout << "Ignoring invalid checkpoint marker " << fileName << endl;
+        return;
+    }
+
+    // A cell is added to each of these data structures in turn,
+    // so if the process adding a cell terminated abnormally
+    // they can have different sizes.
+    const size_t allCellsSize = cellSets.cellSets["AllCells"]->size();
+    if(checkpointCellCount != cells.size() ||
+        checkpointCellCount != cellNames.size() ||
+        checkpointCellCount != cellMetaData.size() ||
+        checkpointCellCount != cellExpressionCounts.size() ||
+        checkpointCellCount != allCellsSize) {
+        checkpointMismatch = true;
+        cout << "The last checkpoint of " << directoryName << " was written when it had " <<
+            checkpointCellCount << " cells, but it now has " << cells.size() << " cells. " <<
+            "The process that modified it did not terminate normally. "
+            "Cells after the checkpoint may be incomplete. "
+            "Use recoverFromCheckpoint to discard the cells after the checkpoint." << endl;
+    }
+}
+
+
+
+// Return true if the data structures containing information for each cell
+// have the same size. This is only false if the process
+// adding a cell terminated abnormally.
+bool ExpressionMatrix::cellDataStructuresAreConsistent()
+{
+    return
+        cellNames.size() == cells.size() &&
+        cellMetaData.size() == cells.size() &&
+        cellExpressionCounts.size() == cells.size() &&
+        cellSets.cellSets["AllCells"]->size() == cells.size() &&
+        cellMetaDataNamesUsageCount.size() == cellMetaDataNames.size();
+}
+
+
+
+// Truncate the data structures containing information for each cell
+// to the number of cells at the last checkpoint.
+// This is done in place, so cells can be added again afterwards.
+void ExpressionMatrix::recoverFromCheckpoint()
+{
+    if(!cells.isOpenWithWriteAccess) {
+        throw runtime_error("Cannot recover expression matrix " + directoryName + " accessed read-only.");
+    }
+    if(checkpointCellCount == invalidCellId) {
+        throw runtime_error("Expression matrix " + directoryName + " does not have a checkpoint.");
+    }
+    const CellId cellCount = checkpointCellCount;
+    CellSet& allCells = *cellSets.cellSets["AllCells"];
+    if(cellCount > cells.size() ||
+        cellCount > cellNames.size() ||
+        cellCount > cellMetaData.size() ||
+        cellCount > cellExpressionCounts.size() ||
+        cellCount > allCells.size()) {
+        throw runtime_error("Expression matrix " + directoryName + " has fewer cells than at the last checkpoint.");
+    }
+    const CellId oldCellCount = CellId(cells.size());
+
+    // Truncate the data structures in the order addCell adds to them.
+    cellNames.truncate(cellCount);
+    cellMetaData.truncate(cellCount);
+    cellExpressionCounts.truncate(cellCount);
+    for(auto& p: expressionLayers) {
+        ExpressionLayer& layer = p.second;
+        if(layer.size() > cellExpressionCounts.totalSize()) {
+            layer.resize(cellExpressionCounts.totalSize());
+        }
+    }
+    cells.resize(cellCount);
+
+    // Remove the discarded cells from the cell sets, which are sorted.
+    for(auto& p: cellSets.cellSets) {
+        CellSet& cellSet = *p.second;
+        cellSet.resize(std::lower_bound(cellSet.begin(), cellSet.end(), cellCount) - cellSet.begin());
+    }
+
+    // Recompute the usage counts of the cell meta data names,
+    // which could also have been incremented for the discarded cells.
+    cellMetaDataNamesUsageCount.resize(cellMetaDataNames.size());
+    fill(cellMetaDataNamesUsageCount.begin(), cellMetaDataNamesUsageCount.end(), CellId(0));
+    for(CellId cellId=0; cellId!=cellCount; cellId++) {
+        for(const auto& p: cellMetaData[cellId]) {
+            ++cellMetaDataNamesUsageCount[p.first];
+        }
+    }
+
+    // The gene set caches can contain the discarded cells.
+    for(auto& p: geneSets) {
+        const GeneSet& geneSet = p.second;
+        {
+            std::lock_guard<std::mutex> lock(geneSet.cellSumsMutex);
+            geneSet.cellSums.reset();
+        }
+        std::lock_guard<std::mutex> lock(geneSet.cellRanksMutex);
+        geneSet.cellRanks.reset();
+    }
+
+    CZI_ASSERT(cellDataStructuresAreConsistent());
+    cout << timestamp << "Discarded " << oldCellCount - cellCount << " cells added to " <<
+        directoryName << " after the last checkpoint." << endl;
+    checkpoint();
+}
+
+
+
+// If the durability mode is not strict, write a checkpoint, so an expression
+// matrix that was closed normally is always consistent with its checkpoint.
+// This is also done if a checkpoint exists, so it stays up to date,
+// unless the expression matrix did not match its checkpoint when accessed.
+// After the checkpoint everything is on disk, so we can return to strict mode
+// for the destructors of the data structures.
+ExpressionMatrix::~ExpressionMatrix()
+{
+    try {
+        if(cells.isOpenWithWriteAccess && !checkpointMismatch &&
+            (MemoryMapped::getDurabilityMode(directoryName) != MemoryMapped::DurabilityMode::strict ||
+            checkpointCellCount != invalidCellId)) {
+            checkpoint();
+        }
+        MemoryMapped::setDurabilityMode(directoryName, MemoryMapped::DurabilityMode::strict);
+    } catch(std::exception& e) {
+        cout << "Error writing checkpoint for " << directoryName << ": " << e.what() << endl;
+    }
+}
+
+
+
+// Check checkpoints written explicitly and by the destructor,
+// and recovery after an abnormal termination, which is
+// simulated by replacing the checkpoint marker with an older one.
+void ChanZuckerberg::ExpressionMatrix2::testExpressionMatrixCheckpoint()
+{
+    ExpressionMatrixTest test("testExpressionMatrixCheckpoint");
+    const GeneId geneCount = 50;
+    const string directoryName = test.path("ExpressionMatrix");
+    const string checkpointFileName = directoryName + "/Checkpoint";
+    const auto writeCheckpointFile = [&checkpointFileName](const string& contents)
+    {
+        ofstream file(checkpointFileName);
+        file << contents;
+    };
+    const auto readCheckpointFile = [&checkpointFileName]()
+    {
+        ifstream file(checkpointFileName);
+        string contents;
+        std::getline(file, contents);
+        return contents;
+    };
+
+    // Add cells in bulk mode, writing a checkpoint,
+    // then add more cells. The destructor writes another checkpoint.
+    {
+        const unique_ptr<ExpressionMatrix> expressionMatrix =
+            test.createExpressionMatrix("ExpressionMatrix", 0, geneCount);
+        CZI_ASSERT(expressionMatrix->getCheckpointCellCount() == invalidCellId);
+        bool exceptionWasThrown = false;
+        try {
+            expressionMatrix->setDurabilityMode("invalid");
+        } catch(const runtime_error&) {
+            exceptionWasThrown = true;
+        }
+        CZI_ASSERT(exceptionWasThrown);
+        expressionMatrix->setDurabilityMode("bulk");
+        for(CellId cellId=0; cellId!=100; cellId++) {
+            test.addCell(*expressionMatrix, cellId, geneCount);
+        }
+        expressionMatrix->checkpoint();
+        CZI_ASSERT(expressionMatrix->getCheckpointCellCount() == 100);
+        CZI_ASSERT(readCheckpointFile() == "cellCount 100");
+        for(CellId cellId=100; cellId!=150; cellId++) {
+            test.addCell(*expressionMatrix, cellId, geneCount);
+        }
+    }
+    {
+        ExpressionMatrix expressionMatrix(directoryName, false);
+        test.checkCells(expressionMatrix, 150, geneCount);
+        CZI_ASSERT(expressionMatrix.getCheckpointCellCount() == 150);
+    }
+
+    // Simulate an abnormal termination after the checkpoint at 100 cells.
+    // Recovery discards the cells after the checkpoint, and then
+    // adding cells can resume.
+    writeCheckpointFile("cellCount 100\ngeneCount 50\n");
+    {
+        ExpressionMatrix expressionMatrix(directoryName, false);
+        CZI_ASSERT(expressionMatrix.cellCount() == 150);
+        CZI_ASSERT(expressionMatrix.getCheckpointCellCount() == 100);
+        vector<CellId> cellIds = {5, 99, 100, 149};
+        expressionMatrix.createCellSet("Some", cellIds);
+    }
+
+    // The destructor did not overwrite the marker, which would hide the mismatch.
+    CZI_ASSERT(readCheckpointFile() == "cellCount 100");
+    {
+        ExpressionMatrix expressionMatrix(directoryName, false);
+        expressionMatrix.recoverFromCheckpoint();
+        CZI_ASSERT(readCheckpointFile() == "cellCount 100");
+        test.checkCells(expressionMatrix, 100, geneCount);
+        CZI_ASSERT(expressionMatrix.getCellSet("Some") == vector<CellId>({5, 99}));
+        CZI_ASSERT(expressionMatrix.cellIdFromString(test.cellName(120)) == invalidCellId);
+        for(CellId cellId=100; cellId!=120; cellId++) {
+            test.addCell(expressionMatrix, cellId, geneCount);
+        }
+    }
+    {
+        ExpressionMatrix expressionMatrix(directoryName, false);
+        test.checkCells(expressionMatrix, 120, geneCount);
+        CZI_ASSERT(expressionMatrix.getCheckpointCellCount() == 120);
+        CZI_ASSERT(expressionMatrix.getCellSet("AllCells").size() == 120);
+    }
+
+    // An invalid marker is ignored, and then there is nothing to recover from.
+    writeCheckpointFile("invalid\n");
+    {
+        ExpressionMatrix expressionMatrix(directoryName, false);
+        CZI_ASSERT(expressionMatrix.getCheckpointCellCount() == invalidCellId);
+        bool exceptionWasThrown = false;
+        try {
+            expressionMatrix.recoverFromCheckpoint();
+        } catch(const runtime_error&) {
+            exceptionWasThrown = true;
+        }
+        CZI_ASSERT(exceptionWasThrown);
+        CZI_ASSERT(expressionMatrix.cellCount() == 120);
+    }
+
+    test.success();
+}
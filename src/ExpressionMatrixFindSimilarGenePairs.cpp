@@ -1,6 +1,7 @@
 #include "ExpressionMatrix.hpp"
 #include "ExpressionMatrixSubset.hpp"
 #include "heap.hpp"
+#include "normalizationKernels.hpp"
 #include "SimilarGenePairs.hpp"
 #include "timestamp.hpp"
 #include "tokenize.hpp"
@@ -60,7 +61,9 @@ void ExpressionMatrix::findSimilarGenePairs0(
     // All indices are local to the gene set and cell set.
     cout << timestamp << "Creating dense expression vectors." << endl;
     vector< vector<float> > v;
-    expressionMatrixSubset.getDenseRepresentation(v, normalizationMethod);
+    PearsonResidualsParameters pearsonResidualsParameters;
+    getPearsonResidualsParameters(geneSet, normalizationMethod, pearsonResidualsParameters);
+    expressionMatrixSubset.getDenseRepresentation(v, normalizationMethod, &pearsonResidualsParameters);
 
 
 
@@ -11,7 +11,8 @@ using namespace ExpressionMatrix2;
 
 
 // Find similar cell pairs by looping over all pairs,
-// taking into account only genes in the specified gene set.
+// taking into account only genes in the specified gene set,
+// and using the specified similarity metric.
 // This is O(N**2) slow because it loops over cell pairs.
 void ExpressionMatrix::findSimilarPairs0(
     ostream& out,
@@ -19,11 +20,15 @@ void ExpressionMatrix::findSimilarPairs0(
     const string& cellSetName,      // The name of the cell set to be used.
     const string& similarPairsName, // The name of the SimilarPairs object to be created.
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
-    double similarityThreshold
+    double similarityThreshold,
+    SimilarityMetric similarityMetric
     )
 {
-    // Sanity check.
+    // Sanity checks.
     CZI_ASSERT(similarityThreshold <= 1.);
+    if(similarityMetric == SimilarityMetric::Invalid) {
+        throw runtime_error("Invalid similarity metric.");
+    }
 
     // Locate the gene set and verify that it is not empty.
     const auto itGeneSet = geneSets.find(geneSetName);
@@ -52,6 +57,9 @@ void ExpressionMatrix::findSimilarPairs0(
     const string expressionMatrixSubsetName = directoryName + "/tmp-ExpressionMatrixSubset-" + similarPairsName;
     ExpressionMatrixSubset expressionMatrixSubset(
         expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+    if(similarityMetric == SimilarityMetric::Spearman) {
+        expressionMatrixSubset.computeRanks();
+    }
 
 
     // Loop over all pairs.
@@ -64,7 +72,8 @@ void ExpressionMatrix::findSimilarPairs0(
 
         // Find all cells with similarity better than the specified threshold.
         for(CellId localCellId1=localCellId0+1; localCellId1!=similarPairs.cellCount(); localCellId1++) {
-            const double similarity = expressionMatrixSubset.computeCellSimilarity(localCellId0, localCellId1);
+            const double similarity = expressionMatrixSubset.computeCellSimilarity(
+                localCellId0, localCellId1, similarityMetric);
 
             // If the similarity is sufficient, pass it to the SimilarPairs container,
             // which will make the decision whether to store it, depending on the
@@ -92,10 +101,11 @@ void ExpressionMatrix::findSimilarPairs0(
     const string& cellSetName,      // The name of the cell set to be used.
     const string& similarPairsName, // The name of the SimilarPairs object to be created.
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
-    double similarityThreshold
+    double similarityThreshold,
+    SimilarityMetric similarityMetric
     )
 {
-    findSimilarPairs0(cout, geneSetName, cellSetName, similarPairsName, k, similarityThreshold);
+    findSimilarPairs0(cout, geneSetName, cellSetName, similarPairsName, k, similarityThreshold, similarityMetric);
 }
 
 
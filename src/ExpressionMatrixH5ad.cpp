@@ -0,0 +1,1026 @@
+// Functionality to read and write expression matrix data in AnnData h5ad files.
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+
+#include "ExpressionMatrix.hpp"
+#include "ExpressionMatrixTest.hpp"
+#include "CellGraph.hpp"
+#include "hdf5.hpp"
+#include "TaskScheduler.hpp"
+#include "timestamp.hpp"
+#include "uuid.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <boost/graph/iteration_macros.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+
+
+/*******************************************************************************
+
+AnnData h5ad files are hdf5 files written by the anndata Python package
+(used by scanpy). See here for a description of the format:
+https://anndata.readthedocs.io/en/latest/fileformat-prose.html
+
+The parts of the file we use are:
+
+/X          The expression matrix, with one row per cell (obs)
+            and one column per gene (var). It can be:
+            - A group with encoding-type attribute csr_matrix or csc_matrix
+              (h5sparse_format attribute csr or csc in older files),
+              containing data sets data, indices, and indptr
+              and a shape attribute.
+            - A dense data set with rank 2.
+/raw/X      Alternative location for the expression matrix,
+            usually containing raw counts. Its genes are in /raw/var.
+/layers/... Additional matrices, in the same format as X.
+/obs        A data frame describing the cells.
+/var        A data frame describing the genes.
+/obsm       Multidimensional annotations of the cells, including embeddings.
+
+A data frame is a group. Its _index attribute contains the name
+of the data set with the row names, and its column-order attribute
+contains the names of the columns. Each column is one of:
+- A data set of strings, integers, floating point numbers, or booleans.
+- A categorical group, with data sets categories and codes.
+  A code of -1 means a missing value.
+- A nullable group (nullable-integer, nullable-boolean, ...)
+  with data sets values and mask. A mask of true means a missing value.
+
+Cells are read in blocks containing a bounded number of expression counts,
+so memory usage does not depend on the size of the file.
+For a matrix in compressed sparse column format (one column per gene),
+the expression counts are reordered by cell with a single sequential scan
+of the matrix. For most files there is a single block, and the scan
+stores them directly in the block. Otherwise, the scan stores them
+in a temporary memory mapped file, in which each block is contiguous.
+
+*******************************************************************************/
+
+
+
+// Classes used only in this file.
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace h5ad {
+            class DataFrameColumn;
+            class ExpressionMatrixReader;
+        }
+    }
+}
+
+
+
+// Class that reads the values of a data frame column for a range of rows.
+class ChanZuckerberg::ExpressionMatrix2::h5ad::DataFrameColumn {
+public:
+
+    // Access the column with the given name in a data frame group.
+    // Throws if the column has a type that is not supported.
+    DataFrameColumn(const H5::Group& dataFrame, const string& name) :
+        name(name)
+    {
+        if(dataFrame.childObjType(name) == H5O_TYPE_DATASET) {
+            values = dataFrame.openDataSet(name);
+
+            // Files written by anndata before version 0.7 store categorical columns
+            // as codes referencing categories stored elsewhere.
+            if(hdf5::hasAttribute(values, "categories")) {
+                throw runtime_error("categorical columns in the format used before anndata 0.7 are not supported");
+            }
+            return;
+        }
+
+        const H5::Group group = dataFrame.openGroup(name);
+        const string encodingType = hdf5::readStringAttribute(group, "encoding-type");
+        if(encodingType == "categorical") {
+            isCategorical = true;
+            values = group.openDataSet("codes");
+            const H5::DataSet categoriesDataSet = group.openDataSet("categories");
+            hdf5::readAsStrings(categoriesDataSet, 0, hdf5::size(categoriesDataSet), categories);
+        } else if(hdf5::exists(group, "values") && hdf5::exists(group, "mask")) {
+            hasMask = true;
+            values = group.openDataSet("values");
+            mask = group.openDataSet("mask");
+        } else {
+            throw runtime_error("encoding type " + encodingType + " is not supported");
+        }
+    }
+
+    string name;
+
+    // Get the values for n rows starting at the given offset.
+    // Missing values are returned as empty strings.
+    void read(hsize_t offset, hsize_t n, vector<string>& data) const
+    {
+        if(isCategorical) {
+            hdf5::readAndConvert(values, offset, n, codes);
+            data.resize(n);
+            for(size_t i=0; i<n; i++) {
+                const int64_t code = codes[i];
+                if(code >= 0 && uint64_t(code) < categories.size()) {
+                    data[i] = categories[code];
+                } else {
+                    data[i].clear();
+                }
+            }
+            return;
+        }
+
+        hdf5::readAsStrings(values, offset, n, data);
+        if(hasMask) {
+            hdf5::readAsStrings(mask, offset, n, maskValues);
+            for(size_t i=0; i<n; i++) {
+                if(maskValues[i] == "TRUE") {
+                    data[i].clear();
+                }
+            }
+        }
+    }
+
+private:
+    H5::DataSet values;     // Or codes, for a categorical column.
+    bool isCategorical = false;
+    vector<string> categories;
+    bool hasMask = false;
+    H5::DataSet mask;
+
+    // Work areas.
+    mutable vector<int64_t> codes;
+    mutable vector<string> maskValues;
+};
+
+
+
+// Class that reads an expression matrix from an h5ad file,
+// one block of cells at a time.
+// Each block is returned in compressed sparse row format.
+class ChanZuckerberg::ExpressionMatrix2::h5ad::ExpressionMatrixReader {
+public:
+
+    // The staging file is only created for a matrix in compressed
+    // sparse column format with more than one block of cells.
+    ExpressionMatrixReader(
+        const H5::H5File& file,
+        const string& matrixName,
+        uint64_t blockSize,
+        const string& stagingFileName) :
+        blockSize(blockSize),
+        stagingFileName(stagingFileName)
+    {
+        if(!hdf5::exists(file, matrixName)) {
+            throw runtime_error("Matrix " + matrixName + " not found.");
+        }
+
+        // A dense matrix.
+        if(file.childObjType(matrixName) == H5O_TYPE_DATASET) {
+            format = Format::dense;
+            data = file.openDataSet(matrixName);
+            const H5::DataSpace dataSpace = data.getSpace();
+            if(dataSpace.getSimpleExtentNdims() != 2) {
+                throw runtime_error("Unexpected rank for dense matrix " + matrixName);
+            }
+            hsize_t dimensions[2];
+            dataSpace.getSimpleExtentDims(dimensions, 0);
+            cellCount = dimensions[0];
+            geneCount = dimensions[1];
+            return;
+        }
+
+        // A sparse matrix.
+        const H5::Group group = file.openGroup(matrixName);
+        string encodingType = hdf5::readStringAttribute(group, "encoding-type");
+        if(encodingType.empty()) {
+            encodingType = hdf5::readStringAttribute(group, "h5sparse_format") + "_matrix";
+        }
+        if(encodingType == "csr_matrix") {
+            format = Format::csr;
+        } else if(encodingType == "csc_matrix") {
+            format = Format::csc;
+        } else {
+            throw runtime_error("Unsupported encoding type " + encodingType + " for matrix " + matrixName);
+        }
+        data = group.openDataSet("data");
+        indices = group.openDataSet("indices");
+        const H5::DataSet indexPointersDataSet = group.openDataSet("indptr");
+        hdf5::readAndConvert(indexPointersDataSet, 0, hdf5::size(indexPointersDataSet), indexPointers);
+
+        // Get the shape.
+        vector<int64_t> shape;
+        const H5::Attribute shapeAttribute = group.openAttribute(hdf5::hasAttribute(group, "shape") ? "shape" : "h5sparse_shape");
+        const hsize_t shapeSize = hsize_t(shapeAttribute.getSpace().getSimpleExtentNpoints());
+        if(shapeSize != 2) {
+            throw runtime_error("Unexpected shape for matrix " + matrixName);
+        }
+        shape.resize(2);
+        shapeAttribute.read(H5::PredType::NATIVE_INT64, &shape.front());
+        cellCount = uint64_t(shape[0]);
+        geneCount = uint64_t(shape[1]);
+
+        if(format == Format::csr) {
+            if(indexPointers.size() != cellCount + 1) {
+                throw runtime_error("Unexpected length of indptr for matrix " + matrixName);
+            }
+            cellIndexPointers.swap(indexPointers);
+        } else {
+            if(indexPointers.size() != geneCount + 1) {
+                throw runtime_error("Unexpected length of indptr for matrix " + matrixName);
+            }
+
+            // For compressed sparse column format, count the expression counts of each cell
+            // with a sequential scan of the indices, then compute index pointers by cell.
+            // This allows us to choose the blocks of cells.
+            cellIndexPointers.resize(cellCount + 1, 0);
+            const uint64_t totalCount = indexPointers.back();
+            vector<uint64_t> cellIds;
+            for(uint64_t begin=0; begin<totalCount; begin+=blockSize) {
+                const uint64_t n = std::min(blockSize, totalCount - begin);
+                hdf5::readAndConvert(indices, begin, n, cellIds);
+                for(const uint64_t cellId: cellIds) {
+                    if(cellId >= cellCount) {
+                        throw runtime_error("Invalid cell index in matrix " + matrixName);
+                    }
+                    ++cellIndexPointers[cellId + 1];
+                }
+            }
+            std::partial_sum(cellIndexPointers.begin(), cellIndexPointers.end(), cellIndexPointers.begin());
+        }
+    }
+
+    ~ExpressionMatrixReader()
+    {
+        if(staging.isOpen) {
+            staging.remove();
+        }
+    }
+
+    uint64_t cellCount;
+    uint64_t geneCount;
+
+    // Read the next block of cells.
+    // On return, the block contains cells [cellBegin, cellEnd),
+    // and the expression counts of cell i are at positions
+    // [blockIndexPointers[i-cellBegin], blockIndexPointers[i-cellBegin+1])
+    // of blockGeneIndices and blockValues, sorted by gene index for sparse matrices.
+    // Returns false if there are no more cells.
+    bool readBlock()
+    {
+        cellBegin = cellEnd;
+        if(cellBegin == cellCount) {
+            if(staging.isOpen) {
+                staging.remove();
+            }
+            return false;
+        }
+
+        switch(format) {
+        case Format::dense:
+            readDenseBlock();
+            break;
+        case Format::csr:
+            chooseBlock();
+            readCsrBlock();
+            break;
+        case Format::csc:
+            chooseBlock();
+            readCscBlock();
+            break;
+        }
+        return true;
+    }
+    uint64_t cellBegin = 0;
+    uint64_t cellEnd = 0;
+    vector<uint64_t> blockIndexPointers;
+    vector<uint64_t> blockGeneIndices;
+    vector<float> blockValues;
+
+private:
+    enum class Format {dense, csr, csc} format;
+    uint64_t blockSize;
+    H5::DataSet data;
+    H5::DataSet indices;
+    vector<uint64_t> indexPointers;
+
+    // The index pointers by cell, for sparse matrices.
+    vector<uint64_t> cellIndexPointers;
+
+    // For a matrix in compressed sparse column format with more than one block,
+    // the gene indices and values of all expression counts,
+    // in the order given by cellIndexPointers.
+    string stagingFileName;
+    MemoryMapped::Vector< pair<GeneId, float> > staging;
+
+    // Choose cellEnd so the block contains at most blockSize expression counts,
+    // but at least one cell.
+    void chooseBlock()
+    {
+        const uint64_t blockBegin = cellIndexPointers[cellBegin];
+        cellEnd = uint64_t(std::upper_bound(cellIndexPointers.begin() + cellBegin + 1, cellIndexPointers.end(),
+            blockBegin + blockSize) - cellIndexPointers.begin()) - 1;
+        cellEnd = std::max(cellEnd, cellBegin + 1);
+        blockIndexPointers.resize(cellEnd - cellBegin + 1);
+        for(uint64_t i=cellBegin; i<=cellEnd; i++) {
+            blockIndexPointers[i - cellBegin] = cellIndexPointers[i] - blockBegin;
+        }
+    }
+
+    // For a matrix in compressed sparse row format, the block is contiguous in the file.
+    void readCsrBlock()
+    {
+        const uint64_t blockBegin = cellIndexPointers[cellBegin];
+        const uint64_t n = cellIndexPointers[cellEnd] - blockBegin;
+        hdf5::readAndConvert(data, blockBegin, n, blockValues);
+        hdf5::readAndConvert(indices, blockBegin, n, blockGeneIndices);
+    }
+
+    // For a matrix in compressed sparse column format, the expression counts
+    // of the block are copied from the staging file, which is filled
+    // when reading the first block. If there is a single block,
+    // they are stored directly in the block instead.
+    void readCscBlock()
+    {
+        const uint64_t n = blockIndexPointers.back();
+        blockValues.resize(n);
+        blockGeneIndices.resize(n);
+
+        if(cellBegin == 0 && cellEnd == cellCount) {
+            vector<uint64_t> positions(blockIndexPointers.begin(), blockIndexPointers.end() - 1);
+            scanCsc([&](uint64_t cellId, uint64_t geneIndex, float value)
+            {
+                uint64_t& position = positions[cellId];
+                blockGeneIndices[position] = geneIndex;
+                blockValues[position] = value;
+                ++position;
+            });
+            return;
+        }
+
+        if(!staging.isOpen) {
+            fillStaging();
+        }
+        const pair<GeneId, float>* p = staging.begin() + cellIndexPointers[cellBegin];
+        for(uint64_t j=0; j<n; j++, p++) {
+            blockGeneIndices[j] = p->first;
+            blockValues[j] = p->second;
+        }
+    }
+
+    // Store all the expression counts in the staging file, ordered by cell.
+    void fillStaging()
+    {
+        if(geneCount >= uint64_t(std::numeric_limits<GeneId>::max())) {
+            throw runtime_error("Too many genes in h5ad matrix.");
+        }
+        staging.createNew(stagingFileName, cellIndexPointers.back());
+        vector<uint64_t> positions(cellIndexPointers.begin(), cellIndexPointers.end() - 1);
+        scanCsc([&](uint64_t cellId, uint64_t geneIndex, float value)
+        {
+            staging[positions[cellId]++] = make_pair(GeneId(geneIndex), value);
+        });
+    }
+
+    // Call f(cellId, geneIndex, value) for each expression count of a matrix
+    // in compressed sparse column format, with a single sequential scan.
+    // Genes are scanned in order, so the expression counts of each cell
+    // are visited sorted by gene index.
+    template<class F> void scanCsc(const F& f)
+    {
+        const uint64_t totalCount = indexPointers.back();
+        vector<uint64_t> cellIds;
+        vector<float> values;
+        uint64_t geneIndex = 0;
+        for(uint64_t begin=0; begin<totalCount; begin+=blockSize) {
+            const uint64_t end = std::min(begin + blockSize, totalCount);
+            hdf5::readAndConvert(indices, begin, end - begin, cellIds);
+            hdf5::readAndConvert(data, begin, end - begin, values);
+            for(uint64_t j=begin; j<end; j++) {
+                while(indexPointers[geneIndex + 1] <= j) {
+                    ++geneIndex;
+                }
+                f(cellIds[j - begin], geneIndex, values[j - begin]);
+            }
+        }
+    }
+
+
+
+    // For a dense matrix, read a block of rows and keep the non-zero values.
+    void readDenseBlock()
+    {
+        const uint64_t rowCount = std::max(uint64_t(1), blockSize / std::max(uint64_t(1), geneCount));
+        cellEnd = std::min(cellCount, cellBegin + rowCount);
+
+        hsize_t offset[2] = {cellBegin, 0};
+        hsize_t dimensions[2] = {cellEnd - cellBegin, geneCount};
+        H5::DataSpace dataSpace = data.getSpace();
+        dataSpace.selectHyperslab(H5S_SELECT_SET, dimensions, offset);
+        const H5::DataSpace memoryDataSpace(2, dimensions);
+        vector<float> values(dimensions[0] * dimensions[1]);
+        if(!values.empty()) {
+            data.read(&values.front(), H5::PredType::NATIVE_FLOAT, memoryDataSpace, dataSpace);
+        }
+
+        blockIndexPointers.assign(1, 0);
+        blockGeneIndices.clear();
+        blockValues.clear();
+        for(uint64_t i=0; i<dimensions[0]; i++) {
+            for(uint64_t geneIndex=0; geneIndex<geneCount; geneIndex++) {
+                const float value = values[i*geneCount + geneIndex];
+                if(value != 0.f) {
+                    blockGeneIndices.push_back(geneIndex);
+                    blockValues.push_back(value);
+                }
+            }
+            blockIndexPointers.push_back(blockValues.size());
+        }
+    }
+};
+
+
+
+// Get the row names of a data frame and access its columns.
+// Columns that cannot be read are skipped with a message.
+static void openDataFrame(
+    const H5::Group& dataFrame,
+    vector<string>& rowNames,
+    vector< shared_ptr<h5ad::DataFrameColumn> >& columns)
+{
+    string indexName = hdf5::readStringAttribute(dataFrame, "_index");
+    if(indexName.empty()) {
+        indexName = "_index";
+    }
+    const H5::DataSet indexDataSet = dataFrame.openDataSet(indexName);
+    hdf5::readAsStrings(indexDataSet, 0, hdf5::size(indexDataSet), rowNames);
+
+    columns.clear();
+    for(const string& columnName: hdf5::readStringsAttribute(dataFrame, "column-order")) {
+        try {
+            columns.push_back(make_shared<h5ad::DataFrameColumn>(dataFrame, columnName));
+        } catch(std::exception& e) {
+            cout << "Column " << columnName << " was skipped: " << e.what() << "." << endl;
+        }
+    }
+}
+
+
+
+void ExpressionMatrix::addCellsFromH5ad(
+    const string& fileName,
+    const string& matrixName,
+    const string& cellNamePrefix,
+    const vector< pair<string, string> >& cellMetaDataArgument,  // Added to all cells.
+    double totalExpressionCountThreshold)
+{
+    cout << timestamp << "ExpressionMatrix::addCellsFromH5ad begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Maximum number of expression counts in each block of cells read at once.
+    const uint64_t blockSize = 1 << 24;
+
+    size_t addedCellsCount = 0;
+    try {
+        const H5::H5File file(fileName, H5F_ACC_RDONLY);
+        if(!hdf5::exists(file, "obs") || file.childObjType("obs") != H5O_TYPE_GROUP) {
+            throw runtime_error("File " + fileName + " does not contain an obs group. "
+                "Files written by anndata before version 0.7 are not supported.");
+        }
+
+        // Access the matrix.
+        h5ad::ExpressionMatrixReader reader(file, matrixName, blockSize,
+            directoryName + "/tmp-H5adStaging-" + randomUuid());
+
+        // Read the genes and their meta data.
+        // The genes of raw/X are in raw/var.
+        const string varName = (matrixName.substr(0, 4) == "raw/") ? "raw/var" : "var";
+        vector<string> h5adGeneNames;
+        vector< shared_ptr<h5ad::DataFrameColumn> > varColumns;
+        openDataFrame(file.openGroup(varName), h5adGeneNames, varColumns);
+        if(h5adGeneNames.size() != reader.geneCount) {
+            throw runtime_error("Number of genes in " + varName + " does not match the shape of " + matrixName);
+        }
+        {
+            vector<string> sortedH5adGeneNames = h5adGeneNames;
+            sort(sortedH5adGeneNames.begin(), sortedH5adGeneNames.end());
+            const auto it = std::adjacent_find(sortedH5adGeneNames.begin(), sortedH5adGeneNames.end());
+            if(it != sortedH5adGeneNames.end()) {
+                throw runtime_error("Duplicate gene name " + *it + " in h5ad file " + fileName);
+            }
+        }
+
+        // Add the genes.
+        // We want to add them independently of the cells, so they all get added, even the ones
+        // for which all cells have zero count.
+        for(const string& h5adGeneName: h5adGeneNames) {
+            addGene(h5adGeneName);
+        }
+        vector<string> values;
+        for(const auto& column: varColumns) {
+            column->read(0, h5adGeneNames.size(), values);
+            for(size_t i=0; i<h5adGeneNames.size(); i++) {
+                if(!values[i].empty()) {
+                    setGeneMetaData(geneIdFromName(h5adGeneNames[i]), column->name, values[i]);
+                }
+            }
+        }
+
+        // Access the cell names and meta data.
+        vector<string> h5adCellNames;
+        vector< shared_ptr<h5ad::DataFrameColumn> > obsColumns;
+        openDataFrame(file.openGroup("obs"), h5adCellNames, obsColumns);
+        if(h5adCellNames.size() != reader.cellCount) {
+            throw runtime_error("Number of cells in obs does not match the shape of " + matrixName);
+        }
+        const auto it = std::find_if(obsColumns.begin(), obsColumns.end(),
+            [](const shared_ptr<h5ad::DataFrameColumn>& column) {return column->name == "CellName";});
+        if(it != obsColumns.end()) {
+            cout << "Column CellName was skipped: the obs index is used as the cell name." << endl;
+            obsColumns.erase(it);
+        }
+        cout << timestamp << "Reading " << reader.cellCount << " cells and " << reader.geneCount <<
+            " genes with " << obsColumns.size() << " meta data fields." << endl;
+
+        // Loop over blocks of cells.
+        vector< vector<string> > obsValues(obsColumns.size());
+        vector< pair<string, string> > cellMetaData;
+        vector< pair<string, float> > expressionCounts;
+        while(reader.readBlock()) {
+            const uint64_t cellBegin = reader.cellBegin;
+            const uint64_t n = reader.cellEnd - cellBegin;
+            for(size_t k=0; k<obsColumns.size(); k++) {
+                obsColumns[k]->read(cellBegin, n, obsValues[k]);
+            }
+
+            for(uint64_t i=0; i<n; i++) {
+
+                // Gather the expression counts.
+                expressionCounts.clear();
+                double totalExpressionCount = 0.;
+                for(uint64_t j=reader.blockIndexPointers[i]; j!=reader.blockIndexPointers[i+1]; j++) {
+                    const uint64_t h5adGeneIndex = reader.blockGeneIndices[j];
+                    if(h5adGeneIndex >= h5adGeneNames.size()) {
+                        throw runtime_error("Invalid gene index in matrix " + matrixName);
+                    }
+                    const float value = reader.blockValues[j];
+                    expressionCounts.push_back(make_pair(h5adGeneNames[h5adGeneIndex], value));
+                    totalExpressionCount += value;
+                }
+
+                // If the total expression count is not enough, skip.
+                if(totalExpressionCount < totalExpressionCountThreshold) {
+                    continue;
+                }
+
+                // Gather the meta data.
+                const string& h5adCellName = h5adCellNames[cellBegin + i];
+                cellMetaData.clear();
+                cellMetaData.push_back(make_pair(string("CellName"),
+                    cellNamePrefix.empty() ? h5adCellName : (cellNamePrefix + "-" + h5adCellName)));
+                for(size_t k=0; k<obsColumns.size(); k++) {
+                    const string& value = obsValues[k][i];
+                    if(!value.empty()) {
+                        cellMetaData.push_back(make_pair(obsColumns[k]->name, value));
+                    }
+                }
+                copy(cellMetaDataArgument.begin(), cellMetaDataArgument.end(), back_inserter(cellMetaData));
+
+                addCell(cellMetaData, expressionCounts);
+                ++addedCellsCount;
+            }
+        }
+    }
+    catch (H5::Exception& e) {
+        cout << "An error occurred while reading h5ad file " << fileName << endl;
+        cout << e.getDetailMsg() << endl;
+        throw runtime_error("Error reading h5ad file " + fileName + ": " + e.getDetailMsg());
+    }
+    catch (std::exception& e) {
+        cout << "An error occurred while reading h5ad file " << fileName << endl;
+        cout << e.what() << endl;
+        throw;
+    }
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "Added " << addedCellsCount << " cells in " << t01 << " s." << endl;
+    cout << "There are " << cellCount() << " cells and " << geneCount() << " genes." << endl;
+}
+
+
+
+// Write the attributes that identify the encoding of an AnnData element.
+static void writeEncoding(H5::H5Object& object, const string& type, const string& version)
+{
+    hdf5::writeAttribute(object, "encoding-type", type);
+    hdf5::writeAttribute(object, "encoding-version", version);
+}
+
+
+
+// Write a categorical data frame column.
+// values[i] is the StringId of the value for row i, or invalidStringId if missing.
+// Categories are sorted numerically if all values are numbers,
+// lexicographically otherwise.
+static void writeCategoricalColumn(
+    H5::Group& dataFrame,
+    const string& name,
+    const vector<StringId>& values,
+    const MemoryMapped::StringTable<StringId>& valueTable,
+    hsize_t chunkSize,
+    int compressionLevel)
+{
+    const StringId invalidStringId = valueTable.invalidStringId;
+
+    // Find the distinct values.
+    vector<StringId> valueIds = values;
+    sort(valueIds.begin(), valueIds.end());
+    valueIds.erase(unique(valueIds.begin(), valueIds.end()), valueIds.end());
+    if(!valueIds.empty() && valueIds.back() == invalidStringId) {
+        valueIds.pop_back();
+    }
+    vector< pair<string, StringId> > categories;
+    bool allNumeric = true;
+    for(const StringId valueId: valueIds) {
+        categories.push_back(make_pair(valueTable[valueId], valueId));
+        try {
+            lexical_cast<double>(categories.back().first);
+        } catch(bad_lexical_cast&) {
+            allNumeric = false;
+        }
+    }
+    if(allNumeric) {
+        sort(categories.begin(), categories.end(),
+            [](const pair<string, StringId>& x, const pair<string, StringId>& y)
+            {
+                return lexical_cast<double>(x.first) < lexical_cast<double>(y.first);
+            });
+    } else {
+        sort(categories.begin(), categories.end());
+    }
+
+    // Compute the codes.
+    map<StringId, int32_t> codeMap;
+    vector<string> categoryNames;
+    for(const auto& p: categories) {
+        codeMap.insert(make_pair(p.second, int32_t(categoryNames.size())));
+        categoryNames.push_back(p.first);
+    }
+    vector<int32_t> codes(values.size());
+    for(size_t i=0; i<values.size(); i++) {
+        codes[i] = (values[i] == invalidStringId) ? -1 : codeMap[values[i]];
+    }
+
+    H5::Group group = dataFrame.createGroup(name);
+    writeEncoding(group, "categorical", "0.2.0");
+    hdf5::writeBooleanAttribute(group, "ordered", false);
+    hdf5::writeVariableLength(group, "categories", categoryNames, chunkSize, compressionLevel);
+    H5::DataSet categoriesDataSet = group.openDataSet("categories");
+    writeEncoding(categoriesDataSet, "string-array", "0.2.0");
+    H5::DataSet codesDataSet = hdf5::createDataSet<int32_t>(group, "codes", codes.size(), chunkSize, compressionLevel);
+    hdf5::write(codesDataSet, 0, codes);
+    writeEncoding(codesDataSet, "array", "0.2.0");
+}
+
+
+
+// Write an empty data frame group with the given row names.
+static H5::Group createDataFrame(
+    H5::Group& parent,
+    const string& name,
+    const vector<string>& rowNames,
+    const vector<string>& columnNames,
+    hsize_t chunkSize,
+    int compressionLevel)
+{
+    H5::Group group = parent.createGroup(name);
+    writeEncoding(group, "dataframe", "0.2.0");
+    hdf5::writeAttribute(group, "_index", string("_index"));
+    hdf5::writeAttribute(group, "column-order", columnNames);
+    hdf5::writeVariableLength(group, "_index", rowNames, chunkSize, compressionLevel);
+    H5::DataSet indexDataSet = group.openDataSet("_index");
+    writeEncoding(indexDataSet, "string-array", "0.2.0");
+    return group;
+}
+
+
+
+/*******************************************************************************
+
+Write the expression counts for a gene set and cell set to an AnnData h5ad file.
+
+The expression counts are written to X in compressed sparse row format,
+as 32 bit floating point values with 64 bit indices and index pointers,
+using writeHdf5ExpressionCounts, the same block writer used by exportToHdf5
+(see ExpressionMatrixHdf5.cpp).
+Cell names are the obs index, and each exported cell meta data field
+is an obs column. Meta data fields are written as categorical columns,
+which is compact for the typical meta data field with few distinct values,
+and represents cells without a value for the field as missing values.
+Gene names are the var index, and gene meta data fields are var columns.
+The layout of each exported cell graph is written to obsm as
+an embedding named X_<graphName>, with NaN positions for cells
+that are not in the graph.
+
+*******************************************************************************/
+
+void ExpressionMatrix::exportToH5ad(
+    const string& fileName,
+    const string& geneSetName,
+    const string& cellSetName,
+    const vector<string>& metaDataNamesArgument,
+    const vector<string>& cellGraphNames,
+    int compressionLevel)
+{
+    cout << timestamp << "ExpressionMatrix::exportToH5ad begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+    if(compressionLevel < 0 || compressionLevel > 9) {
+        throw runtime_error("Invalid compression level " + lexical_cast<string>(compressionLevel) +
+            ". Must be between 0 and 9.");
+    }
+
+    // Locate the gene set and the cell set.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    GeneSet& geneSet = itGeneSet->second;
+    geneSet.genes();
+    const CellSet& cellSet = this->cellSet(cellSetName);
+    const size_t exportedCellCount = cellSet.size();
+
+    // Locate the cell graphs, which must have a layout.
+    vector<const CellGraph*> cellGraphs;
+    for(const string& cellGraphName: cellGraphNames) {
+        const auto it = this->cellGraphs.find(cellGraphName);
+        if(it == this->cellGraphs.end()) {
+            throw runtime_error("Graph " + cellGraphName + " does not exist.");
+        }
+        const CellGraph& cellGraph = *(it->second.second);
+        if(!cellGraph.layoutWasComputed) {
+            throw runtime_error("Layout for graph " + cellGraphName + " is not available.");
+        }
+        cellGraphs.push_back(&cellGraph);
+    }
+
+    // Find the cell meta data names to be exported.
+    // CellName is always exported, as the obs index.
+    const StringId cellNameId = cellMetaDataNames("CellName");
+    vector<StringId> metaDataNameIds;
+    if(metaDataNamesArgument.empty()) {
+        for(StringId nameId=0; nameId!=cellMetaDataNames.size(); nameId++) {
+            if(nameId != cellNameId && cellMetaDataNamesUsageCount[nameId] > 0) {
+                metaDataNameIds.push_back(nameId);
+            }
+        }
+    } else {
+        for(const string& metaDataName: metaDataNamesArgument) {
+            const StringId nameId = cellMetaDataNames(metaDataName);
+            if(nameId == cellMetaDataNames.invalidStringId) {
+                throw runtime_error("Cell meta data name " + metaDataName + " does not exist.");
+            }
+            if(nameId != cellNameId) {
+                metaDataNameIds.push_back(nameId);
+            }
+        }
+    }
+    const size_t columnCount = metaDataNameIds.size();
+    vector<size_t> columnOfName(cellMetaDataNames.size(), columnCount);
+    vector<string> columnNames;
+    for(size_t k=0; k<columnCount; k++) {
+        columnOfName[metaDataNameIds[k]] = k;
+        columnNames.push_back(cellMetaDataNames[metaDataNameIds[k]]);
+    }
+
+    // Gather the values of the exported meta data fields for each cell, in parallel.
+    vector< vector<StringId> > metaDataValues(columnCount,
+        vector<StringId>(exportedCellCount, cellMetaDataValues.invalidStringId));
+    parallelFor(0, exportedCellCount, [&](size_t i)
+        {
+            for(const auto& p: cellMetaData[cellSet[i]]) {
+                const size_t k = columnOfName[p.first];
+                if(k != columnCount) {
+                    metaDataValues[k][i] = p.second;
+                }
+            }
+        });
+
+    // Data sets are chunked in chunks of this many elements.
+    const hsize_t chunkSize = 1 << 16;
+
+    uint64_t totalCount = 0;
+    try {
+        H5::H5File file(fileName, H5F_ACC_TRUNC);
+        writeEncoding(file, "anndata", "0.1.0");
+
+        // Write the expression counts.
+        H5::Group x = file.createGroup("X");
+        writeEncoding(x, "csr_matrix", "0.1.0");
+        hdf5::writeAttribute(x, "shape", vector<int64_t>({int64_t(exportedCellCount), int64_t(geneSet.size())}));
+        totalCount = writeHdf5ExpressionCounts<float, int64_t>(x, geneSet, cellSetName, chunkSize, compressionLevel);
+
+        // Write the cells and their meta data.
+        vector<string> names;
+        for(const CellId cellId: cellSet) {
+            names.push_back(cellNames[cellId]);
+        }
+        H5::Group obs = createDataFrame(file, "obs", names, columnNames, chunkSize, compressionLevel);
+        for(size_t k=0; k<columnCount; k++) {
+            writeCategoricalColumn(obs, columnNames[k], metaDataValues[k], cellMetaDataValues, chunkSize, compressionLevel);
+        }
+
+        // Write the genes and their meta data.
+        names.clear();
+        for(const GeneId geneId: geneSet) {
+            names.push_back(geneNames[geneId]);
+        }
+        vector<StringId> geneMetaDataNameIds;
+        vector<string> geneMetaDataNames;
+        for(const GeneId geneId: geneSet) {
+            for(const auto& p: geneMetaData[geneId]) {
+                geneMetaDataNameIds.push_back(p.first);
+            }
+        }
+        sort(geneMetaDataNameIds.begin(), geneMetaDataNameIds.end());
+        geneMetaDataNameIds.erase(unique(geneMetaDataNameIds.begin(), geneMetaDataNameIds.end()), geneMetaDataNameIds.end());
+        for(const StringId nameId: geneMetaDataNameIds) {
+            geneMetaDataNames.push_back(this->geneMetaDataNames[nameId]);
+        }
+        H5::Group var = createDataFrame(file, "var", names, geneMetaDataNames, chunkSize, compressionLevel);
+        for(size_t k=0; k<geneMetaDataNameIds.size(); k++) {
+            vector<StringId> values(geneSet.size(), geneMetaDataValues.invalidStringId);
+            for(GeneId localGeneId=0; localGeneId!=geneSet.size(); localGeneId++) {
+                for(const auto& p: geneMetaData[geneSet.getGlobalGeneId(localGeneId)]) {
+                    if(p.first == geneMetaDataNameIds[k]) {
+                        values[localGeneId] = p.second;
+                    }
+                }
+            }
+            writeCategoricalColumn(var, geneMetaDataNames[k], values, geneMetaDataValues, chunkSize, compressionLevel);
+        }
+
+        // Write the cell graph layouts as embeddings.
+        H5::Group obsm = file.createGroup("obsm");
+        writeEncoding(obsm, "dict", "0.1.0");
+        vector<size_t> positionInCellSet(cellCount(), exportedCellCount);
+        for(size_t i=0; i<exportedCellCount; i++) {
+            positionInCellSet[cellSet[i]] = i;
+        }
+        for(size_t g=0; g<cellGraphs.size(); g++) {
+            const CellGraph& cellGraph = *cellGraphs[g];
+            vector<double> embedding(2 * exportedCellCount, std::numeric_limits<double>::quiet_NaN());
+            BGL_FORALL_VERTICES(v, cellGraph, CellGraph) {
+                const CellGraphVertex& vertex = cellGraph[v];
+                const size_t i = positionInCellSet[vertex.cellId];
+                if(i != exportedCellCount) {
+                    embedding[2*i] = vertex.position[0];
+                    embedding[2*i+1] = vertex.position[1];
+                }
+            }
+            const string name = "X_" + cellGraphNames[g];
+            hdf5::write(obsm, name, embedding, exportedCellCount, 2);
+            H5::DataSet embeddingDataSet = obsm.openDataSet(name);
+            writeEncoding(embeddingDataSet, "array", "0.2.0");
+        }
+
+        // The remaining elements of an AnnData object are empty.
+        for(const char* name: {"varm", "obsp", "varp", "layers", "uns"}) {
+            H5::Group group = file.createGroup(name);
+            writeEncoding(group, "dict", "0.1.0");
+        }
+    }
+    catch (H5::Exception& e) {
+        cout << "An error occurred while writing h5ad file " << fileName << endl;
+        cout << e.getDetailMsg() << endl;
+        throw runtime_error("Error writing h5ad file " + fileName + ": " + e.getDetailMsg());
+    }
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "Exported " << geneSet.size() << " genes, " << exportedCellCount << " cells, " <<
+        columnCount << " meta data fields, and " <<
+        totalCount << " expression counts to " << fileName << " in " << t01 << " s." << endl;
+}
+
+
+
+// Check that exportToH5ad and addCellsFromH5ad preserve expression counts
+// and meta data, and that addCellsFromH5ad reads h5ad files with X
+// in compressed sparse column format or as a dense matrix,
+// which exportToH5ad does not write.
+void ChanZuckerberg::ExpressionMatrix2::testExpressionMatrixH5ad()
+{
+    ExpressionMatrixTest test("testExpressionMatrixH5ad");
+    const CellId cellCount = 1000;
+    const GeneId geneCount = 100;
+
+    // Create an expression matrix with expression counts that are not integers,
+    // and with cell and gene meta data.
+    // Meta data field Odd is only set for some cells.
+    {
+        const float factor = 0.25f;
+        const unique_ptr<ExpressionMatrix> expressionMatrix =
+            test.createExpressionMatrix("Original", 0, geneCount);
+        for(CellId cellId=0; cellId!=cellCount; cellId++) {
+            vector< pair<string, string> > metaData = {
+                {"Group", (cellId % 3) ? "A" : "B"},
+                {"Index", lexical_cast<string>(cellId % 10)}};
+            if(cellId % 2) {
+                metaData.push_back(make_pair("Odd", "Yes"));
+            }
+            test.addCell(*expressionMatrix, cellId, geneCount, metaData, factor);
+        }
+        expressionMatrix->setGeneMetaData(test.geneName(3), "Kind", "Special");
+
+        // Export it and read it back.
+        expressionMatrix->exportToH5ad(test.path("Exported.h5ad"), "AllGenes", "AllCells", {}, {}, 4);
+        ExpressionMatrix importedExpressionMatrix(test.path("Imported"), test.creationParameters());
+        importedExpressionMatrix.addCellsFromH5ad(test.path("Exported.h5ad"), "X", "", {{"Source", "Test"}}, 0.);
+        test.checkCells(importedExpressionMatrix, cellCount, geneCount, "", factor);
+        for(CellId cellId=0; cellId!=cellCount; cellId++) {
+            for(const char* name: {"Group", "Index", "Odd"}) {
+                CZI_ASSERT(importedExpressionMatrix.getCellMetaData(cellId, name) ==
+                    expressionMatrix->getCellMetaData(cellId, name));
+            }
+            CZI_ASSERT(importedExpressionMatrix.getCellMetaData(cellId, "Source") == "Test");
+        }
+        for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+            CZI_ASSERT(importedExpressionMatrix.getGeneMetaData(
+                importedExpressionMatrix.geneIdFromName(test.geneName(geneId)), "Kind") ==
+                ((geneId == 3) ? "Special" : ""));
+        }
+
+        // Export only some of the meta data.
+        expressionMatrix->exportToH5ad(test.path("Group.h5ad"), "AllGenes", "AllCells", {"Group"}, {}, 0);
+        ExpressionMatrix groupExpressionMatrix(test.path("Group"), test.creationParameters());
+        groupExpressionMatrix.addCellsFromH5ad(test.path("Group.h5ad"), "X", "", {}, 0.);
+        test.checkCells(groupExpressionMatrix, cellCount, geneCount, "", factor);
+        for(CellId cellId=0; cellId!=cellCount; cellId++) {
+            CZI_ASSERT(groupExpressionMatrix.getCellMetaData(cellId, "Group") ==
+                expressionMatrix->getCellMetaData(cellId, "Group"));
+            CZI_ASSERT(groupExpressionMatrix.getCellMetaData(cellId, "Index").empty());
+        }
+    }
+
+    // Write h5ad files with X in compressed sparse column format
+    // and as a dense matrix, and read them.
+    vector<string> cellNames;
+    for(CellId cellId=0; cellId!=cellCount; cellId++) {
+        cellNames.push_back(test.cellName(cellId));
+    }
+    vector<string> geneNames;
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        geneNames.push_back(test.geneName(geneId));
+    }
+    for(const bool isDense: {false, true}) {
+        const string name = isDense ? "Dense" : "Csc";
+        {
+            H5::H5File file(test.path(name + ".h5ad"), H5F_ACC_TRUNC);
+            H5::Group obs = file.createGroup("obs");
+            hdf5::writeAttribute(obs, "_index", string("_index"));
+            hdf5::writeAttribute(obs, "column-order", vector<string>());
+            hdf5::writeVariableLength(obs, "_index", cellNames, 1000, 4);
+            H5::Group var = file.createGroup("var");
+            hdf5::writeAttribute(var, "_index", string("_index"));
+            hdf5::writeAttribute(var, "column-order", vector<string>());
+            hdf5::writeVariableLength(var, "_index", geneNames, 1000, 4);
+            if(isDense) {
+                vector<double> x;
+                for(CellId cellId=0; cellId!=cellCount; cellId++) {
+                    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+                        x.push_back(test.expressionCount(cellId, geneId));
+                    }
+                }
+                hdf5::write(file, "X", x, cellCount, geneCount);
+            } else {
+                H5::Group x = file.createGroup("X");
+                hdf5::writeAttribute(x, "encoding-type", string("csc_matrix"));
+                hdf5::writeAttribute(x, "shape", vector<int64_t>({int64_t(cellCount), int64_t(geneCount)}));
+                vector<int32_t> indices;
+                vector<double> data;
+                vector<int64_t> indexPointers(1, 0);
+                for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+                    for(CellId cellId=0; cellId!=cellCount; cellId++) {
+                        const float count = test.expressionCount(cellId, geneId);
+                        if(count != 0.f) {
+                            indices.push_back(int32_t(cellId));
+                            data.push_back(count);
+                        }
+                    }
+                    indexPointers.push_back(int64_t(indices.size()));
+                }
+                hdf5::write(hdf5::createDataSet<int32_t>(x, "indices", indices.size(), 1000, 4), 0, indices);
+                hdf5::write(hdf5::createDataSet<double>(x, "data", data.size(), 1000, 4), 0, data);
+                hdf5::write(hdf5::createDataSet<int64_t>(x, "indptr", indexPointers.size(), 1000, 4), 0, indexPointers);
+            }
+        }
+        ExpressionMatrix expressionMatrix(test.path(name), test.creationParameters());
+        expressionMatrix.addCellsFromH5ad(test.path(name + ".h5ad"), "X", "", {}, 0.);
+        test.checkCells(expressionMatrix, cellCount, geneCount);
+    }
+
+    test.success();
+}
+#endif
@@ -1,14 +1,23 @@
-// Functionality to read expression matrix data from an hdf5 file created
-// by the 10X Genomics pipeline.
+// Functionality to read and write expression matrix data in hdf5 files
+// in the format created by the 10X Genomics pipeline.
 #ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
 
 #include "ExpressionMatrix.hpp"
+#include "ExpressionMatrixTest.hpp"
 #include "hdf5.hpp"
 #include "iterator.hpp"
+#include "TaskScheduler.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <numeric>
+
 
 /*******************************************************************************
 
@@ -216,4 +225,259 @@ void ExpressionMatrix::addCellsFromHdf5(
 
     cout << "There are " << cellCount() << " cells and " << geneCount() << " genes." << endl;
 }
+
+
+
+/*******************************************************************************
+
+Write the expression counts for a gene set and cell set to an hdf5 file
+in the format read by addCellsFromHdf5:
+
+/groupName/barcodes     The cell names.
+/groupName/genes        The gene names.
+/groupName/gene_names   The gene names (a copy of genes, for compatibility).
+/groupName/indptr       For each cell, the offset of its first expression count
+                        in data and indices, plus a final entry equal to the
+                        total number of expression counts (uint64).
+/groupName/data         The expression counts (uint32).
+/groupName/indices      For each expression count, the index of its gene in genes (uint64).
+/groupName/shape        The number of genes and cells (int32).
+
+Genes are stored in order of increasing GeneId,
+and cells in the order of the cell set.
+
+The file is written in blocks of cells.
+The expression counts of each block are encoded in parallel
+into memory buffers, which are then written to the data sets
+using a single hyperslab write per data set.
+Writing (which includes the compression done by the hdf5 library)
+of each block overlaps with encoding of the next block.
+
+AnnData files use the same compressed sparse row layout for X,
+with different types, so this is done by writeHdf5ExpressionCounts
+(below), which is also used by exportToH5ad.
+
+*******************************************************************************/
+
+void ExpressionMatrix::exportToHdf5(
+    const string& fileName,
+    const string& geneSetName,
+    const string& cellSetName,
+    const string& groupName,
+    int compressionLevel)
+{
+    cout << timestamp << "ExpressionMatrix::exportToHdf5 begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+    if(compressionLevel < 0 || compressionLevel > 9) {
+        throw runtime_error("Invalid compression level " + lexical_cast<string>(compressionLevel) +
+            ". Must be between 0 and 9.");
+    }
+
+    // Locate the gene set and the cell set.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    GeneSet& geneSet = itGeneSet->second;
+    geneSet.genes();
+    const CellSet& cellSet = this->cellSet(cellSetName);
+    const size_t exportedCellCount = cellSet.size();
+
+    // Data sets are chunked in chunks of this many elements.
+    const hsize_t chunkSize = 1 << 16;
+
+    uint64_t totalCount = 0;
+    try {
+        H5::H5File file(fileName, H5F_ACC_TRUNC);
+        H5::Group group = file.createGroup("/" + groupName);
+
+        // Write the cell names, gene names, and shape.
+        vector<string> names;
+        for(const CellId cellId: cellSet) {
+            names.push_back(cellNames[cellId]);
+        }
+        hdf5::write(group, "barcodes", names, chunkSize, compressionLevel);
+        names.clear();
+        for(const GeneId geneId: geneSet) {
+            names.push_back(geneNames[geneId]);
+        }
+        hdf5::write(group, "genes", names, chunkSize, compressionLevel);
+        hdf5::write(group, "gene_names", names, chunkSize, compressionLevel);
+        const vector<int32_t> shape = {int32_t(geneSet.size()), int32_t(exportedCellCount)};
+        hdf5::write(hdf5::createDataSet<int32_t>(group, "shape", 2, chunkSize, 0), 0, shape);
+
+        // Write the expression counts.
+        totalCount = writeHdf5ExpressionCounts<uint32_t, uint64_t>(
+            group, geneSet, cellSetName, chunkSize, compressionLevel);
+    }
+    catch (H5::Exception& e) {
+        cout << "An error occurred while writing HDF5 file " << fileName << endl;
+        cout << e.getDetailMsg() << endl;
+        throw runtime_error("Error writing HDF5 file " + fileName + ": " + e.getDetailMsg());
+    }
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "Exported " << geneSet.size() << " genes, " << exportedCellCount << " cells, and " <<
+        totalCount << " expression counts to " << fileName << " in " << t01 << " s." << endl;
+}
+
+
+
+// Write the expression counts for a gene set and cell set
+// to data sets data, indices, and indptr of an hdf5 group,
+// in blocks of cells as described above for exportToHdf5.
+template<class Data, class Index> uint64_t ExpressionMatrix::writeHdf5ExpressionCounts(
+    H5::Group& group,
+    GeneSet& geneSet,
+    const string& cellSetName,
+    uint64_t chunkSize,
+    int compressionLevel)
+{
+    geneSet.genes();
+    const CellSet& cellSet = this->cellSet(cellSetName);
+    const size_t exportedCellCount = cellSet.size();
+
+    // Count the expression counts of each cell for genes in the gene set,
+    // and store the index pointers.
+    // If storing integers, also check that all expression counts are integers.
+    const bool storeIntegers = std::is_integral<Data>::value;
+    vector<Index> indexPointers(exportedCellCount + 1, 0);
+    std::atomic<bool> nonIntegerFound(false);
+    parallelFor(0, exportedCellCount, [&](size_t i)
+        {
+            Index count = 0;
+            for(const auto& p: cellExpressionCounts[cellSet[i]]) {
+                if(geneSet.getLocalGeneId(p.first) != invalidGeneId) {
+                    ++count;
+                    const float value = p.second;
+                    if(storeIntegers && (value < 0.f || std::floor(value) != value ||
+                        double(value) > double(std::numeric_limits<Data>::max()))) {
+                        nonIntegerFound = true;
+                    }
+                }
+            }
+            indexPointers[i+1] = count;
+        });
+    if(nonIntegerFound) {
+        throw runtime_error("Cell set " + cellSetName + " contains expression counts that are not "
+            "non-negative integers, which cannot be exported to hdf5.");
+    }
+    std::partial_sum(indexPointers.begin(), indexPointers.end(), indexPointers.begin());
+    const uint64_t totalCount = uint64_t(indexPointers.back());
+    hdf5::write(hdf5::createDataSet<Index>(group, "indptr", indexPointers.size(), chunkSize, compressionLevel),
+        0, indexPointers);
+
+    // Maximum number of expression counts in each block of cells written at once.
+    const uint64_t blockSize = 1 << 24;
+
+    // Create the data sets for the expression counts.
+    const H5::DataSet dataDataSet =
+        hdf5::createDataSet<Data>(group, "data", totalCount, chunkSize, compressionLevel);
+    const H5::DataSet indicesDataSet =
+        hdf5::createDataSet<Index>(group, "indices", totalCount, chunkSize, compressionLevel);
+
+    // Loop over blocks of cells. We use two sets of buffers,
+    // so one block can be written while the next one is being encoded.
+    // Each block contains at least one cell.
+    vector<Data> data[2];
+    vector<Index> indices[2];
+    std::future<void> pendingWrite;
+    size_t bufferId = 0;
+    for(size_t cellBegin=0; cellBegin<exportedCellCount; bufferId=1-bufferId) {
+        const uint64_t blockBegin = uint64_t(indexPointers[cellBegin]);
+        size_t cellEnd = size_t(std::upper_bound(indexPointers.begin() + cellBegin + 1, indexPointers.end(),
+            Index(blockBegin + blockSize)) - indexPointers.begin()) - 1;
+        cellEnd = std::max(cellEnd, cellBegin + 1);
+        const uint64_t blockEnd = uint64_t(indexPointers[cellEnd]);
+
+        // Encode the expression counts of this block in parallel.
+        // Cells are sorted by GeneId and the gene set is sorted,
+        // so the gene indices of each cell are in increasing order.
+        vector<Data>& blockData = data[bufferId];
+        vector<Index>& blockIndices = indices[bufferId];
+        blockData.resize(blockEnd - blockBegin);
+        blockIndices.resize(blockEnd - blockBegin);
+        parallelFor(cellBegin, cellEnd, [&](size_t i)
+            {
+                uint64_t position = uint64_t(indexPointers[i]) - blockBegin;
+                for(const auto& p: cellExpressionCounts[cellSet[i]]) {
+                    const GeneId localGeneId = geneSet.getLocalGeneId(p.first);
+                    if(localGeneId != invalidGeneId) {
+                        blockData[position] = Data(p.second);
+                        blockIndices[position] = Index(localGeneId);
+                        ++position;
+                    }
+                }
+                CZI_ASSERT(position == uint64_t(indexPointers[i+1]) - blockBegin);
+            });
+
+        // Wait for the previous block to be written, then start writing this one.
+        if(pendingWrite.valid()) {
+            pendingWrite.get();
+        }
+        pendingWrite = std::async(std::launch::async, [&dataDataSet, &indicesDataSet, &blockData, &blockIndices, blockBegin]()
+            {
+                hdf5::write(dataDataSet, blockBegin, blockData);
+                hdf5::write(indicesDataSet, blockBegin, blockIndices);
+            });
+        cellBegin = cellEnd;
+    }
+    if(pendingWrite.valid()) {
+        pendingWrite.get();
+    }
+
+    return totalCount;
+}
+
+// The instantiations used by exportToHdf5 (10X Genomics layout)
+// and exportToH5ad (AnnData layout).
+template uint64_t ExpressionMatrix::writeHdf5ExpressionCounts<uint32_t, uint64_t>(
+    H5::Group&, GeneSet&, const string&, uint64_t, int);
+template uint64_t ExpressionMatrix::writeHdf5ExpressionCounts<float, int64_t>(
+    H5::Group&, GeneSet&, const string&, uint64_t, int);
+
+
+
+// Export expression matrices to hdf5 files, then read them back
+// with addCellsFromHdf5 and check that they are unchanged.
+void ChanZuckerberg::ExpressionMatrix2::testExpressionMatrixHdf5()
+{
+    ExpressionMatrixTest test("testExpressionMatrixHdf5");
+    const CellId cellCount = 2000;
+    const GeneId geneCount = 200;
+    {
+        const unique_ptr<ExpressionMatrix> expressionMatrix =
+            test.createExpressionMatrix("Original", cellCount, geneCount);
+
+        // Export all genes and cells, then read them back.
+        expressionMatrix->exportToHdf5(test.path("All.h5"), "AllGenes", "AllCells", "matrix", 4);
+        ExpressionMatrix allExpressionMatrix(test.path("All"), test.creationParameters());
+        allExpressionMatrix.addCellsFromHdf5(test.path("All.h5"), "Imported", {}, 0.);
+        test.checkCells(allExpressionMatrix, cellCount, geneCount, "Imported-");
+
+        // Export a gene set, without compression, and read it back.
+        const vector<GeneId> geneIds = {7, 3, 150, 1, 199};
+        vector<string> geneNames;
+        for(const GeneId geneId: geneIds) {
+            geneNames.push_back(test.geneName(geneId));
+        }
+        expressionMatrix->createGeneSetFromGeneNames("Subset", geneNames);
+        expressionMatrix->exportToHdf5(test.path("Subset.h5"), "Subset", "AllCells", "matrix", 0);
+        ExpressionMatrix subsetExpressionMatrix(test.path("Subset"), test.creationParameters());
+        subsetExpressionMatrix.addCellsFromHdf5(test.path("Subset.h5"), "Imported", {}, 0.);
+        test.checkCells(subsetExpressionMatrix, cellCount, geneIds, "Imported-");
+
+        // Expression counts that are not integers cannot be exported.
+        test.addCell(*expressionMatrix, cellCount, geneCount, {}, 0.5f);
+        bool exceptionWasThrown = false;
+        try {
+            expressionMatrix->exportToHdf5(test.path("NotInteger.h5"), "AllGenes", "AllCells", "matrix", 4);
+        } catch(const runtime_error&) {
+            exceptionWasThrown = true;
+        }
+        CZI_ASSERT(exceptionWasThrown);
+    }
+    test.success();
+}
 #endif
@@ -4,6 +4,7 @@
 #include "filesystem.hpp"
 #include "randIndex.hpp"
 #include "SimilarPairs.hpp"
+#include "TaskScheduler.hpp"
 #include "timestamp.hpp"
 #include "tokenize.hpp"
 using namespace ChanZuckerberg;
@@ -106,6 +107,58 @@ void ExpressionMatrix::fillServerFunctionTable()
 
 
 
+// Return the name of the file to be sent for requests
+// that are satisfied by a static file, or an empty string otherwise.
+// These requests are documentation requests of the form help/xyz,
+// which are satisfied from the documentation directory,
+// and requests for a file in the current directory.
+// Static files are sent by the HttpServer base class
+// on a separate thread.
+string ExpressionMatrix::getStaticFileName(const vector<string>& request)
+{
+    // Keywords in the function table are never static files.
+    const string& keyword = request.front();
+    if(serverFunctionTable.find(keyword) != serverFunctionTable.end()) {
+        return "";
+    }
+
+    // See if it is a documentation request of the form help/xyz.
+    // Here, xyz is not allowed to contain "../",
+    // otherwise we would open a big security hole: requests of the form help/../../file
+    // would give access to anywhere in the file system.
+    // If no documentation directory was specified, processRequest
+    // satisfies the request from the GitHub Pages.
+    vector<string> tokens;
+    boost::algorithm::split(tokens, keyword, boost::algorithm::is_any_of("/"));
+    if (keyword.find("../") == string::npos &&
+        tokens.size() > 1 &&
+        tokens.front().empty() &&
+        tokens[1] == "help") {
+        if(!serverParameters.docDirectory.empty()) {
+            const string fileName = serverParameters.docDirectory + "/" + keyword.substr(6);
+            if(filesystem::isRegularFile(fileName)) {
+                return fileName;
+            }
+        }
+        return "";
+    }
+
+    // See if we can interpret as a file name in the current directory.
+    // Note that this gives the client access to all files in the
+    // current directory.
+    if(keyword.size()>1 && keyword[0]=='/') {
+        const string fileName = keyword.substr(1);  // Remove the initial slash
+        if(fileName.find('/') == string::npos &&    // Make sure there are no other slashes
+            filesystem::isRegularFile(fileName)) {
+            return fileName;
+        }
+    }
+
+    return "";
+}
+
+
+
 // Function that provides simple http functionality
 // to facilitate data exploration and debugging.
 // It is passed the string of the GET request,
@@ -152,42 +205,17 @@ void ExpressionMatrix::processRequest(
                 return;
 
 
-            } else {
-
-                // Satisfy the documentation request as specified
-                // in serverParameters.
-                ifstream file(serverParameters.docDirectory + "/" + name);
-                if (file) {
-                    html << "\r\n" << file.rdbuf();
-                    return;
-                }
             }
-        }
-
 
-
-        // This is not a documentation request.
-        // See if we can interpret as a file name in the current directory.
-        // Note that this gives the client access to all files in the
-        // current directory.
-        if(keyword.size()>1 && keyword[0]=='/') {
-            const string fileName = keyword.substr(1);  // Remove the initial slash
-            if(fileName.find('/') == string::npos) {    // Make sure there are no other slashes
-                ifstream file(fileName);
-                if (file) {
-                    const string fileExtension = filesystem::extension(fileName);
-                    if(fileExtension == "pdf") {
-                        html << "Content-Type: application/pdf\r\n";
-                    }
-                    html << "\r\n" << file.rdbuf();
-                    return;
-                }
-            }
+            // Documentation requests that can be satisfied from the documentation
+            // directory specified in serverParameters never get here,
+            // because they are sent as static files (see getStaticFileName).
         }
 
 
 
-        // We don't know how to satisfy this request.
+        // Files in the current directory are also sent as static files,
+        // so we don't know how to satisfy this request.
         // Write a message and stop here.
         html << "\r\nUnsupported request " << keyword;
         return;
@@ -230,9 +258,10 @@ void ExpressionMatrix::processRequest(
     }
 }
 
-ServerParameters::ServerParameters(uint16_t port, string docDirectory) :
+ServerParameters::ServerParameters(uint16_t port, string docDirectory, size_t threadCount) :
     port(port),
-    docDirectory(docDirectory)
+    docDirectory(docDirectory),
+    threadCount(threadCount)
 {
 }
 
@@ -262,6 +291,12 @@ void ExpressionMatrix::explore(const ServerParameters& serverParameters)
         }
     }
 
+    // If requested, change the number of threads used for parallel computations.
+    if(serverParameters.threadCount != 0) {
+        setThreadCount(serverParameters.threadCount);
+    }
+    cout << "Parallel computations will use " << getThreadCount() << " threads." << endl;
+
     // Invoke the base class.
     HttpServer::explore(serverParameters.port);
 }
@@ -697,6 +732,45 @@ NormalizationMethod ExpressionMatrix::getNormalizationMethod(
 }
 
 
+
+
+ostream& ExpressionMatrix::writeSimilarityMetricSelection(
+    ostream& html,
+    SimilarityMetric selectedMetric) const
+{
+    // Begin the select element.
+    html << "<select name=similarityMetric id=similarityMetric>";
+
+    // Write an <option> element for each possible similarity metric.
+    for(SimilarityMetric metric : validSimilarityMetrics) {
+        html << "<option value=" << similarityMetricToString(metric);
+        if(metric == selectedMetric) {
+            html << " selected=selected";
+        }
+        html << ">" << similarityMetricToLongString(metric) << "</option>";
+    }
+
+    // End the select element.
+    html << "</select>";
+
+    return html;
+}
+
+
+
+SimilarityMetric ExpressionMatrix::getSimilarityMetric(
+    const vector<string>& request,
+    SimilarityMetric defaultValue)
+{
+    string similarityMetricString;
+    if(getParameterValue(request, "similarityMetric", similarityMetricString)) {
+        return similarityMetricFromString(similarityMetricString);
+    } else {
+        return defaultValue;
+    }
+}
+
+
 #if 0
 void ExpressionMatrix::clusterDialog(
     const vector<string>& request,
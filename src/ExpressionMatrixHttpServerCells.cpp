@@ -279,6 +279,9 @@ void ExpressionMatrix::compareTwoCells(
     string geneSetName = "AllGenes";
     getParameterValue(request, "geneSetName", geneSetName);
 
+    // Get the similarity metric.
+    const SimilarityMetric similarityMetric = getSimilarityMetric(request, SimilarityMetric::Pearson);
+
 
     // Write the form to get the cell ids.
     html <<
@@ -296,6 +299,8 @@ void ExpressionMatrix::compareTwoCells(
     }
     html << "><br>Select a gene set to be used for the comparison: ";
     writeGeneSetSelection(html, "geneSetName", {geneSetName}, false);
+    html << "<br>Select a similarity metric: ";
+    writeSimilarityMetricSelection(html, similarityMetric);
     html <<
         "<br><input type=submit value=Compare>"
         "</form>";
@@ -322,6 +327,10 @@ void ExpressionMatrix::compareTwoCells(
         return;
     }
     const GeneSet& geneSet = it->second;
+    if(similarityMetric == SimilarityMetric::Invalid) {
+        html << "<p>Invalid similarity metric." << endl;
+        return;
+    }
 
     // Write a title.
     html  << "<h1>Comparison of cells " << cellIds[0] << " ";
@@ -333,10 +342,10 @@ void ExpressionMatrix::compareTwoCells(
 
     // Write a table of similarities between these two cells.
     html <<
-        "<p>The similarity of these two cells "
+        "<p>The " << similarityMetricToLongString(similarityMetric) << " of these two cells "
         "computed using gene set " << geneSetName << " is ";
     const auto oldPrecision = html.precision(3);
-    html << computeCellSimilarity(geneSet, cellIds[0], cellIds[1]);
+    html << computeCellSimilarity(geneSet, cellIds[0], cellIds[1], similarityMetric);
     html.precision(oldPrecision);
     html << ".<br>";
 
@@ -1075,13 +1084,18 @@ void ExpressionMatrix::similarPairs(const vector<string>& request, ostream& html
         "<input type=text style='text-align:center' size=8 name=lshCount value='1024'>"
         "<tr><td>Random seed<td class=centered>"
         "<input type=text style='text-align:center' size=8 name=seed value='231'>"
+        "<tr><td>Similarity metric for exact computation<td class=centered>";
+    writeSimilarityMetricSelection(html, SimilarityMetric::Pearson);
+    html <<
         "</table>"
         "<p><input type=submit value='Create'>"
         "<p>The computation will use Locality Sensitive Hashing (LSH), which "
         "guarantees a standard deviation of 0.05 on computed similarities "
         "when the number of LSH bits is 1024. "
         "For exact computation, specify 0 for the number of LSH bits. "
-        "In that case, the computation will be exact but much slower."
+        "In that case, the computation will be exact but much slower, "
+        "and will use the specified similarity metric. "
+        "The LSH computation always approximates the Pearson correlation."
         "</form>";
 
 }
@@ -1121,6 +1135,7 @@ void ExpressionMatrix::createSimilarPairs(const vector<string>& request, ostream
     getParameterValue(request, "lshCount", lshCount);
     int seed = 231;
     getParameterValue(request, "seed", seed);
+    const SimilarityMetric similarityMetric = getSimilarityMetric(request, SimilarityMetric::Pearson);
 
     html << "<pre>";
     if(lshCount) {
@@ -1128,7 +1143,7 @@ void ExpressionMatrix::createSimilarPairs(const vector<string>& request, ostream
             maxConnectivity, similarityThreshold, lshCount, seed);
     }  else {
         findSimilarPairs0(html, geneSetName, cellSetName, similarPairsName,
-            maxConnectivity, similarityThreshold);
+            maxConnectivity, similarityThreshold, similarityMetric);
     }
     html << "</pre>";
 
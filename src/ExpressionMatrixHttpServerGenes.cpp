@@ -3,6 +3,7 @@
 
 #include "ExpressionMatrix.hpp"
 #include "ExpressionMatrixSubset.hpp"
+#include "normalizationKernels.hpp"
 #include "tokenize.hpp"
 #include "uuid.hpp"
 using namespace ChanZuckerberg;
@@ -537,6 +538,13 @@ void ExpressionMatrix::createGeneSetUsingInformationContent(const vector<string>
     }
     const CellSet& cellSet = *(itCellSet->second);
 
+    // Verify that the normalization method can be used for gene information content.
+    if(!normalizationMethodPreservesZero(normalizationMethod)) {
+        html << "<p>Normalization method " << normalizationMethodToLongString(normalizationMethod) <<
+            " cannot be used to compute gene information content.";
+        return;
+    }
+
     // Write a title.
     html << "<h1>Creation of gene set " << newGeneSetName;
     html << " using gene information content</h1>";
@@ -798,13 +806,18 @@ void ExpressionMatrix::exploreGeneInformationContent(const vector<string>& reque
         "<p>This preliminary implementation is very slow (typically around 20 seconds per thousand cells)."
         " Future versions will be faster.";
 
-    // Compute gene information content for all normalization methods.
-    vector<float> informationContent0;
-    vector<float> informationContent1;
-    vector<float> informationContent2;
-    computeGeneInformationContent(geneSet, cellSet, NormalizationMethod::none, informationContent0);
-    computeGeneInformationContent(geneSet, cellSet, NormalizationMethod::L1  , informationContent1);
-    computeGeneInformationContent(geneSet, cellSet, NormalizationMethod::L2  , informationContent2);
+    // Compute gene information content for all normalization methods
+    // that can be used for it.
+    vector<NormalizationMethod> normalizationMethods;
+    for(const NormalizationMethod normalizationMethod: validNormalizationMethods) {
+        if(normalizationMethodPreservesZero(normalizationMethod)) {
+            normalizationMethods.push_back(normalizationMethod);
+        }
+    }
+    vector< vector<float> > informationContent(normalizationMethods.size());
+    for(size_t i=0; i<normalizationMethods.size(); i++) {
+        computeGeneInformationContent(geneSet, cellSet, normalizationMethods[i], informationContent[i]);
+    }
 
     // Write to html jQuery and TableSorter so we can make the table below sortable.
     writeJQuery( html);
@@ -812,8 +825,9 @@ void ExpressionMatrix::exploreGeneInformationContent(const vector<string>& reque
 
     // Write the table of gene information content.
     const auto oldPrecision = html.precision(3);
-    html << "<table id=countTable class=tablesorter style='table-layout:fixed;width:480px;'><thead><th>Gene";
-    for(const NormalizationMethod normalizationMethod: validNormalizationMethods) {
+    html << "<table id=countTable class=tablesorter style='table-layout:fixed;width:" <<
+        160 * (normalizationMethods.size() + 1) << "px;'><thead><th>Gene";
+    for(const NormalizationMethod normalizationMethod: normalizationMethods) {
         html << "<th>Gene information content in bits computed using " << normalizationMethodToLongString(normalizationMethod);
     }
     html << "</thead><tbody>";
@@ -822,10 +836,9 @@ void ExpressionMatrix::exploreGeneInformationContent(const vector<string>& reque
         CZI_ASSERT(globalGeneId < geneCount());
         const string geneName = geneNames[globalGeneId];
         html <<  "<tr><td class=centered style='width:160px;'><a href='gene?geneId=" << urlEncode(geneName) << "'>" << geneName << "</a>";
-        html <<
-            "<td class=centered style='width:160px;'>" << informationContent0[localGeneId] <<
-            "<td class=centered style='width:160px;'>" << informationContent1[localGeneId] <<
-            "<td class=centered style='width:160px;'>" << informationContent2[localGeneId];
+        for(size_t i=0; i<normalizationMethods.size(); i++) {
+            html << "<td class=centered style='width:160px;'>" << informationContent[i][localGeneId];
+        }
     }
     html.precision(oldPrecision);
 
@@ -948,7 +961,9 @@ void ExpressionMatrix::compareTwoGenes(
     // Create a dense expression vector for each gene.
     // All indices are local to the gene set and cell set.
     vector< vector<float> > v;
-    expressionMatrixSubset.getDenseRepresentation(v, normalizationMethod);
+    PearsonResidualsParameters pearsonResidualsParameters;
+    getPearsonResidualsParameters(geneSet, normalizationMethod, pearsonResidualsParameters);
+    expressionMatrixSubset.getDenseRepresentation(v, normalizationMethod, &pearsonResidualsParameters);
 
 
 
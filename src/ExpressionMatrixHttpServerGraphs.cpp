@@ -4,6 +4,7 @@
 #include "ExpressionMatrix.hpp"
 #include "CellGraph.hpp"
 #include "color.hpp"
+#include "normalizationKernels.hpp"
 #include "SimilarPairs.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
@@ -443,6 +444,7 @@ void ExpressionMatrix::exploreCellGraph(
     string cellIdStringForColoringBySimilarity;
     getParameterValue(request, "cellIdStringForColoringBySimilarity", cellIdStringForColoringBySimilarity);
     CellId cellIdForColoringBySimilarity = cellIdFromString(cellIdStringForColoringBySimilarity);
+    const SimilarityMetric similarityMetric = getSimilarityMetric(request, SimilarityMetric::Pearson);
     string metaDataName;
     getParameterValue(request, "metaDataName", metaDataName);
     string metaDataMeaning = "category";
@@ -477,9 +479,11 @@ void ExpressionMatrix::exploreCellGraph(
         "    // window.alert('Normalization method changed: ' + normalizationMethodChanged);\n"
         "    cellIdChanged = document.getElementById('cellIdInput').value != '" << cellIdStringForColoringBySimilarity << "';\n"
         "    // window.alert('Cell id changed: ' + cellIdChanged);\n"
+        "    similarityMetricChanged = document.getElementById('similarityMetric').value != '" <<
+        similarityMetricToString(similarityMetric) << "';\n"
         "    metaDataChanged = document.getElementById('metaDataName').value != '" << metaDataName << "';\n"
         "    // window.alert('Meta data changed: ' + metaDataChanged);\n"
-        "    if(coloringOptionChanged || geneIdChanged || normalizationMethodChanged || cellIdChanged || metaDataChanged) {\n"
+        "    if(coloringOptionChanged || geneIdChanged || normalizationMethodChanged || cellIdChanged || similarityMetricChanged || metaDataChanged) {\n"
         "        document.getElementById('minColorInput').value = '';"
         "        document.getElementById('maxColorInput').value = '';"
         "    }\n"
@@ -533,7 +537,8 @@ void ExpressionMatrix::exploreCellGraph(
     if(!cellIdStringForColoringBySimilarity.empty()) {
         html << " value='" << cellIdStringForColoringBySimilarity << "'";
     }
-    html << ">";
+    html << "> using ";
+    writeSimilarityMetricSelection(html, similarityMetric);
 
 
 
@@ -820,9 +825,12 @@ Thinner edge
         const GeneId localGeneId = geneSet.getLocalGeneId(geneId);
         CZI_ASSERT(localGeneId != invalidGeneId);
         vector< pair<GeneId, float> > expressionVector;
+        PearsonResidualsParameters pearsonResidualsParameters;
+        getPearsonResidualsParameters(geneSet, normalizationMethod, pearsonResidualsParameters);
         BGL_FORALL_VERTICES(v, graph, CellGraph) {
             CellGraphVertex& vertex = graph[v];
-            computeExpressionVector(vertex.cellId, geneSet, normalizationMethod, expressionVector);
+            computeExpressionVector(vertex.cellId, geneSet, normalizationMethod, expressionVector,
+                &pearsonResidualsParameters);
             vertex.value = 0.;
             for(const auto& p: expressionVector) {  // Could do a binary search instead.
                 if(p.first == localGeneId) {
@@ -840,12 +848,19 @@ Thinner edge
             html << "<p>Invalid cell id.";
             return;
         }
+        if(similarityMetric == SimilarityMetric::Invalid) {
+            html << "<p>Invalid similarity metric.";
+            return;
+        }
         colorByNumber = true;
         const SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, true);
         const GeneSet& geneSet = similarPairs.getGeneSet();
+        GeneSet::CellSimilarityData cellSimilarityData;
+        prepareCellSimilarity(geneSet, similarityMetric, cellSimilarityData);
         BGL_FORALL_VERTICES(v, graph, CellGraph) {
             CellGraphVertex& vertex = graph[v];
-            vertex.value = computeCellSimilarity(geneSet, cellIdForColoringBySimilarity, vertex.cellId);
+            vertex.value = computeCellSimilarity(geneSet, cellIdForColoringBySimilarity, vertex.cellId,
+                similarityMetric, cellSimilarityData);
         }
     }
 
@@ -0,0 +1,117 @@
+// This file contains the implementation of ExpressionMatrix functions
+// that create and use expression layers. See ExpressionLayer.hpp.
+
+#include "ExpressionMatrix.hpp"
+#include "TaskScheduler.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <chrono>
+
+
+
+void ExpressionMatrix::createExpressionLayer(
+    const string& layerName,
+    NormalizationMethod normalizationMethod,
+    const string& precisionString)
+{
+    cout << timestamp << "ExpressionMatrix::createExpressionLayer begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Check the arguments.
+    if(expressionLayers.find(layerName) != expressionLayers.end()) {
+        throw runtime_error("Expression layer " + layerName + " already exists.");
+    }
+    if(!normalizationMethodPreservesZero(normalizationMethod)) {
+        throw runtime_error("Normalization method " + normalizationMethodToShortString(normalizationMethod) +
+            " cannot be used for an expression layer.");
+    }
+    const ExpressionLayerPrecision precision = expressionLayerPrecisionFromString(precisionString);
+    if(precision == ExpressionLayerPrecision::Invalid) {
+        throw runtime_error("Invalid expression layer precision " + precisionString +
+            ". Valid precisions are float32, float16, bfloat16.");
+    }
+
+    // Create the layer.
+    ExpressionLayer& layer = expressionLayers[layerName];
+    layer.createNew(directoryName + "/ExpressionLayer-" + layerName, normalizationMethod, precision);
+
+    // Fill it in parallel. Each cell writes to its own range of values.
+    layer.resize(cellExpressionCounts.totalSize());
+    const pair<GeneId, float>* const begin = cellExpressionCounts.begin();
+    parallelForChunks(0, cellCount(), [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            for(CellId cellId=CellId(chunkBegin); cellId!=CellId(chunkEnd); cellId++) {
+                layer.storeCell(size_t(cellExpressionCounts.begin(cellId) - begin),
+                    cellExpressionCounts.begin(cellId), cellExpressionCounts.end(cellId), cells[cellId]);
+            }
+        });
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "Created expression layer " << layerName << " with normalization " <<
+        normalizationMethodToShortString(normalizationMethod) <<
+        " and precision " << precisionString << " for " << layer.size() <<
+        " expression counts in " << t01 << " s." << endl;
+}
+
+
+
+void ExpressionMatrix::removeExpressionLayer(const string& layerName)
+{
+    const auto it = expressionLayers.find(layerName);
+    if(it == expressionLayers.end()) {
+        throw runtime_error("Expression layer " + layerName + " does not exist.");
+    }
+    it->second.remove();
+    expressionLayers.erase(it);
+}
+
+
+
+vector<string> ExpressionMatrix::getExpressionLayerNames() const
+{
+    vector<string> layerNames;
+    for(const auto& p: expressionLayers) {
+        layerNames.push_back(p.first);
+    }
+    return layerNames;
+}
+
+
+
+const ExpressionLayer& ExpressionMatrix::getExpressionLayer(const string& layerName) const
+{
+    const auto it = expressionLayers.find(layerName);
+    if(it == expressionLayers.end()) {
+        throw runtime_error("Expression layer " + layerName + " does not exist.");
+    }
+    const ExpressionLayer& layer = it->second;
+    if(layer.size() != cellExpressionCounts.totalSize()) {
+        throw runtime_error("Expression layer " + layerName +
+            " is not up to date with the expression counts. Remove it and create it again.");
+    }
+    return layer;
+}
+
+
+
+vector< pair<GeneId, float> > ExpressionMatrix::getCellExpressionLayerValues(
+    CellId cellId,
+    const string& layerName) const
+{
+    const ExpressionLayer& layer = getExpressionLayer(layerName);
+    if(cellId >= cellCount()) {
+        throw runtime_error("Invalid cell id.");
+    }
+    const size_t begin = size_t(cellExpressionCounts.begin(cellId) - cellExpressionCounts.begin());
+    const size_t n = cellExpressionCounts.size(cellId);
+    vector<float> values(n);
+    layer.getValues(begin, begin + n, values.data());
+    vector< pair<GeneId, float> > expressionValues(n);
+    for(size_t i=0; i<n; i++) {
+        expressionValues[i] = make_pair(cellExpressionCounts.begin(cellId)[i].first, values[i]);
+    }
+    return expressionValues;
+}
@@ -0,0 +1,361 @@
+// Functionality to read expression matrix data from loom files.
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+
+#include "ExpressionMatrix.hpp"
+#include "ExpressionMatrixTest.hpp"
+#include "hdf5.hpp"
+#include "TaskScheduler.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <chrono>
+#include <future>
+
+
+
+/*******************************************************************************
+
+Loom files are hdf5 files written by the loompy Python package.
+See here for a description of the format:
+http://linnarssonlab.org/loompy/format/index.html
+
+The parts of the file we use are:
+
+/matrix         The expression matrix, a dense data set with
+                one row per gene and one column per cell.
+/layers/name    Additional matrices with the same shape as /matrix.
+/row_attrs      A group containing one data set for each gene attribute.
+                The gene names are usually in data set Gene,
+                and alternative gene ids in data set Accession.
+/col_attrs      A group containing one data set for each cell attribute.
+                The cell names are usually in data set CellID.
+
+Attributes with one value per gene or cell become gene or cell meta data.
+Attributes with more than one dimension are skipped.
+
+The matrix is stored by gene, so the expression counts of a cell
+are spread over the entire data set. We read it in blocks of columns
+(cells) containing all genes, with a block width that is a multiple
+of the width of the hdf5 chunks, so each chunk is decompressed only once.
+Each block is converted to sparse format and transposed in parallel,
+and its cells are then added using addCellWithGeneIds.
+Reading of each block overlaps with adding the cells of the previous block.
+Memory usage is bounded by the block size.
+
+*******************************************************************************/
+
+
+
+// Open the data sets with one value for each row in a loom attributes group.
+// The data set with the given name is not included.
+// Data sets with a different shape are skipped with a message.
+static vector< pair<string, H5::DataSet> > openLoomAttributes(
+    const H5::Group& group,
+    const string& skipName,
+    hsize_t n)
+{
+    vector< pair<string, H5::DataSet> > attributes;
+    for(hsize_t i=0; i<group.getNumObjs(); i++) {
+        const string name = group.getObjnameByIdx(i);
+        if(name == skipName || group.childObjType(name) != H5O_TYPE_DATASET) {
+            continue;
+        }
+        const H5::DataSet dataSet = group.openDataSet(name);
+        if(dataSet.getSpace().getSimpleExtentNdims() != 1 || hdf5::size(dataSet) != n) {
+            cout << "Attribute " << name << " was skipped: it does not have one value per row." << endl;
+            continue;
+        }
+        attributes.push_back(make_pair(name, dataSet));
+    }
+    return attributes;
+}
+
+
+
+void ExpressionMatrix::addCellsFromLoom(
+    const string& fileName,
+    const string& layerName,
+    const string& cellNameAttribute,
+    const string& geneNameAttribute,
+    const string& cellNamePrefix,
+    const vector< pair<string, string> >& cellMetaDataArgument,  // Added to all cells.
+    double totalExpressionCountThreshold)
+{
+    cout << timestamp << "ExpressionMatrix::addCellsFromLoom begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Maximum number of matrix entries in each block of cells read at once.
+    const hsize_t blockSize = 1 << 24;
+
+    size_t addedCellsCount = 0;
+    try {
+        const H5::H5File file(fileName, H5F_ACC_RDONLY);
+
+        // Access the matrix.
+        const string matrixName = layerName.empty() ? "matrix" : ("layers/" + layerName);
+        const H5::DataSet matrix = file.openDataSet(matrixName);
+        H5::DataSpace matrixDataSpace = matrix.getSpace();
+        if(matrixDataSpace.getSimpleExtentNdims() != 2) {
+            throw runtime_error("Unexpected rank for loom matrix " + matrixName);
+        }
+        hsize_t dimensions[2];
+        matrixDataSpace.getSimpleExtentDims(dimensions, 0);
+        const hsize_t loomGeneCount = dimensions[0];
+        const hsize_t loomCellCount = dimensions[1];
+
+        // Read the gene names and check for duplications.
+        const H5::Group rowAttributes = file.openGroup("row_attrs");
+        const H5::DataSet geneNamesDataSet = rowAttributes.openDataSet(geneNameAttribute);
+        vector<string> loomGeneNames;
+        hdf5::readAsStrings(geneNamesDataSet, 0, hdf5::size(geneNamesDataSet), loomGeneNames);
+        if(loomGeneNames.size() != loomGeneCount) {
+            throw runtime_error("Number of gene names in row attribute " + geneNameAttribute +
+                " does not match the shape of " + matrixName);
+        }
+        {
+            vector<string> sortedLoomGeneNames = loomGeneNames;
+            sort(sortedLoomGeneNames.begin(), sortedLoomGeneNames.end());
+            const auto it = std::adjacent_find(sortedLoomGeneNames.begin(), sortedLoomGeneNames.end());
+            if(it != sortedLoomGeneNames.end()) {
+                throw runtime_error("Duplicate gene name " + *it + " in row attribute " + geneNameAttribute +
+                    " of loom file " + fileName + ". Consider using a different row attribute, such as Accession.");
+            }
+        }
+
+        // Add the genes and their meta data.
+        // We want to add them independently of the cells, so they all get added, even the ones
+        // for which all cells have zero count.
+        vector<GeneId> geneIds(loomGeneCount);
+        for(hsize_t i=0; i<loomGeneCount; i++) {
+            addGene(loomGeneNames[i]);
+            geneIds[i] = geneIdFromName(loomGeneNames[i]);
+        }
+        vector<string> values;
+        for(const auto& p: openLoomAttributes(rowAttributes, geneNameAttribute, loomGeneCount)) {
+            hdf5::readAsStrings(p.second, 0, loomGeneCount, values);
+            for(hsize_t i=0; i<loomGeneCount; i++) {
+                if(!values[i].empty()) {
+                    setGeneMetaData(geneIds[i], p.first, values[i]);
+                }
+            }
+        }
+
+        // Access the cell names and meta data.
+        const H5::Group columnAttributes = file.openGroup("col_attrs");
+        const H5::DataSet cellNamesDataSet = columnAttributes.openDataSet(cellNameAttribute);
+        if(hdf5::size(cellNamesDataSet) != loomCellCount) {
+            throw runtime_error("Number of cell names in column attribute " + cellNameAttribute +
+                " does not match the shape of " + matrixName);
+        }
+        const auto cellAttributes = openLoomAttributes(columnAttributes, cellNameAttribute, loomCellCount);
+
+        // Choose the block width, in cells.
+        hsize_t chunkWidth = 1;
+        const H5::DSetCreatPropList properties = matrix.getCreatePlist();
+        if(properties.getLayout() == H5D_CHUNKED) {
+            hsize_t chunkDimensions[2];
+            properties.getChunk(2, chunkDimensions);
+            chunkWidth = chunkDimensions[1];
+        }
+        const hsize_t blockWidth = std::max(chunkWidth,
+            (blockSize / std::max(hsize_t(1), loomGeneCount)) / chunkWidth * chunkWidth);
+        cout << timestamp << "Reading " << loomCellCount << " cells and " << loomGeneCount <<
+            " genes with " << cellAttributes.size() << " meta data fields, in blocks of " <<
+            blockWidth << " cells." << endl;
+
+        // A block of cells, as read from the file.
+        class Block {
+        public:
+            hsize_t cellBegin;
+            hsize_t cellEnd;
+            vector<float> matrix;               // Indexed by [gene][cell-cellBegin].
+            vector<string> cellNames;
+            vector< vector<string> > metaData;  // Indexed by [attribute][cell-cellBegin].
+        };
+        const auto readBlock = [&](hsize_t cellBegin, Block& block)
+        {
+            block.cellBegin = cellBegin;
+            block.cellEnd = std::min(loomCellCount, cellBegin + blockWidth);
+            const hsize_t n = block.cellEnd - cellBegin;
+
+            hsize_t offset[2] = {0, cellBegin};
+            hsize_t blockDimensions[2] = {loomGeneCount, n};
+            H5::DataSpace dataSpace = matrix.getSpace();
+            dataSpace.selectHyperslab(H5S_SELECT_SET, blockDimensions, offset);
+            const H5::DataSpace memoryDataSpace(2, blockDimensions);
+            block.matrix.resize(loomGeneCount * n);
+            if(!block.matrix.empty()) {
+                matrix.read(&block.matrix.front(), H5::PredType::NATIVE_FLOAT, memoryDataSpace, dataSpace);
+            }
+
+            hdf5::readAsStrings(cellNamesDataSet, cellBegin, n, block.cellNames);
+            block.metaData.resize(cellAttributes.size());
+            for(size_t k=0; k<cellAttributes.size(); k++) {
+                hdf5::readAsStrings(cellAttributes[k].second, cellBegin, n, block.metaData[k]);
+            }
+        };
+
+        // Loop over blocks of cells. We use two blocks,
+        // so one block can be read while the cells of the other one are being added.
+        // Only the reading thread uses the hdf5 library.
+        Block blocks[2];
+        size_t blockId = 0;
+        std::future<void> pendingRead;
+        if(loomCellCount > 0) {
+            pendingRead = std::async(std::launch::async, readBlock, hsize_t(0), std::ref(blocks[0]));
+        }
+        vector< vector< pair<GeneId, float> > > expressionCounts;
+        vector< pair<string, string> > cellMetaData;
+        while(pendingRead.valid()) {
+            pendingRead.get();
+            const Block& block = blocks[blockId];
+            blockId = 1 - blockId;
+            if(block.cellEnd < loomCellCount) {
+                pendingRead = std::async(std::launch::async, readBlock, block.cellEnd, std::ref(blocks[blockId]));
+            }
+            const size_t n = size_t(block.cellEnd - block.cellBegin);
+
+            // Convert to sparse format and transpose, in parallel.
+            // Each thread processes a few cells at a time, so
+            // it accesses the matrix in contiguous runs.
+            const size_t tileWidth = 16;
+            expressionCounts.resize(n);
+            parallelForChunks(0, n, [&](size_t chunkBegin, size_t chunkEnd)
+                {
+                    for(size_t tileBegin=chunkBegin; tileBegin<chunkEnd; tileBegin+=tileWidth) {
+                        const size_t tileEnd = std::min(chunkEnd, tileBegin + tileWidth);
+                        for(size_t j=tileBegin; j!=tileEnd; j++) {
+                            expressionCounts[j].clear();
+                        }
+                        for(hsize_t i=0; i<loomGeneCount; i++) {
+                            const float* row = &block.matrix[i*n];
+                            for(size_t j=tileBegin; j!=tileEnd; j++) {
+                                if(row[j] != 0.f) {
+                                    expressionCounts[j].push_back(make_pair(geneIds[i], row[j]));
+                                }
+                            }
+                        }
+                    }
+                });
+
+            // Add the cells of this block.
+            for(size_t j=0; j<n; j++) {
+
+                // If the total expression count is not enough, skip.
+                double totalExpressionCount = 0.;
+                for(const auto& p: expressionCounts[j]) {
+                    totalExpressionCount += p.second;
+                }
+                if(totalExpressionCount < totalExpressionCountThreshold) {
+                    continue;
+                }
+
+                // Gather the meta data.
+                const string& loomCellName = block.cellNames[j];
+                cellMetaData.clear();
+                cellMetaData.push_back(make_pair(string("CellName"),
+                    cellNamePrefix.empty() ? loomCellName : (cellNamePrefix + "-" + loomCellName)));
+                for(size_t k=0; k<cellAttributes.size(); k++) {
+                    const string& value = block.metaData[k][j];
+                    if(!value.empty()) {
+                        cellMetaData.push_back(make_pair(cellAttributes[k].first, value));
+                    }
+                }
+                copy(cellMetaDataArgument.begin(), cellMetaDataArgument.end(), back_inserter(cellMetaData));
+
+                addCellWithGeneIds(cellMetaData, expressionCounts[j]);
+                ++addedCellsCount;
+            }
+        }
+    }
+    catch (H5::Exception& e) {
+        cout << "An error occurred while reading loom file " << fileName << endl;
+        cout << e.getDetailMsg() << endl;
+        throw runtime_error("Error reading loom file " + fileName + ": " + e.getDetailMsg());
+    }
+    catch (std::exception& e) {
+        cout << "An error occurred while reading loom file " << fileName << endl;
+        cout << e.what() << endl;
+        throw;
+    }
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "Added " << addedCellsCount << " cells in " << t01 << " s." << endl;
+    cout << "There are " << cellCount() << " cells and " << geneCount() << " genes." << endl;
+}
+
+
+
+// Write a loom file as written by loompy, with a chunked and compressed matrix
+// and a layer, then read it and check expression counts and meta data.
+void ChanZuckerberg::ExpressionMatrix2::testExpressionMatrixLoom()
+{
+    ExpressionMatrixTest test("testExpressionMatrixLoom");
+
+    // The number of cells is not a multiple of the chunk size.
+    const CellId cellCount = 1001;
+    const GeneId geneCount = 150;
+
+    // Write the loom file. The matrix has one row per gene.
+    const string fileName = test.path("Test.loom");
+    {
+        H5::H5File file(fileName, H5F_ACC_TRUNC);
+        const hsize_t dimensions[2] = {geneCount, cellCount};
+        const hsize_t chunkDimensions[2] = {64, 64};
+        H5::DSetCreatPropList properties;
+        properties.setChunk(2, chunkDimensions);
+        properties.setDeflate(2);
+        vector<float> matrix;
+        for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+            for(CellId cellId=0; cellId!=cellCount; cellId++) {
+                matrix.push_back(test.expressionCount(cellId, geneId));
+            }
+        }
+        file.createDataSet("matrix", H5::PredType::NATIVE_FLOAT,
+            H5::DataSpace(2, dimensions), properties).write(matrix.data(), H5::PredType::NATIVE_FLOAT);
+        H5::Group layers = file.createGroup("layers");
+        for(float& value: matrix) {
+            value *= 2.f;
+        }
+        layers.createDataSet("Doubled", H5::PredType::NATIVE_FLOAT,
+            H5::DataSpace(2, dimensions), properties).write(matrix.data(), H5::PredType::NATIVE_FLOAT);
+
+        H5::Group rowAttributes = file.createGroup("row_attrs");
+        vector<string> geneNames;
+        vector<string> accessions;
+        for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+            geneNames.push_back(test.geneName(geneId));
+            accessions.push_back("Accession" + lexical_cast<string>(geneId));
+        }
+        hdf5::write(rowAttributes, "Gene", geneNames, 100, 0);
+        hdf5::writeVariableLength(rowAttributes, "Accession", accessions, 100, 0);
+
+        H5::Group columnAttributes = file.createGroup("col_attrs");
+        vector<string> cellNames;
+        vector<int64_t> clusterIds;
+        for(CellId cellId=0; cellId!=cellCount; cellId++) {
+            cellNames.push_back(test.cellName(cellId));
+            clusterIds.push_back(cellId % 5);
+        }
+        hdf5::writeVariableLength(columnAttributes, "CellID", cellNames, 1000, 4);
+        hdf5::write(hdf5::createDataSet<int64_t>(columnAttributes, "ClusterID", cellCount, 1000, 0), 0, clusterIds);
+    }
+
+    // Read the matrix and the layer.
+    for(const string layerName: {"", "Doubled"}) {
+        ExpressionMatrix expressionMatrix(test.path("Layer" + layerName), test.creationParameters());
+        expressionMatrix.addCellsFromLoom(fileName, layerName, "CellID", "Gene", "", {{"Source", "Loom"}}, 0.);
+        test.checkCells(expressionMatrix, cellCount, geneCount, "", layerName.empty() ? 1.f : 2.f);
+        for(CellId cellId=0; cellId!=cellCount; cellId++) {
+            CZI_ASSERT(expressionMatrix.getCellMetaData(cellId, "ClusterID") == lexical_cast<string>(cellId % 5));
+            CZI_ASSERT(expressionMatrix.getCellMetaData(cellId, "Source") == "Loom");
+        }
+        const GeneId geneId = expressionMatrix.geneIdFromName(test.geneName(7));
+        CZI_ASSERT(expressionMatrix.getGeneMetaData(geneId, "Accession") == "Accession7");
+    }
+
+    test.success();
+}
+#endif
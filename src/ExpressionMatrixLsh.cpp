@@ -24,14 +24,17 @@
 #include "ExpressionMatrix.hpp"
 #include "BitSet.hpp"
 #include "charikar.hpp"
+#include "CounterBasedRandom.hpp"
 #include "ExpressionMatrixSubset.hpp"
 #include "heap.hpp"
 #include "iterator.hpp"
 #include "Lsh.hpp"
 #include "multipleSetUnion.hpp"
 #include "nextPowerOfTwo.hpp"
+#include "normalizationKernels.hpp"
 #include "orderPairs.hpp"
 #include "SimilarPairs.hpp"
+#include "TaskScheduler.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
@@ -45,6 +48,7 @@ using namespace ExpressionMatrix2;
 #include <cmath>
 #include "fstream.hpp"
 #include <chrono>
+#include <mutex>
 #include <numeric>
 #include <queue>
 #include <random>
@@ -317,7 +321,8 @@ void ExpressionMatrix::findSimilarPairs5(
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
     double similarityThreshold,     // The minimum similarity for a pair to be stored.
     size_t lshSliceLength,          // The number of bits in each LSH signature slice, or 0 for automatic selection.
-    size_t bucketOverflow           // If not zero, ignore buckets larger than this.
+    size_t bucketOverflow,          // If not zero, ignore buckets larger than this.
+    size_t lshBitCount              // The number of LSH signature bits to use (a prefix), or 0 to use all.
     )
 {
     cout << timestamp << "ExpressionMatrix::findSimilarPairs5 begins." << endl;
@@ -345,14 +350,17 @@ void ExpressionMatrix::findSimilarPairs5(
     }
 
     // Access the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/Lsh-" + lshName);
-    if(lsh.cellCount() != cellSet.size()) {
-        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
-    }
+    // If the Lsh object was created for a larger cell set, this uses a view
+    // of its signatures for the cells of this cell set.
+    const shared_ptr<Lsh> lshPointer = accessLsh(lshName, cellSetName, cellSet);
+    Lsh& lsh = *lshPointer;
+
+    // Use the requested number of signature bits.
+    lsh.setPrefixBitCount(lshBitCount);
 
 
     // Find the signature bits corresponding to each slice.
-    const size_t sliceCount = lsh.lshCount() / lshSliceLength;
+    const size_t sliceCount = lsh.bitCount() / lshSliceLength;
     vector< vector<size_t> > allSlicesBits(sliceCount);
     for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
         vector<size_t>& sliceBits = allSlicesBits[sliceId];
@@ -513,7 +521,8 @@ void ExpressionMatrix::findSimilarPairs7(
     double similarityThreshold,     // The minimum similarity for a pair to be stored.
     const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
     CellId maxCheck,                // Maximum number of cells to consider for each cell.
-    size_t log2BucketCount
+    size_t log2BucketCount,
+    size_t lshBitCount              // The number of LSH signature bits to use (a prefix), or 0 to use all.
     )
 {
     cout << timestamp << "ExpressionMatrix::findSimilarPairs7 begins." << endl;
@@ -541,12 +550,14 @@ void ExpressionMatrix::findSimilarPairs7(
     }
 
     // Access the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/Lsh-" + lshName);
-    if(lsh.cellCount() != cellCount) {
-        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
-    }
-    const size_t lshBitCount = lsh.lshCount();
-    cout << "Number of LSH signature bits is " << lshBitCount << endl;
+    // If the Lsh object was created for a larger cell set, this uses a view
+    // of its signatures for the cells of this cell set.
+    const shared_ptr<Lsh> lshPointer = accessLsh(lshName, cellSetName, cellSet);
+    Lsh& lsh = *lshPointer;
+
+    // Use the requested number of signature bits.
+    lsh.setPrefixBitCount(lshBitCount);
+    cout << "Number of LSH signature bits is " << lsh.bitCount() << endl;
 
     // Check that the slice lengths are in decreasing order.
     const size_t sliceLengthCount = lshSliceLengths.size();
@@ -566,6 +577,34 @@ void ExpressionMatrix::findSimilarPairs7(
     // Create SimilarPairs object that will store the results.
     SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, k, geneSet, cellSet);
 
+    // Do the computation.
+    findSimilarPairs7(lsh, similarPairs, k, similarityThreshold, lshSliceLengths, maxCheck, log2BucketCount);
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "ExpressionMatrix::findSimilarPairs7 ends. Took " << t01 << " s." << endl;
+}
+
+
+
+// The core of findSimilarPairs7, operating on an existing Lsh object
+// and storing its results in the given SimilarPairs object.
+// The Lsh and SimilarPairs objects must use the same cells.
+void ExpressionMatrix::findSimilarPairs7(
+    Lsh& lsh,
+    SimilarPairs& similarPairs,
+    size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+    double similarityThreshold,     // The minimum similarity for a pair to be stored.
+    const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
+    CellId maxCheck,                // Maximum number of cells to consider for each cell.
+    size_t log2BucketCount
+    )
+{
+    const CellId cellCount = lsh.cellCount();
+    CZI_ASSERT(similarPairs.cellCount() == cellCount);
+    const size_t lshBitCount = lsh.bitCount();
+    const size_t sliceLengthCount = lshSliceLengths.size();
+
 
 
     // For each slice length and signature slice of that length,
@@ -694,11 +733,6 @@ void ExpressionMatrix::findSimilarPairs7(
         neighbors.clear();
 
     }
-
-
-    const auto t1 = std::chrono::steady_clock::now();
-    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
-    cout << timestamp << "ExpressionMatrix::findSimilarPairs7 ends. Took " << t01 << " s." << endl;
 }
 
 
@@ -752,7 +786,7 @@ void ExpressionMatrix::findSimilarPairs7AssignCellsToBuckets(
     sliceBits3.resize(sliceLengthCount);
     const uint64_t bucketCount = (1ULL << log2BucketCount);
     const uint64_t bucketMask = bucketCount - 1ULL;
-    const size_t lshBitCount = lsh.lshCount();
+    const size_t lshBitCount = lsh.bitCount();
     for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
         auto& table3 = table4[sliceLengthId];
         auto& sliceBits2 = sliceBits3[sliceLengthId];
@@ -849,7 +883,8 @@ void ExpressionMatrix::findSimilarPairs6(
     size_t permutationCount,        // The number of bit permutations for the Charikar algorithm.
     size_t searchCount,             // The number of cells checked for each cell, in the Charikar algorithm.
     size_t permutedBitCount,        // The number of most significant bits stored for each permuted signature.
-    int seed                        // The seed used to randomly generate the bit permutations.
+    int seed,                       // The seed used to randomly generate the bit permutations.
+    size_t lshBitCount              // The number of LSH signature bits to use (a prefix), or 0 to use all.
     )
 {
     cout << timestamp << "ExpressionMatrix::findSimilarPairs6 begins." << endl;
@@ -878,11 +913,14 @@ void ExpressionMatrix::findSimilarPairs6(
     }
 
     // Access the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/Lsh-" + lshName);
-    if(lsh.cellCount() != cellSet.size()) {
-        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
-    }
-    const size_t lshCount = lsh.lshCount();
+    // If the Lsh object was created for a larger cell set, this uses a view
+    // of its signatures for the cells of this cell set.
+    const shared_ptr<Lsh> lshPointer = accessLsh(lshName, cellSetName, cellSet);
+    Lsh& lsh = *lshPointer;
+
+    // Use the requested number of signature bits.
+    lsh.setPrefixBitCount(lshBitCount);
+    const size_t lshCount = lsh.bitCount();
 
     // Sanity check on the number of most significant bits stored for
     // each permuted signature.
@@ -911,7 +949,9 @@ void ExpressionMatrix::findSimilarPairs6(
 
     // Create the random number generator that will be used to generate
     // the random permutations of the signature bits.
-    std::mt19937 randomGenerator(seed);
+    // Each permutation uses its own stream, so the permutations
+    // don't depend on the number of threads.
+    const CounterBasedRandom random = CounterBasedRandom(uint64_t(seed));
 
 
     // For each of the permutations, we will store:
@@ -927,15 +967,24 @@ void ExpressionMatrix::findSimilarPairs6(
 
     // For each of the permutations, compute permuted/sorted signatures.
     // We only compute and store the first permutedBitCount bits of each permuted signature.
+    // Permutations are processed in parallel. The debug output
+    // is only readable if a single thread is used.
     cout << timestamp << "Phase 1 of Charikar algorithm begins." << endl;
     const auto t1 = std::chrono::steady_clock::now();
-    for(size_t permutationId=0; permutationId<permutationCount; permutationId++) {
-        cout << timestamp << "Working on permutation " << permutationId << " of " << permutationCount << endl;
+    ScopedThreadCount scopedThreadCount(debug ? 1 : getEffectiveThreadCount());
+    std::mutex messageMutex;
+    parallelFor(0, permutationCount, [&](size_t permutationId)
+    {
+        {
+            std::lock_guard<std::mutex> lock(messageMutex);
+            cout << timestamp << "Working on permutation " << permutationId << " of " << permutationCount << endl;
+        }
 
         // Generate a random permutation of the signature bits.
         vector<uint64_t> bitPermutation(lshCount);
         std::iota(bitPermutation.begin(), bitPermutation.end(), 0ULL);
-        std::shuffle(bitPermutation.begin(), bitPermutation.end(), randomGenerator);
+        CounterBasedRandom permutationRandom = random.split(permutationId);
+        permutationRandom.shuffle(bitPermutation.begin(), bitPermutation.end());
         bitPermutation.resize(permutedBitCount);    // Only keep the permutedBitCount most significant bits.
 
         if(debug) {
@@ -1004,7 +1053,8 @@ void ExpressionMatrix::findSimilarPairs6(
                 cout << thisPermutationBitSets[i].getString(lshCount) << " " << thisPermutationCellIds[i] << "\n";
             }
         }
-    }
+    }, 1);
+    scopedThreadCount.restore();
     const auto t2 = std::chrono::steady_clock::now();
     cout << timestamp << "Phase 1 of Charikar algorithm took ";
     cout << 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1)).count()) << " s." << endl;
@@ -1152,7 +1202,9 @@ void ExpressionMatrix::computeLshSignatures(
     const string& cellSetName,      // The name of the cell set to be used.
     const string& lshName,          // The name of the Lsh object to be created.
     size_t lshCount,                // The number of LSH vectors to use.
-    unsigned int seed               // The seed used to generate the LSH vectors.
+    unsigned int seed,              // The seed used to generate the LSH vectors.
+    const string& layerName,        // The name of the expression layer to be used, if any.
+    NormalizationMethod normalizationMethod
     )
 {
     cout << timestamp << "ExpressionMatrix::computeLshSignatures begins." << endl;
@@ -1178,6 +1230,73 @@ void ExpressionMatrix::computeLshSignatures(
         throw runtime_error("Cell set " + cellSetName + " is empty.");
     }
 
+    // If an expression layer was specified, stream its values
+    // directly into the Lsh object.
+    if(!layerName.empty()) {
+        if(normalizationMethod != NormalizationMethod::none) {
+            throw runtime_error("A normalization method cannot be specified when using an expression layer.");
+        }
+        const ExpressionLayer& layer = getExpressionLayer(layerName);
+
+        // The local GeneId in the gene set of each global GeneId,
+        // or invalidGeneId if not in the gene set.
+        vector<GeneId> localGeneIds(geneCount());
+        for(GeneId globalGeneId=0; globalGeneId!=geneCount(); globalGeneId++) {
+            localGeneIds[globalGeneId] = geneSet.getLocalGeneId(globalGeneId);
+        }
+
+        // The expression counts of a cell are sorted by global GeneId,
+        // and the gene set is sorted, so the local GeneIds come out sorted.
+        // The layer values are stored directly in the buffer
+        // of the calling thread, without a temporary copy.
+        const pair<GeneId, float>* const begin = cellExpressionCounts.begin();
+        const auto getCellExpressionCounts =
+            [&](CellId localCellId, vector< pair<GeneId, float> >& counts)
+            {
+                const CellId cellId = cellSet[localCellId];
+                const pair<GeneId, float>* const cellBegin = cellExpressionCounts.begin(cellId);
+                const size_t position = size_t(cellBegin - begin);
+                counts.clear();
+                layer.forEachValue(position, position + cellExpressionCounts.size(cellId),
+                    [&](size_t i, float value)
+                    {
+                        const GeneId localGeneId = localGeneIds[begin[i].first];
+                        if(localGeneId != invalidGeneId) {
+                            counts.push_back(make_pair(localGeneId, value));
+                        }
+                    });
+            };
+        Lsh lsh(directoryName + "/Lsh-" + lshName, GeneId(geneSet.size()), cellCount,
+            getCellExpressionCounts, lshCount, seed, getNumaPolicy("Lsh-" + lshName));
+        lsh.storeCellIds(directoryName + "/Lsh-" + lshName, cellSet);
+
+        cout << timestamp << "ExpressionMatrix::computeLshSignatures ends." << endl;
+        return;
+    }
+
+    // If a normalization that changes the direction of the expression vectors
+    // was requested, normalize each cell as it is used by the Lsh object.
+    if(normalizationMethod == NormalizationMethod::Invalid) {
+        throw runtime_error("Invalid normalization method.");
+    }
+    if(normalizationMethodUsesLog1p(normalizationMethod) ||
+        normalizationMethod == NormalizationMethod::PearsonResiduals) {
+        PearsonResidualsParameters pearsonResidualsParameters;
+        getPearsonResidualsParameters(geneSet, normalizationMethod, pearsonResidualsParameters);
+        const auto getCellExpressionCounts =
+            [&](CellId localCellId, vector< pair<GeneId, float> >& counts)
+            {
+                computeExpressionVector(cellSet[localCellId], geneSet, normalizationMethod, counts,
+                    &pearsonResidualsParameters);
+            };
+        Lsh lsh(directoryName + "/Lsh-" + lshName, GeneId(geneSet.size()), cellCount,
+            getCellExpressionCounts, lshCount, seed, getNumaPolicy("Lsh-" + lshName));
+        lsh.storeCellIds(directoryName + "/Lsh-" + lshName, cellSet);
+
+        cout << timestamp << "ExpressionMatrix::computeLshSignatures ends." << endl;
+        return;
+    }
+
     // Create the expression matrix subset for this gene set and cell set.
     cout << timestamp << "Creating expression matrix subset." << endl;
     const string expressionMatrixSubsetName =
@@ -1186,17 +1305,104 @@ void ExpressionMatrix::computeLshSignatures(
         expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
 
     // Create the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/Lsh-" + lshName, expressionMatrixSubset, lshCount, seed);
+    Lsh lsh(directoryName + "/Lsh-" + lshName, expressionMatrixSubset, lshCount, seed,
+        getNumaPolicy("Lsh-" + lshName));
+    lsh.storeCellIds(directoryName + "/Lsh-" + lshName, cellSet);
 
     cout << timestamp << "ExpressionMatrix::computeLshSignatures ends." << endl;
 }
 
 
 
+// Access an existing Lsh object for use with a cell set.
+shared_ptr<Lsh> ExpressionMatrix::accessLsh(
+    const string& lshName,
+    const string& cellSetName,
+    const MemoryMapped::Vector<CellId>& cellSet)
+{
+    const string name = directoryName + "/Lsh-" + lshName;
+    const shared_ptr<Lsh> lsh = make_shared<Lsh>(name);
+
+    // If the CellIds of the Lsh object were not stored,
+    // we can only check the number of cells.
+    if(!lsh->hasCellIds()) {
+        if(lsh->cellCount() != cellSet.size()) {
+            throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
+        }
+        return lsh;
+    }
+
+    // If the Lsh object was created for this cell set, use it directly.
+    bool isSameCellSet = (lsh->cellCount() == cellSet.size());
+    for(CellId localCellId=0; isSameCellSet && localCellId!=cellSet.size(); localCellId++) {
+        isSameCellSet = (lsh->getCellId(localCellId) == cellSet[localCellId]);
+    }
+    if(isSameCellSet) {
+        return lsh;
+    }
+
+    // Otherwise, find the local CellId in the Lsh object
+    // of each cell of the cell set, and create a view.
+    vector<CellId> lshCellIds(cellCount(), invalidCellId);
+    for(CellId lshCellId=0; lshCellId!=lsh->cellCount(); lshCellId++) {
+        lshCellIds[lsh->getCellId(lshCellId)] = lshCellId;
+    }
+    vector<CellId> parentCellIds(cellSet.size());
+    for(CellId localCellId=0; localCellId!=cellSet.size(); localCellId++) {
+        const CellId lshCellId = lshCellIds[cellSet[localCellId]];
+        if(lshCellId == invalidCellId) {
+            throw runtime_error("Cell set " + cellSetName + " contains cells not in LSH object " + lshName);
+        }
+        parentCellIds[localCellId] = lshCellId;
+    }
+    cout << timestamp << "Using a view of LSH object " << lshName <<
+        " for the " << cellSet.size() << " cells of cell set " << cellSetName << "." << endl;
+    return make_shared<Lsh>(name, parentCellIds);
+}
+
+
+
+// Create a new Lsh object containing a contiguous copy of the signatures
+// that an existing Lsh object has for the cells of a cell set.
+void ExpressionMatrix::gatherLshSignatures(
+    const string& cellSetName,      // The name of the cell set to be used.
+    const string& lshName,          // The name of the existing Lsh object.
+    const string& newLshName        // The name of the Lsh object to be created.
+    )
+{
+    // Locate the cell set and verify that it is not empty.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    if(cellSet.size() == 0) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+
+    // Access the existing Lsh object and copy its signatures.
+    const shared_ptr<Lsh> lshPointer = accessLsh(lshName, cellSetName, cellSet);
+    const string newName = directoryName + "/Lsh-" + newLshName;
+    Lsh newLsh(newName, *lshPointer);
+    newLsh.storeCellIds(newName, cellSet);
+    cout << timestamp << "Gathered the LSH signatures of " << cellSet.size() <<
+        " cells into LSH object " << newLshName << "." << endl;
+}
+
+
+
 // Compare two SimilarPairs objects computed using LSH,
 // assuming that the first one was computed using a complete
 // loop on all pairs (findSimilarPairs4).
-void ExpressionMatrix::compareSimilarPairs(
+// Cells for which the two differ are written to CompareSimilarPairs.csv,
+// and a summary is written to cout.
+// When the second one was computed by findSimilarPairs4Gpu
+// with the same Lsh object, on any OpenCL device,
+// all cells should have identical similarities.
+// The neighbors themselves can differ in the presence of ties
+// at the lowest similarity stored.
+// Returns true if all cells have identical similarities.
+bool ExpressionMatrix::compareSimilarPairs(
     const string& similarPairsName0,
     const string& similarPairsName1)
 {
@@ -1212,9 +1418,43 @@ void ExpressionMatrix::compareSimilarPairs(
     ofstream csvOut("CompareSimilarPairs.csv");
     csvOut << "CellId,Stored0,Stored1,Lowest0,Lowest1,\n";
     const CellId cellCount = CellId(similarPairs0.getCellSet().size());
+    CellId identicalCellCount = 0;
+    size_t neighborCount0 = 0;
+    size_t commonNeighborCount = 0;
+    vector<CellId> neighbors0;
+    vector<CellId> neighbors1;
+    vector<CellId> commonNeighbors;
     for(CellId cellId=0; cellId<cellCount; cellId++) {
         const auto n0 = similarPairs0.size(cellId);
         const auto n1 = similarPairs1.size(cellId);
+
+        // Count the neighbors stored in both.
+        neighbors0.clear();
+        for(auto it=similarPairs0.begin(cellId); it!=similarPairs0.end(cellId); ++it) {
+            neighbors0.push_back(it->first);
+        }
+        neighbors1.clear();
+        for(auto it=similarPairs1.begin(cellId); it!=similarPairs1.end(cellId); ++it) {
+            neighbors1.push_back(it->first);
+        }
+        sort(neighbors0.begin(), neighbors0.end());
+        sort(neighbors1.begin(), neighbors1.end());
+        commonNeighbors.clear();
+        std::set_intersection(neighbors0.begin(), neighbors0.end(),
+            neighbors1.begin(), neighbors1.end(), std::back_inserter(commonNeighbors));
+        neighborCount0 += n0;
+        commonNeighborCount += commonNeighbors.size();
+
+        // Both are sorted by decreasing similarity,
+        // so we can compare similarities in order.
+        if(n0 == n1 && std::equal(
+            similarPairs0.begin(cellId), similarPairs0.end(cellId), similarPairs1.begin(cellId),
+            [](const SimilarPairs::Pair& x, const SimilarPairs::Pair& y) {
+                return x.second == y.second;
+            })) {
+            ++identicalCellCount;
+        }
+
         const auto lowest0 = n0 ? ((similarPairs0.end(cellId)-1)->second) : 1.;
         const auto lowest1 = n1 ? ((similarPairs1.end(cellId)-1)->second) : 1.;
         if(n0==n1 && lowest0==lowest1) {
@@ -1236,7 +1476,14 @@ void ExpressionMatrix::compareSimilarPairs(
 
     }
 
+    cout << identicalCellCount << " of " << cellCount <<
+        " cells have identical similarities in " << similarPairsName0 <<
+        " and " << similarPairsName1 << "." << endl;
+    cout << commonNeighborCount << " of " << neighborCount0 <<
+        " neighbors in " << similarPairsName0 <<
+        " are also in " << similarPairsName1 << "." << endl;
 
+    return identicalCellCount == cellCount;
 }
 
 
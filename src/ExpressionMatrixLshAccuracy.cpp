@@ -0,0 +1,334 @@
+// This file contains the implementation of ExpressionMatrix::estimateLshAccuracy.
+// See LshAccuracy.hpp for more information.
+
+#include "ExpressionMatrix.hpp"
+#include "CounterBasedRandom.hpp"
+#include "Lsh.hpp"
+#include "TaskScheduler.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace {
+
+            // A sampled pair of cells, with its exact and LSH similarity.
+            // For near neighbor pairs, found is true if the pair is also
+            // among the k nearest neighbors according to LSH similarity.
+            class LshAccuracySample {
+            public:
+                double exactSimilarity = 0.;
+                double lshSimilarity = 0.;
+                bool isNeighbor = false;
+                bool found = false;
+            };
+
+            // Sums accumulated for each bin.
+            class LshAccuracySums {
+            public:
+                size_t n = 0;
+                double sum1 = 0.;   // Sum of differences between LSH and exact similarity.
+                double sum2 = 0.;   // Sum of squares of the differences.
+                double sum4 = 0.;   // Sum of fourth powers of the differences.
+                size_t neighborCount = 0;
+                size_t foundNeighborCount = 0;
+
+                void add(const LshAccuracySample& sample)
+                {
+                    if(!sample.isNeighbor) {
+                        const double d = sample.lshSimilarity - sample.exactSimilarity;
+                        ++n;
+                        sum1 += d;
+                        sum2 += d * d;
+                        sum4 += d * d * d * d;
+                    } else {
+                        ++neighborCount;
+                        if(sample.found) {
+                            ++foundNeighborCount;
+                        }
+                    }
+                }
+
+                void fill(LshAccuracyBin& bin) const
+                {
+                    // z for a two-sided 95% confidence interval.
+                    const double z = 1.96;
+
+                    bin.pairCount = n;
+                    if(n > 0) {
+                        const double N = double(n);
+                        const double mean1 = sum1 / N;
+                        const double mean2 = sum2 / N;
+                        const double mean4 = sum4 / N;
+                        const double sigma1 = std::sqrt(std::max(0., mean2 - mean1 * mean1) / N);
+                        const double sigma2 = std::sqrt(std::max(0., mean4 - mean2 * mean2) / N);
+                        bin.bias = mean1;
+                        bin.biasLow = mean1 - z * sigma1;
+                        bin.biasHigh = mean1 + z * sigma1;
+                        bin.rms = std::sqrt(mean2);
+                        bin.rmsLow = std::sqrt(std::max(0., mean2 - z * sigma2));
+                        bin.rmsHigh = std::sqrt(mean2 + z * sigma2);
+                    }
+
+                    bin.neighborCount = neighborCount;
+                    bin.foundNeighborCount = foundNeighborCount;
+                    if(neighborCount > 0) {
+                        bin.recall = double(foundNeighborCount) / double(neighborCount);
+                        computeWilsonScoreInterval(foundNeighborCount, neighborCount, bin.recallLow, bin.recallHigh);
+                    }
+                }
+            };
+        }
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::computeWilsonScoreInterval(
+    size_t successCount,
+    size_t trialCount,
+    double& low,
+    double& high)
+{
+    if(trialCount == 0) {
+        low = 0.;
+        high = 1.;
+        return;
+    }
+    const double z = 1.96;
+    const double n = double(trialCount);
+    const double p = double(successCount) / n;
+    const double denominator = 1. + z * z / n;
+    const double center = (p + z * z / (2. * n)) / denominator;
+    const double halfWidth = z * std::sqrt(p * (1. - p) / n + z * z / (4. * n * n)) / denominator;
+    low = std::max(0., center - halfWidth);
+    high = std::min(1., center + halfWidth);
+}
+
+
+
+LshAccuracy ExpressionMatrix::estimateLshAccuracy(
+    const string& geneSetName,
+    const string& cellSetName,
+    const string& lshName,
+    size_t lshBitCount,
+    size_t randomPairCount,
+    size_t queryCellCount,
+    size_t referenceCellCount,
+    size_t k,
+    size_t binCount,
+    unsigned int seed)
+{
+    cout << timestamp << "ExpressionMatrix::estimateLshAccuracy begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+
+    // Locate the cell set and verify that it has at least two cells.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount < 2) {
+        throw runtime_error("Cell set " + cellSetName + " has less than two cells.");
+    }
+
+    // Access the Lsh object.
+    // If the Lsh object was created for a larger cell set, this uses a view
+    // of its signatures for the cells of this cell set.
+    const shared_ptr<Lsh> lshPointer = accessLsh(lshName, cellSetName, cellSet);
+    Lsh& lsh = *lshPointer;
+
+    // Use only the first lshBitCount bits of each signature.
+    lsh.setPrefixBitCount(lshBitCount);
+    lshBitCount = lsh.bitCount();
+
+    // Check the remaining arguments.
+    if(binCount == 0) {
+        throw runtime_error("The number of bins must be positive.");
+    }
+
+    // Get what we need to compute exact similarities in parallel.
+    GeneSet::CellSimilarityData cellSimilarityData;
+    prepareCellSimilarity(geneSet, SimilarityMetric::Pearson, cellSimilarityData);
+    const auto exactSimilarity = [&](CellId localCellId0, CellId localCellId1)
+        {
+            return computeCellSimilarity(geneSet, cellSet[localCellId0], cellSet[localCellId1],
+                SimilarityMetric::Pearson, cellSimilarityData);
+        };
+
+    const auto mismatchCount = [&](CellId localCellId0, CellId localCellId1)
+        {
+            return lsh.computeMismatchCount(localCellId0, localCellId1);
+        };
+
+    // Independent random streams for each use, so results do not
+    // depend on the number of threads.
+    const CounterBasedRandom random(seed);
+    const CounterBasedRandom pairRandom = random.split(0);
+
+    // Random pairs.
+    vector<LshAccuracySample> randomSamples(randomPairCount);
+    parallelForChunks(0, randomPairCount, [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t i=chunkBegin; i!=chunkEnd; i++) {
+                const CellId localCellId0 = CellId(pairRandom.at(2*i) % cellCount);
+                CellId localCellId1 = CellId(pairRandom.at(2*i+1) % cellCount);
+                if(localCellId1 == localCellId0) {
+                    localCellId1 = (localCellId1 + 1) % cellCount;
+                }
+                LshAccuracySample& sample = randomSamples[i];
+                sample.exactSimilarity = exactSimilarity(localCellId0, localCellId1);
+                sample.lshSimilarity = lsh.getSimilarity(mismatchCount(localCellId0, localCellId1));
+            }
+        });
+    const auto t1 = std::chrono::steady_clock::now();
+
+    // Choose the query cells and the reference cells.
+    vector<CellId> shuffledCells(cellCount);
+    std::iota(shuffledCells.begin(), shuffledCells.end(), CellId(0));
+    parallelShuffle(shuffledCells, random.split(1));
+    const vector<CellId> queryCells(shuffledCells.begin(),
+        shuffledCells.begin() + std::min(size_t(cellCount), queryCellCount));
+    if(referenceCellCount == 0 || referenceCellCount > cellCount) {
+        referenceCellCount = cellCount;
+    }
+    vector<CellId> referenceCells;
+    if(referenceCellCount == cellCount) {
+        std::iota(shuffledCells.begin(), shuffledCells.end(), CellId(0));
+        referenceCells.swap(shuffledCells);
+    } else {
+        parallelShuffle(shuffledCells, random.split(2));
+        referenceCells.assign(shuffledCells.begin(), shuffledCells.begin() + referenceCellCount);
+    }
+
+    // For each query cell, find the exact k nearest neighbors and the k nearest neighbors
+    // according to LSH among the reference cells, excluding the query cell itself.
+    // Ties are broken by cell id, so the results are deterministic.
+    if(k >= referenceCellCount) {
+        k = referenceCellCount - 1;
+    }
+    vector< vector<LshAccuracySample> > neighborSamples(queryCells.size());
+    parallelForChunks(0, queryCells.size(), [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            vector< pair<double, CellId> > exactNeighbors;
+            vector< pair<uint64_t, CellId> > lshNeighbors;
+            vector<CellId> lshNeighborCells;
+            for(size_t i=chunkBegin; i!=chunkEnd; i++) {
+                const CellId queryCell = queryCells[i];
+                exactNeighbors.clear();
+                lshNeighbors.clear();
+                for(const CellId referenceCell: referenceCells) {
+                    if(referenceCell == queryCell) {
+                        continue;
+                    }
+                    const double similarity = exactSimilarity(queryCell, referenceCell);
+                    if(std::isfinite(similarity)) {
+                        exactNeighbors.push_back(make_pair(-similarity, referenceCell));
+                    }
+                    lshNeighbors.push_back(make_pair(mismatchCount(queryCell, referenceCell), referenceCell));
+                }
+                const size_t exactK = std::min(k, exactNeighbors.size());
+                const size_t lshK = std::min(k, lshNeighbors.size());
+                std::partial_sort(exactNeighbors.begin(), exactNeighbors.begin() + exactK, exactNeighbors.end());
+                std::partial_sort(lshNeighbors.begin(), lshNeighbors.begin() + lshK, lshNeighbors.end());
+                lshNeighborCells.clear();
+                for(size_t j=0; j<lshK; j++) {
+                    lshNeighborCells.push_back(lshNeighbors[j].second);
+                }
+                std::sort(lshNeighborCells.begin(), lshNeighborCells.end());
+
+                vector<LshAccuracySample>& samples = neighborSamples[i];
+                samples.resize(exactK);
+                for(size_t j=0; j<exactK; j++) {
+                    const CellId neighborCell = exactNeighbors[j].second;
+                    LshAccuracySample& sample = samples[j];
+                    sample.exactSimilarity = -exactNeighbors[j].first;
+                    sample.lshSimilarity = lsh.getSimilarity(mismatchCount(queryCell, neighborCell));
+                    sample.isNeighbor = true;
+                    sample.found = std::binary_search(lshNeighborCells.begin(), lshNeighborCells.end(), neighborCell);
+                }
+            }
+        }, 1);
+    const auto t2 = std::chrono::steady_clock::now();
+
+    // Accumulate the statistics for each bin of exact similarity in [-1, 1].
+    // Near neighbor pairs contribute to the recall but not to bias and RMS,
+    // so bias and RMS describe a uniform sample of pairs.
+    vector<LshAccuracySums> binSums(binCount);
+    LshAccuracySums totalSums;
+    const auto addSample = [&](const LshAccuracySample& sample)
+        {
+            if(!std::isfinite(sample.exactSimilarity)) {
+                return;
+            }
+            const double x = 0.5 * (sample.exactSimilarity + 1.) * double(binCount);
+            const size_t bin = size_t(std::min(double(binCount - 1), std::max(0., std::floor(x))));
+            binSums[bin].add(sample);
+            totalSums.add(sample);
+        };
+    for(const LshAccuracySample& sample: randomSamples) {
+        addSample(sample);
+    }
+    for(const vector<LshAccuracySample>& samples: neighborSamples) {
+        for(const LshAccuracySample& sample: samples) {
+            addSample(sample);
+        }
+    }
+
+    // Store the results.
+    LshAccuracy accuracy;
+    accuracy.lshBitCount = lshBitCount;
+    accuracy.bins.resize(binCount);
+    for(size_t i=0; i<binCount; i++) {
+        LshAccuracyBin& bin = accuracy.bins[i];
+        bin.minSimilarity = -1. + 2. * double(i) / double(binCount);
+        bin.maxSimilarity = -1. + 2. * double(i + 1) / double(binCount);
+        binSums[i].fill(bin);
+    }
+    accuracy.total.minSimilarity = -1.;
+    accuracy.total.maxSimilarity = 1.;
+    totalSums.fill(accuracy.total);
+
+    // Write a summary.
+    cout << "Accuracy of LSH similarity with " << lshBitCount << " bits, using " <<
+        randomPairCount << " random pairs and the " << k << " nearest neighbors of " <<
+        queryCells.size() << " cells among " << referenceCellCount << " cells:" << endl;
+    cout << "Similarity range, pairs, bias, RMS, neighbors, recall" << endl;
+    for(const LshAccuracyBin& bin: accuracy.bins) {
+        if(bin.pairCount == 0 && bin.neighborCount == 0) {
+            continue;
+        }
+        cout << bin.minSimilarity << " " << bin.maxSimilarity << " " <<
+            bin.pairCount << " " << bin.bias << " " << bin.rms << " " <<
+            bin.neighborCount << " " << bin.recall << endl;
+    }
+    cout << "All " << accuracy.total.pairCount << " " << accuracy.total.bias << " " <<
+        accuracy.total.rms << " " << accuracy.total.neighborCount << " " << accuracy.total.recall << endl;
+
+    const auto t3 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    const double t12 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1)).count());
+    const double t03 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t3 - t0)).count());
+    cout << "Random pairs took " << t01 << " s, near neighbors took " << t12 << " s." << endl;
+    cout << timestamp << "ExpressionMatrix::estimateLshAccuracy ends. Took " << t03 << " s." << endl;
+    return accuracy;
+}
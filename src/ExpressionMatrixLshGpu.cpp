@@ -22,7 +22,8 @@ void ExpressionMatrix::findSimilarPairs4Gpu(
     size_t lshCount,                // The number of LSH vectors to use.
     unsigned int seed,              // The seed used to generate the LSH vectors.
     unsigned int kernel,            // The GPU kernel (algorithm) to use.
-    CellId blockSize                // The number of cells processed by each kernel instance.
+    CellId blockSize,               // The number of cells processed by each kernel instance.
+    size_t lshBitCount              // The number of LSH signature bits to use (a prefix), or 0 to use all.
     )
 {
     cout << timestamp << "ExpressionMatrix::findSimilarPairs4Gpu begins." << endl;
@@ -57,10 +58,14 @@ void ExpressionMatrix::findSimilarPairs4Gpu(
         expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
 
     // Create the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/Lsh-" + lshName);
-    if(lsh.cellCount() != cellSet.size()) {
-        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
-    }
+    // If the Lsh object was created for a larger cell set, this uses a view
+    // of its signatures for the cells of this cell set.
+    const shared_ptr<Lsh> lshPointer = accessLsh(lshName, cellSetName, cellSet);
+    Lsh& lsh = *lshPointer;
+
+    // Use the requested number of signature bits.
+    lsh.setPrefixBitCount(lshBitCount);
+
     lsh.initializeGpu();
     cout << "GPU computing will use " << lsh.getGpuName() << "." << endl;
 
@@ -361,7 +366,8 @@ void ExpressionMatrix::findSimilarPairs7Gpu(
     const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
     CellId maxCheck,                    // Maximum number of candidate neighbors to consider for each cell.
     size_t log2BucketCount,
-    CellId blockSize                    // The number of cells processed by each kernel instance on the GPU.
+    CellId blockSize,                   // The number of cells processed by each kernel instance on the GPU.
+    size_t lshBitCount                  // The number of LSH signature bits to use (a prefix), or 0 to use all.
     )
 {
     cout << timestamp << "ExpressionMatrix::findSimilarPairs7Gpu begins." << endl;
@@ -389,10 +395,14 @@ void ExpressionMatrix::findSimilarPairs7Gpu(
     }
 
     // Create the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/Lsh-" + lshName);
-    if(lsh.cellCount() != cellSet.size()) {
-        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
-    }
+    // If the Lsh object was created for a larger cell set, this uses a view
+    // of its signatures for the cells of this cell set.
+    const shared_ptr<Lsh> lshPointer = accessLsh(lshName, cellSetName, cellSet);
+    Lsh& lsh = *lshPointer;
+
+    // Use the requested number of signature bits.
+    lsh.setPrefixBitCount(lshBitCount);
+
     lsh.initializeGpu();
     cout << "GPU computing will use " << lsh.getGpuName() << "." << endl;
 
@@ -443,7 +453,7 @@ void ExpressionMatrix::findSimilarPairs7GpuKernel3(
     size_t log2BucketCount)
 {
     const CellId cellCount = lsh.cellCount();
-    const size_t lshBitCount = lsh.lshCount();
+    const size_t lshBitCount = lsh.bitCount();
     const size_t sliceLengthCount = lshSliceLengths.size();
     const uint64_t bucketCount = (1ULL << log2BucketCount);
     const uint64_t bucketMask = bucketCount - 1ULL;
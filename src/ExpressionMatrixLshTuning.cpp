@@ -0,0 +1,660 @@
+// This file contains the implementation of ExpressionMatrix::tuneLsh.
+// See LshTuning.hpp for more information.
+
+#include "ExpressionMatrix.hpp"
+#include "BitSet.hpp"
+#include "CounterBasedRandom.hpp"
+#include "heap.hpp"
+#include "Lsh.hpp"
+#include "LshAccuracy.hpp"
+#include "TaskScheduler.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <boost/math/constants/constants.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace {
+
+            // Return true if bits [begin, begin+length) of a bit vector are all zero.
+            // As in BitSet, bit 0 is the most significant bit of word 0.
+            // The length must be between 1 and 64.
+            inline bool isZeroBitRange(const uint64_t* x, size_t begin, size_t length)
+            {
+                const size_t word = begin >> 6;
+                const size_t offset = begin & 63;
+                if(offset + length <= 64) {
+                    const uint64_t mask = (length == 64) ? ~0ULL :
+                        (((1ULL << length) - 1ULL) << (64 - offset - length));
+                    return (x[word] & mask) == 0;
+                } else {
+                    const size_t remainingLength = offset + length - 64;
+                    return
+                        ((x[word] & (~0ULL >> offset)) == 0) &&
+                        ((x[word+1] & (~0ULL << (64 - remainingLength))) == 0);
+                }
+            }
+
+            // Return the position of the first set bit among the first n bits
+            // of a mask stored least significant bit first, or n if there is none.
+            inline size_t findFirstSetBit(const uint64_t* mask, size_t n)
+            {
+                for(size_t word=0; 64*word<n; word++) {
+                    if(mask[word]) {
+                        return std::min(n, 64*word + size_t(__builtin_ctzll(mask[word])));
+                    }
+                }
+                return n;
+            }
+
+            // Return true if two masks have a set bit in common.
+            inline bool intersects(const uint64_t* mask0, const uint64_t* mask1, size_t wordCount)
+            {
+                for(size_t word=0; word<wordCount; word++) {
+                    if(mask0[word] & mask1[word]) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Given the indexes of the cells checked for a query cell that are above the
+            // similarity threshold, in order of increasing mismatch count, count how many
+            // of the exact neighbors are among the first k that are candidates.
+            template<class IsCandidate> size_t countFoundNeighbors(
+                const vector<uint32_t>& checkedOrder,
+                size_t k,
+                const vector< pair<uint64_t, CellId> >& checkedCells,
+                const vector<CellId>& exactNeighborCells,
+                const IsCandidate& isCandidate)
+            {
+                size_t candidateCount = 0;
+                size_t foundCount = 0;
+                for(const uint32_t j: checkedOrder) {
+                    if(!isCandidate(j)) {
+                        continue;
+                    }
+                    if(std::binary_search(exactNeighborCells.begin(), exactNeighborCells.end(), checkedCells[j].second)) {
+                        ++foundCount;
+                    }
+                    if(++candidateCount == k) {
+                        break;
+                    }
+                }
+                return foundCount;
+            }
+
+            // Configurations that only differ in bucketOverflow (for findSimilarPairs5)
+            // or maxCheck (for findSimilarPairs7) are evaluated together.
+            class LshTuningGroup {
+            public:
+                bool isFindSimilarPairs7 = false;
+                size_t lshCountIndex = 0;
+                vector<size_t> sliceLengthIndexes;  // In order of decreasing slice length.
+                vector<size_t> configurationIds;
+            };
+
+            // The results for one query cell.
+            class LshTuningQueryResult {
+            public:
+                size_t neighborCount = 0;
+                vector<size_t> foundNeighborCounts;     // Indexed by configuration id.
+                vector<double> candidateCounts;         // Indexed by configuration id.
+            };
+        }
+    }
+}
+
+
+
+LshTuning ExpressionMatrix::tuneLsh(
+    const string& geneSetName,
+    const string& cellSetName,
+    const string& lshName,
+    size_t k,
+    double similarityThreshold,
+    double targetRecall,
+    size_t queryCellCount,
+    size_t exactCheckCount,
+    size_t referenceCellCount,
+    unsigned int seed)
+{
+    cout << timestamp << "ExpressionMatrix::tuneLsh begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+
+    // Locate the cell set and verify that it has at least two cells.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount < 2) {
+        throw runtime_error("Cell set " + cellSetName + " has less than two cells.");
+    }
+
+    // Access the Lsh object.
+    // If the Lsh object was created for a larger cell set, this uses a view
+    // of its signatures for the cells of this cell set.
+    const shared_ptr<Lsh> lshPointer = accessLsh(lshName, cellSetName, cellSet);
+    Lsh& lsh = *lshPointer;
+    const size_t lshBitCount = lsh.lshCount();
+    const size_t signatureWordCount = lsh.getSignature(0).wordCount();
+
+    if(k == 0) {
+        throw runtime_error("k must be positive.");
+    }
+    if(queryCellCount == 0) {
+        throw runtime_error("The number of query cells must be positive.");
+    }
+    if(referenceCellCount == 1) {
+        throw runtime_error("At least two reference cells are needed.");
+    }
+
+
+
+    // The values of lshCount to consider: the number of bits
+    // of the existing signatures, halved down to 64.
+    vector<size_t> lshCounts;
+    for(size_t lshCount=lshBitCount; ; lshCount/=2) {
+        lshCounts.push_back(lshCount);
+        if(lshCount/2 < 64) {
+            break;
+        }
+    }
+
+    // The slice lengths to consider, in decreasing order,
+    // around the base 2 log of the number of cells.
+    size_t log2CellCount = 0;
+    while((1ULL << log2CellCount) < cellCount) {
+        ++log2CellCount;
+    }
+    vector<size_t> sliceLengths;
+    for(int delta=4; delta>=-6; delta-=2) {
+        const int sliceLength = int(log2CellCount) + delta;
+        if(sliceLength >= 4 && sliceLength <= 64 && size_t(sliceLength) <= lshBitCount) {
+            sliceLengths.push_back(size_t(sliceLength));
+        }
+    }
+    if(sliceLengths.empty()) {
+        throw runtime_error("LSH object " + lshName + " has too few signature bits.");
+    }
+
+    // findSimilarPairs5 allocates 2^sliceLength buckets for each slice,
+    // so we don't consider longer slices for it.
+    const size_t maxSliceLength5 = 20;
+
+    // findSimilarPairs7 uses tables of at most 2^log2BucketCount buckets.
+    // We use no more buckets than about twice the number of cells.
+    const size_t maxLog2BucketCount = std::max(size_t(8), log2CellCount + 1);
+
+    // The values of bucketOverflow and maxCheck to consider.
+    vector<size_t> bucketOverflows;
+    vector<CellId> maxChecks;
+    for(size_t n=k; n<cellCount; n*=4) {
+        bucketOverflows.push_back(n);
+        maxChecks.push_back(CellId(n));
+    }
+    bucketOverflows.push_back(0);
+    maxChecks.push_back(cellCount);
+
+
+
+    // The lists of slice lengths to consider for findSimilarPairs7:
+    // each slice length, and each pair of slice lengths.
+    // These are stored as indexes into sliceLengths, in increasing order.
+    vector< vector<size_t> > sliceLengthLists;
+    for(size_t i=0; i<sliceLengths.size(); i++) {
+        sliceLengthLists.push_back(vector<size_t>(1, i));
+    }
+    for(size_t i=0; i<sliceLengths.size(); i++) {
+        for(size_t j=i+1; j<sliceLengths.size(); j++) {
+            sliceLengthLists.push_back(vector<size_t>({i, j}));
+        }
+    }
+
+
+
+    // Create the configurations to be evaluated.
+    vector<LshConfiguration> configurations;
+    vector<LshTuningGroup> groups;
+    for(size_t lshCountIndex=0; lshCountIndex<lshCounts.size(); lshCountIndex++) {
+        const size_t lshCount = lshCounts[lshCountIndex];
+
+        // findSimilarPairs5 with each slice length.
+        for(size_t i=0; i<sliceLengths.size(); i++) {
+            if(sliceLengths[i] > maxSliceLength5 || sliceLengths[i] > lshCount) {
+                continue;
+            }
+            LshTuningGroup group;
+            group.lshCountIndex = lshCountIndex;
+            group.sliceLengthIndexes.push_back(i);
+            for(const size_t bucketOverflow: bucketOverflows) {
+                LshConfiguration configuration;
+                configuration.algorithm = "findSimilarPairs5";
+                configuration.lshCount = lshCount;
+                configuration.lshSliceLengths.push_back(int(sliceLengths[i]));
+                configuration.bucketOverflow = bucketOverflow;
+                group.configurationIds.push_back(configurations.size());
+                configurations.push_back(configuration);
+            }
+            groups.push_back(group);
+        }
+
+        // findSimilarPairs7 with one or two slice lengths.
+        for(const vector<size_t>& sliceLengthIndexes: sliceLengthLists) {
+            if(sliceLengths[sliceLengthIndexes.front()] > lshCount) {
+                continue;
+            }
+            LshTuningGroup group;
+            group.isFindSimilarPairs7 = true;
+            group.lshCountIndex = lshCountIndex;
+            group.sliceLengthIndexes = sliceLengthIndexes;
+            for(const CellId maxCheck: maxChecks) {
+                LshConfiguration configuration;
+                configuration.algorithm = "findSimilarPairs7";
+                configuration.lshCount = lshCount;
+                for(const size_t i: sliceLengthIndexes) {
+                    configuration.lshSliceLengths.push_back(int(sliceLengths[i]));
+                }
+                configuration.maxCheck = maxCheck;
+                configuration.log2BucketCount =
+                    std::min(sliceLengths[sliceLengthIndexes.front()] + 1, maxLog2BucketCount);
+                group.configurationIds.push_back(configurations.size());
+                configurations.push_back(configuration);
+            }
+            groups.push_back(group);
+        }
+    }
+    cout << "Evaluating " << configurations.size() << " LSH configurations." << endl;
+
+
+
+    // For each slice length, the matching slices of two cells are stored
+    // as a bit mask, with one bit for each slice, least significant bit first.
+    // The masks for all slice lengths are stored contiguously.
+    vector<size_t> sliceCounts(sliceLengths.size());
+    vector<size_t> maskWordOffsets(sliceLengths.size());
+    vector<size_t> sliceOffsets(sliceLengths.size());
+    size_t maskWordCount = 0;
+    size_t totalSliceCount = 0;
+    for(size_t i=0; i<sliceLengths.size(); i++) {
+        sliceCounts[i] = lshBitCount / sliceLengths[i];
+        maskWordOffsets[i] = maskWordCount;
+        sliceOffsets[i] = totalSliceCount;
+        maskWordCount += (sliceCounts[i] + 63) / 64;
+        totalSliceCount += sliceCounts[i];
+    }
+
+    // Compute the masks of the slices where two signatures are identical.
+    // If occupancy is not zero, increment it for each identical slice.
+    const auto computeMasks = [&](const uint64_t* signatureXor, uint64_t* masks, uint32_t* occupancy)
+        {
+            std::fill(masks, masks + maskWordCount, 0ULL);
+            for(size_t i=0; i<sliceLengths.size(); i++) {
+                const size_t sliceLength = sliceLengths[i];
+                uint64_t* mask = masks + maskWordOffsets[i];
+                for(size_t sliceId=0; sliceId<sliceCounts[i]; sliceId++) {
+                    if(isZeroBitRange(signatureXor, sliceId*sliceLength, sliceLength)) {
+                        mask[sliceId >> 6] |= (1ULL << (sliceId & 63));
+                        if(occupancy) {
+                            ++occupancy[sliceOffsets[i] + sliceId];
+                        }
+                    }
+                }
+            }
+        };
+    const auto computeSignatureXor = [&](CellId cellId0, CellId cellId1, uint64_t* signatureXor)
+        {
+            const BitSetPointer signature0 = lsh.getSignature(cellId0);
+            const BitSetPointer signature1 = lsh.getSignature(cellId1);
+            for(size_t word=0; word<signatureWordCount; word++) {
+                signatureXor[word] = signature0.begin[word] ^ signature1.begin[word];
+            }
+        };
+
+    // For findSimilarPairs7, the order in which a cell is visited
+    // is given by the first slice length and slice where it matches,
+    // then by cell id. Return false if it is not visited.
+    const auto computeVisitKey = [&](
+        const LshTuningGroup& group, const uint64_t* masks, CellId cellId, uint64_t& key)
+        {
+            const size_t lshCount = lshCounts[group.lshCountIndex];
+            for(size_t position=0; position<group.sliceLengthIndexes.size(); position++) {
+                const size_t i = group.sliceLengthIndexes[position];
+                const size_t sliceCount = lshCount / sliceLengths[i];
+                const size_t sliceId = findFirstSetBit(masks + maskWordOffsets[i], sliceCount);
+                if(sliceId < sliceCount) {
+                    key = (uint64_t(position) << 56) | (uint64_t(sliceId) << 32) | uint64_t(cellId);
+                    return true;
+                }
+            }
+            return false;
+        };
+
+
+
+    // Get what we need to compute exact similarities in parallel.
+    GeneSet::CellSimilarityData cellSimilarityData;
+    prepareCellSimilarity(geneSet, SimilarityMetric::Pearson, cellSimilarityData);
+
+    // LSH similarity as a function of the number of mismatching bits, for each lshCount.
+    vector< vector<double> > similarityTables(lshCounts.size());
+    for(size_t lshCountIndex=0; lshCountIndex<lshCounts.size(); lshCountIndex++) {
+        const size_t lshCount = lshCounts[lshCountIndex];
+        vector<double>& similarityTable = similarityTables[lshCountIndex];
+        similarityTable.resize(lshCount + 1);
+        for(size_t mismatchingBitCount=0; mismatchingBitCount<=lshCount; mismatchingBitCount++) {
+            similarityTable[mismatchingBitCount] = std::cos(double(mismatchingBitCount) *
+                boost::math::double_constants::pi / double(lshCount));
+        }
+    }
+
+    // Choose the query cells and the reference cells.
+    const CounterBasedRandom random(seed);
+    vector<CellId> shuffledCells(cellCount);
+    std::iota(shuffledCells.begin(), shuffledCells.end(), CellId(0));
+    parallelShuffle(shuffledCells, random.split(1));
+    const vector<CellId> queryCells(shuffledCells.begin(),
+        shuffledCells.begin() + std::min(size_t(cellCount), queryCellCount));
+    if(referenceCellCount == 0 || referenceCellCount > cellCount) {
+        referenceCellCount = cellCount;
+    }
+    parallelShuffle(shuffledCells, random.split(2));
+    const vector<CellId> referenceCells(shuffledCells.begin(), shuffledCells.begin() + referenceCellCount);
+    if(exactCheckCount == 0 || exactCheckCount > cellCount - 1) {
+        exactCheckCount = cellCount - 1;
+    }
+    const bool recallIsOverestimated = exactCheckCount < cellCount - 1;
+    if(recallIsOverestimated) {
+        cout << "The exact neighbors are only searched among the " << exactCheckCount <<
+            " cells with the best LSH similarity, so recall will be overestimated." << endl;
+    }
+
+
+
+    // Process the query cells in parallel.
+    vector<LshTuningQueryResult> queryResults(queryCells.size());
+    parallelForChunks(0, queryCells.size(), [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            vector<uint64_t> signatureXor(signatureWordCount);
+            vector< pair<uint64_t, CellId> > lshNeighbors;
+            vector< pair<double, CellId> > exactNeighbors;
+            vector<CellId> exactNeighborCells;
+            vector< pair<uint32_t, uint32_t> > checkedMismatchCounts;
+            vector< vector<uint32_t> > checkedOrders(lshCounts.size());
+            vector<double> checkedPositions(exactCheckCount);
+            vector<uint64_t> checkedMasks;
+            vector<CellId> otherReferenceCells;
+            vector<uint64_t> referenceMasks;
+            vector<uint32_t> occupancy;
+            vector<uint64_t> allowedSlices(maskWordCount);
+            vector<uint64_t> referenceKeys;
+
+            for(size_t queryIndex=chunkBegin; queryIndex!=chunkEnd; queryIndex++) {
+                const CellId queryCell = queryCells[queryIndex];
+                LshTuningQueryResult& result = queryResults[queryIndex];
+                result.foundNeighborCounts.assign(configurations.size(), 0);
+                result.candidateCounts.assign(configurations.size(), 0.);
+
+                // Find the cells with the best LSH similarity using all bits.
+                // The exact neighbors are searched among those.
+                const BitSetPointer querySignature = lsh.getSignature(queryCell);
+                lshNeighbors.clear();
+                for(CellId cellId=0; cellId<cellCount; cellId++) {
+                    if(cellId != queryCell) {
+                        lshNeighbors.push_back(make_pair(
+                            countMismatches(querySignature, lsh.getSignature(cellId)), cellId));
+                    }
+                }
+                std::nth_element(lshNeighbors.begin(), lshNeighbors.begin() + (exactCheckCount - 1), lshNeighbors.end());
+                lshNeighbors.resize(exactCheckCount);
+
+                // Find the exact neighbors.
+                exactNeighbors.clear();
+                for(const auto& p: lshNeighbors) {
+                    const double similarity = computeCellSimilarity(geneSet, cellSet[queryCell], cellSet[p.second],
+                        SimilarityMetric::Pearson, cellSimilarityData);
+                    if(std::isfinite(similarity) && similarity > similarityThreshold) {
+                        exactNeighbors.push_back(make_pair(-similarity, p.second));
+                    }
+                }
+                keepBest(exactNeighbors, k, std::less< pair<double, CellId> >());
+                exactNeighborCells.clear();
+                for(const auto& p: exactNeighbors) {
+                    exactNeighborCells.push_back(p.second);
+                }
+                std::sort(exactNeighborCells.begin(), exactNeighborCells.end());
+                result.neighborCount = exactNeighborCells.size();
+
+                // For each lshCount, the checked cells with LSH similarity above the
+                // similarity threshold, in order of increasing mismatch count, then cell id.
+                // Also compute the matching slices of the checked cells.
+                checkedMasks.resize(exactCheckCount * maskWordCount);
+                for(size_t lshCountIndex=0; lshCountIndex<lshCounts.size(); lshCountIndex++) {
+                    const vector<double>& similarityTable = similarityTables[lshCountIndex];
+                    checkedMismatchCounts.clear();
+                    for(size_t j=0; j<exactCheckCount; j++) {
+                        const uint32_t mismatchCount = uint32_t(countMismatches(
+                            querySignature, lsh.getSignature(lshNeighbors[j].second), lshCounts[lshCountIndex]));
+                        if(similarityTable[mismatchCount] > similarityThreshold) {
+                            checkedMismatchCounts.push_back(make_pair(mismatchCount, uint32_t(j)));
+                        }
+                    }
+                    std::sort(checkedMismatchCounts.begin(), checkedMismatchCounts.end(),
+                        [&](const pair<uint32_t, uint32_t>& x, const pair<uint32_t, uint32_t>& y)
+                        {
+                            return make_pair(x.first, lshNeighbors[x.second].second) <
+                                make_pair(y.first, lshNeighbors[y.second].second);
+                        });
+                    vector<uint32_t>& checkedOrder = checkedOrders[lshCountIndex];
+                    checkedOrder.clear();
+                    for(const auto& p: checkedMismatchCounts) {
+                        checkedOrder.push_back(p.second);
+                    }
+                }
+                for(size_t j=0; j<exactCheckCount; j++) {
+                    computeSignatureXor(queryCell, lshNeighbors[j].second, signatureXor.data());
+                    computeMasks(signatureXor.data(), checkedMasks.data() + j*maskWordCount, 0);
+                }
+
+                // Matching slices of the reference cells, and the number of
+                // reference cells in each bucket of the query cell.
+                otherReferenceCells.clear();
+                for(const CellId cellId: referenceCells) {
+                    if(cellId != queryCell) {
+                        otherReferenceCells.push_back(cellId);
+                    }
+                }
+                const double scale = double(cellCount - 1) / double(otherReferenceCells.size());
+                referenceMasks.resize(otherReferenceCells.size() * maskWordCount);
+                occupancy.assign(totalSliceCount, 0);
+                for(size_t i=0; i<otherReferenceCells.size(); i++) {
+                    computeSignatureXor(queryCell, otherReferenceCells[i], signatureXor.data());
+                    computeMasks(signatureXor.data(), referenceMasks.data() + i*maskWordCount, occupancy.data());
+                }
+
+                // Evaluate each group of configurations.
+                for(const LshTuningGroup& group: groups) {
+                    const size_t lshCountIndex = group.lshCountIndex;
+                    const size_t lshCount = lshCounts[lshCountIndex];
+                    const vector<uint32_t>& checkedOrder = checkedOrders[lshCountIndex];
+
+                    if(!group.isFindSimilarPairs7) {
+
+                        // findSimilarPairs5. A cell is a candidate if it matches in at least one slice
+                        // whose bucket is not larger than bucketOverflow.
+                        // The bucket also contains the query cell.
+                        const size_t i = group.sliceLengthIndexes.front();
+                        const size_t sliceCount = lshCount / sliceLengths[i];
+                        const size_t wordCount = (sliceCounts[i] + 63) / 64;
+                        const size_t maskWordOffset = maskWordOffsets[i];
+                        for(const size_t configurationId: group.configurationIds) {
+                            const size_t bucketOverflow = configurations[configurationId].bucketOverflow;
+                            std::fill(allowedSlices.begin(), allowedSlices.end(), 0ULL);
+                            for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
+                                const double bucketSize = 1. + scale * double(occupancy[sliceOffsets[i] + sliceId]);
+                                if(bucketOverflow == 0 || bucketSize <= double(bucketOverflow)) {
+                                    allowedSlices[sliceId >> 6] |= (1ULL << (sliceId & 63));
+                                }
+                            }
+
+                            size_t candidateCount = 0;
+                            for(size_t j=0; j<otherReferenceCells.size(); j++) {
+                                if(intersects(referenceMasks.data() + j*maskWordCount + maskWordOffset,
+                                    allowedSlices.data(), wordCount)) {
+                                    ++candidateCount;
+                                }
+                            }
+                            result.candidateCounts[configurationId] = scale * double(candidateCount);
+
+                            result.foundNeighborCounts[configurationId] = countFoundNeighbors(
+                                checkedOrder, k, lshNeighbors, exactNeighborCells,
+                                [&](uint32_t j)
+                                {
+                                    return intersects(checkedMasks.data() + j*maskWordCount + maskWordOffset,
+                                        allowedSlices.data(), wordCount);
+                                });
+                        }
+
+                    } else {
+
+                        // findSimilarPairs7. Cells are visited in order of their visit key,
+                        // and a cell is a candidate if fewer than maxCheck cells are visited before it.
+                        referenceKeys.clear();
+                        uint64_t key = 0;
+                        for(size_t j=0; j<otherReferenceCells.size(); j++) {
+                            if(computeVisitKey(group, referenceMasks.data() + j*maskWordCount, otherReferenceCells[j], key)) {
+                                referenceKeys.push_back(key);
+                            }
+                        }
+                        std::sort(referenceKeys.begin(), referenceKeys.end());
+                        const double visitedCount = scale * double(referenceKeys.size());
+
+                        // The estimated number of cells visited before each checked cell.
+                        for(const uint32_t j: checkedOrder) {
+                            if(computeVisitKey(group, checkedMasks.data() + j*maskWordCount, lshNeighbors[j].second, key)) {
+                                checkedPositions[j] = scale * double(
+                                    std::lower_bound(referenceKeys.begin(), referenceKeys.end(), key) - referenceKeys.begin());
+                            } else {
+                                checkedPositions[j] = std::numeric_limits<double>::infinity();
+                            }
+                        }
+
+                        for(const size_t configurationId: group.configurationIds) {
+                            const double maxCheck = double(configurations[configurationId].maxCheck);
+                            result.candidateCounts[configurationId] = std::min(maxCheck, visitedCount);
+                            result.foundNeighborCounts[configurationId] = countFoundNeighbors(
+                                checkedOrder, k, lshNeighbors, exactNeighborCells,
+                                [&](uint32_t j)
+                                {
+                                    return checkedPositions[j] < maxCheck;
+                                });
+                        }
+                    }
+                }
+            }
+        }, 1);
+    const auto t1 = std::chrono::steady_clock::now();
+
+
+
+    // Combine the results for all query cells.
+    size_t neighborCount = 0;
+    for(const LshTuningQueryResult& result: queryResults) {
+        neighborCount += result.neighborCount;
+    }
+    if(neighborCount == 0) {
+        throw runtime_error("No pairs with similarity above the similarity threshold were found "
+            "for the sampled cells.");
+    }
+    for(size_t configurationId=0; configurationId<configurations.size(); configurationId++) {
+        LshConfiguration& configuration = configurations[configurationId];
+        size_t foundNeighborCount = 0;
+        double candidateCount = 0.;
+        for(const LshTuningQueryResult& result: queryResults) {
+            foundNeighborCount += result.foundNeighborCounts[configurationId];
+            candidateCount += result.candidateCounts[configurationId];
+        }
+        configuration.recall = double(foundNeighborCount) / double(neighborCount);
+        computeWilsonScoreInterval(foundNeighborCount, neighborCount,
+            configuration.recallLow, configuration.recallHigh);
+        configuration.candidateCount = candidateCount / double(queryCells.size());
+        double bucketLookupCount = 0.;
+        for(const int sliceLength: configuration.lshSliceLengths) {
+            bucketLookupCount += double(configuration.lshCount / size_t(sliceLength));
+        }
+        configuration.cost =
+            configuration.candidateCount * double((configuration.lshCount + 63) / 64) +
+            bucketLookupCount;
+    }
+
+    // Sort by cost and choose the best configuration.
+    LshTuning tuning;
+    tuning.k = k;
+    tuning.targetRecall = targetRecall;
+    tuning.recallIsOverestimated = recallIsOverestimated;
+    std::stable_sort(configurations.begin(), configurations.end(),
+        [](const LshConfiguration& x, const LshConfiguration& y) { return x.cost < y.cost; });
+    tuning.best = configurations.front();
+    for(const LshConfiguration& configuration: configurations) {
+        if(configuration.recall >= targetRecall) {
+            tuning.best = configuration;
+            tuning.targetRecallAchieved = true;
+            break;
+        }
+        if(configuration.recall > tuning.best.recall) {
+            tuning.best = configuration;
+        }
+    }
+    tuning.configurations.swap(configurations);
+
+    // Write a summary.
+    const LshConfiguration& best = tuning.best;
+    if(tuning.targetRecallAchieved) {
+        cout << "Cheapest configuration with recall at least " << targetRecall << ":" << endl;
+    } else {
+        cout << "No configuration has recall at least " << targetRecall <<
+            ". Configuration with the highest recall:" << endl;
+    }
+    cout << best.algorithm << " with lshCount " << best.lshCount << ", slice lengths";
+    for(const int sliceLength: best.lshSliceLengths) {
+        cout << " " << sliceLength;
+    }
+    if(best.algorithm == "findSimilarPairs5") {
+        cout << ", bucketOverflow " << best.bucketOverflow;
+    } else {
+        cout << ", maxCheck " << best.maxCheck << ", log2BucketCount " << best.log2BucketCount;
+    }
+    cout << endl;
+    cout << "Predicted recall " << best.recall << " [" << best.recallLow << ", " << best.recallHigh <<
+        "]" << (recallIsOverestimated ? " (overestimated)" : "") <<
+        ", candidates per cell " << best.candidateCount << ", cost " << best.cost << endl;
+
+    const auto t2 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    const double t02 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t0)).count());
+    cout << "Evaluation of " << queryCells.size() << " query cells took " << t01 << " s." << endl;
+    cout << timestamp << "ExpressionMatrix::tuneLsh ends. Took " << t02 << " s." << endl;
+    return tuning;
+}
@@ -0,0 +1,219 @@
+// This file contains the implementation of
+// ExpressionMatrix::mergeExpressionMatrices.
+
+#include "ExpressionMatrix.hpp"
+#include "TaskScheduler.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <chrono>
+#include <numeric>
+
+
+
+// Create a new expression matrix in the specified directory,
+// containing all the cells of the expression matrices in the input directories.
+void ExpressionMatrix::mergeExpressionMatrices(
+    const string& outputDirectoryName,
+    const vector<string>& inputDirectoryNames,
+    const string& metaDataTag)
+{
+    cout << timestamp << "ExpressionMatrix::mergeExpressionMatrices begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+    if(inputDirectoryNames.empty()) {
+        throw runtime_error("No input expression matrices specified for merge.");
+    }
+
+    // Access the input expression matrices read-only.
+    // This way we never write to the input directories,
+    // not even a checkpoint when the inputs are destroyed.
+    const size_t inputCount = inputDirectoryNames.size();
+    vector< shared_ptr<ExpressionMatrix> > inputs;
+    for(const string& inputDirectoryName: inputDirectoryNames) {
+        inputs.push_back(make_shared<ExpressionMatrix>(inputDirectoryName, false, false));
+    }
+
+    // The first global CellId of the cells of each input in the merged expression matrix.
+    vector<CellId> cellIdOffsets(inputCount + 1, 0);
+    for(size_t i=0; i<inputCount; i++) {
+        const uint64_t cellCount = uint64_t(cellIdOffsets[i]) + inputs[i]->cellCount();
+        if(cellCount >= uint64_t(invalidCellId)) {
+            throw runtime_error("Too many cells in merged expression matrix.");
+        }
+        cellIdOffsets[i+1] = CellId(cellCount);
+    }
+    const CellId outputCellCount = cellIdOffsets.back();
+
+    // Choose string table capacities sufficient to hold the union of all the inputs.
+    // Each capacity is at least the largest capacity used by the inputs,
+    // and at least twice the total number of strings, as required by the StringTable.
+    // The order of the tables is the order of the ExpressionMatrixCreationParameters.
+    vector<uint64_t> capacities(6, 0);
+    vector<uint64_t> totalSizes(6, 0);
+    const auto accumulate = [&capacities, &totalSizes](size_t k, size_t capacity, size_t size)
+    {
+        capacities[k] = std::max(capacities[k], uint64_t(capacity));
+        totalSizes[k] += size;
+    };
+    for(const auto& input: inputs) {
+        accumulate(0, input->geneNames.capacity(), input->geneNames.size());
+        accumulate(1, input->cellNames.capacity(), input->cellNames.size());
+        accumulate(2, input->cellMetaDataNames.capacity(), input->cellMetaDataNames.size());
+        accumulate(3, input->cellMetaDataValues.capacity(), input->cellMetaDataValues.size() + inputCount);
+        accumulate(4, input->geneMetaDataNames.capacity(), input->geneMetaDataNames.size());
+        accumulate(5, input->geneMetaDataValues.capacity(), input->geneMetaDataValues.size());
+    }
+    for(size_t k=0; k<6; k++) {
+        capacities[k] = std::max(capacities[k], 2 * totalSizes[k] + 2);
+    }
+    const ExpressionMatrixCreationParameters parameters(
+        capacities[0], capacities[1], capacities[2],
+        capacities[3], capacities[4], capacities[5]);
+    ExpressionMatrix output(outputDirectoryName, parameters);
+
+
+
+    // Merge the genes and their meta data, and create a table
+    // to map the GeneIds of each input to GeneIds in the output.
+    // If the same gene meta data name appears in more than one input,
+    // the value from the last input prevails.
+    cout << timestamp << "Merging genes." << endl;
+    vector< vector<GeneId> > geneIdMap(inputCount);
+    for(size_t i=0; i<inputCount; i++) {
+        const ExpressionMatrix& input = *inputs[i];
+        geneIdMap[i].resize(input.geneCount());
+        for(GeneId geneId=0; geneId!=input.geneCount(); geneId++) {
+            const string geneName = input.geneNames[geneId];
+            output.addGene(geneName);
+            const GeneId outputGeneId = output.geneIdFromName(geneName);
+            geneIdMap[i][geneId] = outputGeneId;
+            for(const auto& p: input.geneMetaData[geneId]) {
+                output.setGeneMetaData(outputGeneId,
+                    input.geneMetaDataNames[p.first], input.geneMetaDataValues[p.second]);
+            }
+        }
+    }
+    cout << "The merged expression matrix has " << output.geneCount() << " genes." << endl;
+
+
+
+    // Merge the cell names and meta data.
+    // The string tables and lists of meta data must be updated sequentially.
+    // To keep this fast, each distinct name and value of each input
+    // is looked up in the output only once.
+    cout << timestamp << "Merging cell names and meta data for " << outputCellCount << " cells." << endl;
+    // If an input already has a meta data field named metaDataTag,
+    // it is replaced by the tag.
+    // Names must be entered in the output when first used,
+    // to keep the name usage counts consistent.
+    StringId tagNameId = output.cellMetaDataNames.invalidStringId;
+    for(size_t i=0; i<inputCount; i++) {
+        const ExpressionMatrix& input = *inputs[i];
+        const StringId tagValueId = metaDataTag.empty() ?
+            output.cellMetaDataValues.invalidStringId : output.cellMetaDataValues[inputDirectoryNames[i]];
+        const StringId inputTagNameId = metaDataTag.empty() ?
+            input.cellMetaDataNames.invalidStringId : input.cellMetaDataNames(metaDataTag);
+        vector<StringId> nameIdMap(input.cellMetaDataNames.size(), input.cellMetaDataNames.invalidStringId);
+        vector<StringId> valueIdMap(input.cellMetaDataValues.size(), input.cellMetaDataValues.invalidStringId);
+        for(CellId cellId=0; cellId!=input.cellCount(); cellId++) {
+            const string cellName = input.cellNames[cellId];
+            if(output.cellNames(cellName) != output.cellNames.invalidStringId) {
+                throw runtime_error("Cell name " + cellName + " in " + inputDirectoryNames[i] +
+                    " is also present in a previous input.");
+            }
+            const StringId outputCellId = output.cellNames[cellName];
+            CZI_ASSERT(outputCellId == cellIdOffsets[i] + cellId);
+
+            output.cellMetaData.push_back();
+            for(const auto& p: input.cellMetaData[cellId]) {
+                if(p.first == inputTagNameId) {
+                    continue;
+                }
+                StringId& nameId = nameIdMap[p.first];
+                if(nameId == input.cellMetaDataNames.invalidStringId) {
+                    nameId = output.cellMetaDataNames[input.cellMetaDataNames[p.first]];
+                }
+                StringId& valueId = valueIdMap[p.second];
+                if(valueId == input.cellMetaDataValues.invalidStringId) {
+                    valueId = output.cellMetaDataValues[input.cellMetaDataValues[p.second]];
+                }
+                output.cellMetaData.push_back(make_pair(nameId, valueId));
+                output.incrementCellMetaDataNameUsageCount(nameId);
+            }
+            if(!metaDataTag.empty()) {
+                if(tagNameId == output.cellMetaDataNames.invalidStringId) {
+                    tagNameId = output.cellMetaDataNames[metaDataTag];
+                }
+                output.cellMetaData.push_back(make_pair(tagNameId, tagValueId));
+                output.incrementCellMetaDataNameUsageCount(tagNameId);
+            }
+        }
+    }
+
+
+
+    // Merge the expression counts in two passes, in parallel.
+    // In pass 1 we count the expression counts of each cell.
+    // In pass 2 we store them, with gene ids mapped to the output
+    // and sorted again by GeneId. The Cell sums don't change and are just copied.
+    // Each cell is processed by a single thread, so no synchronization is needed.
+    cout << timestamp << "Merging expression counts using " <<
+        getEffectiveThreadCount() << " threads." << endl;
+    const auto inputIndex = [&cellIdOffsets](CellId outputCellId)
+    {
+        return size_t(std::upper_bound(cellIdOffsets.begin(), cellIdOffsets.end(), outputCellId) -
+            cellIdOffsets.begin()) - 1;
+    };
+    auto& outputCellExpressionCounts = output.cellExpressionCounts;
+    outputCellExpressionCounts.beginPass1(outputCellCount);
+    parallelFor(0, outputCellCount, [&](size_t outputCellId)
+        {
+            const size_t i = inputIndex(CellId(outputCellId));
+            const CellId cellId = CellId(outputCellId - cellIdOffsets[i]);
+            outputCellExpressionCounts.incrementCount(outputCellId, inputs[i]->cellExpressionCounts.size(cellId));
+        });
+    outputCellExpressionCounts.beginPass2();
+    output.cells.resize(outputCellCount);
+    parallelForChunks(0, outputCellCount, [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            vector< pair<GeneId, float> > counts;
+            for(size_t outputCellId=chunkBegin; outputCellId!=chunkEnd; outputCellId++) {
+                const size_t i = inputIndex(CellId(outputCellId));
+                const ExpressionMatrix& input = *inputs[i];
+                const CellId cellId = CellId(outputCellId - cellIdOffsets[i]);
+                const vector<GeneId>& inputGeneIdMap = geneIdMap[i];
+
+                counts.clear();
+                for(const auto& p: input.cellExpressionCounts[cellId]) {
+                    counts.push_back(make_pair(inputGeneIdMap[p.first], p.second));
+                }
+                sort(counts.begin(), counts.end());
+
+                // Store fills each vector starting at the end,
+                // so we loop backward to preserve the order.
+                for(auto it=counts.rbegin(); it!=counts.rend(); ++it) {
+                    outputCellExpressionCounts.store(outputCellId, *it);
+                }
+                output.cells[outputCellId] = input.cells[cellId];
+            }
+        });
+    outputCellExpressionCounts.endPass2();
+
+    // All cells go in the AllCells cell set of the new expression matrix.
+    CellSet& allCells = *output.cellSets.cellSets["AllCells"];
+    allCells.resize(outputCellCount);
+    std::iota(allCells.begin(), allCells.end(), CellId(0));
+
+    // Sanity checks.
+    CZI_ASSERT(output.cellNames.size() == outputCellCount);
+    CZI_ASSERT(output.cellMetaData.size() == outputCellCount);
+    CZI_ASSERT(output.cellExpressionCounts.size() == outputCellCount);
+    CZI_ASSERT(output.cells.size() == outputCellCount);
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "Merged " << inputCount << " expression matrices into " << outputDirectoryName <<
+        " with " << output.geneCount() << " genes, " << outputCellCount << " cells, and " <<
+        outputCellExpressionCounts.totalSize() << " expression counts in " << t01 << " s." << endl;
+}
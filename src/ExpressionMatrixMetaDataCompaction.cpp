@@ -0,0 +1,148 @@
+// This file contains portions of the implementation of class ExpressionMatrix
+// that measure and reduce the fragmentation of cell and gene meta data.
+
+#include "ExpressionMatrix.hpp"
+#include "ExpressionMatrixTest.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "stdexcept.hpp"
+
+
+
+double ExpressionMatrix::getCellMetaDataFragmentation() const
+{
+    return cellMetaData.fragmentation();
+}
+
+
+
+double ExpressionMatrix::getGeneMetaDataFragmentation() const
+{
+    return geneMetaData.fragmentation();
+}
+
+
+
+void ExpressionMatrix::compactMetaData()
+{
+    compactMetaDataIfFragmented(0.);
+}
+
+
+
+// With a zero threshold, this compacts any meta data that are not
+// already compacted.
+bool ExpressionMatrix::compactMetaDataIfFragmented(double threshold)
+{
+    if(!cells.isOpenWithWriteAccess) {
+        throw runtime_error("Cannot compact meta data of an expression matrix accessed read-only.");
+    }
+
+    bool compacted = false;
+
+    const double cellMetaDataFragmentation = cellMetaData.fragmentation();
+    if(cellMetaDataFragmentation > threshold) {
+        cout << timestamp << "Compacting cell meta data, fragmentation " << cellMetaDataFragmentation << endl;
+        cellMetaData.compact();
+        compacted = true;
+    }
+
+    const double geneMetaDataFragmentation = geneMetaData.fragmentation();
+    if(geneMetaDataFragmentation > threshold) {
+        cout << timestamp << "Compacting gene meta data, fragmentation " << geneMetaDataFragmentation << endl;
+        geneMetaData.compact();
+        compacted = true;
+    }
+
+    if(compacted) {
+        cout << timestamp << "Meta data compaction completed." << endl;
+    }
+    return compacted;
+}
+
+
+
+// Fragment the cell and gene meta data by repeatedly setting
+// and removing meta data, then check that compaction
+// removes the fragmentation without changing the meta data.
+void ChanZuckerberg::ExpressionMatrix2::testExpressionMatrixMetaDataCompaction()
+{
+    ExpressionMatrixTest test("testExpressionMatrixMetaDataCompaction");
+    const CellId cellCount = 500;
+    const GeneId geneCount = 50;
+
+    // Gather the meta data of all cells, and the value of gene meta data
+    // field Kind for all genes.
+    using MetaData = pair< vector< vector< pair<string, string> > >, vector<string> >;
+    const auto getMetaData = [](const ExpressionMatrix& expressionMatrix)
+    {
+        MetaData metaData;
+        for(CellId cellId=0; cellId!=expressionMatrix.cellCount(); cellId++) {
+            metaData.first.push_back(expressionMatrix.getCellMetaData(cellId));
+        }
+        for(GeneId geneId=0; geneId!=expressionMatrix.geneCount(); geneId++) {
+            metaData.second.push_back(expressionMatrix.getGeneMetaData(geneId, "Kind"));
+        }
+        return metaData;
+    };
+
+    MetaData metaData;
+    {
+        const unique_ptr<ExpressionMatrix> expressionMatrix =
+            test.createExpressionMatrix("ExpressionMatrix", cellCount, geneCount);
+        CZI_ASSERT(expressionMatrix->getCellMetaDataFragmentation() == 0.);
+
+        // Set meta data fields in rounds, removing the fields
+        // set in the previous round every other round.
+        for(int round=0; round!=4; round++) {
+            const string name = "Field" + lexical_cast<string>(round);
+            for(CellId cellId=0; cellId!=cellCount; cellId++) {
+                expressionMatrix->setCellMetaData(cellId, name, lexical_cast<string>(cellId % (round + 2)));
+            }
+            for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+                expressionMatrix->setGeneMetaData(test.geneName(geneId), "Kind",
+                    "Kind" + lexical_cast<string>(round + geneId % 3));
+            }
+            if(round % 2 == 1) {
+                expressionMatrix->removeCellMetaData("AllCells", "Field" + lexical_cast<string>(round - 1));
+            }
+        }
+        CZI_ASSERT(expressionMatrix->getCellMetaDataFragmentation() > 0.);
+        CZI_ASSERT(expressionMatrix->getGeneMetaDataFragmentation() > 0.);
+        metaData = getMetaData(*expressionMatrix);
+
+        // Compact.
+        CZI_ASSERT(!expressionMatrix->compactMetaDataIfFragmented(1.));
+        expressionMatrix->compactMetaData();
+        CZI_ASSERT(expressionMatrix->getCellMetaDataFragmentation() == 0.);
+        CZI_ASSERT(expressionMatrix->getGeneMetaDataFragmentation() == 0.);
+        CZI_ASSERT(getMetaData(*expressionMatrix) == metaData);
+        CZI_ASSERT(!expressionMatrix->compactMetaDataIfFragmented(0.));
+        test.checkCells(*expressionMatrix, cellCount, geneCount);
+
+        // Meta data can still be changed after compaction.
+        expressionMatrix->setCellMetaData(0, "Field3", "Changed");
+        expressionMatrix->setGeneMetaData(test.geneName(0), "Kind", "Changed");
+        for(auto& p: metaData.first.front()) {
+            if(p.first == "Field3") {
+                p.second = "Changed";
+            }
+        }
+        metaData.second.front() = "Changed";
+        CZI_ASSERT(getMetaData(*expressionMatrix) == metaData);
+        expressionMatrix->compactMetaData();
+        CZI_ASSERT(getMetaData(*expressionMatrix) == metaData);
+    }
+
+    // Compaction was persisted.
+    {
+        ExpressionMatrix expressionMatrix(test.path("ExpressionMatrix"), false);
+        CZI_ASSERT(expressionMatrix.getCellMetaDataFragmentation() == 0.);
+        CZI_ASSERT(expressionMatrix.getGeneMetaDataFragmentation() == 0.);
+        CZI_ASSERT(getMetaData(expressionMatrix) == metaData);
+    }
+
+    test.success();
+}
@@ -0,0 +1,50 @@
+// This file contains portions of the implementation of class ExpressionMatrix
+// that deal with placement of large data structures on NUMA nodes.
+// See numa.hpp for more information.
+
+#include "ExpressionMatrix.hpp"
+#include "Lsh.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+
+
+void ExpressionMatrix::setNumaPolicy(const string& containerName, const string& policyName)
+{
+    const numa::Policy policy = numa::policyFromString(policyName);
+
+    // Apply the policy to the container, if it exists.
+    vector<size_t> pageCountPerNode;
+    if(containerName == "Cells") {
+        pageCountPerNode = cells.applyNumaPolicy(policy);
+    } else if(containerName == "CellExpressionCounts") {
+        pageCountPerNode = cellExpressionCounts.applyNumaPolicy(policy);
+    } else if(containerName.substr(0, 4) == "Lsh-") {
+        if(filesystem::exists(directoryName + "/" + containerName + "-Info")) {
+            const Lsh lsh(directoryName + "/" + containerName);
+            pageCountPerNode = lsh.applyNumaPolicy(policy);
+        }
+    } else {
+        throw runtime_error("Invalid container name " + containerName +
+            " specified for NUMA policy. Valid names are Cells, CellExpressionCounts, Lsh-<lshName>.");
+    }
+    numaPolicies[containerName] = policy;
+
+    if(numa::nodeCount() > 1 && !pageCountPerNode.empty()) {
+        cout << timestamp << "Applied NUMA policy " << policyName << " to " << containerName << "." << endl;
+        numa::writePlacement(cout, pageCountPerNode);
+    }
+}
+
+
+
+numa::Policy ExpressionMatrix::getNumaPolicy(const string& containerName) const
+{
+    const auto it = numaPolicies.find(containerName);
+    if(it == numaPolicies.end()) {
+        return numa::Policy::none;
+    } else {
+        return it->second;
+    }
+}
@@ -0,0 +1,530 @@
+// This file contains the implementation of ExpressionMatrix::runPipeline.
+// See Pipeline.hpp for more information.
+
+#include "ExpressionMatrix.hpp"
+#include "CellGraph.hpp"
+#include "ClusterGraph.hpp"
+#include "filesystem.hpp"
+#include "Pipeline.hpp"
+#include "TaskScheduler.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "boost_lexical_cast.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include "fstream.hpp"
+#include "iostream.hpp"
+#include "map.hpp"
+#include <mutex>
+#include <streambuf>
+#include <thread>
+
+
+
+// The signatures of completed pipeline stages are stored in this file
+// in the expression matrix directory, one stage per line.
+static const string completedPipelineStagesFileName = "PipelineStages";
+
+// For stages that add cells and have not completed, this file stores
+// the signature of the stage and the number of cells when it began,
+// separated by a comma.
+static const string startedPipelineStagesFileName = "PipelineStagesStarted";
+
+// Read a file containing a value for each pipeline stage, keyed by stage name.
+static map<string, string> readPipelineStagesFile(const string& fileName)
+{
+    map<string, string> stages;
+    ifstream file(fileName);
+    string line;
+    while(getline(file, line)) {
+        const size_t separator = line.rfind(' ');
+        if(separator != string::npos) {
+            stages[line.substr(0, separator)] = line.substr(separator + 1);
+        }
+    }
+    return stages;
+}
+
+// Write a file containing a value for each pipeline stage.
+// The file is written under a temporary name and then renamed,
+// so an interruption never leaves it partially written.
+static void writePipelineStagesFile(
+    const string& fileName,
+    const map<string, string>& stages)
+{
+    const string temporaryFileName = fileName + ".tmp";
+    {
+        ofstream file(temporaryFileName);
+        for(const auto& p: stages) {
+            file << p.first << " " << p.second << "\n";
+        }
+        if(!file) {
+            throw runtime_error("Error writing " + temporaryFileName);
+        }
+    }
+    if(std::rename(temporaryFileName.c_str(), fileName.c_str()) != 0) {
+        throw runtime_error("Error renaming " + temporaryFileName + " to " + fileName);
+    }
+}
+
+
+
+// Return true if a pipeline stage adds cells.
+// These stages cannot remove the output of a previous interrupted run,
+// so instead they resume after the cells it added.
+static bool pipelineStageAddsCells(const PipelineStage& stage)
+{
+    return stage.function.compare(0, 8, "addCells") == 0;
+}
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace {
+
+            // A stream buffer that collects the output of each thread
+            // and writes it one complete line at a time,
+            // prefixed by the name of the pipeline stage running on that thread.
+            // It replaces the buffer of cout while stages run concurrently,
+            // so their output does not interleave.
+            class PipelineOutputBuffer : public std::streambuf {
+            public:
+                explicit PipelineOutputBuffer(std::streambuf* output) : output(output) {}
+
+                // Write any incomplete lines.
+                ~PipelineOutputBuffer()
+                {
+                    for(const auto& p: threadOutputs) {
+                        const ThreadOutput& threadOutput = p.second;
+                        if(!threadOutput.line.empty()) {
+                            writeLine(threadOutput);
+                            output->sputc('\n');
+                        }
+                    }
+                    output->pubsync();
+                }
+
+                // Set the prefix of lines written by the calling thread
+                // and return the previous one.
+                string setPrefix(const string& prefix)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ThreadOutput& threadOutput = threadOutputs[std::this_thread::get_id()];
+                    const string previousPrefix = threadOutput.prefix;
+                    threadOutput.prefix = prefix;
+                    return previousPrefix;
+                }
+
+            protected:
+                int_type overflow(int_type c)
+                {
+                    if(!traits_type::eq_int_type(c, traits_type::eof())) {
+                        const char_type character = traits_type::to_char_type(c);
+                        xsputn(&character, 1);
+                    }
+                    return traits_type::not_eof(c);
+                }
+
+                std::streamsize xsputn(const char_type* s, std::streamsize n)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ThreadOutput& threadOutput = threadOutputs[std::this_thread::get_id()];
+                    for(std::streamsize i=0; i<n; i++) {
+                        threadOutput.line.push_back(s[i]);
+                        if(s[i] == '\n') {
+                            writeLine(threadOutput);
+                            threadOutput.line.clear();
+                        }
+                    }
+                    return n;
+                }
+
+                int sync()
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    return output->pubsync();
+                }
+
+            private:
+                std::streambuf* output;
+                std::mutex mutex;
+                class ThreadOutput {
+                public:
+                    string prefix;
+                    string line;
+                };
+                map<std::thread::id, ThreadOutput> threadOutputs;
+
+                void writeLine(const ThreadOutput& threadOutput)
+                {
+                    output->sputn(threadOutput.prefix.data(), std::streamsize(threadOutput.prefix.size()));
+                    output->sputn(threadOutput.line.data(), std::streamsize(threadOutput.line.size()));
+                }
+            };
+        }
+    }
+}
+
+
+
+// Convert the normalization method parameter of a pipeline stage.
+static NormalizationMethod getStageNormalizationMethod(
+    const PipelineStage& stage,
+    const string& normalizationMethodString)
+{
+    const NormalizationMethod normalizationMethod =
+        normalizationMethodFromShortString(normalizationMethodString);
+    if(normalizationMethod == NormalizationMethod::Invalid) {
+        throw runtime_error("Invalid normalization method " + normalizationMethodString +
+            " for pipeline stage " + stage.name);
+    }
+    return normalizationMethod;
+}
+
+
+
+void ExpressionMatrix::runPipeline(const string& fileName, bool force)
+{
+    cout << timestamp << "ExpressionMatrix::runPipeline begins for " << fileName << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    const Pipeline pipeline(fileName);
+    const vector<PipelineStage>& stages = pipeline.stages;
+    const size_t stageCount = stages.size();
+
+    // The signatures of the stages completed in previous runs.
+    // When a stage begins, its entry is removed, and it is added back
+    // when the stage completes, so an interrupted stage is never skipped.
+    const string completedStagesFileName = directoryName + "/" + completedPipelineStagesFileName;
+    map<string, string> completedStages = readPipelineStagesFile(completedStagesFileName);
+    std::mutex completedStagesMutex;
+
+    // The stages that add cells and did not complete in previous runs.
+    // Only one stage that adds cells runs at a time,
+    // so these are only accessed while holding completedStagesMutex
+    // to avoid races with the completion of concurrent stages.
+    const string startedStagesFileName = directoryName + "/" + startedPipelineStagesFileName;
+    map<string, string> startedStages = readPipelineStagesFile(startedStagesFileName);
+
+    enum class StageStatus {pending, skipped, completed};
+    vector<StageStatus> status(stageCount, StageStatus::pending);
+
+    const auto runStage = [&](size_t i)
+    {
+        const PipelineStage& stage = stages[i];
+        const bool addsCells = pipelineStageAddsCells(stage);
+        CellId resumeCellCount = invalidCellId;
+
+        // If a previous run was interrupted while adding a cell, the cell
+        // data structures are inconsistent, and we cannot resume adding cells.
+        if(addsCells && !cellDataStructuresAreConsistent()) {
+            throw runtime_error("Pipeline stage " + stage.name + " cannot run because "
+                "a previous run was interrupted while adding a cell to expression matrix " +
+                directoryName + ", which is now inconsistent. "
+                "Use recoverFromCheckpoint to discard the cells added after the last checkpoint, "
+                "then run the pipeline again.");
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(completedStagesMutex);
+            completedStages.erase(stage.name);
+            writePipelineStagesFile(completedStagesFileName, completedStages);
+
+            // If a previous run of this stage with the same signature was interrupted,
+            // resume after the cells it added. Otherwise, record the number of cells now.
+            if(addsCells) {
+                const auto it = startedStages.find(stage.name);
+                if(it != startedStages.end()) {
+                    const string& value = it->second;
+                    const size_t separator = value.rfind(',');
+                    if(separator != string::npos && value.substr(0, separator) == stage.signature) {
+                        const CellId startCellCount = lexical_cast<CellId>(value.substr(separator + 1));
+                        if(startCellCount <= cellCount()) {
+                            resumeCellCount = startCellCount;
+                        }
+                    }
+                }
+                if(resumeCellCount == invalidCellId) {
+                    startedStages[stage.name] = stage.signature + "," + lexical_cast<string>(cellCount());
+                    writePipelineStagesFile(startedStagesFileName, startedStages);
+                }
+            }
+        }
+        cout << timestamp << "Pipeline stage " << stage.name << " (" << stage.function << ") begins." << endl;
+        if(resumeCellCount != invalidCellId) {
+            cout << timestamp << "Pipeline stage " << stage.name << " was interrupted in a previous run. " <<
+                "It will resume after the " << cellCount() - resumeCellCount << " cells it already added." << endl;
+        }
+        const auto t0 = std::chrono::steady_clock::now();
+        pipelineResumeCellCount = resumeCellCount;
+        try {
+            runPipelineStage(stage);
+        } catch(...) {
+            pipelineResumeCellCount = invalidCellId;
+            throw;
+        }
+        pipelineResumeCellCount = invalidCellId;
+        const auto t1 = std::chrono::steady_clock::now();
+        const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+        {
+            std::lock_guard<std::mutex> lock(completedStagesMutex);
+            completedStages[stage.name] = stage.signature;
+            writePipelineStagesFile(completedStagesFileName, completedStages);
+            if(addsCells) {
+                startedStages.erase(stage.name);
+                writePipelineStagesFile(startedStagesFileName, startedStages);
+            }
+        }
+        cout << timestamp << "Pipeline stage " << stage.name << " completed in " << t01 << " s." << endl;
+    };
+
+
+
+    // Each iteration runs the stages whose dependencies are all satisfied.
+    // A stage is skipped if it completed in a previous run with the same signature,
+    // its outputs still exist, and all the stages it depends on were also skipped.
+    // Stages that don't modify the expression matrix run concurrently,
+    // each on a task of the TaskScheduler, so they share its threads
+    // with the parallel loops they contain.
+    // While they run, their output lines are prefixed with the stage name.
+    // Other stages run one at a time.
+    size_t skippedCount = 0;
+    size_t completedCount = 0;
+    while(true) {
+
+        // Find the stages that are ready to run.
+        vector<size_t> readyStages;
+        for(size_t i=0; i<stageCount; i++) {
+            const PipelineStage& stage = stages[i];
+            if(status[i] == StageStatus::pending && std::all_of(
+                stage.dependencies.begin(), stage.dependencies.end(),
+                [&status](size_t j) {return status[j] != StageStatus::pending;})) {
+                readyStages.push_back(i);
+            }
+        }
+        if(readyStages.empty()) {
+            break;
+        }
+
+        // Skip the ones that don't need to run.
+        // This can make other stages ready, so we start over.
+        bool stagesWereSkipped = false;
+        for(const size_t i: readyStages) {
+            const PipelineStage& stage = stages[i];
+            const auto it = completedStages.find(stage.name);
+            if(!force && it != completedStages.end() && it->second == stage.signature &&
+                std::all_of(stage.dependencies.begin(), stage.dependencies.end(),
+                [&status](size_t j) {return status[j] == StageStatus::skipped;}) &&
+                pipelineStageOutputsExist(stage)) {
+                cout << timestamp << "Pipeline stage " << stage.name <<
+                    " was skipped: it already completed with the same parameters." << endl;
+                status[i] = StageStatus::skipped;
+                ++skippedCount;
+                stagesWereSkipped = true;
+            }
+        }
+        if(stagesWereSkipped) {
+            continue;
+        }
+
+        // Run the first ready stage that modifies the expression matrix or,
+        // if there are none, all the ready stages.
+        // Running the stages that modify the expression matrix first
+        // makes more stages available to run concurrently later.
+        vector<size_t> batch;
+        const auto it = std::find_if(readyStages.begin(), readyStages.end(),
+            [&stages](size_t i) {return stages[i].isExclusive;});
+        if(it == readyStages.end()) {
+            batch = readyStages;
+        } else {
+            batch.push_back(*it);
+        }
+        if(batch.size() == 1) {
+            runStage(batch.front());
+        } else {
+            std::streambuf* coutBuffer = cout.rdbuf();
+            PipelineOutputBuffer outputBuffer(coutBuffer);
+            cout.rdbuf(&outputBuffer);
+            try {
+                TaskScheduler& scheduler = TaskScheduler::instance();
+                TaskScheduler::TaskGroup group;
+                for(const size_t i: batch) {
+                    scheduler.submit(group, [&runStage, &stages, &outputBuffer, i]()
+                    {
+                        const string previousPrefix = outputBuffer.setPrefix("[" + stages[i].name + "] ");
+                        runStage(i);
+                        outputBuffer.setPrefix(previousPrefix);
+                    });
+                }
+                scheduler.wait(group);
+            } catch(...) {
+                cout.rdbuf(coutBuffer);
+                throw;
+            }
+            cout.rdbuf(coutBuffer);
+        }
+        for(const size_t i: batch) {
+            status[i] = StageStatus::completed;
+            ++completedCount;
+        }
+    }
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "Pipeline " << fileName << " ran " << completedCount <<
+        " stages and skipped " << skippedCount << " in " << t01 << " s." << endl;
+}
+
+
+
+// Return true if the outputs of a pipeline stage exist.
+// Cells are persistent and are always considered to exist.
+// Cell graphs and cluster graphs are not persistent,
+// so stages that create them always run in a new process.
+bool ExpressionMatrix::pipelineStageOutputsExist(const PipelineStage& stage) const
+{
+    const string& function = stage.function;
+    if(function == "createGeneSetUsingInformationContent") {
+        return geneSets.find(stage.get<string>("newGeneSetName")) != geneSets.end();
+    } else if(function == "computeLshSignatures") {
+        return filesystem::exists(directoryName + "/Lsh-" + stage.get<string>("lshName") + "-Signatures");
+    } else if(function == "findSimilarPairs7") {
+        return filesystem::exists(directoryName + "/SimilarPairs-" + stage.get<string>("similarPairsName") + "-Pairs");
+    } else if(function == "createCellGraph") {
+        return cellGraphs.find(stage.get<string>("graphName")) != cellGraphs.end();
+    } else if(function == "createClusterGraph") {
+        return clusterGraphs.find(stage.get<string>("clusterGraphName")) != clusterGraphs.end();
+    } else {
+        return true;
+    }
+}
+
+
+
+// Run a pipeline stage, using the same parameter defaults as the Python API.
+// Gene sets, cell graphs, and cluster graphs left over by a previous
+// run of the stage are removed first.
+// Lsh and SimilarPairs objects are overwritten.
+void ExpressionMatrix::runPipelineStage(const PipelineStage& stage)
+{
+    const string& function = stage.function;
+
+    if(function == "addCells") {
+        addCells(
+            stage.get<string>("expressionCountsFileName"),
+            stage.get<string>("expressionCountsFileSeparators", ","),
+            stage.get<string>("cellMetaDataFileName"),
+            stage.get<string>("cellMetaDataFileSeparators", ","),
+            stage.getMetaData("additionalCellMetaData"));
+    }
+
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+    else if(function == "addCellsFromHdf5") {
+        addCellsFromHdf5(
+            stage.get<string>("fileName"),
+            stage.get<string>("cellNamePrefix", ""),
+            stage.getMetaData("cellMetaData"),
+            stage.get<double>("totalExpressionCountThreshold", 0.));
+    }
+
+    else if(function == "addCellsFromH5ad") {
+        addCellsFromH5ad(
+            stage.get<string>("fileName"),
+            stage.get<string>("matrixName", "X"),
+            stage.get<string>("cellNamePrefix", ""),
+            stage.getMetaData("cellMetaData"),
+            stage.get<double>("totalExpressionCountThreshold", 0.));
+    }
+
+    else if(function == "addCellsFromLoom") {
+        addCellsFromLoom(
+            stage.get<string>("fileName"),
+            stage.get<string>("layerName", ""),
+            stage.get<string>("cellNameAttribute", "CellID"),
+            stage.get<string>("geneNameAttribute", "Gene"),
+            stage.get<string>("cellNamePrefix", ""),
+            stage.getMetaData("cellMetaData"),
+            stage.get<double>("totalExpressionCountThreshold", 0.));
+    }
+#endif
+
+    else if(function == "createGeneSetUsingInformationContent") {
+        const string newGeneSetName = stage.get<string>("newGeneSetName");
+        const NormalizationMethod normalizationMethod =
+            getStageNormalizationMethod(stage, stage.get<string>("normalizationMethod"));
+        if(geneSets.find(newGeneSetName) != geneSets.end()) {
+            removeGeneSet(newGeneSetName);
+        }
+        createGeneSetUsingInformationContent(
+            stage.get<string>("existingGeneSetName", "AllGenes"),
+            stage.get<string>("cellSetName", "AllCells"),
+            normalizationMethod,
+            stage.get<double>("geneInformationContentThreshold"),
+            newGeneSetName);
+    }
+
+    else if(function == "computeLshSignatures") {
+        computeLshSignatures(
+            stage.get<string>("geneSetName", "AllGenes"),
+            stage.get<string>("cellSetName", "AllCells"),
+            stage.get<string>("lshName"),
+            stage.get<size_t>("lshCount", 1024),
+            stage.get<unsigned int>("seed", 231),
+            stage.get<string>("layerName", ""),
+            getStageNormalizationMethod(stage, stage.get<string>("normalizationMethod", "none")));
+    }
+
+    else if(function == "findSimilarPairs7") {
+        findSimilarPairs7(
+            stage.get<string>("geneSetName", "AllGenes"),
+            stage.get<string>("cellSetName", "AllCells"),
+            stage.get<string>("lshName"),
+            stage.get<string>("similarPairsName"),
+            stage.get<size_t>("k", 100),
+            stage.get<double>("similarityThreshold", 0.2),
+            stage.getIntegers("lshSliceLengths"),
+            stage.get<CellId>("maxCheck"),
+            stage.get<size_t>("log2BucketCount"),
+            stage.get<size_t>("lshBitCount", 0));
+    }
+
+    else if(function == "createCellGraph") {
+        const string graphName = stage.get<string>("graphName");
+        cellGraphs.erase(graphName);
+        createCellGraph(
+            graphName,
+            stage.get<string>("cellSetName", "AllCells"),
+            stage.get<string>("similarPairsName"),
+            stage.get<double>("similarityThreshold", 0.5),
+            stage.get<size_t>("k", 20),
+            stage.get<bool>("keepIsolatedVertices", false));
+    }
+
+    else if(function == "createClusterGraph") {
+        const string clusterGraphName = stage.get<string>("clusterGraphName");
+        clusterGraphs.erase(clusterGraphName);
+        const ClusterGraphCreationParameters defaults;
+        createClusterGraph(
+            stage.get<string>("cellGraphName"),
+            clusterGraphName,
+            stage.get<size_t>("stableIterationCount", defaults.stableIterationCount),
+            stage.get<size_t>("maxIterationCount", defaults.maxIterationCount),
+            stage.get<size_t>("seed", defaults.seed),
+            stage.get<size_t>("minClusterSize", defaults.minClusterSize),
+            stage.get<size_t>("k", defaults.maxConnectivity),
+            stage.get<double>("similarityThreshold", defaults.similarityThreshold),
+            stage.get<double>("similarityThresholdForMerge", defaults.similarityThresholdForMerge));
+    }
+
+    else if(function == "compactMetaData") {
+        compactMetaDataIfFragmented(stage.get<double>("fragmentationThreshold", 0.));
+    }
+
+    else {
+        throw runtime_error("Pipeline stage " + stage.name + " uses unsupported function " + function);
+    }
+}
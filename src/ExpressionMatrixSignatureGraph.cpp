@@ -59,11 +59,10 @@ void ExpressionMatrix::createSignatureGraph(
     }
 
     // Access the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/Lsh-" + lshName);
-    if(lsh.cellCount() != cellCount) {
-        throw runtime_error("LSH object " + lshName +
-            " has a number of cells inconsistent with cell set " + cellSetName + ".");
-    }
+    // If the Lsh object was created for a larger cell set, this uses a view
+    // of its signatures for the cells of this cell set.
+    const shared_ptr<Lsh> lshPointer = accessLsh(lshName, cellSetName, cellSet);
+    Lsh& lsh = *lshPointer;
     const size_t lshBitCount = lsh.lshCount();
     cout << "Number of LSH signature bits is " << lshBitCount << "." << endl;
 
@@ -0,0 +1,201 @@
+// This file contains portions of the implementation of class ExpressionMatrix
+// that create and access snapshots and branches.
+// See MemoryMappedCopyOnWrite.hpp for more information.
+
+#include "ExpressionMatrix.hpp"
+#include "ExpressionMatrixTest.hpp"
+#include "MemoryMappedCopyOnWrite.hpp"
+#include "MemoryMappedDurability.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include "stdexcept.hpp"
+
+
+
+string ExpressionMatrix::getSnapshotDirectoryName(const string& snapshotName) const
+{
+    return directoryName + "/Snapshots/" + snapshotName;
+}
+
+
+
+// Files are cloned if the file system supports it. Otherwise,
+// data structures are hard linked and other files are copied.
+// Open data structures of this expression matrix whose files were hard linked
+// are switched to copy-on-write mappings, so changes made to this
+// expression matrix after the snapshot don't appear in the snapshot.
+void ExpressionMatrix::createSnapshot(const string& snapshotName)
+{
+    if(snapshotName.empty() || snapshotName.find('/') != string::npos) {
+        throw runtime_error("Invalid snapshot name \"" + snapshotName + "\".");
+    }
+    const string snapshotsDirectoryName = directoryName + "/Snapshots";
+    const string snapshotDirectoryName = getSnapshotDirectoryName(snapshotName);
+    if(filesystem::exists(snapshotDirectoryName)) {
+        throw runtime_error("Snapshot " + snapshotName + " already exists.");
+    }
+    if(!filesystem::exists(snapshotsDirectoryName)) {
+        filesystem::createDirectory(snapshotsDirectoryName);
+    }
+    filesystem::createDirectory(snapshotDirectoryName);
+
+    // Changes held in copy-on-write mappings (left by an earlier snapshot)
+    // must be in the files before we share them again.
+    MemoryMapped::persistPrivateMappings(directoryName);
+
+    size_t cloneCount = 0;
+    size_t hardLinkCount = 0;
+    size_t copyCount = 0;
+    const string prefix = directoryName + "/";
+    for(const string& fileName: filesystem::directoryContents(directoryName)) {
+
+        // Skip directories, including the one containing the snapshots.
+        if(!filesystem::isRegularFile(fileName)) {
+            continue;
+        }
+
+        // The checkpoint marker only applies to this expression matrix.
+        const string name = fileName.substr(prefix.size());
+        if(name == "Checkpoint" || name == "Checkpoint-tmp") {
+            continue;
+        }
+
+        switch(MemoryMapped::snapshotFile(fileName, snapshotDirectoryName + "/" + name)) {
+        case MemoryMapped::SnapshotMethod::clone:
+            ++cloneCount;
+            break;
+        case MemoryMapped::SnapshotMethod::hardLink:
+            ++hardLinkCount;
+            MemoryMapped::makeMappingsPrivate(fileName);
+            break;
+        case MemoryMapped::SnapshotMethod::copy:
+            ++copyCount;
+            break;
+        }
+    }
+
+    cout << timestamp << "Created snapshot " << snapshotName << " of " << directoryName <<
+        ": " << cloneCount << " files cloned, " << hardLinkCount << " hard linked, " <<
+        copyCount << " copied." << endl;
+}
+
+
+
+vector<string> ExpressionMatrix::getSnapshotNames() const
+{
+    vector<string> snapshotNames;
+    const string snapshotsDirectoryName = directoryName + "/Snapshots";
+    if(filesystem::isDirectory(snapshotsDirectoryName)) {
+        const string prefix = snapshotsDirectoryName + "/";
+        for(const string& name: filesystem::directoryContents(snapshotsDirectoryName)) {
+            if(filesystem::isDirectory(name)) {
+                snapshotNames.push_back(name.substr(prefix.size()));
+            }
+        }
+    }
+    sort(snapshotNames.begin(), snapshotNames.end());
+    return snapshotNames;
+}
+
+
+
+unique_ptr<ExpressionMatrix> ExpressionMatrix::openBranch(const string& snapshotName) const
+{
+    const string snapshotDirectoryName = getSnapshotDirectoryName(snapshotName);
+    if(!filesystem::isDirectory(snapshotDirectoryName)) {
+        throw runtime_error("Snapshot " + snapshotName + " does not exist.");
+    }
+    return unique_ptr<ExpressionMatrix>(new ExpressionMatrix(snapshotDirectoryName, false));
+}
+
+
+
+void ExpressionMatrix::removeSnapshot(const string& snapshotName)
+{
+    const string snapshotDirectoryName = getSnapshotDirectoryName(snapshotName);
+    if(!filesystem::isDirectory(snapshotDirectoryName)) {
+        throw runtime_error("Snapshot " + snapshotName + " does not exist.");
+    }
+    // This also removes any snapshots that were created from it
+    // while it was open as a branch.
+    filesystem::removeDirectoryTree(snapshotDirectoryName);
+}
+
+
+
+// Check that changes to an expression matrix after a snapshot
+// don't appear in the snapshot, and that changes to a branch
+// don't appear in the expression matrix, before and after reopening.
+void ChanZuckerberg::ExpressionMatrix2::testExpressionMatrixSnapshots()
+{
+    ExpressionMatrixTest test("testExpressionMatrixSnapshots");
+    const CellId cellCount = 100;
+    const GeneId geneCount = 50;
+    {
+        const unique_ptr<ExpressionMatrix> expressionMatrix =
+            test.createExpressionMatrix("ExpressionMatrix", cellCount, geneCount);
+        CZI_ASSERT(expressionMatrix->getSnapshotNames().empty());
+        expressionMatrix->createSnapshot("Snapshot");
+        CZI_ASSERT(expressionMatrix->getSnapshotNames() == vector<string>(1, "Snapshot"));
+        for(const string snapshotName: {"Snapshot", "", "Invalid/Name"}) {
+            bool exceptionWasThrown = false;
+            try {
+                expressionMatrix->createSnapshot(snapshotName);
+            } catch(const runtime_error&) {
+                exceptionWasThrown = true;
+            }
+            CZI_ASSERT(exceptionWasThrown);
+        }
+
+        // Change the expression matrix after the snapshot.
+        expressionMatrix->setCellMetaData(0, "Group", "Original");
+        test.addCell(*expressionMatrix, cellCount, geneCount, {{"Source", "Original"}});
+
+        // The branch has the expression matrix as it was at the snapshot.
+        {
+            const unique_ptr<ExpressionMatrix> branch = expressionMatrix->openBranch("Snapshot");
+            test.checkCells(*branch, cellCount, geneCount);
+            CZI_ASSERT(branch->getCellMetaData(0, "Group").empty());
+
+            // Change the branch.
+            branch->setCellMetaData(1, "Group", "Branch");
+            test.addCell(*branch, cellCount, geneCount, {{"Source", "Branch"}});
+            CZI_ASSERT(expressionMatrix->getCellMetaData(1, "Group").empty());
+            CZI_ASSERT(expressionMatrix->getCellMetaData(cellCount, "Source") == "Original");
+        }
+
+        // The changes to the branch were persisted.
+        {
+            const unique_ptr<ExpressionMatrix> branch = expressionMatrix->openBranch("Snapshot");
+            test.checkCells(*branch, cellCount + 1, geneCount);
+            CZI_ASSERT(branch->getCellMetaData(0, "Group").empty());
+            CZI_ASSERT(branch->getCellMetaData(1, "Group") == "Branch");
+            CZI_ASSERT(branch->getCellMetaData(cellCount, "Source") == "Branch");
+        }
+    }
+
+    // The changes to the expression matrix were persisted
+    // and are not affected by those to the branch.
+    {
+        ExpressionMatrix expressionMatrix(test.path("ExpressionMatrix"), false);
+        test.checkCells(expressionMatrix, cellCount + 1, geneCount);
+        CZI_ASSERT(expressionMatrix.getCellMetaData(0, "Group") == "Original");
+        CZI_ASSERT(expressionMatrix.getCellMetaData(1, "Group").empty());
+        CZI_ASSERT(expressionMatrix.getCellMetaData(cellCount, "Source") == "Original");
+
+        expressionMatrix.removeSnapshot("Snapshot");
+        CZI_ASSERT(expressionMatrix.getSnapshotNames().empty());
+        bool exceptionWasThrown = false;
+        try {
+            expressionMatrix.openBranch("Snapshot");
+        } catch(const runtime_error&) {
+            exceptionWasThrown = true;
+        }
+        CZI_ASSERT(exceptionWasThrown);
+    }
+
+    test.success();
+}
@@ -2,6 +2,8 @@
 // subset of cells and a subset of genes.
 
 #include "ExpressionMatrixSubset.hpp"
+#include "normalizationKernels.hpp"
+#include "similarityKernels.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
@@ -82,54 +84,54 @@ void ExpressionMatrixSubset::remove()
 // instead of the global expression counts stored by class ExpressionMatrix.
 double ExpressionMatrixSubset::computeCellSimilarity(CellId localCellId0, CellId localCellId1) const
 {
-    // Compute the scalar product of the expression counts for the two cells.
-    typedef pair<GeneId, float>const* Iterator;
-    const Iterator begin0 = cellExpressionCounts.begin(localCellId0);
-    const Iterator end0 = cellExpressionCounts.end(localCellId0);
-    const Iterator begin1 = cellExpressionCounts.begin(localCellId1);
-    const Iterator end1 = cellExpressionCounts.end(localCellId1);
-    Iterator it0 = begin0;
-    Iterator it1 = begin1;
-    double scalarProduct = 0.;
-    while((it0 != end0) && (it1 != end1)) {
-        const GeneId localGeneId0 = it0->first;
-        const GeneId localGeneId1 = it1->first;
-
-        if(localGeneId0 < localGeneId1) {
-            ++it0;
-        } else if(localGeneId1 < localGeneId0) {
-            ++it1;
-        } else {
-            scalarProduct += it0->second * it1->second;
-            ++it0;
-            ++it1;
-        }
+    return computeCellSimilarity(localCellId0, localCellId1, SimilarityMetric::Pearson);
+}
+double ExpressionMatrixSubset::computeCellSimilarity(
+    CellId localCellId0,
+    CellId localCellId1,
+    SimilarityMetric similarityMetric) const
+{
+    const double n = double(geneSet.size());
+
+    // For Spearman, use the correlation coefficient of the ranks.
+    if(similarityMetric == SimilarityMetric::Spearman) {
+        CZI_ASSERT(ranks.size() == cellCount());
+        const vector< pair<GeneId, float> >& ranks0 = ranks[localCellId0];
+        const vector< pair<GeneId, float> >& ranks1 = ranks[localCellId1];
+        const SparseIntersectionSums intersectionSums = computeSparseIntersectionSums(
+            ranks0.data(), ranks0.data() + ranks0.size(),
+            ranks1.data(), ranks1.data() + ranks1.size(),
+            0, 0);
+        const Sum& cell0Sum = rankSums[localCellId0];
+        const Sum& cell1Sum = rankSums[localCellId1];
+        return computeSimilarityFromSums(similarityMetric, n,
+            cell0Sum.sum1, cell0Sum.sum2, cell1Sum.sum1, cell1Sum.sum2, intersectionSums);
     }
 
-    // Compute the correlation coefficient.
-    // See, for example, https://en.wikipedia.org/wiki/Correlation_and_dependence
-    const double n = double(geneSet.size());
+    // Intersect the expression counts for the two cells.
+    const SparseIntersectionSums intersectionSums = computeSparseIntersectionSums(
+        cellExpressionCounts.begin(localCellId0), cellExpressionCounts.end(localCellId0),
+        cellExpressionCounts.begin(localCellId1), cellExpressionCounts.end(localCellId1),
+        0, 0);
     const Sum& cell0Sum = sums[localCellId0];
     const Sum& cell1Sum = sums[localCellId1];
-    const double numerator = n*scalarProduct - cell0Sum.sum1*cell1Sum.sum1;
-    const double denominator = sqrt(
-            (n*cell0Sum.sum2 - cell0Sum.sum1*cell0Sum.sum1) *
-            (n*cell1Sum.sum2 - cell1Sum.sum1*cell1Sum.sum1)
-            );
-
-#if 0
-    cout << "ExpressionMatrixSubset::computeCellSimilarity" << endl;
-    cout << "n " << n << endl;
-    cout << "scalarProduct " << scalarProduct << endl;
-    cout << "cell0Sum.sum1 " << cell0Sum.sum1 << endl;
-    cout << "cell1Sum.sum1 " << cell1Sum.sum1 << endl;
-    cout << "cell0Sum.sum2 " << cell0Sum.sum2 << endl;
-    cout << "cell1Sum.sum2 " << cell1Sum.sum2 << endl;
-    cout << "numerator " << numerator << endl;
-    cout << "denominator " << denominator << endl;
-#endif
-
-    return numerator / denominator;
+    return computeSimilarityFromSums(similarityMetric, n,
+        cell0Sum.sum1, cell0Sum.sum2, cell1Sum.sum1, cell1Sum.sum2, intersectionSums);
+}
+
+
+
+// Compute the ranks used for SimilarityMetric::Spearman.
+void ExpressionMatrixSubset::computeRanks()
+{
+    ranks.resize(cellCount());
+    rankSums.resize(cellCount());
+    for(CellId localCellId=0; localCellId<cellCount(); localCellId++) {
+        computeSparseRanks(
+            cellExpressionCounts.begin(localCellId), cellExpressionCounts.end(localCellId),
+            geneSet.size(), ranks[localCellId],
+            rankSums[localCellId].sum1, rankSums[localCellId].sum2);
+    }
 }
 
 
@@ -141,7 +143,8 @@ double ExpressionMatrixSubset::computeCellSimilarity(CellId localCellId0, CellId
 // Cell expression vectors are normalized as requested.
 void ExpressionMatrixSubset::getDenseRepresentation(
     vector< vector<float> >& v,
-    NormalizationMethod normalizationMethod) const
+    NormalizationMethod normalizationMethod,
+    const PearsonResidualsParameters* pearsonResidualsParameters) const
 {
     v.clear();
     v.resize(geneCount(), vector<float>(cellCount(), 0.));
@@ -155,19 +158,27 @@ void ExpressionMatrixSubset::getDenseRepresentation(
     }
 
     // Normalize the expression vector of each cell, if requested.
-    if(normalizationMethod != NormalizationMethod::none) {
-        CZI_ASSERT(normalizationMethod != NormalizationMethod::Invalid);
-        for(CellId cellId=0; cellId!=cellCount(); cellId++) {
-            const double scaling =
-                (normalizationMethod==NormalizationMethod::L1) ?
-                    sums[cellId].sum1 :
-                    sqrt(sums[cellId].sum2);
-            if(scaling != 0.) {
-                const float factor = float(1./scaling);
-                for(GeneId geneId=0; geneId!=geneCount(); geneId++) {
-                    v[geneId][cellId] *= factor;
-                }
-            }
+    CZI_ASSERT(normalizationMethod != NormalizationMethod::Invalid);
+    if(normalizationMethod == NormalizationMethod::none) {
+        return;
+    }
+    if(normalizationMethod == NormalizationMethod::PearsonResiduals) {
+        CZI_ASSERT(pearsonResidualsParameters);
+        CZI_ASSERT(pearsonResidualsParameters->geneFractions.size() == geneCount());
+    }
+    vector<float> x(geneCount());
+    for(CellId cellId=0; cellId!=cellCount(); cellId++) {
+        for(GeneId geneId=0; geneId!=geneCount(); geneId++) {
+            x[geneId] = v[geneId][cellId];
+        }
+        if(normalizationMethod == NormalizationMethod::PearsonResiduals) {
+            computePearsonResiduals(x.data(), pearsonResidualsParameters->geneFractions.data(), x.data(), x.size(),
+                float(sums[cellId].sum1), pearsonResidualsParameters->clip);
+        } else if(sums[cellId].sum1 != 0.) {
+            normalizeValues(normalizationMethod, x.data(), x.size(), sums[cellId].sum1, sums[cellId].sum2);
+        }
+        for(GeneId geneId=0; geneId!=geneCount(); geneId++) {
+            v[geneId][cellId] = x[geneId];
         }
     }
 
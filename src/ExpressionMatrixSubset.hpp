@@ -17,12 +17,14 @@ It uses temporary files for all of its mapped files, so it is not persistent.
 #include "Ids.hpp"
 #include "MemoryMappedVectorOfVectors.hpp"
 #include "NormalizationMethod.hpp"
+#include "SimilarityMetric.hpp"
 
 #include "utility.hpp"
 
 namespace ChanZuckerberg {
     namespace ExpressionMatrix2 {
         class ExpressionMatrixSubset;
+        class PearsonResidualsParameters;
     }
 }
 
@@ -86,7 +88,10 @@ public:
     // This is similar to ExpressionMatrix::computeCellSimilarity,
     // but it used the expression counts stored in the ExpressionMatrixSubset
     // instead of the global expression counts stored by class ExpressionMatrix.
+    // The version without a SimilarityMetric uses SimilarityMetric::Pearson.
+    // For SimilarityMetric::Spearman, computeRanks must be called first.
     double computeCellSimilarity(CellId localCellId0, CellId localCellId1) const;
+    double computeCellSimilarity(CellId localCellId0, CellId localCellId1, SimilarityMetric) const;
 
     // Close and remove the supporting files.
     void remove();
@@ -99,14 +104,25 @@ public:
     };
     vector<Sum> sums;
 
+    // The ranks of the expression counts of each cell, used for SimilarityMetric::Spearman,
+    // and their sums and sums of squares. See similarityKernels.hpp.
+    // These are only available after calling computeRanks.
+    vector< vector< pair<GeneId, float> > > ranks;
+    vector<Sum> rankSums;
+    void computeRanks();
+
     // Get a dense representation of the expression matrix subset.
     // Indexed by [localGeneId][localCellId].
     // Note this means that the counts for all cells and a given
     // gene are contiguous.
     // Cell expression vectors are normalized as requested.
+    // For NormalizationMethod::PearsonResiduals, the PearsonResidualsParameters
+    // for the gene set must be given (see ExpressionMatrix::getPearsonResidualsParameters),
+    // so the residuals are the same as those computed by the ExpressionMatrix.
     void getDenseRepresentation(
         vector< vector<float> >&,
-        NormalizationMethod) const;
+        NormalizationMethod,
+        const PearsonResidualsParameters* = 0) const;
 
 private:
     void computeSums();
@@ -0,0 +1,149 @@
+// Class ExpressionMatrixTest contains the setup shared by
+// the functions that test ExpressionMatrix functionality.
+
+#include "ExpressionMatrixTest.hpp"
+#include "filesystem.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include "iostream.hpp"
+
+
+
+ExpressionMatrixTest::ExpressionMatrixTest(const string& testName) :
+    testName(testName)
+{
+    if(filesystem::exists(testName)) {
+        filesystem::removeDirectoryTree(testName);
+    }
+    filesystem::createDirectory(testName);
+}
+
+
+
+void ExpressionMatrixTest::success()
+{
+    filesystem::removeDirectoryTree(testName);
+    cout << testName << " completed successfully." << endl;
+}
+
+
+
+string ExpressionMatrixTest::path(const string& name) const
+{
+    return testName + "/" + name;
+}
+
+
+
+ExpressionMatrixCreationParameters ExpressionMatrixTest::creationParameters()
+{
+    return ExpressionMatrixCreationParameters(1<<12, 1<<14, 1<<6, 1<<14, 1<<6, 1<<10);
+}
+
+
+
+string ExpressionMatrixTest::cellName(CellId cellId)
+{
+    return "Cell" + lexical_cast<string>(cellId);
+}
+
+
+
+string ExpressionMatrixTest::geneName(GeneId geneId)
+{
+    return "Gene" + lexical_cast<string>(geneId);
+}
+
+
+
+float ExpressionMatrixTest::expressionCount(CellId cellId, GeneId geneId)
+{
+    if(((cellId*7 + geneId*13) % 11) >= 3) {
+        return 0.f;
+    }
+    return float(1 + (cellId*geneId) % 17);
+}
+
+
+
+CellId ExpressionMatrixTest::addCell(
+    ExpressionMatrix& expressionMatrix,
+    CellId cellId,
+    GeneId geneCount,
+    const vector< pair<string, string> >& metaDataArgument,
+    float factor)
+{
+    vector< pair<string, string> > metaData = metaDataArgument;
+    metaData.insert(metaData.begin(), make_pair(string("CellName"), cellName(cellId)));
+    vector< pair<string, float> > expressionCounts;
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        const float count = expressionCount(cellId, geneId);
+        if(count != 0.f) {
+            expressionCounts.push_back(make_pair(geneName(geneId), factor * count));
+        }
+    }
+    return expressionMatrix.addCell(metaData, expressionCounts);
+}
+
+
+
+unique_ptr<ExpressionMatrix> ExpressionMatrixTest::createExpressionMatrix(
+    const string& name,
+    CellId cellCount,
+    GeneId geneCount,
+    float factor) const
+{
+    unique_ptr<ExpressionMatrix> expressionMatrix(new ExpressionMatrix(path(name), creationParameters()));
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        expressionMatrix->addGene(geneName(geneId));
+    }
+    for(CellId cellId=0; cellId!=cellCount; cellId++) {
+        addCell(*expressionMatrix, cellId, geneCount, {}, factor);
+    }
+    return expressionMatrix;
+}
+
+
+
+void ExpressionMatrixTest::checkCells(
+    const ExpressionMatrix& expressionMatrix,
+    CellId cellCount,
+    const vector<GeneId>& geneIds,
+    const string& cellNamePrefix,
+    float factor)
+{
+    CZI_ASSERT(expressionMatrix.cellCount() == cellCount);
+    CZI_ASSERT(expressionMatrix.geneCount() == GeneId(geneIds.size()));
+    vector< pair<GeneId, float> > expectedExpressionCounts;
+    for(CellId cellId=0; cellId!=cellCount; cellId++) {
+        CZI_ASSERT(expressionMatrix.getCellMetaData(cellId, "CellName") == cellNamePrefix + cellName(cellId));
+        expectedExpressionCounts.clear();
+        for(const GeneId geneId: geneIds) {
+            const float count = expressionCount(cellId, geneId);
+            if(count != 0.f) {
+                expectedExpressionCounts.push_back(make_pair(
+                    expressionMatrix.geneIdFromName(geneName(geneId)), factor * count));
+            }
+        }
+        sort(expectedExpressionCounts.begin(), expectedExpressionCounts.end());
+        CZI_ASSERT(expressionMatrix.getCellExpressionCounts(cellId) == expectedExpressionCounts);
+    }
+}
+
+
+
+void ExpressionMatrixTest::checkCells(
+    const ExpressionMatrix& expressionMatrix,
+    CellId cellCount,
+    GeneId geneCount,
+    const string& cellNamePrefix,
+    float factor)
+{
+    vector<GeneId> geneIds(geneCount);
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        geneIds[geneId] = geneId;
+    }
+    checkCells(expressionMatrix, cellCount, geneIds, cellNamePrefix, factor);
+}
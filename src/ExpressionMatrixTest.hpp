@@ -0,0 +1,105 @@
+#ifndef CZI_EXPRESSION_MATRIX2_EXPRESSION_MATRIX_TEST_HPP
+#define CZI_EXPRESSION_MATRIX2_EXPRESSION_MATRIX_TEST_HPP
+
+
+
+/*******************************************************************************
+
+Functions that test ExpressionMatrix functionality, and class
+ExpressionMatrixTest, which contains the setup they share.
+
+Each test function is in the file containing the functionality it tests.
+It works in a directory with the same name as the test function,
+created in the current directory and removed when the test is successful.
+
+*******************************************************************************/
+
+#include "ExpressionMatrix.hpp"
+
+#include "memory.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class ExpressionMatrixTest;
+
+        void testExpressionMatrixCheckpoint();
+        void testExpressionMatrixSnapshots();
+        void testExpressionMatrixMetaDataCompaction();
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+        void testExpressionMatrixHdf5();
+        void testExpressionMatrixH5ad();
+        void testExpressionMatrixLoom();
+#endif
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::ExpressionMatrixTest {
+public:
+
+    // Create the directory for a test, removing any directory
+    // left by a previous run of the same test.
+    explicit ExpressionMatrixTest(const string& testName);
+
+    // Remove the directory and report that the test was successful.
+    void success();
+
+    // Return the path of a file or directory in the test directory.
+    string path(const string& name) const;
+
+    // Parameters to create the small expression matrices used by the tests.
+    static ExpressionMatrixCreationParameters creationParameters();
+
+    // Synthetic cell names, gene names, and expression counts.
+    // About one in four expression counts are zero. The others are positive integers.
+    static string cellName(CellId);
+    static string geneName(GeneId);
+    static float expressionCount(CellId, GeneId);
+
+    // Add a cell with the synthetic name and the synthetic expression counts
+    // for genes 0 to geneCount-1, multiplied by the given factor.
+    static CellId addCell(
+        ExpressionMatrix&,
+        CellId,
+        GeneId geneCount,
+        const vector< pair<string, string> >& metaData = {},
+        float factor = 1.f);
+
+    // Create an expression matrix in the test directory,
+    // containing genes 0 to geneCount-1 (in this order)
+    // and cells 0 to cellCount-1, as created by addCell.
+    unique_ptr<ExpressionMatrix> createExpressionMatrix(
+        const string& name,
+        CellId cellCount,
+        GeneId geneCount,
+        float factor = 1.f) const;
+
+    // Check that an expression matrix contains exactly cells 0 to cellCount-1,
+    // with the synthetic names preceded by the given prefix,
+    // and exactly the given genes, with the synthetic expression counts
+    // multiplied by the given factor. Gene ids of the expression matrix
+    // don't have to be the same as the synthetic gene ids.
+    static void checkCells(
+        const ExpressionMatrix&,
+        CellId cellCount,
+        const vector<GeneId>& geneIds,
+        const string& cellNamePrefix = "",
+        float factor = 1.f);
+
+    // Same as above, for genes 0 to geneCount-1.
+    static void checkCells(
+        const ExpressionMatrix&,
+        CellId cellCount,
+        GeneId geneCount,
+        const string& cellNamePrefix = "",
+        float factor = 1.f);
+
+private:
+    string testName;
+};
+
+#endif
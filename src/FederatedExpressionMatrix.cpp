@@ -0,0 +1,361 @@
+// Class FederatedExpressionMatrix provides a read-only view of several
+// existing expression matrices. See FederatedExpressionMatrix.hpp for details.
+
+#include "FederatedExpressionMatrix.hpp"
+#include "ExpressionMatrix.hpp"
+#include "filesystem.hpp"
+#include "Lsh.hpp"
+#include "SimilarPairs.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include <chrono>
+#include "set.hpp"
+
+
+
+FederatedExpressionMatrix::FederatedExpressionMatrix(
+    const string& directoryName,
+    const vector<string>& memberDirectoryNames) :
+    directoryName(directoryName)
+{
+    if(memberDirectoryNames.empty()) {
+        throw runtime_error("No member expression matrices specified for federated expression matrix.");
+    }
+    if(!filesystem::exists(directoryName)) {
+        filesystem::createDirectory(directoryName);
+    }
+
+    // Access the members read-only and compute the CellId offsets.
+    // This way we never write to the member directories,
+    // not even a checkpoint when the members are destroyed.
+    cellIdOffsets.push_back(0);
+    for(const string& memberDirectoryName: memberDirectoryNames) {
+        members.push_back(make_shared<ExpressionMatrix>(memberDirectoryName, false, false));
+        const uint64_t cellCount = uint64_t(cellIdOffsets.back()) + members.back()->cellCount();
+        if(cellCount >= uint64_t(invalidCellId)) {
+            throw runtime_error("Too many cells in federated expression matrix.");
+        }
+        cellIdOffsets.push_back(CellId(cellCount));
+    }
+
+    // Unify the genes, in order of first appearance.
+    memberGeneIds.resize(members.size());
+    for(size_t memberId=0; memberId<members.size(); memberId++) {
+        const ExpressionMatrix& member = *members[memberId];
+        vector<GeneId>& v = memberGeneIds[memberId];
+        v.resize(member.geneCount());
+        for(GeneId memberGeneId=0; memberGeneId!=member.geneCount(); memberGeneId++) {
+            const string name = member.geneNames[memberGeneId];
+            const auto it = geneIds.find(name);
+            if(it == geneIds.end()) {
+                const GeneId geneId = GeneId(geneNames.size());
+                geneIds.insert(make_pair(name, geneId));
+                geneNames.push_back(name);
+                v[memberGeneId] = geneId;
+            } else {
+                v[memberGeneId] = it->second;
+            }
+        }
+    }
+
+    cout << timestamp << "Federated expression matrix has " << members.size() << " members, " <<
+        geneCount() << " genes, and " << cellCount() << " cells." << endl;
+}
+
+
+
+// Find the member that contains a given cell.
+pair<size_t, CellId> FederatedExpressionMatrix::getMemberCellId(CellId cellId) const
+{
+    if(cellId >= cellCount()) {
+        throw runtime_error("Invalid cell id " + std::to_string(cellId));
+    }
+    const size_t memberId = size_t(
+        std::upper_bound(cellIdOffsets.begin(), cellIdOffsets.end(), cellId) - cellIdOffsets.begin()) - 1;
+    return make_pair(memberId, cellId - cellIdOffsets[memberId]);
+}
+
+
+
+string FederatedExpressionMatrix::geneName(GeneId geneId) const
+{
+    if(geneId >= geneCount()) {
+        throw runtime_error("Invalid gene id " + std::to_string(geneId));
+    }
+    return geneNames[geneId];
+}
+
+
+
+GeneId FederatedExpressionMatrix::geneIdFromName(const string& name) const
+{
+    const auto it = geneIds.find(name);
+    if(it == geneIds.end()) {
+        return invalidGeneId;
+    } else {
+        return it->second;
+    }
+}
+
+
+
+string FederatedExpressionMatrix::cellName(CellId cellId) const
+{
+    const auto p = getMemberCellId(cellId);
+    return members[p.first]->cellNames[p.second];
+}
+
+
+
+CellId FederatedExpressionMatrix::cellIdFromName(const string& name) const
+{
+    for(size_t memberId=0; memberId<members.size(); memberId++) {
+        const ExpressionMatrix& member = *members[memberId];
+        const CellId memberCellId = member.cellNames(name);
+        if(memberCellId != member.cellNames.invalidStringId) {
+            return cellIdOffsets[memberId] + memberCellId;
+        }
+    }
+    return invalidCellId;
+}
+
+
+
+string FederatedExpressionMatrix::getCellMetaData(CellId cellId, const string& name) const
+{
+    const auto p = getMemberCellId(cellId);
+    return members[p.first]->getCellMetaData(p.second, name);
+}
+vector< pair<string, string> > FederatedExpressionMatrix::getCellMetaData(CellId cellId) const
+{
+    const auto p = getMemberCellId(cellId);
+    return members[p.first]->getCellMetaData(p.second);
+}
+
+
+
+// Get all the non-zero expression counts for a given cell.
+// The member gene ids are converted to federated gene ids,
+// which can change their order, so we have to sort them again.
+vector< pair<GeneId, float> > FederatedExpressionMatrix::getCellExpressionCounts(CellId cellId) const
+{
+    const auto p = getMemberCellId(cellId);
+    const vector<GeneId>& v = memberGeneIds[p.first];
+    vector< pair<GeneId, float> > counts;
+    for(const auto& q: members[p.first]->cellExpressionCounts[p.second]) {
+        counts.push_back(make_pair(v[q.first], q.second));
+    }
+    sort(counts.begin(), counts.end());
+    return counts;
+}
+
+
+
+vector<string> FederatedExpressionMatrix::getCellSetNames() const
+{
+    vector<string> names = members.front()->getCellSetNames();
+    for(size_t memberId=1; memberId<members.size(); memberId++) {
+        const vector<string> memberNames = members[memberId]->getCellSetNames();
+        const set<string> memberNamesSet(memberNames.begin(), memberNames.end());
+        names.erase(std::remove_if(names.begin(), names.end(),
+            [&memberNamesSet](const string& name)
+            {
+                return memberNamesSet.find(name) == memberNamesSet.end();
+            }),
+            names.end());
+    }
+    return names;
+}
+
+
+
+// The cell set is the concatenation of the member cell sets,
+// each shifted by the CellId offset of its member.
+// Because member cell sets are sorted, the result is also sorted.
+vector<CellId> FederatedExpressionMatrix::getCellSet(const string& cellSetName) const
+{
+    vector<CellId> cellSet;
+    for(size_t memberId=0; memberId<members.size(); memberId++) {
+        for(const CellId memberCellId: members[memberId]->cellSet(cellSetName)) {
+            cellSet.push_back(cellIdOffsets[memberId] + memberCellId);
+        }
+    }
+    return cellSet;
+}
+void FederatedExpressionMatrix::createCellSet(
+    const string& cellSetName,
+    CellSet& cellSet,
+    const string& fileName) const
+{
+    const vector<CellId> v = getCellSet(cellSetName);
+    if(v.empty()) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+    cellSet.createNew(fileName, v.size());
+    copy(v.begin(), v.end(), cellSet.begin());
+}
+
+
+
+// The gene set is the union of the member gene sets with the given name.
+// Throws if a member does not have that gene set.
+void FederatedExpressionMatrix::createGeneSet(
+    const string& geneSetName,
+    GeneSet& geneSet,
+    const string& fileName) const
+{
+    vector<bool> isInGeneSet(geneCount(), false);
+    for(size_t memberId=0; memberId<members.size(); memberId++) {
+        const auto& memberGeneSets = members[memberId]->geneSets;
+        const auto it = memberGeneSets.find(geneSetName);
+        if(it == memberGeneSets.end()) {
+            throw runtime_error("Gene set " + geneSetName + " does not exist in member " +
+                std::to_string(memberId) + ".");
+        }
+        for(const GeneId memberGeneId: it->second) {
+            isInGeneSet[memberGeneIds[memberId][memberGeneId]] = true;
+        }
+    }
+
+    // Add the genes in order of increasing GeneId, so the gene set is sorted.
+    geneSet.createNew(fileName);
+    for(GeneId geneId=0; geneId!=geneCount(); geneId++) {
+        if(isInGeneSet[geneId]) {
+            geneSet.addGene(geneId);
+        }
+    }
+    geneSet.forceSorted();
+    if(geneSet.size() == 0) {
+        geneSet.remove();
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+}
+
+
+
+// Compute cell LSH signatures.
+// Each thread reads the expression counts of its cells directly from the members,
+// converting member gene ids to ids local to the gene set.
+void FederatedExpressionMatrix::computeLshSignatures(
+    const string& geneSetName,
+    const string& cellSetName,
+    const string& lshName,
+    size_t lshCount,
+    unsigned int seed)
+{
+    cout << timestamp << "FederatedExpressionMatrix::computeLshSignatures begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Create the gene set and cell set.
+    GeneSet geneSet;
+    createGeneSet(geneSetName, geneSet, directoryName + "/tmp-GeneSet-" + lshName);
+    const vector<CellId> cellSet = getCellSet(cellSetName);
+    if(cellSet.empty()) {
+        geneSet.remove();
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+
+    // For each member, the local GeneId in the gene set
+    // of each member GeneId, or invalidGeneId if not in the gene set.
+    vector< vector<GeneId> > localGeneIds(members.size());
+    for(size_t memberId=0; memberId<members.size(); memberId++) {
+        const vector<GeneId>& v = memberGeneIds[memberId];
+        localGeneIds[memberId].resize(v.size());
+        for(GeneId memberGeneId=0; memberGeneId!=v.size(); memberGeneId++) {
+            localGeneIds[memberId][memberGeneId] = geneSet.getLocalGeneId(v[memberGeneId]);
+        }
+    }
+
+    // Create the Lsh object, which computes the signatures.
+    const auto getCellExpressionCounts =
+        [&](CellId localCellId, vector< pair<GeneId, float> >& counts)
+        {
+            const auto p = getMemberCellId(cellSet[localCellId]);
+            const vector<GeneId>& v = localGeneIds[p.first];
+            counts.clear();
+            for(const auto& q: members[p.first]->cellExpressionCounts[p.second]) {
+                const GeneId localGeneId = v[q.first];
+                if(localGeneId != invalidGeneId) {
+                    counts.push_back(make_pair(localGeneId, q.second));
+                }
+            }
+            sort(counts.begin(), counts.end());
+        };
+    Lsh lsh(directoryName + "/Lsh-" + lshName, geneSet.size(), CellId(cellSet.size()),
+        getCellExpressionCounts, lshCount, seed);
+    geneSet.remove();
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "FederatedExpressionMatrix::computeLshSignatures ends. Took " << t01 << " s." << endl;
+}
+
+
+
+void FederatedExpressionMatrix::findSimilarPairs7(
+    const string& geneSetName,
+    const string& cellSetName,
+    const string& lshName,
+    const string& similarPairsName,
+    size_t k,
+    double similarityThreshold,
+    const vector<int>& lshSliceLengths,
+    CellId maxCheck,
+    size_t log2BucketCount,
+    size_t lshBitCount)
+{
+    cout << timestamp << "FederatedExpressionMatrix::findSimilarPairs7 begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Access the Lsh object and use the requested number of signature bits.
+    Lsh lsh(directoryName + "/Lsh-" + lshName);
+    lsh.setPrefixBitCount(lshBitCount);
+
+    // Create the gene set and cell set. They are only needed
+    // because the SimilarPairs object stores copies of them.
+    GeneSet geneSet;
+    createGeneSet(geneSetName, geneSet, directoryName + "/tmp-GeneSet-" + similarPairsName);
+    CellSet cellSet;
+    try {
+        createCellSet(cellSetName, cellSet, directoryName + "/tmp-CellSet-" + similarPairsName);
+    } catch(...) {
+        geneSet.remove();
+        throw;
+    }
+    if(lsh.cellCount() != cellSet.size()) {
+        geneSet.remove();
+        cellSet.remove();
+        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
+    }
+
+    // Do the computation.
+    SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, k, geneSet, cellSet);
+    geneSet.remove();
+    cellSet.remove();
+    ExpressionMatrix::findSimilarPairs7(lsh, similarPairs, k, similarityThreshold,
+        lshSliceLengths, maxCheck, log2BucketCount);
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "FederatedExpressionMatrix::findSimilarPairs7 ends. Took " << t01 << " s." << endl;
+}
+
+
+
+vector< pair<CellId, float> > FederatedExpressionMatrix::getSimilarPairs(
+    const string& similarPairsName,
+    CellId cellId) const
+{
+    const SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName, true);
+    const CellId localCellId = similarPairs.getLocalCellId(cellId);
+    vector< pair<CellId, float> > pairs;
+    if(localCellId != invalidCellId) {
+        for(const auto& p: similarPairs[localCellId]) {
+            pairs.push_back(make_pair(similarPairs.getGlobalCellId(p.first), p.second));
+        }
+    }
+    return pairs;
+}
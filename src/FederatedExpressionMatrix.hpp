@@ -0,0 +1,176 @@
+#ifndef CZI_EXPRESSION_MATRIX2_FEDERATED_EXPRESSION_MATRIX_HPP
+#define CZI_EXPRESSION_MATRIX2_FEDERATED_EXPRESSION_MATRIX_HPP
+
+
+
+/*******************************************************************************
+
+Class FederatedExpressionMatrix provides a read-only view of several
+existing expression matrices (the members), as if they were
+a single expression matrix, without copying any of their data.
+
+Cells are numbered by concatenating the cells of all members, in member order:
+the cells of member 0 come first, followed by the cells of member 1, and so on.
+Genes are the union of the genes of all members, numbered in order
+of first appearance. Both numberings are the same used by
+ExpressionMatrix::mergeExpressionMatrices for the same members,
+so results can be compared with those obtained on a merged expression matrix.
+
+The federated view supports the read functionality: expression counts,
+cell meta data, cell sets, computation of LSH signatures, and
+finding similar cell pairs using LSH.
+A cell set or gene set of the federated view is the union
+of the cell sets or gene sets with the same name in all members.
+
+Objects created by the federated view (Lsh and SimilarPairs objects)
+are stored in its own directory. The member directories are not modified.
+
+*******************************************************************************/
+
+#include "CellSets.hpp"
+#include "GeneSet.hpp"
+#include "Ids.hpp"
+
+#include "map.hpp"
+#include "memory.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class ExpressionMatrix;
+        class FederatedExpressionMatrix;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::FederatedExpressionMatrix {
+public:
+
+    // Construct a federated view of the expression matrices
+    // in the given member directories.
+    // Objects created by the federated view are stored
+    // in the specified directory, which is created if it does not exist.
+    FederatedExpressionMatrix(
+        const string& directoryName,
+        const vector<string>& memberDirectoryNames);
+
+    // Return the number of member expression matrices.
+    size_t memberCount() const
+    {
+        return members.size();
+    }
+
+    // Return the number of genes and cells.
+    GeneId geneCount() const
+    {
+        return GeneId(geneNames.size());
+    }
+    CellId cellCount() const
+    {
+        return cellIdOffsets.back();
+    }
+
+    // Find the member that contains a given cell.
+    // Returns the index of the member and the CellId in that member.
+    pair<size_t, CellId> getMemberCellId(CellId) const;
+
+    // Return the name of the gene with the given id.
+    string geneName(GeneId) const;
+
+    // Return a gene id given its name.
+    // Returns invalidGeneId if the gene was not found.
+    GeneId geneIdFromName(const string&) const;
+
+    // Return the name of the cell with the given id.
+    string cellName(CellId) const;
+
+    // Return a cell id given its name.
+    // If more than one member has a cell with that name, the first one is returned.
+    // Returns invalidCellId if the cell was not found.
+    CellId cellIdFromName(const string&) const;
+
+    // Return the value of a specified meta data field for a given cell.
+    // Returns an empty string if the cell does not have the specified meta data field.
+    string getCellMetaData(CellId, const string& name) const;
+
+    // Return a vector containing all of the meta data (Name, Value) pairs
+    // for a given cell.
+    vector< pair<string, string> > getCellMetaData(CellId) const;
+
+    // Get all the non-zero expression counts for a given cell,
+    // sorted by GeneId.
+    vector< pair<GeneId, float> > getCellExpressionCounts(CellId) const;
+
+    // Get the names of the cell sets that exist in all members.
+    vector<string> getCellSetNames() const;
+
+    // Get the cell set with a given name: the union of the cell sets
+    // with that name in all members. Throws if a member does not have that cell set.
+    vector<CellId> getCellSet(const string& cellSetName) const;
+
+    // Compute cell LSH signatures and store them in the directory of the federated view.
+    // The expression counts are read directly from the members.
+    void computeLshSignatures(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& lshName,          // The name of the Lsh object to be created.
+        size_t lshCount,                // The number of LSH vectors to use.
+        unsigned int seed               // The seed used to generate the LSH vectors.
+        );
+
+    // Find similar cell pairs using an Lsh object previously created
+    // by computeLshSignatures. See ExpressionMatrix::findSimilarPairs7.
+    void findSimilarPairs7(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& lshName,          // The name of the Lsh object to be used.
+        const string& similarPairsName, // The name of the SimilarPairs object to be created.
+        size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+        double similarityThreshold,     // The minimum similarity for a pair to be stored.
+        const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
+        CellId maxCheck,                // Maximum number of cells to consider for each cell.
+        size_t log2BucketCount,
+        size_t lshBitCount              // The number of LSH signature bits to use (a prefix), or 0 to use all.
+        );
+
+    // Return the similar pairs stored for a given cell
+    // in a SimilarPairs object created by findSimilarPairs7.
+    // Returns an empty vector if the cell is not in the cell set
+    // used to create the SimilarPairs object.
+    vector< pair<CellId, float> > getSimilarPairs(
+        const string& similarPairsName,
+        CellId) const;
+
+private:
+
+    // The directory used to store objects created by the federated view.
+    string directoryName;
+
+    // The member expression matrices, accessed read-only.
+    vector< shared_ptr<ExpressionMatrix> > members;
+
+    // The first CellId of the cells of each member.
+    // Has size memberCount()+1, and the last entry is the total number of cells.
+    vector<CellId> cellIdOffsets;
+
+    // The names of all genes, indexed by GeneId,
+    // and the GeneId corresponding to each name.
+    vector<string> geneNames;
+    map<string, GeneId> geneIds;
+
+    // The GeneId corresponding to each GeneId of each member.
+    // Indexed by [memberId][memberGeneId].
+    vector< vector<GeneId> > memberGeneIds;
+
+    // Create a federated gene set: the union of the gene sets
+    // with the given name in all members.
+    void createGeneSet(const string& geneSetName, GeneSet&, const string& fileName) const;
+
+    // Create a federated cell set in a memory mapped vector.
+    void createCellSet(const string& cellSetName, CellSet&, const string& fileName) const;
+};
+
+#endif
@@ -10,14 +10,20 @@ void GeneSet::createNew(const string& name)
 {
     globalGeneIdVector.createNew(name + "-GlobalIds", 0);
     localGeneIdVector.createNew(name + "-LocalIds", 0);
+    membership.clear();
 }
 
 
 
-void GeneSet::accessExisting(const string& name, bool allowReadOnly)
+void GeneSet::accessExisting(const string& name, bool allowReadOnly, bool readWriteAccess)
 {
-    globalGeneIdVector.accessExistingReadWrite(name + "-GlobalIds", allowReadOnly);
-    localGeneIdVector.accessExistingReadWrite(name + "-LocalIds", allowReadOnly);
+    if(readWriteAccess) {
+        globalGeneIdVector.accessExistingReadWrite(name + "-GlobalIds", allowReadOnly);
+        localGeneIdVector.accessExistingReadWrite(name + "-LocalIds", allowReadOnly);
+    } else {
+        globalGeneIdVector.accessExistingReadOnly(name + "-GlobalIds");
+        localGeneIdVector.accessExistingReadOnly(name + "-LocalIds");
+    }
 
 
 
@@ -32,6 +38,19 @@ void GeneSet::accessExisting(const string& name, bool allowReadOnly)
         // It is not sorted and we only have read access.
         throw runtime_error("Gene set " + name + " is not sorted and accessed read-only.");
     }
+
+    computeMembership();
+}
+
+
+
+// Compute the membership bitmap used by contains.
+void GeneSet::computeMembership()
+{
+    membership.assign((localGeneIdVector.size() + 63) / 64, 0);
+    for(const GeneId globalGeneId: globalGeneIdVector) {
+        membership[globalGeneId >> 6] |= uint64_t(1) << (globalGeneId & 63);
+    }
 }
 
 
@@ -41,6 +60,7 @@ void GeneSet::makeCopy(GeneSet& copy, const string& newName) const
 {
     globalGeneIdVector.makeCopy(copy.globalGeneIdVector, newName + "-GlobalIds");
     localGeneIdVector.makeCopy(copy.localGeneIdVector, newName + "-LocalIds");
+    copy.membership = membership;
     copy.sort();
 }
 
@@ -59,14 +79,11 @@ void GeneSet::addGene(GeneId geneId)
     localGeneIdVector[geneId] = GeneId(globalGeneIdVector.size());
     globalGeneIdVector.push_back(geneId);
     isSorted = false;
-}
-
 
-
-// Return true if a given global GeneId belongs to the set, false otherwise.
-bool GeneSet::contains(GeneId globalGeneId) const
-{
-    return getLocalGeneId(globalGeneId) != invalidGeneId;
+    if((geneId >> 6) >= membership.size()) {
+        membership.resize((geneId >> 6) + 1, 0);
+    }
+    membership[geneId >> 6] |= uint64_t(1) << (geneId & 63);
 }
 
 
@@ -3,8 +3,12 @@
 
 #include "Ids.hpp"
 #include "MemoryMappedVector.hpp"
+#include "memory.hpp"
+#include "utility.hpp"
 #include "vector.hpp"
 
+#include <mutex>
+
 namespace ChanZuckerberg {
     namespace ExpressionMatrix2 {
         class GeneSet;
@@ -23,7 +27,9 @@ public:
     void createNew(const string& name);
 
     // Access a previously created GeneSet.
-    void accessExisting(const string& name, bool allowReadOnly);
+    // If readWriteAccess is false, it is accessed read-only
+    // and allowReadOnly is ignored.
+    void accessExisting(const string& name, bool allowReadOnly, bool readWriteAccess=true);
 
     // Make a copy of this gene set.
     void makeCopy(GeneSet& copy, const string& newName) const;
@@ -34,7 +40,13 @@ public:
     void addGene(GeneId);
 
     // Return true if a given GeneId belongs to the set, false otherwise.
-    bool contains(GeneId) const;
+    // This uses a bitmap with one bit per gene, which stays in cache
+    // even for large numbers of genes.
+    bool contains(GeneId globalGeneId) const
+    {
+        const size_t word = globalGeneId >> 6;
+        return (word < membership.size()) && ((membership[word] >> (globalGeneId & 63)) & 1);
+    }
 
     // Get a reference to the vector of gene ids for the genes in this set.
     // When this function returns, the vector is guaranteed to be sorted by id.
@@ -79,6 +91,9 @@ public:
     {
         globalGeneIdVector.remove();
         localGeneIdVector.remove();
+        membership.clear();
+        cellSums.reset();
+        cellRanks.reset();
     }
 
     void getSortedGenes(vector<GeneId>&);
@@ -103,8 +118,60 @@ public:
         isSorted = true;
     }
 
+    // The sum and sum of squares of the expression counts of a cell,
+    // for the genes in this set.
+    class CellSums {
+    public:
+        double sum1;
+        double sum2;
+    };
+
+    // The ranks of the expression counts of a cell, for the genes in this set,
+    // as used for SimilarityMetric::Spearman (see similarityKernels.hpp),
+    // plus their sum and sum of squares.
+    class CellRanks {
+    public:
+        vector< pair<GeneId, float> > ranks;
+        CellSums sums;
+    };
+
+    // What is needed to compute cell similarities for the genes in this set,
+    // as returned by ExpressionMatrix::prepareCellSimilarity: the CellSums
+    // and, for SimilarityMetric::Spearman, the CellRanks of all cells,
+    // indexed by CellId. Holding them keeps them valid
+    // even if the cache in the GeneSet is updated.
+    class CellSimilarityData {
+    public:
+        shared_ptr<const vector<CellSums> > cellSums;
+        shared_ptr<const vector<CellRanks> > cellRanks;
+    };
+
 private:
 
+    // Bitmap used by contains, with one bit for each global GeneId.
+    vector<uint64_t> membership;
+    void computeMembership();
+
+    // The CellSums for each cell, indexed by CellId.
+    // This is a cache kept in memory, computed by ExpressionMatrix::getGeneSetCellSums
+    // when first needed, and updated when cells or genes are added.
+    // The cache is valid if cellSumsGeneCount equals the number of genes in the set.
+    // A vector is never changed once published here: an update
+    // replaces the pointer, so vectors handed out earlier stay valid.
+    // The mutex only protects the pointer and cellSumsGeneCount.
+    // (GeneSet is not copyable anyway, because MemoryMapped::Vector is not).
+    mutable shared_ptr<const vector<CellSums> > cellSums;
+    mutable GeneId cellSumsGeneCount = 0;
+    mutable std::mutex cellSumsMutex;
+
+    // The CellRanks for each cell, indexed by CellId.
+    // This is a cache kept in memory, computed by ExpressionMatrix::getGeneSetCellRanks,
+    // in the same way as cellSums.
+    mutable shared_ptr<const vector<CellRanks> > cellRanks;
+    mutable GeneId cellRanksGeneCount = 0;
+    mutable std::mutex cellRanksMutex;
+    friend class ExpressionMatrix;
+
     // The global GeneId's of the genes in this set.
     // Indexed by the local GeneId.
     MemoryMapped::Vector<GeneId> globalGeneIdVector;
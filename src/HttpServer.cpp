@@ -11,15 +11,24 @@ using namespace ExpressionMatrix2;
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ip/v6_only.hpp>
+#include <boost/version.hpp>
 #include <chrono>
 using namespace boost;
 using namespace asio;
 using namespace ip;
 
+#include <cerrno>
+#include <ctime>
 #include "iostream.hpp"
 #include "stdexcept.hpp"
 #include <sstream>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 
 
 // This function puts the server into an endless loop
@@ -57,15 +66,17 @@ void HttpServer::explore(uint16_t port)
     cout << "Listening for http requests on port " << port << endl;
 
     // Endless loop over incoming connections.
+    // The stream is allocated on the heap, so a static file
+    // can continue to use it on a separate thread.
     while(true) {
-          tcp::iostream s;
+          const std::shared_ptr<tcp::iostream> s = std::make_shared<tcp::iostream>();
           tcp::endpoint remoteEndpoint;
           boost::system::error_code errorCode;
-          acceptor.accept(*s.rdbuf(), remoteEndpoint, errorCode);
+          acceptor.accept(*s->rdbuf(), remoteEndpoint, errorCode);
           if(errorCode) {
               // If interrupted with Ctrl-C, we get here.
               cout << "\nError code from accept: " << errorCode.message() << endl;
-              s.close();        // Should not be necessary.
+              s->close();       // Should not be necessary.
               acceptor.close(); // Should not be necessary
               return;
           }
@@ -82,8 +93,10 @@ void HttpServer::explore(uint16_t port)
 
 
 
-void HttpServer::processRequest(tcp::iostream& s)
+void HttpServer::processRequest(const std::shared_ptr<tcp::iostream>& sPointer)
 {
+    tcp::iostream& s = *sPointer;
+
     // If the client is too slow sending the request, drop it.
     s.expires_from_now(boost::posix_time::seconds(1));
 
@@ -138,8 +151,10 @@ void HttpServer::processRequest(tcp::iostream& s)
     	token = newToken;
     }
 
-    // Read the rest of the input from the client, but ignore it.
+    // Read the rest of the input from the client.
     // We have to do this, otherwise the client may get a timeout.
+    // The headers are only used for static files.
+    map<string, string> requestHeaders;
     string line;
     while(true) {
         if(!s) {
@@ -153,6 +168,24 @@ void HttpServer::processRequest(tcp::iostream& s)
         if(line.size()==1) {
             break;
         }
+        const size_t colonPosition = line.find(':');
+        if(colonPosition != string::npos) {
+            string name = line.substr(0, colonPosition);
+            boost::algorithm::to_lower(name);
+            requestHeaders[name] = boost::algorithm::trim_copy(line.substr(colonPosition+1));
+        }
+    }
+
+    // If this is a static file, queue it for one of the static file threads.
+    // The request keeps a reference to the stream until it is sent.
+    const string staticFileName = getStaticFileName(tokens);
+    if(!staticFileName.empty()) {
+        StaticFileRequest staticFileRequest;
+        staticFileRequest.stream = sPointer;
+        staticFileRequest.fileName = staticFileName;
+        staticFileRequest.requestHeaders = requestHeaders;
+        queueStaticFileRequest(staticFileRequest);
+        return;
     }
 
     // Write the success response.
@@ -166,6 +199,322 @@ void HttpServer::processRequest(tcp::iostream& s)
 
 
 
+HttpServer::~HttpServer()
+{
+    {
+        std::lock_guard<std::mutex> lock(staticFileRequestsMutex);
+        staticFileThreadsMustStop = true;
+    }
+    staticFileRequestsCondition.notify_all();
+    for(std::thread& thread: staticFileThreads) {
+        thread.join();
+    }
+}
+
+
+
+// Queue a request for a static file, starting the static file threads
+// if this is the first one.
+void HttpServer::queueStaticFileRequest(const StaticFileRequest& staticFileRequest)
+{
+    {
+        std::lock_guard<std::mutex> lock(staticFileRequestsMutex);
+        if(staticFileThreads.empty()) {
+            for(size_t i=0; i<staticFileThreadCount; i++) {
+                staticFileThreads.push_back(std::thread(&HttpServer::staticFileThreadFunction, this));
+            }
+        }
+        if(staticFileRequests.size() < maxStaticFileRequestCount) {
+            staticFileRequests.push_back(staticFileRequest);
+            staticFileRequestsCondition.notify_one();
+            return;
+        }
+    }
+
+    // Too many requests are waiting.
+    cout << "Too many pending static file requests." << endl;
+    *staticFileRequest.stream << "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: 1\r\nConnection: close\r\n\r\n" << flush;
+}
+
+
+
+// Function run by each of the static file threads.
+// Requests still queued when the server is destroyed are dropped.
+void HttpServer::staticFileThreadFunction()
+{
+    while(true) {
+        StaticFileRequest staticFileRequest;
+        {
+            std::unique_lock<std::mutex> lock(staticFileRequestsMutex);
+            staticFileRequestsCondition.wait(lock, [this]()
+                {
+                    return staticFileThreadsMustStop || !staticFileRequests.empty();
+                });
+            if(staticFileThreadsMustStop) {
+                return;
+            }
+            staticFileRequest = staticFileRequests.front();
+            staticFileRequests.pop_front();
+        }
+        try {
+            sendStaticFile(*staticFileRequest.stream, staticFileRequest.fileName, staticFileRequest.requestHeaders);
+        } catch(...) {
+            // The client went away. Nothing to do.
+        }
+    }
+}
+
+
+
+// Send a static file, with headers as described in HttpServer.hpp.
+void HttpServer::sendStaticFile(
+    tcp::iostream& s,
+    const string& fileName,
+    const map<string, string>& requestHeaders)
+{
+    const std::shared_ptr<StaticFile> file = staticFileCache.get(fileName);
+    if(!file) {
+        s << "HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\n";
+        s << "File not found.";
+        return;
+    }
+
+    // Headers common to all responses.
+    // Cache-Control: no-cache tells the browser to keep the file,
+    // but to check with us that it did not change before using it.
+    const string cacheHeaders =
+        "ETag: " + file->eTag + "\r\n"
+        "Last-Modified: " + file->lastModified + "\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: close\r\n";
+
+    // See if the client already has this version of the file.
+    // If-None-Match takes precedence over If-Modified-Since.
+    bool isNotModified = false;
+    const auto itIfNoneMatch = requestHeaders.find("if-none-match");
+    if(itIfNoneMatch != requestHeaders.end()) {
+        vector<string> eTags;
+        boost::algorithm::split(eTags, itIfNoneMatch->second, boost::algorithm::is_any_of(","));
+        for(string eTag: eTags) {
+            boost::algorithm::trim(eTag);
+            if(eTag.substr(0, 2) == "W/") {
+                eTag = eTag.substr(2);
+            }
+            if(eTag == file->eTag || eTag == "*") {
+                isNotModified = true;
+            }
+        }
+    } else {
+        const auto itIfModifiedSince = requestHeaders.find("if-modified-since");
+        isNotModified =
+            (itIfModifiedSince != requestHeaders.end()) &&
+            (itIfModifiedSince->second == file->lastModified);
+    }
+    if(isNotModified) {
+        s << "HTTP/1.1 304 Not Modified\r\n" << cacheHeaders << "\r\n" << flush;
+        return;
+    }
+
+    // See if the client requested a single byte range.
+    // Multiple ranges are not supported, and in that case
+    // we send the entire file, as permitted by RFC 7233.
+    // A range is ignored if If-Range specifies a different version of the file,
+    // or if it cannot be parsed. Only a valid range that starts
+    // past the end of the file gets 416 Range Not Satisfiable.
+    uint64_t begin = 0;
+    uint64_t end = file->size;
+    bool isRange = false;
+    const auto itRange = requestHeaders.find("range");
+    const auto itIfRange = requestHeaders.find("if-range");
+    if(itRange != requestHeaders.end() &&
+        itRange->second.substr(0, 6) == "bytes=" &&
+        itRange->second.find(',') == string::npos &&
+        (itIfRange == requestHeaders.end() || itIfRange->second == file->eTag)) {
+        const string range = itRange->second.substr(6);
+        const size_t dashPosition = range.find('-');
+        bool isValid = (dashPosition != string::npos);
+        bool isSatisfiable = true;
+        uint64_t rangeBegin = 0;
+        uint64_t rangeEnd = file->size;
+        try {
+            if(isValid && dashPosition == 0) {
+                // Range of the form -n: the last n bytes.
+                const uint64_t n = lexical_cast<uint64_t>(range.substr(1));
+                rangeBegin = (n < file->size) ? (file->size - n) : 0;
+                isSatisfiable = (n > 0);
+            } else if(isValid) {
+                // Range of the form first-last or first-.
+                rangeBegin = lexical_cast<uint64_t>(range.substr(0, dashPosition));
+                if(dashPosition+1 < range.size()) {
+                    const uint64_t last = lexical_cast<uint64_t>(range.substr(dashPosition+1));
+                    isValid = (last >= rangeBegin);
+                    rangeEnd = (last < file->size) ? (last + 1) : file->size;
+                }
+            }
+        } catch(const bad_lexical_cast&) {
+            isValid = false;
+        }
+        if(isValid) {
+            if(!isSatisfiable || rangeBegin >= file->size) {
+                s << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                    "Content-Range: bytes */" << file->size << "\r\n" << cacheHeaders << "\r\n" << flush;
+                return;
+            }
+            begin = rangeBegin;
+            end = rangeEnd;
+            isRange = true;
+        }
+    }
+
+    // Write the headers.
+    if(isRange) {
+        s << "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Range: bytes " << begin << "-" << end-1 << "/" << file->size << "\r\n";
+    } else {
+        s << "HTTP/1.1 200 OK\r\n";
+    }
+    s <<
+        "Content-Type: " << getMimeType(fileName) << "\r\n"
+        "Content-Length: " << end - begin << "\r\n"
+        "Accept-Ranges: bytes\r\n" <<
+        cacheHeaders << "\r\n" << flush;
+
+    // Send the file directly from the file descriptor to the socket.
+    // The socket can be in non-blocking mode, so we may have to wait for it.
+#if BOOST_VERSION >= 106600
+    const int socketDescriptor = s.socket().native_handle();
+#else
+    const int socketDescriptor = s.rdbuf()->native_handle();
+#endif
+    off_t offset = off_t(begin);
+    while(uint64_t(offset) < end) {
+        const ssize_t n = ::sendfile(socketDescriptor, file->fileDescriptor, &offset, size_t(end - uint64_t(offset)));
+        if(n > 0) {
+            continue;
+        }
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd p;
+            p.fd = socketDescriptor;
+            p.events = POLLOUT;
+            p.revents = 0;
+            if(::poll(&p, 1, 60000) > 0) {
+                continue;
+            }
+        }
+        // The client went away, or the file was truncated.
+        break;
+    }
+}
+
+
+
+HttpServer::StaticFile::~StaticFile()
+{
+    ::close(fileDescriptor);
+}
+
+
+
+// Return an open static file, or a null pointer if
+// the file does not exist or is not a regular file.
+std::shared_ptr<HttpServer::StaticFile> HttpServer::StaticFileCache::get(const string& fileName)
+{
+    struct stat fileStatus;
+    if(::stat(fileName.c_str(), &fileStatus) != 0 || !S_ISREG(fileStatus.st_mode)) {
+        return std::shared_ptr<StaticFile>();
+    }
+    const uint64_t modificationTime =
+        uint64_t(fileStatus.st_mtim.tv_sec) * 1000000000ULL + uint64_t(fileStatus.st_mtim.tv_nsec);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // If we have it and it did not change, use it.
+    const auto it = entries.find(fileName);
+    if(it != entries.end()) {
+        const Entry& entry = it->second;
+        if(entry.device == uint64_t(fileStatus.st_dev) &&
+            entry.inode == uint64_t(fileStatus.st_ino) &&
+            entry.file->size == uint64_t(fileStatus.st_size) &&
+            entry.modificationTime == modificationTime) {
+            return entry.file;
+        }
+    }
+
+    // Open it.
+    const int fileDescriptor = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fileDescriptor < 0) {
+        return std::shared_ptr<StaticFile>();
+    }
+
+    // The ETag is derived from the inode, size, and modification time.
+    ostringstream eTag;
+    eTag << '"' << hex << uint64_t(fileStatus.st_ino) << "-" <<
+        uint64_t(fileStatus.st_size) << "-" << modificationTime << '"';
+
+    // Last-Modified uses the format of RFC 7231.
+    const time_t modificationSeconds = fileStatus.st_mtim.tv_sec;
+    std::tm modificationTm;
+    gmtime_r(&modificationSeconds, &modificationTm);
+    char lastModified[64];
+    std::strftime(lastModified, sizeof(lastModified), "%a, %d %b %Y %H:%M:%S GMT", &modificationTm);
+
+    if(entries.size() >= maxSize) {
+        entries.clear();
+    }
+    Entry& entry = entries[fileName];
+    entry.device = uint64_t(fileStatus.st_dev);
+    entry.inode = uint64_t(fileStatus.st_ino);
+    entry.modificationTime = modificationTime;
+    entry.file = std::make_shared<StaticFile>(fileDescriptor, uint64_t(fileStatus.st_size), eTag.str(), lastModified);
+    return entry.file;
+}
+
+
+
+// Return the MIME type to be used in the Content-Type header
+// for a file with the given name, based on its extension.
+string HttpServer::getMimeType(const string& fileName)
+{
+    static const map<string, string> mimeTypes = {
+        {"html", "text/html; charset=UTF-8"},
+        {"htm", "text/html; charset=UTF-8"},
+        {"css", "text/css"},
+        {"js", "application/javascript"},
+        {"json", "application/json"},
+        {"txt", "text/plain; charset=UTF-8"},
+        {"csv", "text/csv"},
+        {"dot", "text/vnd.graphviz"},
+        {"xml", "application/xml"},
+        {"svg", "image/svg+xml"},
+        {"png", "image/png"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"},
+        {"ico", "image/x-icon"},
+        {"pdf", "application/pdf"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        };
+
+    const size_t slashPosition = fileName.find_last_of('/');
+    const size_t dotPosition = fileName.find_last_of('.');
+    if(dotPosition != string::npos && (slashPosition == string::npos || dotPosition > slashPosition)) {
+        string extension = fileName.substr(dotPosition+1);
+        boost::algorithm::to_lower(extension);
+        const auto it = mimeTypes.find(extension);
+        if(it != mimeTypes.end()) {
+            return it->second;
+        }
+    }
+    return "application/octet-stream";
+}
+
+
+
 // Return all values assigned to a parameter.
 // For example, if the request has ...&a=xyz&a=uv,
 // when called with argument "a" returns a set containing "xyz" and "uv".
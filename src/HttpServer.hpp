@@ -3,15 +3,33 @@
 // The derived class only has to override
 // function processRequest.
 
+// Static files (for example, documentation pages) are served
+// separately from other requests: see getStaticFileName.
+// They are sent with sendfile(2) by a small pool of threads, using a cache
+// of open file descriptors, so they don't wait for
+// or delay the processing of other requests.
+// Responses for static files include Content-Type, Content-Length,
+// ETag and Last-Modified headers, support conditional requests
+// (If-None-Match and If-Modified-Since, answered with 304 Not Modified)
+// and requests for a single byte range. A Range header that cannot be parsed
+// is ignored, as required by RFC 7233.
+
 #ifndef CZI_EXPRESSION_MATRIX2_HTTP_SERVER_HPP
 #define CZI_EXPRESSION_MATRIX2_HTTP_SERVER_HPP
 
 #include <boost/asio/ip/tcp.hpp>
 #include "boost_lexical_cast.hpp"
 
+#include <condition_variable>
+#include "cstdint.hpp"
+#include <deque>
 #include "iosfwd.hpp"
+#include "map.hpp"
+#include "memory.hpp"
+#include <mutex>
 #include "set.hpp"
 #include "string.hpp"
+#include <thread>
 #include "vector.hpp"
 
 namespace ChanZuckerberg {
@@ -36,9 +54,21 @@ public:
 	// The request is guaranteed not to be empty.
 	virtual void processRequest(const vector<string>& request, ostream& html) = 0;
 
+    // The derived class can override this to request that a request
+    // be satisfied by sending a static file.
+    // It is passed the parsed request, as for processRequest,
+    // and should return the name of the file to be sent,
+    // or an empty string if the request should be passed to processRequest.
+    // The file is sent by a separate thread, so it should not
+    // be modified while the server is running.
+    virtual string getStaticFileName(const vector<string>& request)
+    {
+        return "";
+    }
+
 	// The destructor needs to be virtual for clean destruction of
-	// the derived class.
-	virtual ~HttpServer() {}
+	// the derived class. It stops and joins the threads that send static files.
+	virtual ~HttpServer();
 
 	// This function can be used by the derived class to get the value of a parameter.
 	// If the parameter is missing, returns false and the value is not touched.
@@ -81,10 +111,80 @@ public:
     // https://stackoverflow.com/questions/154536/encode-decode-urls-in-c
     static string urlEncode(const string&);
 
-private:
+    // Return the MIME type to be used in the Content-Type header
+    // for a file with the given name, based on its extension.
+    static string getMimeType(const string& fileName);
 
-	void processRequest(boost::asio::ip::tcp::iostream&);
+private:
 
+	void processRequest(const shared_ptr<boost::asio::ip::tcp::iostream>&);
+
+    // A request for a static file, waiting to be sent
+    // by one of the static file threads.
+    class StaticFileRequest {
+    public:
+        shared_ptr<boost::asio::ip::tcp::iostream> stream;
+        string fileName;
+        map<string, string> requestHeaders;
+    };
+
+    // The threads that send static files and the queue of requests they process.
+    // The threads are started when the first static file is requested,
+    // and stopped and joined by the destructor.
+    // When the queue is full, requests for static files are answered
+    // with 503 Service Unavailable.
+    vector<std::thread> staticFileThreads;
+    std::deque<StaticFileRequest> staticFileRequests;
+    std::mutex staticFileRequestsMutex;
+    std::condition_variable staticFileRequestsCondition;
+    bool staticFileThreadsMustStop = false;
+    static const size_t staticFileThreadCount = 4;
+    static const size_t maxStaticFileRequestCount = 256;
+    void queueStaticFileRequest(const StaticFileRequest&);
+    void staticFileThreadFunction();
+
+    // Send a static file, with headers as described above.
+    // The request headers are indexed by lower case name.
+    void sendStaticFile(
+        boost::asio::ip::tcp::iostream&,
+        const string& fileName,
+        const map<string, string>& requestHeaders);
+
+    // An open static file.
+    // The file descriptor is closed when the last reference goes away,
+    // so a file can be replaced in the cache while it is being sent.
+    class StaticFile {
+    public:
+        int fileDescriptor;
+        uint64_t size;
+        string eTag;
+        string lastModified;
+        StaticFile(int fileDescriptor, uint64_t size, const string& eTag, const string& lastModified) :
+            fileDescriptor(fileDescriptor), size(size), eTag(eTag), lastModified(lastModified) {}
+        ~StaticFile();
+    };
+
+    // Cache of open static files, keyed by file name.
+    // A cached file is reused if its inode, size, and modification time
+    // did not change.
+    class StaticFileCache {
+    public:
+        shared_ptr<StaticFile> get(const string& fileName);
+    private:
+        class Entry {
+        public:
+            uint64_t device;
+            uint64_t inode;
+            uint64_t modificationTime;  // Nanoseconds.
+            shared_ptr<StaticFile> file;
+        };
+        map<string, Entry> entries;
+        std::mutex mutex;
+
+        // When the cache grows beyond this number of files, it is cleared.
+        static const size_t maxSize = 256;
+    };
+    StaticFileCache staticFileCache;
 
 };
 
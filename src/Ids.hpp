@@ -16,6 +16,7 @@ namespace ChanZuckerberg {
 
         // Type used to identify strings used for cell meta data and for gene names.
         using StringId = uint32_t;
+        static const StringId invalidStringId = std::numeric_limits<StringId>::max();
     }
 };
 
@@ -22,6 +22,9 @@ void kernel kernel0(
     global ushort* mismatchCounts)
 { 
     uint cellId1 = get_global_id(0);
+    if(cellId1 >= cellCount) {
+        return;
+    }
     global const ulong* signature0 = signatures + cellId0 * lshWordCount;
     global const ulong* signature1 = signatures + cellId1 * lshWordCount;
     ulong mismatchCount = 0;
@@ -53,6 +56,9 @@ void kernel kernel1(
     global ushort* mismatchCounts)
 { 
     uint cellId1 = get_global_id(0);
+    if(cellId1 >= cellCount) {
+        return;
+    }
     global const ulong* signature0Begin = signatures + cellId0Begin * lshWordCount;
     global const ulong* signature1Begin = signatures + cellId1 * lshWordCount;
     global ushort* mismatchCount1 = mismatchCounts + blockSize*cellId1;
@@ -106,13 +112,19 @@ void kernel kernel2(
     ulong mismatchCountThreshold,
     global const ulong* signatures, 
     global uint* neighbors, 
-    global uint* neighborsCount)
+    global uint* neighborsCount,
+    ulong cellId0End)
 {
     // i0 runs from zero to the number of cellId0 values we are processing in parallel.
     const ulong i0 = get_global_id(0);
     
     // Get the cellId0 corresponding to this i0.
+    // The global size can exceed the number of cells in the block
+    // because it is rounded up to a multiple of the work group size.
     const ulong cellId0 = cellId0Begin + i0;
+    if(cellId0 >= cellId0End) {
+        return;
+    }
     
     // Access its signature.
     global ulong const * signature0Begin = signatures + cellId0 * lshWordCount;
@@ -235,7 +247,10 @@ void kernel kernel3(
     // The neighbor vector for all cells in the current block (see comments above).
     // The stride between successive values of cellId0 is (mismatchCountThreshold+1)*k.
     // The stride between successive values of mismatchCount is k.
-    global uint* neighbors      
+    global uint* neighbors,
+
+    // The end of the block currently being processed.
+    ulong cellId0End
 
     )
 {
@@ -243,7 +258,12 @@ void kernel kernel3(
     const ulong i0 = get_global_id(0);
     
     // Get the cellId0 corresponding to this i0.
+    // The global size can exceed the number of cells in the block
+    // because it is rounded up to a multiple of the work group size.
     const ulong cellId0 = cellId0Begin + i0;
+    if(cellId0 >= cellId0End) {
+        return;
+    }
     
     // Access its signature.
     global ulong const * signature0Begin = signatures + cellId0 * lshWordCount;
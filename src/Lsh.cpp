@@ -1,17 +1,23 @@
 #include "Lsh.hpp"
+#include "CounterBasedRandom.hpp"
 #include "ExpressionMatrixSubset.hpp"
+#include "numa.hpp"
 #include "SimilarPairs.hpp"
+#include "TaskScheduler.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
 #include <boost/math/constants/constants.hpp>
-#include <boost/random/mersenne_twister.hpp>
 #include <boost/random/normal_distribution.hpp>
-#include <boost/random/variate_generator.hpp>
 
+#include "algorithm.hpp"
+#include <atomic>
 #include <chrono>
+#include "filesystem.hpp"
 #include "fstream.hpp"
+#include <mutex>
+#include "stdexcept.hpp"
 
 
 
@@ -19,7 +25,8 @@ Lsh::Lsh(
     const string& name,             // Name prefix for memory mapped files.
     const ExpressionMatrixSubset& expressionMatrixSubset,
     size_t lshCount,                // Number of LSH hyperplanes
-    uint32_t seed                   // Seed to generate LSH hyperplanes.
+    uint32_t seed,                  // Seed to generate LSH hyperplanes.
+    numa::Policy numaPolicy         // NUMA placement of the signatures.
     )
 {
     // Store the Info object.
@@ -27,19 +34,66 @@ Lsh::Lsh(
     info->lshCount = lshCount;
     info->cellCount = expressionMatrixSubset.cellCount();
 
+    // Use all signature bits.
+    // This also computes the similarity table.
+    setPrefixBitCount(0);
+
     // Generate the LSH vectors.
     cout << timestamp << "Generating LSH vectors." << endl;
     generateLshVectors(expressionMatrixSubset.geneCount(), lshCount, seed);
 
     // Compute cell signatures.
+    // The expression counts and their sum are used directly
+    // from the ExpressionMatrixSubset, without copying.
     cout << timestamp << "Computing cell LSH signatures." << endl;
-    computeCellLshSignatures(name, expressionMatrixSubset);
+    computeCellLshSignatures(name, expressionMatrixSubset.geneCount(), expressionMatrixSubset.cellCount(),
+        [&expressionMatrixSubset](CellId localCellId, vector< pair<GeneId, float> >&, double& sum1)
+        {
+            sum1 = expressionMatrixSubset.sums[localCellId].sum1;
+            return expressionMatrixSubset.cellExpressionCounts[localCellId];
+        },
+        numaPolicy);
+}
 
-    // Compute the similarity table.
-    // This is a look up table indexed by the number of mismatching bits.
-    // Each entry contgains the similarity corresponding to that number
-    // of mismatching bits.
-    computeSimilarityTable();
+
+
+Lsh::Lsh(
+    const string& name,             // Name prefix for memory mapped files.
+    GeneId geneCount,               // Number of genes in the gene set in use.
+    CellId cellCount,               // Number of cells in the cell set in use.
+    const GetCellExpressionCounts& getCellExpressionCounts,
+    size_t lshCount,                // Number of LSH hyperplanes
+    uint32_t seed,                  // Seed to generate LSH hyperplanes.
+    numa::Policy numaPolicy         // NUMA placement of the signatures.
+    )
+{
+    // Store the Info object.
+    info.createNew(name + "-Info");
+    info->lshCount = lshCount;
+    info->cellCount = cellCount;
+
+    // Use all signature bits.
+    // This also computes the similarity table.
+    setPrefixBitCount(0);
+
+    // Generate the LSH vectors.
+    cout << timestamp << "Generating LSH vectors." << endl;
+    generateLshVectors(geneCount, lshCount, seed);
+
+    // Compute cell signatures.
+    cout << timestamp << "Computing cell LSH signatures." << endl;
+    computeCellLshSignatures(name, geneCount, cellCount,
+        [&getCellExpressionCounts](CellId localCellId, vector< pair<GeneId, float> >& counts, double& sum1)
+            -> const vector< pair<GeneId, float> >&
+        {
+            getCellExpressionCounts(localCellId, counts);
+            sum1 = 0.;
+            for(const auto& p: counts) {
+                sum1 += p.second;
+            }
+            return counts;
+        },
+        numaPolicy);
 }
 
 
@@ -56,47 +110,126 @@ Lsh::Lsh(
     // Compute the number of 64 bit words in each cell signature.
     signatureWordCount = (lshCount()-1)/64 + 1;
 
-    // Compute the similarity table.
-    // This is a look up table indexed by the number of mismatching bits.
-    // Each entry contgains the similarity corresponding to that number
-    // of mismatching bits.
-    computeSimilarityTable();
+    // Access the global CellIds, if they were stored.
+    if(filesystem::exists(name + "-CellIds")) {
+        cellIds.accessExistingReadOnly(name + "-CellIds");
+    }
+
+    // Use all signature bits.
+    // This also computes the similarity table.
+    setPrefixBitCount(0);
+}
+
+
+
+// Access an existing Lsh object as a view restricted to a subset of its cells.
+Lsh::Lsh(
+    const string& name,             // Name prefix for memory mapped files of the existing Lsh object.
+    const vector<CellId>& parentCellIds
+    )
+{
+    if(parentCellIds.empty()) {
+        throw runtime_error("Cannot create an LSH view with no cells.");
+    }
+
+    // Access the memory mapped data.
+    info.accessExistingReadOnly(name + "-Info");
+    signatures.accessExistingReadOnly(name + "-Signatures");
+
+    // Compute the number of 64 bit words in each cell signature.
+    signatureWordCount = (lshCount()-1)/64 + 1;
+
+    // Compute the signature offsets.
+    signatureOffsets.reserve(parentCellIds.size());
+    for(const CellId parentCellId: parentCellIds) {
+        if(parentCellId >= info->cellCount) {
+            throw runtime_error("Invalid cell id " + to_string(parentCellId) +
+                " for LSH view of " + name + ".");
+        }
+        signatureOffsets.push_back(parentCellId*signatureWordCount);
+    }
+
+    // Use all signature bits.
+    // This also computes the similarity table.
+    setPrefixBitCount(0);
+}
+
+
+
+// Create a new Lsh object, copying the signatures of an existing one
+// into a contiguous block.
+Lsh::Lsh(
+    const string& name,             // Name prefix for memory mapped files.
+    Lsh& source                     // The Lsh object to copy the signatures from.
+    )
+{
+    const CellId cellCount = source.cellCount();
+
+    // Store the Info object.
+    info.createNew(name + "-Info");
+    info->lshCount = source.lshCount();
+    info->cellCount = cellCount;
+    signatureWordCount = source.signatureWordCount;
+
+    // Copy the signatures.
+    signatures.createNew(name + "-Signatures", cellCount*signatureWordCount);
+    for(CellId cellId=0; cellId<cellCount; cellId++) {
+        const size_t sourceOffset = source.signatureOffsets.empty() ?
+            cellId*signatureWordCount : source.signatureOffsets[cellId];
+        copy(
+            source.signatures.begin() + sourceOffset,
+            source.signatures.begin() + sourceOffset + signatureWordCount,
+            signatures.begin() + cellId*signatureWordCount);
+    }
+
+    // Use all signature bits.
+    // This also computes the similarity table.
+    setPrefixBitCount(0);
 }
 
 
 // Generate the LSH vectors.
+// The components for each gene are generated using a separate random stream
+// derived from the seed and the gene id, so genes can be processed in parallel
+// and the result does not depend on the number of threads.
 void Lsh::generateLshVectors(
     size_t geneCount,
     size_t lshCount,                // Number of LSH hyperplanes
     uint32_t seed                   // Seed to generate LSH hyperplanes.
 )
 {
-    // Prepare to generate normally vector distributed components.
-    using RandomSource = boost::mt19937;
-    using NormalDistribution = boost::normal_distribution<>;
-    RandomSource randomSource(seed);
-    NormalDistribution normalDistribution;
-    boost::variate_generator<RandomSource, NormalDistribution> normalGenerator(randomSource, normalDistribution);
+    const CounterBasedRandom random(seed);
 
     // Allocate space for the LSH vectors.
     lshVectors.resize(geneCount, vector<double>(lshCount, 0.));
 
-    // Sum of the squares of the components of each of the LSH vectors.
-    vector<double> normalizationFactor(lshCount, 0.);
-
-
-
-    // Loop over genes.
-    for(size_t geneId = 0; geneId<geneCount; geneId++) {
+    // Generate normally distributed components, gene by gene.
+    // For each chunk of genes, also accumulate the sum of the squares
+    // of the components of each of the LSH vectors.
+    // The chunk size is fixed, so the partial sums are always the same.
+    const size_t grainSize = 64;
+    const size_t chunkCount = (geneCount == 0) ? 0 : ((geneCount - 1) / grainSize + 1);
+    vector< vector<double> > chunkNormalizationFactors(chunkCount, vector<double>(lshCount, 0.));
+    parallelForChunks(0, geneCount, [&](size_t chunkBegin, size_t chunkEnd)
+    {
+        vector<double>& chunkNormalizationFactor = chunkNormalizationFactors[chunkBegin / grainSize];
+        for(size_t geneId=chunkBegin; geneId!=chunkEnd; geneId++) {
+            CounterBasedRandom geneRandom = random.split(geneId);
+            boost::normal_distribution<> normalDistribution;
+            for(size_t lshVectorId = 0; lshVectorId<lshCount; lshVectorId++) {
+                const double x = normalDistribution(geneRandom);
+                lshVectors[geneId][lshVectorId] = x;
+                chunkNormalizationFactor[lshVectorId] += x*x;
+            }
+        }
+    }, grainSize);
 
-        // For this gene, generate the components of all the LSH vectors.
+    // Sum of the squares of the components of each of the LSH vectors,
+    // combining the chunks in order.
+    vector<double> normalizationFactor(lshCount, 0.);
+    for(const vector<double>& chunkNormalizationFactor: chunkNormalizationFactors) {
         for(size_t lshVectorId = 0; lshVectorId<lshCount; lshVectorId++) {
-
-            const double x = normalGenerator();
-            lshVectors[geneId][lshVectorId] = x;
-
-            // Update the sum of squares for this LSH vector.
-            normalizationFactor[lshVectorId] += x*x;
+            normalizationFactor[lshVectorId] += chunkNormalizationFactor[lshVectorId];
         }
     }
 
@@ -104,20 +237,27 @@ void Lsh::generateLshVectors(
     for(auto& f: normalizationFactor) {
         f = 1. / sqrt(f);
     }
-    for(size_t geneId = 0; geneId<geneCount; geneId++) {
+    parallelFor(0, geneCount, [&](size_t geneId)
+    {
         for(size_t lshVectorId = 0; lshVectorId<lshCount; lshVectorId++) {
             lshVectors[geneId][lshVectorId] *= normalizationFactor[lshVectorId];
         }
-    }
+    });
 
 }
 
 
 
 // Compute the LSH signatures of all cells in the cell set we are using.
-void Lsh::computeCellLshSignatures(
+// For each cell, getCell(localCellId, buffer, sum1) returns the expression counts
+// of the cell (which it can store in the buffer, owned by the calling thread)
+// and stores in sum1 the sum of its expression counts.
+template<class GetCell> void Lsh::computeCellLshSignatures(
     const string& name,             // Name prefix for memory mapped files.
-    const ExpressionMatrixSubset& expressionMatrixSubset)
+    GeneId geneCount,               // Number of genes in the gene set we are using.
+    CellId cellCount,               // Number of cells in the cell set we are using.
+    const GetCell& getCell,
+    numa::Policy numaPolicy)
 {
     // Get the number of LSH vectors.
     CZI_ASSERT(!lshVectors.empty());
@@ -126,9 +266,6 @@ void Lsh::computeCellLshSignatures(
     // Compute the number of 64 bit words in each cell signature.
     signatureWordCount = (lshCount-1)/64 + 1;
 
-    // Get the number of genes and cells in the gene set and cell set we are using.
-    const auto geneCount = expressionMatrixSubset.geneCount();
-    const auto cellCount = expressionMatrixSubset.cellCount();
     CZI_ASSERT(lshVectors.size() == geneCount);
 
     // Compute the sum of the components of each lsh vector.
@@ -146,69 +283,94 @@ void Lsh::computeCellLshSignatures(
     // Initialize the cell signatures.
     cout << timestamp << "Initializing cell LSH signatures." << endl;
     signatures.createNew(name + "-Signatures", cellCount*signatureWordCount);
-
-    // Vector to contain, for a single cell, the scalar products of the shifted
-    // expression vector for the cell with all of the LSH vectors.
-    vector<double> scalarProducts(lshCount);
-
-
+    if(numaPolicy != numa::Policy::none && numa::nodeCount() > 1) {
+        cout << timestamp << "Placing cell LSH signatures on NUMA nodes using policy " <<
+            numa::policyToString(numaPolicy) << "." << endl;
+        numa::writePlacement(cout, applyNumaPolicy(numaPolicy));
+    }
 
     // Loop over all the cells in the cell set we are using.
     // The CellId is local to the cell set we are using.
-    const CellId messageFrequency = CellId(1.e7 / double(lshCount));
-    cout << timestamp << "Computation of cell LSH signatures begins." << endl;
+    // Cells are processed in parallel. Each cell only writes to its own signature,
+    // which occupies whole 64-bit words, so no synchronization is needed.
+    // On NUMA systems, each slice of cells is processed by threads on the node
+    // that holds the corresponding signatures if the partitioned policy was used.
+    const CellId messageFrequency = std::max(CellId(1), CellId(1.e7 / double(lshCount)));
+    std::mutex messageMutex;
+    cout << timestamp << "Computation of cell LSH signatures begins using " <<
+        getEffectiveThreadCount() << " threads." << endl;
+    std::atomic<size_t> totalExpressionCount(0);
+    const numa::AllocationStatistics numaAllocationStatistics0;
     const auto t0 = std::chrono::steady_clock::now();
-    for(CellId localCellId=0; localCellId<cellCount; localCellId++) {
-        if((localCellId % messageFrequency) == 0) {
-            cout << timestamp << "Working on cell " << localCellId << " of " << cellCount << endl;
-        }
-
-        // Compute the mean of the expression vector for this cell.
-        const ExpressionMatrixSubset::Sum& sum = expressionMatrixSubset.sums[localCellId];
-        const double mean = sum.sum1 / double(geneCount);
-
-        // If U is one of the LSH vectors, we need to compute the scalar product
-        // s = X*U, where X is the cell expression vector, shifted to zero mean:
-        // X = x - mean,
-        // mean = sum(x)/geneCount (computed above).
-        // We get:
-        // s = (x-mean)*U = x*U - mean*U = x*U - mean*sum(U)
-        // We computed sum(U) above and stored it in lshVectorSums for
-        // each of the LSH vectors.
-        // Initialize the scalar products for this cell
-        // with all of the LSH vectors to -mean*sum(U).
-        for(size_t i=0; i<lshCount; i++) {
-            scalarProducts[i] = -mean * lshVectorsSums[i];
-        }
+    parallelForChunksByNode(0, cellCount, [&](size_t chunkBegin, size_t chunkEnd)
+    {
+        // Vector to contain, for a single cell, the scalar products of the shifted
+        // expression vector for the cell with all of the LSH vectors.
+        vector<double> scalarProducts(lshCount);
+
+        // Vector that getCell can use to store the expression counts of a single cell.
+        vector< pair<GeneId, float> > buffer;
+        size_t chunkExpressionCount = 0;
+
+        for(CellId localCellId=CellId(chunkBegin); localCellId!=CellId(chunkEnd); localCellId++) {
+            if((localCellId % messageFrequency) == 0) {
+                std::lock_guard<std::mutex> lock(messageMutex);
+                cout << timestamp << "Working on cell " << localCellId << " of " << cellCount << endl;
+            }
 
-        // Now add to each scalar product the x*U portion.
-        // For performance, the loop over genes is outside,
-        // which gives better memory locality.
-        // Add the contributions of the non-zero expression counts for this cell.
-        for(const auto& p : expressionMatrixSubset.cellExpressionCounts[localCellId]) {
-            const GeneId localGeneId = p.first;
-            const double count = double(p.second);
-
-            // Add the contribution of this gene to the scalar products.
-            const auto& v = lshVectors[localGeneId];
-            CZI_ASSERT(v.size() == lshCount);
+            // Get the expression counts for this cell
+            // and compute the mean of its expression vector.
+            double sum1;
+            const auto& counts = getCell(localCellId, buffer, sum1);
+            chunkExpressionCount += counts.size();
+            const double mean = sum1 / double(geneCount);
+
+            // If U is one of the LSH vectors, we need to compute the scalar product
+            // s = X*U, where X is the cell expression vector, shifted to zero mean:
+            // X = x - mean,
+            // mean = sum(x)/geneCount (computed above).
+            // We get:
+            // s = (x-mean)*U = x*U - mean*U = x*U - mean*sum(U)
+            // We computed sum(U) above and stored it in lshVectorSums for
+            // each of the LSH vectors.
+            // Initialize the scalar products for this cell
+            // with all of the LSH vectors to -mean*sum(U).
             for(size_t i=0; i<lshCount; i++) {
-                scalarProducts[i] += count * v[i];
+                scalarProducts[i] = -mean * lshVectorsSums[i];
             }
-        }
 
-        // Set to 1 the signature bits corresponding to positive scalar products.
-        BitSetPointer cellSignature = getSignature(localCellId);
-        for(size_t i=0; i<lshCount; i++) {
-            if(scalarProducts[i]>0.) {
-                cellSignature.set(i);
+            // Now add to each scalar product the x*U portion.
+            // For performance, the loop over genes is outside,
+            // which gives better memory locality.
+            // Add the contributions of the non-zero expression counts for this cell.
+            for(const auto& p : counts) {
+                const GeneId localGeneId = p.first;
+                const double count = double(p.second);
+
+                // Add the contribution of this gene to the scalar products.
+                const auto& v = lshVectors[localGeneId];
+                CZI_ASSERT(v.size() == lshCount);
+                for(size_t i=0; i<lshCount; i++) {
+                    scalarProducts[i] += count * v[i];
+                }
             }
-        }
 
-    }
+            // Set to 1 the signature bits corresponding to positive scalar products.
+            BitSetPointer cellSignature = getSignature(localCellId);
+            for(size_t i=0; i<lshCount; i++) {
+                if(scalarProducts[i]>0.) {
+                    cellSignature.set(i);
+                }
+            }
+        }
+        totalExpressionCount += chunkExpressionCount;
+    });
     const auto t1 = std::chrono::steady_clock::now();
     cout << timestamp << "Computation of cell LSH signatures ends." << endl;
-    const size_t nonZeroExpressionCount = expressionMatrixSubset.totalExpressionCounts();
+    if(numa::nodeCount() > 1) {
+        numa::AllocationStatistics().writeChanges(cout, numaAllocationStatistics0);
+    }
+    const size_t nonZeroExpressionCount = totalExpressionCount;
     cout << "Processed " << nonZeroExpressionCount << " non-zero expression counts for ";
     cout << geneCount << " genes and " << cellCount << " cells." << endl;
     cout << "Average number of expression counts per cell  is " << double(nonZeroExpressionCount) / double(cellCount) << endl;
@@ -225,52 +387,93 @@ void Lsh::computeCellLshSignatures(
 
 
 
-// Compute the similarity (cosine of the angle) corresponding to each number of mismatching bits.
+// Use only the first bitCount bits of each signature.
+// See Lsh.hpp for details.
+void Lsh::setPrefixBitCount(size_t bitCount)
+{
+    if(bitCount == 0) {
+        bitCount = lshCount();
+    }
+    if(bitCount > lshCount()) {
+        throw runtime_error("Requested " + std::to_string(bitCount) +
+            " LSH signature bits, but only " + std::to_string(lshCount()) +
+            " are available.");
+    }
+    prefixBitCount = bitCount;
+    prefixWordCount = (bitCount-1)/64 + 1;
+
+    // Compute the similarity table.
+    // This is a look up table indexed by the number of mismatching bits.
+    // Each entry contgains the similarity corresponding to that number
+    // of mismatching bits.
+    computeSimilarityTable();
+}
+
+
+
+// Compute the similarity (cosine of the angle) corresponding to each number of mismatching bits,
+// for the signature prefix in use.
 void Lsh::computeSimilarityTable()
 {
     // Initialize the similarity table.
-    similarityTable.resize(lshCount() + 1);
+    similarityTable.resize(bitCount() + 1);
 
     // Loop over all possible numbers of mismatching bits.
     for(size_t mismatchingBitCount = 0;
-        mismatchingBitCount <= lshCount(); mismatchingBitCount++) {
+        mismatchingBitCount <= bitCount(); mismatchingBitCount++) {
+        similarityTable[mismatchingBitCount] =
+            computeSimilarity(mismatchingBitCount, bitCount());
+    }
+
+}
 
-        // Compute the angle between the vectors corresponding to
-        // this number of mismatching bits.
-        const double angle = double(mismatchingBitCount) *
-            boost::math::double_constants::pi / double(lshCount());
 
-        // The cosine of the angle is the similarity for
-        // this number of mismatcning bits.
-        CZI_ASSERT(mismatchingBitCount < similarityTable.size());
-        similarityTable[mismatchingBitCount] = std::cos(angle);
-    }
 
+// The LSH similarity corresponding to a number of mismatching bits
+// out of bitCount signature bits.
+double Lsh::computeSimilarity(size_t mismatchCount, size_t bitCount)
+{
+    // Compute the angle between the vectors corresponding to
+    // this number of mismatching bits.
+    const double angle = double(mismatchCount) *
+        boost::math::double_constants::pi / double(bitCount);
+
+    // The cosine of the angle is the similarity for
+    // this number of mismatcning bits.
+    return std::cos(angle);
 }
 
 
 // Compute the LSH similarity between two cells,
 // specified by their ids local to the cell set used by this Lsh object.
 double Lsh::computeCellSimilarity(CellId localCellId0, CellId localCellId1)
+{
+    // Return the similarity corresponding to the number of mismatching bits.
+    return similarityTable[computeMismatchCount(localCellId0, localCellId1)];
+}
+size_t Lsh::computeMismatchCount(CellId localCellId0, CellId localCellId1)
 {
     // Access the LSH signatures for the two cells.
     const BitSetPointer signature0 = getSignature(localCellId0);
     const BitSetPointer signature1 = getSignature(localCellId1);
 
     // Count the number of bits where the signatures of these two cells disagree.
-    const size_t mismatchingBitCount = countMismatches(signature0, signature1);
+    return countMismatches(signature0, signature1, prefixBitCount);
+}
+
 
-    // Return the similarity corresponding to this number of mismatching bits.
-    return similarityTable[mismatchingBitCount];
+
+// Same, using the first bitCount bits of each signature.
+double Lsh::computeCellSimilarity(CellId localCellId0, CellId localCellId1, size_t bitCount)
+{
+    return computeSimilarity(computeMismatchCount(localCellId0, localCellId1, bitCount), bitCount);
 }
-size_t Lsh::computeMismatchCount(CellId localCellId0, CellId localCellId1)
+size_t Lsh::computeMismatchCount(CellId localCellId0, CellId localCellId1, size_t bitCount)
 {
-    // Access the LSH signatures for the two cells.
+    CZI_ASSERT(bitCount <= lshCount());
     const BitSetPointer signature0 = getSignature(localCellId0);
     const BitSetPointer signature1 = getSignature(localCellId1);
-
-    // Count the number of bits where the signatures of these two cells disagree.
-    return countMismatches(signature0, signature1);
+    return countMismatches(signature0, signature1, bitCount);
 }
 
 
@@ -289,14 +492,14 @@ void Lsh::writeSignatureStatistics(ostream& csv)
 
         // Count the number of cells that have this bit set.
         size_t setCount = 0;
-        for(CellId cellId = 0; cellId < info->cellCount; cellId++) {
+        for(CellId cellId = 0; cellId < cellCount(); cellId++) {
             if(getSignature(cellId).get(i)) {
                 ++setCount;
             }
         }
-        const size_t unsetCount = info->cellCount - setCount;
+        const size_t unsetCount = cellCount() - setCount;
 
-        csv << i << "," << setCount << "," << unsetCount << "," << info->cellCount << "\n";
+        csv << i << "," << setCount << "," << unsetCount << "," << cellCount() << "\n";
 
     }
 
@@ -305,7 +508,26 @@ void Lsh::writeSignatureStatistics(ostream& csv)
 
 void Lsh::remove()
 {
+    if(isView()) {
+        throw runtime_error("Cannot remove an LSH view.");
+    }
     signatures.remove();
     info.remove();
+    if(cellIds.isOpen) {
+        cellIds.remove();
+    }
+}
+
+
+
+// Store the global CellIds of the cells of this Lsh object.
+void Lsh::storeCellIds(
+    const string& name,             // Name prefix for memory mapped files.
+    const MemoryMapped::Vector<CellId>& cellSet)
+{
+    CZI_ASSERT(!isView());
+    CZI_ASSERT(cellSet.size() == cellCount());
+    cellIds.createNew(name + "-CellIds", cellSet.size());
+    copy(cellSet.begin(), cellSet.end(), cellIds.begin());
 }
 
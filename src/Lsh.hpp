@@ -11,6 +11,7 @@
 #include "Ids.hpp"
 #include "MemoryMappedObject.hpp"
 #include "MemoryMappedVector.hpp"
+#include "numa.hpp"
 
 // OpenCL
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
@@ -20,7 +21,9 @@
 // Standard libraries.
 #include "cstddef.hpp"
 #include "cstdint.hpp"
+#include <functional>
 #include "memory.hpp"
+#include "utility.hpp"
 #include "vector.hpp"
 
 namespace ChanZuckerberg {
@@ -42,7 +45,30 @@ public:
         const string& name,             // Name prefix for memory mapped files.
         const ExpressionMatrixSubset&,  // For a subset of genes and cells.
         size_t lshCount,                // Number of LSH hyperplanes
-        uint32_t seed                   // Seed to generate LSH hyperplanes.
+        uint32_t seed,                  // Seed to generate LSH hyperplanes.
+        numa::Policy numaPolicy = numa::Policy::none    // NUMA placement of the signatures.
+        );
+
+    // Function used to obtain the expression counts of a cell,
+    // specified by its CellId local to the cell set in use.
+    // It must store in its second argument the expression counts
+    // for the genes of the gene set in use, each with its local GeneId,
+    // sorted by local GeneId.
+    // It is called concurrently by multiple threads.
+    using GetCellExpressionCounts = std::function<void(CellId, vector< pair<GeneId, float> >&)>;
+
+    // Create a new Lsh object and store it on disk, obtaining
+    // the expression counts of each cell from the given function.
+    // This does not require the expression counts to be stored
+    // contiguously in an ExpressionMatrixSubset.
+    Lsh(
+        const string& name,             // Name prefix for memory mapped files.
+        GeneId geneCount,               // Number of genes in the gene set in use.
+        CellId cellCount,               // Number of cells in the cell set in use.
+        const GetCellExpressionCounts&,
+        size_t lshCount,                // Number of LSH hyperplanes
+        uint32_t seed,                  // Seed to generate LSH hyperplanes.
+        numa::Policy numaPolicy = numa::Policy::none    // NUMA placement of the signatures.
         );
 
     // Access an existing Lsh object.
@@ -50,21 +76,96 @@ public:
         const string& name              // Name prefix for memory mapped files.
         );
 
+    // Access an existing Lsh object as a view restricted to a subset of its cells.
+    // Local CellId i of the view corresponds to local CellId parentCellIds[i]
+    // of the existing Lsh object. The view uses the signatures of the existing
+    // Lsh object in place, through a table of signature offsets,
+    // so no signatures are computed or copied.
+    Lsh(
+        const string& name,             // Name prefix for memory mapped files of the existing Lsh object.
+        const vector<CellId>& parentCellIds
+        );
+
+    // Create a new Lsh object and store it on disk, copying
+    // into a contiguous block the signatures of all the cells of an existing
+    // Lsh object, which is typically a view. All lshCount bits are copied.
+    Lsh(
+        const string& name,             // Name prefix for memory mapped files.
+        Lsh&                            // The Lsh object to copy the signatures from.
+        );
+
     // Remove the memory mapped files.
+    // This cannot be called for a view.
     void remove();
 
+    // Return true if this Lsh object is a view of another Lsh object.
+    bool isView() const
+    {
+        return !signatureOffsets.empty();
+    }
+
+    // Store the global CellIds of the cells of this Lsh object,
+    // indexed by local CellId. ExpressionMatrix uses them to create views
+    // of this Lsh object for cell sets contained in its cell set.
+    void storeCellIds(
+        const string& name,             // Name prefix for memory mapped files.
+        const MemoryMapped::Vector<CellId>& cellSet);
+
+    // Return true if the global CellIds were stored.
+    // This is false for Lsh objects created before they were stored,
+    // and for views.
+    bool hasCellIds() const
+    {
+        return cellIds.isOpen;
+    }
+    CellId getCellId(CellId localCellId) const
+    {
+        return cellIds[localCellId];
+    }
+
+    // Place the signatures on the NUMA nodes according to a policy (see numa.hpp).
+    vector<size_t> applyNumaPolicy(numa::Policy policy) const
+    {
+        return signatures.applyNumaPolicy(policy);
+    }
+
+    // Use only the first bitCount bits of each signature (a signature prefix).
+    // The LSH vectors are generated in the same order regardless of lshCount,
+    // so a prefix of bitCount bits is identical to the signature that would be
+    // computed with lshCount equal to bitCount and the same seed.
+    // This allows using any number of bits up to lshCount without
+    // recomputing or copying the signatures.
+    // After this call, bitCount, wordCount, getSignature, getSimilarity,
+    // computeCellSimilarity, computeMismatchCount, and
+    // computeMismatchCountThresholdFromSimilarityThreshold all refer to the prefix.
+    // A bitCount of 0 uses all lshCount bits, which is also the initial state.
+    void setPrefixBitCount(size_t bitCount);
+
     // Compute the LSH similarity between two cells,
     // specified by their ids local to the cell set used by this Lsh object.
     double computeCellSimilarity(CellId localCellId0, CellId localCellId1);
     size_t computeMismatchCount(CellId localCellId0, CellId localCellId1);
 
+    // Same, using the first bitCount bits of each signature,
+    // regardless of the prefix set by setPrefixBitCount.
+    double computeCellSimilarity(CellId localCellId0, CellId localCellId1, size_t bitCount);
+    size_t computeMismatchCount(CellId localCellId0, CellId localCellId1, size_t bitCount);
+
+    // The LSH similarity corresponding to a number of mismatching bits
+    // out of bitCount signature bits.
+    static double computeSimilarity(size_t mismatchCount, size_t bitCount);
+
 
     // Get the signature corresponding to a given CellId (local to the cell set).
+    // This contains the words of the signature prefix in use.
+    // If the prefix does not end at a word boundary,
+    // the last word also contains bits past the prefix.
     BitSetPointer getSignature(CellId cellId)
     {
-        const size_t offset = cellId*signatureWordCount;    // Offset of the signature of this cell (in 64 bit words)
+        // Offset of the signature of this cell (in 64 bit words)
+        const size_t offset = signatureOffsets.empty() ? cellId*signatureWordCount : signatureOffsets[cellId];
         size_t* pointer = &(signatures[offset]);            // Pointer to the signature of this cell (as uint64_t words)
-        return BitSetPointer(pointer, signatureWordCount);
+        return BitSetPointer(pointer, prefixWordCount);
     }
 
     void writeSignatureStatistics(const string& csvFileName);
@@ -72,15 +173,23 @@ public:
 
     CellId cellCount() const
     {
-        return CellId(info->cellCount);
+        return signatureOffsets.empty() ? CellId(info->cellCount) : CellId(signatureOffsets.size());
     }
+    // The number of signature bits stored.
     size_t lshCount() const
     {
         return info->lshCount;
     }
+
+    // The number of signature bits in use and the number of
+    // 64-bit words they occupy (see setPrefixBitCount).
+    size_t bitCount() const
+    {
+        return prefixBitCount;
+    }
     size_t wordCount() const
     {
-        return signatureWordCount;
+        return prefixWordCount;
     }
 
     size_t computeMismatchCountThresholdFromSimilarityThreshold(
@@ -120,15 +229,34 @@ private:
     // The number of 64 bit words in each cell signature.
     size_t signatureWordCount;
 
+    // The number of signature bits in use and the number of
+    // 64-bit words they occupy (see setPrefixBitCount).
+    size_t prefixBitCount;
+    size_t prefixWordCount;
+
     // The LSH signatures of all cells in the cell set we are using.
     // Each cell signature is a vector of bits.
     // The bit is 1 if the scalar product of the cell shifted expression vector
     // with the LSH vector corresponding to the bit position is positive,
     // and negative otherwise.
     MemoryMapped::Vector<uint64_t> signatures;
-    void computeCellLshSignatures(const string& name, const ExpressionMatrixSubset&);
 
-    // The similarity (cosine of the angle) corresponding to each number of mismatching bits.
+    // For a view, the offset (in 64 bit words) of the signature
+    // of each cell of the view in the signatures vector.
+    // Empty if this is not a view.
+    vector<size_t> signatureOffsets;
+
+    // The global CellIds of the cells, if stored (see storeCellIds).
+    MemoryMapped::Vector<CellId> cellIds;
+    template<class GetCell> void computeCellLshSignatures(
+        const string& name,
+        GeneId geneCount,
+        CellId cellCount,
+        const GetCell&,
+        numa::Policy);
+
+    // The similarity (cosine of the angle) corresponding to each number of mismatching bits,
+    // for the signature prefix in use.
     vector<double> similarityTable;
     void computeSimilarityTable();
 
@@ -164,9 +292,24 @@ private:
 
         void writeDeviceInformation(ostream&) const;
         string deviceName() const;
+        string deviceTypeName() const;
 
         bool isInitialized = false;
 
+        // The type of the device in use and its number of compute units.
+        // The device can be a CPU when using a CPU OpenCL runtime.
+        cl_device_type deviceType;
+        size_t computeUnitCount;
+
+        // The work group size for each kernel, chosen for the type of device in use.
+        size_t kernel0WorkGroupSize;
+        size_t kernel1WorkGroupSize;
+        size_t kernel2WorkGroupSize;
+        size_t kernel3WorkGroupSize;
+
+        // Run a kernel on n work items.
+        void runKernel(cl::Kernel&, size_t workGroupSize, size_t n);
+
         shared_ptr<cl::Buffer> mismatchBuffer;
         size_t mismatchBufferSize;
         uint16_t* mismatchBufferHostPointer;
@@ -206,9 +349,9 @@ private:
             );
 
     private:
-        void choosePlatform();
         void chooseDevice();
         void buildProgram();
+        size_t chooseWorkGroupSize(const cl::Kernel&) const;
     };
     Gpu gpu;
 public:
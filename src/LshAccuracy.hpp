@@ -0,0 +1,85 @@
+#ifndef CZI_EXPRESSION_MATRIX2_LSH_ACCURACY_HPP
+#define CZI_EXPRESSION_MATRIX2_LSH_ACCURACY_HPP
+
+
+
+/*******************************************************************************
+
+Classes used to return the results of ExpressionMatrix::estimateLshAccuracy,
+which compares LSH and exact similarities on a sample of cell pairs.
+
+The sample contains random pairs, which mostly have low similarity,
+plus the exact k nearest neighbors of a sample of query cells,
+found among a sample of reference cells, which have high similarity.
+Pairs are binned by their exact similarity.
+
+For each bin we report the bias and RMS of the difference between
+LSH and exact similarity, and the recall@k: the fraction of
+exact k nearest neighbors in the bin that are also among
+the k nearest neighbors according to LSH similarity.
+
+All confidence intervals are 95% intervals.
+For bias and RMS they use the normal approximation
+for the mean of the differences and the mean of their squares.
+For recall they use the Wilson score interval.
+
+*******************************************************************************/
+
+#include "cstddef.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class LshAccuracyBin;
+        class LshAccuracy;
+
+        // Compute the 95% Wilson score interval for a proportion.
+        void computeWilsonScoreInterval(
+            size_t successCount,
+            size_t trialCount,
+            double& low,
+            double& high);
+    }
+}
+
+
+
+// Statistics for the pairs with exact similarity in [minSimilarity, maxSimilarity).
+class ChanZuckerberg::ExpressionMatrix2::LshAccuracyBin {
+public:
+    double minSimilarity = 0.;
+    double maxSimilarity = 0.;
+
+    // Difference between LSH and exact similarity.
+    size_t pairCount = 0;
+    double bias = 0.;
+    double biasLow = 0.;
+    double biasHigh = 0.;
+    double rms = 0.;
+    double rmsLow = 0.;
+    double rmsHigh = 0.;
+
+    // Recall of the exact k nearest neighbors in this bin.
+    size_t neighborCount = 0;
+    size_t foundNeighborCount = 0;
+    double recall = 0.;
+    double recallLow = 0.;
+    double recallHigh = 0.;
+};
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::LshAccuracy {
+public:
+
+    // The number of LSH bits used.
+    size_t lshBitCount = 0;
+
+    // Statistics for each bin of exact similarity.
+    vector<LshAccuracyBin> bins;
+
+    // Statistics for all pairs.
+    LshAccuracyBin total;
+};
+
+#endif
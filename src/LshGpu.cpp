@@ -9,6 +9,11 @@
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
+#include "algorithm.hpp"
+#include "iostream.hpp"
+#include "stdexcept.hpp"
+#include <cstdlib>
+
 
 
 void Lsh::initializeGpu()
@@ -26,12 +31,21 @@ void Lsh::Gpu::initialize()
     }
 
     try {
-        choosePlatform();
         chooseDevice();
         context = cl::Context(device);
         queue = cl::CommandQueue(context, device);
         buildProgram();
 
+        // Choose work group sizes for our kernels.
+        kernel0WorkGroupSize = chooseWorkGroupSize(kernel0);
+        kernel1WorkGroupSize = chooseWorkGroupSize(kernel1);
+        kernel2WorkGroupSize = chooseWorkGroupSize(kernel2);
+        kernel3WorkGroupSize = chooseWorkGroupSize(kernel3);
+        cout << "Using OpenCL device " << deviceName() << " of type " << deviceTypeName() <<
+            " with " << computeUnitCount << " compute units and work group sizes " <<
+            kernel0WorkGroupSize << " " << kernel1WorkGroupSize << " " <<
+            kernel2WorkGroupSize << " " << kernel3WorkGroupSize << "." << endl;
+
         // Mark it as initialized.
         isInitialized = true;
 
@@ -44,39 +58,132 @@ void Lsh::Gpu::initialize()
 }
 
 
-void Lsh::Gpu::choosePlatform()
+
+// Choose the OpenCL device to use.
+// We look at the devices of all platforms, so a CPU runtime
+// such as PoCL can be used even if it is not the first platform,
+// or if it is the only one. We use the first GPU we find,
+// otherwise the first accelerator, otherwise the first device of any type.
+// Environment variable EXPRESSION_MATRIX2_OPENCL_DEVICE_TYPE,
+// if set to gpu, cpu, or accelerator, restricts the choice
+// to devices of that type.
+void Lsh::Gpu::chooseDevice()
 {
+    // Get the requested device type, if any.
+    cl_device_type requestedDeviceType = CL_DEVICE_TYPE_ALL;
+    const char* environmentValue = std::getenv("EXPRESSION_MATRIX2_OPENCL_DEVICE_TYPE");
+    if(environmentValue) {
+        const string value = environmentValue;
+        if(value == "gpu") {
+            requestedDeviceType = CL_DEVICE_TYPE_GPU;
+        } else if(value == "cpu") {
+            requestedDeviceType = CL_DEVICE_TYPE_CPU;
+        } else if(value == "accelerator") {
+            requestedDeviceType = CL_DEVICE_TYPE_ACCELERATOR;
+        } else {
+            cout << "Ignoring invalid value of EXPRESSION_MATRIX2_OPENCL_DEVICE_TYPE: " <<
+                value << endl;
+        }
+    }
+
     // Get the platforms supported on the current system.
-     vector<cl::Platform> platforms;
-     cl::Platform::get(&platforms);
-     if(platforms.empty()){
-         throw runtime_error("No OpenCL plaform found.");
-     }
+    vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    if(platforms.empty()){
+        throw runtime_error("No OpenCL plaform found.");
+    }
 
-     // Use the first platform we found.
-     platform = platforms.front();
+    // Loop over devices of all platforms, keeping the best one.
+    // Rank 0 is best.
+    const auto rank = [](cl_device_type type) {
+        if(type & CL_DEVICE_TYPE_GPU) {
+            return 0;
+        } else if(type & CL_DEVICE_TYPE_ACCELERATOR) {
+            return 1;
+        } else {
+            return 2;
+        }
+    };
+    bool found = false;
+    for(const cl::Platform& p: platforms) {
+        vector<cl::Device> devices;
+        try {
+            p.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        } catch(cl::Error) {
+            // This platform has no devices.
+            continue;
+        }
+        for(const cl::Device& d: devices) {
+            const cl_device_type type = d.getInfo<CL_DEVICE_TYPE>();
+            if(!(type & requestedDeviceType)) {
+                continue;
+            }
+            if(!found || rank(type) < rank(deviceType)) {
+                platform = p;
+                device = d;
+                deviceType = type;
+                found = true;
+            }
+        }
+    }
+    if(!found) {
+        throw runtime_error("No OpenCL device found.");
+    }
 
+    computeUnitCount = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
 }
 
-void Lsh::Gpu::chooseDevice()
+
+
+// Choose the work group size for a kernel, depending on the device type.
+// The kernels do a large amount of work per work item
+// and don't use local memory, so the work group size
+// only affects how work items are mapped to the hardware.
+// On a GPU, a work group runs on a single compute unit,
+// in lockstep in units of the preferred work group size multiple
+// (the warp or wavefront size), and we use a few of those
+// to help hide memory latency.
+// On a CPU runtime, each work group is run by a single thread,
+// with work items mapped to the lanes of SIMD instructions,
+// and the preferred work group size multiple is the SIMD width.
+// Using just that keeps work groups small, so there are
+// enough of them to keep all cores busy and balance the load.
+size_t Lsh::Gpu::chooseWorkGroupSize(const cl::Kernel& kernel) const
 {
-    // Get the devices of this platform.
-    vector<cl::Device> devices;
-    platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
-    if(devices.empty()){
-        throw runtime_error("No OpenCL device found.");
-    }
+    const size_t maxWorkGroupSize =
+        kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    const size_t multiple =
+        kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+    const size_t workGroupSize = (deviceType & CL_DEVICE_TYPE_CPU) ? multiple : 4 * multiple;
+    return max(size_t(1), min(workGroupSize, maxWorkGroupSize));
+}
+
 
-    // Use the first device we found.
-    device = devices.front();
+
+// Run a kernel on n work items.
+// The global size is rounded up to a multiple of the work group size,
+// and the kernels ignore the work items beyond n.
+// For small n, the work group size is reduced
+// so there is at least one work group per compute unit.
+void Lsh::Gpu::runKernel(cl::Kernel& kernel, size_t workGroupSize, size_t n)
+{
+    size_t localSize = workGroupSize;
+    while(localSize > 1 && localSize * computeUnitCount > n) {
+        localSize /= 2;
+    }
+    const size_t globalSize = ((n + localSize - 1) / localSize) * localSize;
+    queue.enqueueNDRangeKernel(kernel,
+        cl::NullRange, cl::NDRange(globalSize), cl::NDRange(localSize));
 }
 
 
+
 void Lsh::Gpu::writeDeviceInformation(ostream& s) const
 {
     CZI_ASSERT(isInitialized);
 
     s << "CL_DEVICE_NAME "<< device.getInfo<CL_DEVICE_NAME>() << endl;
+    s << "CL_DEVICE_TYPE "<< deviceTypeName() << endl;
     s << "CL_DEVICE_VENDOR "<< device.getInfo<CL_DEVICE_VENDOR>() << endl;
     s << "CL_DRIVER_VERSION "<< device.getInfo<CL_DRIVER_VERSION>() << endl;
     s << "CL_DEVICE_PROFILE "<< device.getInfo<CL_DEVICE_PROFILE>() << endl;
@@ -100,18 +207,33 @@ void Lsh::Gpu::writeDeviceInformation(ostream& s) const
 
 string Lsh::getGpuName() const
 {
+    CZI_ASSERT(gpu.isInitialized);
     return gpu.deviceName();
 }
 
 
 string Lsh::Gpu::deviceName() const
 {
-    CZI_ASSERT(isInitialized);
     return device.getInfo<CL_DEVICE_NAME>();
 }
 
 
 
+string Lsh::Gpu::deviceTypeName() const
+{
+    if(deviceType & CL_DEVICE_TYPE_GPU) {
+        return "gpu";
+    } else if(deviceType & CL_DEVICE_TYPE_CPU) {
+        return "cpu";
+    } else if(deviceType & CL_DEVICE_TYPE_ACCELERATOR) {
+        return "accelerator";
+    } else {
+        return "other";
+    }
+}
+
+
+
 void Lsh::Gpu::buildProgram()
 {
     // Define a C++ string named "code" containing the OpenCL code.
@@ -149,10 +271,31 @@ void Lsh::loadSignaturesToGpu()
     gpu.signatureBuffer =
         cl::Buffer(gpu.context, CL_MEM_READ_WRITE, signatureBufferSize);
 
-    gpu.queue.enqueueWriteBuffer(
-        gpu.signatureBuffer, CL_TRUE, 0,
-        signatureBufferSize,
-        signatures.begin());
+    // If we are using a signature prefix (see setPrefixBitCount),
+    // the kernels expect signatures of wordCount() words each,
+    // so we load a copy of the prefixes, with the bits past
+    // the prefix cleared. For a view, we also have to gather
+    // the signatures of the cells of the view.
+    if(bitCount() == lshCount() && !isView()) {
+        gpu.queue.enqueueWriteBuffer(
+            gpu.signatureBuffer, CL_TRUE, 0,
+            signatureBufferSize,
+            signatures.begin());
+    } else {
+        vector<uint64_t> prefixes(cellCount()*wordCount());
+        const size_t remainingBitCount = bitCount() & 63;
+        const uint64_t lastWordMask = remainingBitCount ? (~0ULL << (64 - remainingBitCount)) : ~0ULL;
+        for(CellId cellId=0; cellId<cellCount(); cellId++) {
+            const BitSetPointer signature = getSignature(cellId);
+            uint64_t* prefix = prefixes.data() + cellId*wordCount();
+            copy(signature.begin, signature.end, prefix);
+            prefix[wordCount()-1] &= lastWordMask;
+        }
+        gpu.queue.enqueueWriteBuffer(
+            gpu.signatureBuffer, CL_TRUE, 0,
+            signatureBufferSize,
+            prefixes.data());
+    }
     gpu.queue.finish();
 
 }
@@ -189,8 +332,7 @@ void Lsh::gpuKernel0(CellId cellId0)
 
         // Run the kernel.
         gpu.kernel0.setArg(3, cellId0);
-        gpu.queue.enqueueNDRangeKernel(gpu.kernel0,
-            cl::NullRange, cl::NDRange(cellCount()), cl::NullRange);
+        gpu.runKernel(gpu.kernel0, gpu.kernel0WorkGroupSize, cellCount());
 
         // Get back the results.
         gpu.queue.enqueueReadBuffer(*(gpu.mismatchBuffer), CL_TRUE, 0,
@@ -249,8 +391,7 @@ void Lsh::gpuKernel1(CellId cellId0Begin, CellId cellId0End)
         // Run the kernel.
         gpu.kernel1.setArg(3, cellId0Begin);
         gpu.kernel1.setArg(4, cellId0End);
-        gpu.queue.enqueueNDRangeKernel(gpu.kernel1,
-            cl::NullRange, cl::NDRange(cellCount()), cl::NullRange);
+        gpu.runKernel(gpu.kernel1, gpu.kernel1WorkGroupSize, cellCount());
 
         // Get back the results.
         gpu.queue.enqueueReadBuffer(*(gpu.mismatchBuffer), CL_TRUE, 0,
@@ -351,8 +492,8 @@ void Lsh::gpuKernel2(CellId cellId0Begin, CellId cellId0End)
 
         // Run the kernel.
         gpu.kernel2.setArg(2, uint64_t(cellId0Begin));
-        gpu.queue.enqueueNDRangeKernel(gpu.kernel2,
-            cl::NullRange, cl::NDRange(cellId0End-cellId0Begin), cl::NullRange);
+        gpu.kernel2.setArg(8, uint64_t(cellId0End));
+        gpu.runKernel(gpu.kernel2, gpu.kernel2WorkGroupSize, cellId0End-cellId0Begin);
 
         // Get back the results.
         gpu.queue.enqueueReadBuffer(*(gpu.neighborsBuffer), CL_TRUE, 0,
@@ -475,8 +616,8 @@ void Lsh::gpuKernel3(CellId cellId0Begin, CellId cellId0End)
 
         // Run the kernel.
         gpu.kernel3.setArg(1, uint64_t(cellId0Begin));
-        gpu.queue.enqueueNDRangeKernel(gpu.kernel3,
-            cl::NullRange, cl::NDRange(cellId0End-cellId0Begin), cl::NullRange);
+        gpu.kernel3.setArg(10, uint64_t(cellId0End));
+        gpu.runKernel(gpu.kernel3, gpu.kernel3WorkGroupSize, cellId0End-cellId0Begin);
 
         // Get back the results.
         gpu.queue.enqueueReadBuffer(*(gpu.neighborsBuffer), CL_TRUE, 0,
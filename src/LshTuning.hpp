@@ -0,0 +1,112 @@
+#ifndef CZI_EXPRESSION_MATRIX2_LSH_TUNING_HPP
+#define CZI_EXPRESSION_MATRIX2_LSH_TUNING_HPP
+
+
+
+/*******************************************************************************
+
+Classes used to return the results of ExpressionMatrix::tuneLsh,
+which chooses parameters for findSimilarPairs5 and findSimilarPairs7
+that achieve a requested recall@k at the lowest cost.
+
+For a sample of query cells, we find the exact k nearest neighbors
+by checking all cells. For each configuration of parameters, we then predict
+which of those neighbors the LSH algorithm would return,
+and how many candidate cells it would check for each cell.
+
+To save time, the exact neighbors can instead be searched only among
+the cells with the best LSH similarity using all signature bits.
+Neighbors that LSH ranks poorly are then missed, and they are also
+the ones that the LSH algorithm tends to miss, so the predicted
+recall is higher than the actual recall.
+
+Smaller values of lshCount are evaluated using the first lshCount bits
+of the existing signatures. These are identical to the signatures
+that computeLshSignatures would compute with the same seed and
+that value of lshCount, so the existing signatures can also be used
+by passing lshCount as lshBitCount to findSimilarPairs5 or findSimilarPairs7.
+
+The number of cells in each bucket of the query cells,
+and the number of candidates checked, are estimated using
+a random sample of reference cells.
+
+The cost of a configuration is the predicted number of
+64-bit signature words compared for each cell, plus the number
+of buckets looked up for each cell.
+
+*******************************************************************************/
+
+#include "Ids.hpp"
+#include "string.hpp"
+#include "vector.hpp"
+
+#include "cstddef.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class LshConfiguration;
+        class LshTuning;
+    }
+}
+
+
+
+// A set of parameters for findSimilarPairs5 or findSimilarPairs7,
+// with its predicted recall and cost.
+class ChanZuckerberg::ExpressionMatrix2::LshConfiguration {
+public:
+
+    // "findSimilarPairs5" or "findSimilarPairs7".
+    string algorithm;
+
+    // The number of LSH signature bits, to be used in computeLshSignatures,
+    // or as lshBitCount in findSimilarPairs5 or findSimilarPairs7.
+    size_t lshCount = 0;
+
+    // The slice lengths. For findSimilarPairs5, this contains a single slice length.
+    vector<int> lshSliceLengths;
+
+    // Only used by findSimilarPairs5 (0 = no limit).
+    size_t bucketOverflow = 0;
+
+    // Only used by findSimilarPairs7.
+    CellId maxCheck = 0;
+    size_t log2BucketCount = 0;
+
+    // Predicted recall@k, with its 95% confidence interval.
+    double recall = 0.;
+    double recallLow = 0.;
+    double recallHigh = 0.;
+
+    // Predicted average number of candidates checked for each cell.
+    double candidateCount = 0.;
+
+    // Predicted cost for each cell. See above.
+    double cost = 0.;
+};
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::LshTuning {
+public:
+
+    // The requested recall@k.
+    size_t k = 0;
+    double targetRecall = 0.;
+
+    // All configurations evaluated, in order of increasing cost.
+    vector<LshConfiguration> configurations;
+
+    // True if at least one configuration achieves the target recall.
+    bool targetRecallAchieved = false;
+
+    // The cheapest configuration that achieves the target recall,
+    // or, if none does, the configuration with the highest recall.
+    LshConfiguration best;
+
+    // True if the exact neighbors were not searched among all cells,
+    // so the predicted recall of all configurations is overestimated.
+    bool recallIsOverestimated = false;
+};
+
+#endif
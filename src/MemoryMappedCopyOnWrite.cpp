@@ -0,0 +1,365 @@
+// Copy-on-write sharing of memory mapped files between
+// an expression matrix and its snapshots.
+// See MemoryMappedCopyOnWrite.hpp for more information.
+
+#include "MemoryMappedCopyOnWrite.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace MemoryMapped;
+
+#include "algorithm.hpp"
+#include "boost_lexical_cast.hpp"
+#include "cstdint.hpp"
+#include "stdexcept.hpp"
+#include "vector.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MemoryMapped {
+            namespace {
+
+                string errorMessage(const string& message, const string& fileName)
+                {
+                    return "Error " + lexical_cast<string>(errno) + " " + message + " " +
+                        fileName + ": " + string(::strerror(errno));
+                }
+
+                // Suffix used for temporary copies of a file.
+                const string copyOnWriteSuffix = "-CopyOnWrite";
+
+                // Try to create a clone of a file using ioctl(FICLONE).
+                // Returns false, without leaving a destination file,
+                // if the file system does not support it.
+                bool cloneFile(const string& sourceFileName, const string& destinationFileName)
+                {
+                    const int sourceFileDescriptor = ::open(sourceFileName.c_str(), O_RDONLY);
+                    if(sourceFileDescriptor == -1) {
+                        throw runtime_error(errorMessage("opening", sourceFileName));
+                    }
+                    struct stat fileInformation;
+                    if(::fstat(sourceFileDescriptor, &fileInformation) == -1) {
+                        ::close(sourceFileDescriptor);
+                        throw runtime_error(errorMessage("during fstat for", sourceFileName));
+                    }
+                    const int destinationFileDescriptor = ::open(destinationFileName.c_str(),
+                        O_CREAT | O_TRUNC | O_WRONLY, fileInformation.st_mode & 0777);
+                    if(destinationFileDescriptor == -1) {
+                        ::close(sourceFileDescriptor);
+                        throw runtime_error(errorMessage("creating", destinationFileName));
+                    }
+                    const bool success = (::ioctl(destinationFileDescriptor, FICLONE, sourceFileDescriptor) == 0);
+                    ::close(destinationFileDescriptor);
+                    ::close(sourceFileDescriptor);
+                    if(!success) {
+                        ::unlink(destinationFileName.c_str());
+                    }
+                    return success;
+                }
+
+                // Copy the contents of a file without cloning.
+                void copyFileContents(const string& sourceFileName, const string& destinationFileName)
+                {
+                    const int sourceFileDescriptor = ::open(sourceFileName.c_str(), O_RDONLY);
+                    if(sourceFileDescriptor == -1) {
+                        throw runtime_error(errorMessage("opening", sourceFileName));
+                    }
+                    struct stat fileInformation;
+                    if(::fstat(sourceFileDescriptor, &fileInformation) == -1) {
+                        ::close(sourceFileDescriptor);
+                        throw runtime_error(errorMessage("during fstat for", sourceFileName));
+                    }
+                    const int destinationFileDescriptor = ::open(destinationFileName.c_str(),
+                        O_CREAT | O_TRUNC | O_WRONLY, fileInformation.st_mode & 0777);
+                    if(destinationFileDescriptor == -1) {
+                        ::close(sourceFileDescriptor);
+                        throw runtime_error(errorMessage("creating", destinationFileName));
+                    }
+
+                    // Use copy_file_range, which copies in the kernel,
+                    // and fall back to read/write if it is not available.
+                    size_t remainingBytes = size_t(fileInformation.st_size);
+                    bool useCopyFileRange = true;
+                    vector<char> buffer;
+                    while(remainingBytes > 0) {
+                        ssize_t byteCount = -1;
+                        if(useCopyFileRange) {
+                            byteCount = ::copy_file_range(sourceFileDescriptor, 0,
+                                destinationFileDescriptor, 0, remainingBytes, 0);
+                            if(byteCount == -1 &&
+                                (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                                useCopyFileRange = false;
+                                continue;
+                            }
+                        } else {
+                            buffer.resize(1 << 20);
+                            byteCount = ::read(sourceFileDescriptor, buffer.data(), buffer.size());
+                            if(byteCount > 0) {
+                                const char* begin = buffer.data();
+                                const char* end = begin + byteCount;
+                                while(begin != end) {
+                                    const ssize_t writtenByteCount = ::write(destinationFileDescriptor, begin, size_t(end - begin));
+                                    if(writtenByteCount == -1) {
+                                        byteCount = -1;
+                                        break;
+                                    }
+                                    begin += writtenByteCount;
+                                }
+                            }
+                        }
+                        if(byteCount <= 0) {
+                            const string message = errorMessage("copying", sourceFileName);
+                            ::close(destinationFileDescriptor);
+                            ::close(sourceFileDescriptor);
+                            ::unlink(destinationFileName.c_str());
+                            throw runtime_error(message);
+                        }
+                        remainingBytes -= size_t(byteCount);
+                    }
+
+                    ::close(destinationFileDescriptor);
+                    ::close(sourceFileDescriptor);
+                }
+
+                // Find the pages of a MAP_PRIVATE file mapping that were modified.
+                // These are the pages that are no longer backed by the file:
+                // present pages without the "file page" bit, and swapped pages.
+                // If /proc/self/pagemap is not available, return all pages.
+                void findModifiedPages(void* pointer, size_t size, size_t pageSize, vector<size_t>& modifiedPages)
+                {
+                    const size_t pageCount = (size - 1) / pageSize + 1;
+                    modifiedPages.clear();
+
+                    const int fileDescriptor = ::open("/proc/self/pagemap", O_RDONLY);
+                    if(fileDescriptor == -1) {
+                        for(size_t page=0; page<pageCount; page++) {
+                            modifiedPages.push_back(page);
+                        }
+                        return;
+                    }
+
+                    const uint64_t presentBit = 1ULL << 63;
+                    const uint64_t swappedBit = 1ULL << 62;
+                    const uint64_t filePageBit = 1ULL << 61;
+                    const size_t firstPage = size_t(reinterpret_cast<uintptr_t>(pointer)) / pageSize;
+                    vector<uint64_t> entries(1 << 16);
+                    for(size_t begin=0; begin<pageCount; begin+=entries.size()) {
+                        const size_t entryCount = min(entries.size(), pageCount - begin);
+                        const size_t byteCount = entryCount * sizeof(uint64_t);
+                        const ssize_t readByteCount = ::pread(fileDescriptor, entries.data(), byteCount,
+                            off_t((firstPage + begin) * sizeof(uint64_t)));
+                        if(readByteCount != ssize_t(byteCount)) {
+                            ::close(fileDescriptor);
+                            modifiedPages.clear();
+                            for(size_t page=0; page<pageCount; page++) {
+                                modifiedPages.push_back(page);
+                            }
+                            return;
+                        }
+                        for(size_t i=0; i<entryCount; i++) {
+                            const uint64_t entry = entries[i];
+                            if((entry & swappedBit) || ((entry & presentBit) && !(entry & filePageBit))) {
+                                modifiedPages.push_back(begin + i);
+                            }
+                        }
+                    }
+                    ::close(fileDescriptor);
+                }
+            }
+        }
+    }
+}
+
+
+
+bool MemoryMapped::isHardLinked(int fileDescriptor)
+{
+    struct stat fileInformation;
+    if(::fstat(fileDescriptor, &fileInformation) == -1) {
+        throw runtime_error("Error during fstat.");
+    }
+    return fileInformation.st_nlink > 1;
+}
+
+
+
+void MemoryMapped::removeIfHardLinked(const string& fileName)
+{
+    struct stat fileInformation;
+    if(::stat(fileName.c_str(), &fileInformation) == 0 && fileInformation.st_nlink > 1) {
+        if(::unlink(fileName.c_str()) == -1) {
+            throw runtime_error(errorMessage("removing", fileName));
+        }
+    }
+}
+
+
+
+void MemoryMapped::breakHardLink(const string& fileName)
+{
+    struct stat fileInformation;
+    if(::stat(fileName.c_str(), &fileInformation) == -1) {
+        throw runtime_error(errorMessage("during stat for", fileName));
+    }
+    if(fileInformation.st_nlink <= 1) {
+        return;
+    }
+    const string temporaryFileName = fileName + copyOnWriteSuffix;
+    copyFile(fileName, temporaryFileName);
+    if(std::rename(temporaryFileName.c_str(), fileName.c_str()) != 0) {
+        throw runtime_error(errorMessage("renaming", temporaryFileName));
+    }
+}
+
+
+
+bool MemoryMapped::copyFile(const string& sourceFileName, const string& destinationFileName)
+{
+    if(cloneFile(sourceFileName, destinationFileName)) {
+        return true;
+    }
+    copyFileContents(sourceFileName, destinationFileName);
+    return false;
+}
+
+
+
+// The first seven fields of the headers of Vector and Object
+// are headerSize, objectSize, objectCount, pageCount, fileSize,
+// capacity, and magicNumber.
+bool MemoryMapped::isContainerFile(const string& fileName)
+{
+    const uint64_t vectorMagicNumber = 0xa3756fd4b5d8bcc1ULL;
+    const uint64_t objectMagicNumber = 0xb7756f4515d8bc94ULL;
+    const uint64_t headerSize = 256;
+
+    const int fileDescriptor = ::open(fileName.c_str(), O_RDONLY);
+    if(fileDescriptor == -1) {
+        return false;
+    }
+    struct stat fileInformation;
+    uint64_t header[7];
+    const bool success =
+        ::fstat(fileDescriptor, &fileInformation) == 0 &&
+        ::pread(fileDescriptor, header, sizeof(header), 0) == ssize_t(sizeof(header));
+    ::close(fileDescriptor);
+
+    return
+        success &&
+        header[0] == headerSize &&
+        header[4] == uint64_t(fileInformation.st_size) &&
+        (header[6] == vectorMagicNumber || header[6] == objectMagicNumber);
+}
+
+
+
+SnapshotMethod MemoryMapped::snapshotFile(const string& sourceFileName, const string& destinationFileName)
+{
+    if(cloneFile(sourceFileName, destinationFileName)) {
+        return SnapshotMethod::clone;
+    }
+    if(isContainerFile(sourceFileName)) {
+        if(::link(sourceFileName.c_str(), destinationFileName.c_str()) == 0) {
+            return SnapshotMethod::hardLink;
+        }
+        if(errno != EXDEV && errno != EPERM && errno != EMLINK) {
+            throw runtime_error(errorMessage("linking", sourceFileName));
+        }
+    }
+    copyFileContents(sourceFileName, destinationFileName);
+    return SnapshotMethod::copy;
+}
+
+
+
+void MemoryMapped::makeMappingPrivate(void* pointer, size_t size, const string& fileName)
+{
+    const int fileDescriptor = ::open(fileName.c_str(), O_RDONLY);
+    if(fileDescriptor == -1) {
+        throw runtime_error(errorMessage("opening", fileName));
+    }
+    void* newPointer = ::mmap(pointer, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileDescriptor, 0);
+    ::close(fileDescriptor);
+    if(newPointer != pointer) {
+        throw runtime_error(errorMessage("during mmap for", fileName));
+    }
+}
+
+
+
+bool MemoryMapped::persistPrivateMapping(void* pointer, size_t size, const string& fileName)
+{
+    const size_t pageSize = size_t(::sysconf(_SC_PAGESIZE));
+    vector<size_t> modifiedPages;
+    findModifiedPages(pointer, size, pageSize, modifiedPages);
+    if(modifiedPages.empty()) {
+        return false;
+    }
+
+    // If the file is still shared with a snapshot, write to a copy.
+    struct stat fileInformation;
+    if(::stat(fileName.c_str(), &fileInformation) == -1) {
+        throw runtime_error(errorMessage("during stat for", fileName));
+    }
+    const bool isShared = fileInformation.st_nlink > 1;
+    const string targetFileName = isShared ? (fileName + copyOnWriteSuffix) : fileName;
+    if(isShared) {
+        copyFile(fileName, targetFileName);
+    }
+
+    // Write the modified pages, grouping consecutive pages.
+    const int fileDescriptor = ::open(targetFileName.c_str(), O_RDWR);
+    if(fileDescriptor == -1) {
+        throw runtime_error(errorMessage("opening", targetFileName));
+    }
+    const char* begin = static_cast<const char*>(pointer);
+    for(size_t i=0; i<modifiedPages.size(); ) {
+        size_t j = i + 1;
+        while(j<modifiedPages.size() && modifiedPages[j] == modifiedPages[j-1] + 1) {
+            ++j;
+        }
+        const size_t offset = modifiedPages[i] * pageSize;
+        const size_t byteCount = min(size, (modifiedPages[j-1] + 1) * pageSize) - offset;
+        size_t writtenByteCount = 0;
+        while(writtenByteCount < byteCount) {
+            const ssize_t n = ::pwrite(fileDescriptor, begin + offset + writtenByteCount,
+                byteCount - writtenByteCount, off_t(offset + writtenByteCount));
+            if(n <= 0) {
+                const string message = errorMessage("writing", targetFileName);
+                ::close(fileDescriptor);
+                throw runtime_error(message);
+            }
+            writtenByteCount += size_t(n);
+        }
+        i = j;
+    }
+
+    // Replace the original file with the copy, which breaks the hard link.
+    if(isShared) {
+        if(std::rename(targetFileName.c_str(), fileName.c_str()) != 0) {
+            const string message = errorMessage("renaming", targetFileName);
+            ::close(fileDescriptor);
+            throw runtime_error(message);
+        }
+    }
+
+    // The file now has the same contents as the mapping,
+    // so we can replace the mapping with a shared one.
+    void* newPointer = ::mmap(pointer, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fileDescriptor, 0);
+    ::close(fileDescriptor);
+    if(newPointer != pointer) {
+        throw runtime_error(errorMessage("during mmap for", fileName));
+    }
+    return true;
+}
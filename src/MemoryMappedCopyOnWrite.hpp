@@ -0,0 +1,79 @@
+// Copy-on-write sharing of memory mapped files between
+// an expression matrix and its snapshots.
+
+#ifndef CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_COPY_ON_WRITE_HPP
+#define CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_COPY_ON_WRITE_HPP
+
+/*******************************************************************************
+
+ExpressionMatrix::createSnapshot makes an instant copy of an expression
+matrix directory. Files of the snapshot share storage
+with the original files in one of two ways:
+
+- If the file system supports it (for example, Btrfs and XFS),
+  each file is cloned using ioctl(FICLONE). The clone is a separate file
+  that shares disk blocks with the original until either is modified.
+  This is handled entirely by the file system.
+
+- Otherwise, files of MemoryMapped::Vector and MemoryMapped::Object
+  are hard linked, so the original and the snapshot are the same file.
+  When Vector or Object open with write access a file that has more
+  than one link, they map it with MAP_PRIVATE instead of MAP_SHARED.
+  Modified pages then become private copies in memory, and the file
+  (shared with the snapshot) is not changed.
+  When the mapping is synced (at close, resize, or checkpoint),
+  the pages that were modified are found via /proc/self/pagemap.
+  If there are any, the file is copied, the modified pages
+  are written to the copy, the copy is renamed over the original name
+  (which breaks the link), and the mapping is replaced with
+  a MAP_SHARED mapping of the new file at the same address.
+  Unmodified containers remain shared and cost no disk space.
+
+Other files are small and are just copied.
+
+*******************************************************************************/
+
+#include "cstddef.hpp"
+#include "string.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MemoryMapped {
+
+            // Return true if the file open with the given descriptor
+            // has more than one hard link.
+            bool isHardLinked(int fileDescriptor);
+
+            // If the given file exists and has more than one hard link, remove it.
+            // Used before creating a new file with the same name.
+            void removeIfHardLinked(const string& fileName);
+
+            // If the given file has more than one hard link,
+            // replace it with a copy that shares nothing with the other links.
+            void breakHardLink(const string& fileName);
+
+            // Copy a file, using a clone if the file system supports it.
+            // Returns true if a clone was created.
+            bool copyFile(const string& sourceFileName, const string& destinationFileName);
+
+            // Return true if the file contains a MemoryMapped::Vector or MemoryMapped::Object.
+            bool isContainerFile(const string& fileName);
+
+            // Make a copy-on-write copy of a file for a snapshot (see above).
+            enum class SnapshotMethod {clone, hardLink, copy};
+            SnapshotMethod snapshotFile(const string& sourceFileName, const string& destinationFileName);
+
+            // Replace a MAP_SHARED mapping with write access with a MAP_PRIVATE
+            // mapping of the same file at the same address.
+            void makeMappingPrivate(void* pointer, size_t size, const string& fileName);
+
+            // Store to disk the modified pages of a MAP_PRIVATE mapping,
+            // breaking the hard link if necessary, then replace it with
+            // a MAP_SHARED mapping at the same address.
+            // If no pages were modified, does nothing and returns false.
+            bool persistPrivateMapping(void* pointer, size_t size, const string& fileName);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,361 @@
+// Control of when memory mapped containers are synced to disk.
+// See MemoryMappedDurability.hpp for more information.
+
+#include "MemoryMappedDurability.hpp"
+#include "MemoryMappedCopyOnWrite.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace MemoryMapped;
+
+#include <condition_variable>
+#include "map.hpp"
+#include <mutex>
+#include "vector.hpp"
+#include "stdexcept.hpp"
+#include "utility.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MemoryMapped {
+            namespace {
+
+                // The durability mode of each directory.
+                // Directories not in the map use DurabilityMode::strict.
+                map<string, DurabilityMode>& durabilityModes()
+                {
+                    static map<string, DurabilityMode> modes;
+                    return modes;
+                }
+
+                // Information on a registered mapping.
+                class MappingInformation {
+                public:
+                    size_t size;
+                    string fileName;
+
+                    // True for MAP_PRIVATE mappings of files shared
+                    // with a snapshot (see MemoryMappedCopyOnWrite.hpp).
+                    bool isPrivate;
+
+                    // The number of syncDirectory calls currently syncing this mapping
+                    // without holding the mutex. The mapping cannot be unregistered
+                    // (and therefore unmapped) until this is zero.
+                    size_t syncInProgressCount;
+                };
+
+                // The registered mappings, keyed by address.
+                map<void*, MappingInformation>& mappings()
+                {
+                    static map<void*, MappingInformation> m;
+                    return m;
+                }
+
+                // Protects the above.
+                std::mutex& durabilityMutex()
+                {
+                    static std::mutex m;
+                    return m;
+                }
+
+                // Notified when syncDirectory finishes syncing mappings.
+                std::condition_variable& syncCompletedCondition()
+                {
+                    static std::condition_variable c;
+                    return c;
+                }
+
+                // Remove trailing slashes from a directory name.
+                string normalizeDirectoryName(const string& directoryName)
+                {
+                    string s = directoryName;
+                    while(s.size() > 1 && s.back() == '/') {
+                        s.pop_back();
+                    }
+                    return s;
+                }
+
+                // The name of the directory containing a file.
+                string getDirectoryName(const string& fileName)
+                {
+                    const size_t slashPosition = fileName.find_last_of('/');
+                    if(slashPosition == string::npos) {
+                        return ".";
+                    }
+                    if(slashPosition == 0) {
+                        return "/";
+                    }
+                    return normalizeDirectoryName(fileName.substr(0, slashPosition));
+                }
+
+                // If a registered mapping is private, store its modified pages
+                // and make it shared, if there are any.
+                // Returns true if the mapping is shared on return.
+                // Must be called with the mutex held.
+                bool persistIfPrivate(void* pointer, MappingInformation& mapping)
+                {
+                    if(mapping.isPrivate) {
+                        if(persistPrivateMapping(pointer, mapping.size, mapping.fileName)) {
+                            mapping.isPrivate = false;
+                        }
+                    }
+                    return !mapping.isPrivate;
+                }
+            }
+        }
+    }
+}
+
+
+
+string MemoryMapped::durabilityModeToString(DurabilityMode mode)
+{
+    switch(mode) {
+    case DurabilityMode::strict:
+        return "strict";
+    case DurabilityMode::async:
+        return "async";
+    case DurabilityMode::bulk:
+        return "bulk";
+    default:
+        return "invalid";
+    }
+}
+
+
+
+DurabilityMode MemoryMapped::durabilityModeFromString(const string& s)
+{
+    if(s == "strict") {
+        return DurabilityMode::strict;
+    }
+    if(s == "async") {
+        return DurabilityMode::async;
+    }
+    if(s == "bulk") {
+        return DurabilityMode::bulk;
+    }
+    throw runtime_error("Invalid durability mode " + s + ". Valid values are strict, async, bulk.");
+}
+
+
+
+void MemoryMapped::setDurabilityMode(const string& directoryName, DurabilityMode mode)
+{
+    std::lock_guard<std::mutex> lock(durabilityMutex());
+    durabilityModes()[normalizeDirectoryName(directoryName)] = mode;
+}
+
+
+
+DurabilityMode MemoryMapped::getDurabilityMode(const string& directoryName)
+{
+    std::lock_guard<std::mutex> lock(durabilityMutex());
+    const auto it = durabilityModes().find(normalizeDirectoryName(directoryName));
+    if(it == durabilityModes().end()) {
+        return DurabilityMode::strict;
+    } else {
+        return it->second;
+    }
+}
+
+
+
+void MemoryMapped::registerMapping(void* pointer, size_t size, const string& fileName, bool isPrivate)
+{
+    std::lock_guard<std::mutex> lock(durabilityMutex());
+    MappingInformation& mapping = mappings()[pointer];
+    mapping.size = size;
+    mapping.fileName = fileName;
+    mapping.isPrivate = isPrivate;
+    mapping.syncInProgressCount = 0;
+}
+
+
+
+void MemoryMapped::unregisterMapping(void* pointer)
+{
+    std::unique_lock<std::mutex> lock(durabilityMutex());
+    syncCompletedCondition().wait(lock, [pointer]()
+    {
+        const auto it = mappings().find(pointer);
+        return it == mappings().end() || it->second.syncInProgressCount == 0;
+    });
+    mappings().erase(pointer);
+}
+
+
+
+void MemoryMapped::syncMapping(void* pointer, size_t size, const string& fileName, size_t writeBackBegin)
+{
+    // A private mapping that was not modified
+    // has nothing to sync.
+    {
+        std::lock_guard<std::mutex> lock(durabilityMutex());
+        const auto it = mappings().find(pointer);
+        if(it != mappings().end() && !persistIfPrivate(pointer, it->second)) {
+            return;
+        }
+    }
+
+    switch(getDurabilityMode(getDirectoryName(fileName))) {
+
+    case DurabilityMode::strict:
+        if(::msync(pointer, size, MS_SYNC) == -1) {
+            throw runtime_error("Error during msync for " + fileName);
+        }
+        return;
+
+    // On Linux, msync(MS_ASYNC) does not start write-back,
+    // so we use sync_file_range, which does.
+    // Failures are ignored because this is only a hint.
+    case DurabilityMode::async:
+        {
+            const int fileDescriptor = ::open(fileName.c_str(), O_RDONLY);
+            if(fileDescriptor != -1) {
+                const size_t pageSize = 4096;
+                ::sync_file_range(fileDescriptor, 0, off_t(pageSize), SYNC_FILE_RANGE_WRITE);
+                if(writeBackBegin < size) {
+                    ::sync_file_range(fileDescriptor, off_t(writeBackBegin),
+                        off_t(size - writeBackBegin), SYNC_FILE_RANGE_WRITE);
+                }
+                ::close(fileDescriptor);
+            }
+        }
+        return;
+
+    case DurabilityMode::bulk:
+        return;
+    }
+}
+
+
+
+void MemoryMapped::startWriteBack(const string& fileName, size_t begin, size_t end)
+{
+    if(begin >= end || getDurabilityMode(getDirectoryName(fileName)) != DurabilityMode::async) {
+        return;
+    }
+    const int fileDescriptor = ::open(fileName.c_str(), O_RDONLY);
+    if(fileDescriptor != -1) {
+        ::sync_file_range(fileDescriptor, off_t(begin), off_t(end - begin), SYNC_FILE_RANGE_WRITE);
+        ::close(fileDescriptor);
+    }
+}
+
+
+
+size_t MemoryMapped::syncDirectory(const string& directoryName)
+{
+    const string normalizedDirectoryName = normalizeDirectoryName(directoryName);
+
+    // With the mutex held, find the mappings to be synced
+    // and mark them so they cannot be unmapped while we sync them.
+    // Private mappings are made shared first.
+    vector< pair<void*, MappingInformation> > mappingsToSync;
+    size_t count = 0;
+    {
+        std::lock_guard<std::mutex> lock(durabilityMutex());
+        for(auto& p: mappings()) {
+            MappingInformation& mapping = p.second;
+            if(getDirectoryName(mapping.fileName) == normalizedDirectoryName) {
+                if(persistIfPrivate(p.first, mapping)) {
+                    ++mapping.syncInProgressCount;
+                    mappingsToSync.push_back(p);
+                }
+                ++count;
+            }
+        }
+    }
+
+    // Sync them without holding the mutex.
+    string failedFileName;
+    for(const auto& p: mappingsToSync) {
+        if(::msync(p.first, p.second.size, MS_SYNC) == -1 && failedFileName.empty()) {
+            failedFileName = p.second.fileName;
+        }
+    }
+
+    // Allow them to be unmapped again.
+    {
+        std::lock_guard<std::mutex> lock(durabilityMutex());
+        for(const auto& p: mappingsToSync) {
+            --mappings()[p.first].syncInProgressCount;
+        }
+    }
+    syncCompletedCondition().notify_all();
+
+    if(!failedFileName.empty()) {
+        throw runtime_error("Error during msync for " + failedFileName);
+    }
+    return count;
+}
+
+
+
+void MemoryMapped::syncFile(const string& fileName)
+{
+    const int fileDescriptor = ::open(fileName.c_str(), O_RDONLY);
+    if(fileDescriptor == -1) {
+        throw runtime_error("Error opening " + fileName);
+    }
+    const int fsyncReturnCode = ::fsync(fileDescriptor);
+    ::close(fileDescriptor);
+    if(fsyncReturnCode == -1) {
+        throw runtime_error("Error during fsync for " + fileName);
+    }
+}
+
+
+
+void MemoryMapped::syncDirectoryEntry(const string& fileName)
+{
+    syncFile(getDirectoryName(fileName));
+}
+
+
+
+void MemoryMapped::persistPrivateMappings(const string& directoryName)
+{
+    const string normalizedDirectoryName = normalizeDirectoryName(directoryName);
+    std::lock_guard<std::mutex> lock(durabilityMutex());
+    for(auto& p: mappings()) {
+        if(getDirectoryName(p.second.fileName) == normalizedDirectoryName) {
+            persistIfPrivate(p.first, p.second);
+        }
+    }
+}
+
+
+
+// The file is identified by device and inode, so we find
+// the mappings regardless of how their file name was spelled.
+size_t MemoryMapped::makeMappingsPrivate(const string& fileName)
+{
+    struct stat fileInformation;
+    if(::stat(fileName.c_str(), &fileInformation) == -1) {
+        throw runtime_error("Error during stat for " + fileName);
+    }
+
+    std::lock_guard<std::mutex> lock(durabilityMutex());
+    size_t count = 0;
+    for(auto& p: mappings()) {
+        MappingInformation& mapping = p.second;
+        struct stat mappingFileInformation;
+        if(!mapping.isPrivate &&
+            ::stat(mapping.fileName.c_str(), &mappingFileInformation) == 0 &&
+            mappingFileInformation.st_dev == fileInformation.st_dev &&
+            mappingFileInformation.st_ino == fileInformation.st_ino) {
+            makeMappingPrivate(p.first, mapping.size, mapping.fileName);
+            mapping.isPrivate = true;
+            ++count;
+        }
+    }
+    return count;
+}
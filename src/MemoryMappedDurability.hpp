@@ -0,0 +1,101 @@
+// Control of when memory mapped containers are synced to disk.
+
+#ifndef CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_DURABILITY_HPP
+#define CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_DURABILITY_HPP
+
+/*******************************************************************************
+
+MemoryMapped::Vector and MemoryMapped::Object are MAP_SHARED file mappings.
+By default they are synced to disk with msync(MS_SYNC) every time
+they are closed, which also happens every time a Vector
+grows beyond its capacity. During long bulk operations
+(for example, adding millions of cells) this generates
+large bursts of synchronous writes that stall the computation.
+
+The durability mode, which is set separately for each directory
+(that is, for each ExpressionMatrix), controls this:
+- strict: msync(MS_SYNC) at close and resize (the default).
+- async: write-back is started with sync_file_range(SYNC_FILE_RANGE_WRITE),
+  but we don't wait for it to complete. A Vector starts write-back
+  of each chunk of appended data (asyncWriteBackChunkSize bytes) as soon as
+  the chunk is complete, and of any remaining appended data
+  at close and resize. Other changes are written back by the kernel
+  at its own pace, or at the next checkpoint.
+- bulk: no syncing at close and resize. Dirty pages are written
+  back by the kernel at its own pace.
+
+In all modes, syncDirectory syncs with msync(MS_SYNC)
+all the mappings currently open with write access
+for files in a directory. ExpressionMatrix::checkpoint uses it to create
+a crash-consistent checkpoint. The registry mutex is not held
+during msync, so other threads can open, close, and resize data structures
+while this runs, except that unmapping a mapping that
+is being synced waits for its msync to complete.
+
+To make this possible, Vector and Object register here
+all mappings with write access.
+
+The registry also keeps track of MAP_PRIVATE mappings
+of files shared with a snapshot (see MemoryMappedCopyOnWrite.hpp).
+Syncing one of these stores its modified pages to disk
+and makes it a MAP_SHARED mapping.
+
+*******************************************************************************/
+
+#include "cstddef.hpp"
+#include "string.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MemoryMapped {
+
+            enum class DurabilityMode {strict, async, bulk};
+            string durabilityModeToString(DurabilityMode);
+            DurabilityMode durabilityModeFromString(const string&);  // Throws for invalid strings.
+
+            // Set or get the durability mode for the files in a directory.
+            void setDurabilityMode(const string& directoryName, DurabilityMode);
+            DurabilityMode getDurabilityMode(const string& directoryName);
+
+            // Register or unregister a mapping with write access.
+            // isPrivate is true for MAP_PRIVATE mappings of files shared with a snapshot.
+            void registerMapping(void* pointer, size_t size, const string& fileName, bool isPrivate);
+            void unregisterMapping(void* pointer);
+
+            // Sync a mapping at close or resize, as specified by the durability mode
+            // of the directory containing the file.
+            // In async mode, write-back is only started for the first page
+            // (which contains the header) and for the bytes starting at writeBackBegin.
+            void syncMapping(void* pointer, size_t size, const string& fileName, size_t writeBackBegin=0);
+
+            // In async mode, start write-back for a range of bytes of a file.
+            // Does nothing in the other modes.
+            const size_t asyncWriteBackChunkSize = 16ULL * 1024ULL * 1024ULL;
+            void startWriteBack(const string& fileName, size_t begin, size_t end);
+
+            // Sync with msync(MS_SYNC) all registered mappings
+            // of files in a directory, regardless of durability mode.
+            // Returns the number of mappings synced.
+            size_t syncDirectory(const string& directoryName);
+
+            // Sync a file with fsync, regardless of durability mode.
+            void syncFile(const string& fileName);
+
+            // Sync with fsync the directory containing a file,
+            // so a rename, creation, or removal of the file is on disk.
+            void syncDirectoryEntry(const string& fileName);
+
+            // Store to disk the modified pages of all MAP_PRIVATE
+            // registered mappings of files in a directory.
+            // Used before creating a snapshot.
+            void persistPrivateMappings(const string& directoryName);
+
+            // Make MAP_PRIVATE all registered mappings of a file,
+            // after it was hard linked into a snapshot.
+            // Returns the number of mappings changed.
+            size_t makeMappingsPrivate(const string& fileName);
+        }
+    }
+}
+
+#endif
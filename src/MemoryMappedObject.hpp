@@ -6,6 +6,8 @@
 // CZI.
 #include "CZI_ASSERT.hpp"
 #include "filesystem.hpp"
+#include "MemoryMappedCopyOnWrite.hpp"
+#include "MemoryMappedDurability.hpp"
 
 // Boost libraries, partially injected into the ExpressionMatrix2 namespace,
 #include "boost_lexical_cast.hpp"
@@ -55,8 +57,10 @@ public:
     void accessExistingReadOnly(const string& name);
     void accessExistingReadWrite(const string& name);
 
-    // Sync the mapped memory to disk.
-    // This guarantees that the data on disk reflect all the latest changes in memory.
+    // Sync the mapped memory to disk, as specified by the durability mode
+    // of the directory containing the file (see MemoryMappedDurability.hpp).
+    // With the default durability mode, this guarantees that the data on disk
+    // reflect all the latest changes in memory.
     // This is automatically called by close, and therefore also by the destructor.
     void syncToDisk();
 
@@ -171,7 +175,8 @@ private:
     static void truncate(int fileDescriptor, size_t fileSize);
 
     // Map to memory the given file descriptor for the specified size.
-    static void* map(int fileDescriptor, size_t fileSize, bool writeAccess);
+    // If copyOnWrite is true, use MAP_PRIVATE (see MemoryMappedCopyOnWrite.hpp).
+    static void* map(int fileDescriptor, size_t fileSize, bool writeAccess, bool copyOnWrite);
 
     // Find the size of the file corresponding to an open file descriptor.
     size_t getFileSize(int fileDescriptor);
@@ -203,6 +208,10 @@ template<class T> inline ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Object
 // Return the file descriptor.
 template<class T> inline int ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Object<T>::openNew(const string& name)
 {
+    // Truncating a file shared with a snapshot would also
+    // truncate the snapshot, so remove it instead.
+    removeIfHardLinked(name);
+
     const int fileDescriptor = ::open(
             name.c_str(),
             O_CREAT | O_TRUNC | O_RDWR,
@@ -238,9 +247,10 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::O
 }
 
 // Map to memory the given file descriptor for the specified size.
-template<class T> inline void* ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Object<T>::map(int fileDescriptor, size_t fileSize, bool writeAccess)
+template<class T> inline void* ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Object<T>::map(int fileDescriptor, size_t fileSize, bool writeAccess, bool copyOnWrite)
 {
-    void* pointer = ::mmap(0, fileSize, PROT_READ | (writeAccess ? PROT_WRITE : 0), MAP_SHARED, fileDescriptor, 0);
+    void* pointer = ::mmap(0, fileSize, PROT_READ | (writeAccess ? PROT_WRITE : 0),
+        copyOnWrite ? MAP_PRIVATE : MAP_SHARED, fileDescriptor, 0);
     if(pointer == reinterpret_cast<void*>(-1LL)) {
         ::close(fileDescriptor);
         throw runtime_error("Error during mmap.");
@@ -280,7 +290,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::O
         truncate(fileDescriptor, fileSize);
 
         // Map it in memory.
-        void* pointer = map(fileDescriptor, fileSize, true);
+        void* pointer = map(fileDescriptor, fileSize, true, false);
 
         // There is no need to keep the file descriptor open.
         // Closing the file descriptor as early as possible will make it possible to use large
@@ -302,6 +312,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::O
         isOpen = true;
         isOpenWithWriteAccess = true;
         fileName = name;
+        registerMapping(header, header->fileSize, fileName, false);
 
     } catch(std::exception& e) {
         cout << e.what() << endl;
@@ -326,7 +337,9 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::O
         const size_t fileSize = getFileSize(fileDescriptor);
 
         // Now map it in memory.
-        void* pointer = map(fileDescriptor, fileSize, readWriteAccess);
+        // If the file is shared with a snapshot, use a copy-on-write mapping.
+        const bool copyOnWrite = readWriteAccess && isHardLinked(fileDescriptor);
+        void* pointer = map(fileDescriptor, fileSize, readWriteAccess, copyOnWrite);
 
         // There is no need to keep the file descriptor open.
         // Closing the file descriptor as early as possible will make it possible to use large
@@ -347,6 +360,9 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::O
         isOpen = true;
         isOpenWithWriteAccess = readWriteAccess;
         fileName = name;
+        if(isOpenWithWriteAccess) {
+            registerMapping(header, header->fileSize, fileName, copyOnWrite);
+        }
 
     } catch(std::exception& e) {
         throw runtime_error("Error accessing " + name + ": " + e.what());
@@ -368,9 +384,8 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::O
 template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Object<T>::syncToDisk()
 {
     CZI_ASSERT(isOpen);
-    const int msyncReturnCode = ::msync(header, header->fileSize, MS_SYNC);
-    if(msyncReturnCode == -1) {
-        throw runtime_error("Error during msync for " + fileName);
+    if(isOpenWithWriteAccess) {
+        syncMapping(header, header->fileSize, fileName);
     }
 }
 
@@ -379,6 +394,9 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::O
 {
     CZI_ASSERT(isOpen);
 
+    if(isOpenWithWriteAccess) {
+        unregisterMapping(header);
+    }
     const int munmapReturnCode = ::munmap(header, header->fileSize);
     if(munmapReturnCode == -1) {
         throw runtime_error("Error unmapping " + fileName);
@@ -406,8 +424,10 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::O
 // Close it and remove the supporting file.
 template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Object<T>::remove()
 {
+    // There is no need to sync, since the file goes away.
+    // This also avoids copying files shared with a snapshot.
     const string savedFileName = fileName;
-    close();    // This forgets the fileName.
+    unmap();    // This forgets the fileName.
     filesystem::remove(savedFileName);
 }
 
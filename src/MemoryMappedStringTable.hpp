@@ -10,7 +10,8 @@ n distinct strings (a set of strings) and the integers 0 to n-1.
 
 The table is persistent. This is achieved by storing it on memory mapped files.
 
-Strings can only be added to the table, never removed.
+Strings can only be added to the table. They can only be removed
+by truncate, which discards all strings after a given string id.
 
 Each of the n strings is assigned a string id of type StringId, which
 should be an unsigned integer type. The choice of this type
@@ -82,6 +83,11 @@ public:
     // For performance, we should stay below half this value.
     size_t capacity() const;
 
+    // Keep only the strings with ids 0 to n-1, rebuilding the hash table.
+    // This also works if a string was only partially added
+    // by a process that terminated abnormally.
+    void truncate(size_t n);
+
     // The strings are stored using a MemoryMapped::VectorOfVectors.
     // The i-th string is stored in the open range of characters
     // strings.begin(i) through strings.end(i).
@@ -165,6 +171,25 @@ template<class StringId> inline
 
 
 
+template<class StringId> inline
+    void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::truncate(size_t n)
+{
+    CZI_ASSERT(n <= strings.size());
+    strings.truncate(StringId(n));
+
+    fill(hashTable.begin(), hashTable.end(), invalidStringId);
+    for(StringId stringId=0; stringId!=StringId(n); stringId++) {
+        uint64_t bucketIndex = MurmurHash64A(strings.begin(stringId), int(strings.size(stringId)), 237) & mask;
+        while(hashTable[bucketIndex] != invalidStringId) {
+            ++bucketIndex;
+            bucketIndex &= mask;
+        }
+        hashTable[bucketIndex] = stringId;
+    }
+}
+
+
+
 // Return the StringId corresponding to a given string, creating it if necessary.
 template<class StringId> inline
     StringId ChanZuckerberg::ExpressionMatrix2::MemoryMapped::StringTable<StringId>::operator[](const string& s)
@@ -6,6 +6,9 @@
 // CZI.
 #include "CZI_ASSERT.hpp"
 #include "filesystem.hpp"
+#include "MemoryMappedCopyOnWrite.hpp"
+#include "MemoryMappedDurability.hpp"
+#include "numa.hpp"
 #include "touchMemory.hpp"
 
 // Boost libraries, partially injected into the ExpressionMatrix2 namespace,
@@ -81,8 +84,10 @@ public:
     void accessExistingReadOnly(const string& name);
     void accessExistingReadWrite(const string& name, bool allowReadOnly);
 
-    // Sync the mapped memory to disk.
-    // This guarantees that the data on disk reflect all the latest changes in memory.
+    // Sync the mapped memory to disk, as specified by the durability mode
+    // of the directory containing the file (see MemoryMappedDurability.hpp).
+    // With the default durability mode, this guarantees that the data on disk
+    // reflect all the latest changes in memory.
     // This is automatically called by close, and therefore also by the destructor.
     void syncToDisk();
 
@@ -104,6 +109,14 @@ public:
         return ExpressionMatrix2::touchMemory(begin(), end());
     }
 
+    // Place the pages of the vector on the NUMA nodes according to a policy
+    // (see numa.hpp). This has no effect on single node systems.
+    // Returns the number of pages placed on each node.
+    vector<size_t> applyNumaPolicy(numa::Policy policy) const
+    {
+        return numa::applyPolicy(begin(), end(), policy);
+    }
+
 
     void reserve();
     void reserve(size_t capacity);
@@ -210,6 +223,26 @@ private:
     // Unmap the memory.
     void unmap();
 
+    // The offset in the file, in bytes, of the first appended data
+    // for which write-back was not yet started in async durability mode
+    // (see MemoryMappedDurability.hpp).
+    size_t writeBackBegin;
+
+    // The offset in the file, in bytes, of the end of the vector data.
+    size_t dataEndOffset() const
+    {
+        return header->headerSize + header->objectSize * header->objectCount;
+    }
+
+    // In async durability mode, start write-back of the data appended
+    // since the last call, up to the last complete page.
+    void startWriteBackOfAppendedData()
+    {
+        const size_t writeBackEnd = (dataEndOffset() / pageSize) * pageSize;
+        startWriteBack(fileName, writeBackBegin, writeBackEnd);
+        writeBackBegin = writeBackEnd;
+    }
+
     // Some private utility functions;
 
     // Open the given file name as new (create if not existing, truncate if existing)
@@ -225,7 +258,8 @@ private:
     static void truncate(int fileDescriptor, size_t fileSize);
 
     // Map to memory the given file descriptor for the specified size.
-    static void* map(int fileDescriptor, size_t fileSize, bool writeAccess);
+    // If copyOnWrite is true, use MAP_PRIVATE (see MemoryMappedCopyOnWrite.hpp).
+    static void* map(int fileDescriptor, size_t fileSize, bool writeAccess, bool copyOnWrite);
 
     // Find the size of the file corresponding to an open file descriptor.
     size_t getFileSize(int fileDescriptor);
@@ -329,7 +363,8 @@ template<class T> inline ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector
     header(0),
     data(0),
     isOpen(false),
-    isOpenWithWriteAccess(false)
+    isOpenWithWriteAccess(false),
+    writeBackBegin(0)
 {
 }
 
@@ -343,6 +378,10 @@ template<class T> inline int ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Ve
 
     // The specified name is not a directory.
     // Open or create a file with this name.
+    // Truncating a file shared with a snapshot would also
+    // truncate the snapshot, so remove it instead.
+    removeIfHardLinked(name);
+
     const int fileDescriptor = ::open(
             name.c_str(),
             O_CREAT | O_TRUNC | O_RDWR,
@@ -379,9 +418,10 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
 }
 
 // Map to memory the given file descriptor for the specified size.
-template<class T> inline void* ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::map(int fileDescriptor, size_t fileSize, bool writeAccess)
+template<class T> inline void* ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::map(int fileDescriptor, size_t fileSize, bool writeAccess, bool copyOnWrite)
 {
-    void* pointer = ::mmap(0, fileSize, PROT_READ | (writeAccess ? PROT_WRITE : 0), MAP_SHARED, fileDescriptor, 0);
+    void* pointer = ::mmap(0, fileSize, PROT_READ | (writeAccess ? PROT_WRITE : 0),
+        copyOnWrite ? MAP_PRIVATE : MAP_SHARED, fileDescriptor, 0);
     if(pointer == reinterpret_cast<void*>(-1LL)) {
         ::close(fileDescriptor);
         throw runtime_error("Error during mmap.");
@@ -428,7 +468,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
         truncate(fileDescriptor, fileSize);
 
         // Map it in memory.
-        void* pointer = map(fileDescriptor, fileSize, true);
+        void* pointer = map(fileDescriptor, fileSize, true, false);
 
         // There is no need to keep the file descriptor open.
         // Closing the file descriptor as early as possible will make it possible to use large
@@ -452,6 +492,8 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
         isOpen = true;
         isOpenWithWriteAccess = true;
         fileName = name;
+        writeBackBegin = 0;
+        registerMapping(header, header->fileSize, fileName, false);
 
     } catch(std::exception& e) {
         cout << e.what() << endl;
@@ -476,7 +518,9 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
         const size_t fileSize = getFileSize(fileDescriptor);
 
         // Now map it in memory.
-        void* pointer = map(fileDescriptor, fileSize, readWriteAccess);
+        // If the file is shared with a snapshot, use a copy-on-write mapping.
+        const bool copyOnWrite = readWriteAccess && isHardLinked(fileDescriptor);
+        void* pointer = map(fileDescriptor, fileSize, readWriteAccess, copyOnWrite);
 
         // There is no need to keep the file descriptor open.
         // Closing the file descriptor as early as possible will make it possible to use large
@@ -497,6 +541,10 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
         isOpen = true;
         isOpenWithWriteAccess = readWriteAccess;
         fileName = name;
+        writeBackBegin = (dataEndOffset() / pageSize) * pageSize;
+        if(isOpenWithWriteAccess) {
+            registerMapping(header, header->fileSize, fileName, copyOnWrite);
+        }
 
     } catch(std::exception& e) {
         throw runtime_error("Error accessing " + name + ": " + e.what());
@@ -531,9 +579,9 @@ template<class T> inline
 template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::syncToDisk()
 {
     CZI_ASSERT(isOpen);
-    const int msyncReturnCode = ::msync(header, header->fileSize, MS_SYNC);
-    if(msyncReturnCode == -1) {
-        throw runtime_error("Error during msync for " + fileName);
+    if(isOpenWithWriteAccess) {
+        syncMapping(header, header->fileSize, fileName, writeBackBegin);
+        writeBackBegin = (dataEndOffset() / pageSize) * pageSize;
     }
 }
 
@@ -542,6 +590,9 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
 {
     CZI_ASSERT(isOpen);
 
+    if(isOpenWithWriteAccess) {
+        unregisterMapping(header);
+    }
     const int munmapReturnCode = ::munmap(header, header->fileSize);
     if(munmapReturnCode == -1) {
         throw runtime_error("Error unmapping " + fileName);
@@ -567,8 +618,10 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
 // Close it and remove the supporting file.
 template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::remove()
 {
+    // There is no need to sync, since the file goes away.
+    // This also avoids copying files shared with a snapshot.
     const string savedFileName = fileName;
-    close();	// This forgets the fileName.
+    unmap();	// This forgets the fileName.
     filesystem::remove(savedFileName);
 }
 
@@ -607,6 +660,13 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
                 new(data+i) T();
             }
 
+            // Once a chunk of appended data is complete,
+            // start its write-back in async durability mode.
+            // This only does work once per chunk.
+            if(dataEndOffset() >= writeBackBegin + asyncWriteBackChunkSize) {
+                startWriteBackOfAppendedData();
+            }
+
 
         } else {
 
@@ -622,11 +682,13 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
             const Header headerOnStack(newSize, size_t(1.5*double(newSize)));
 
             // Resize the file as necessary.
+            // If it is shared with a snapshot, it must be copied first.
+            breakHardLink(name);
             const int fileDescriptor = openExisting(name, true);
             truncate(fileDescriptor, headerOnStack.fileSize);
 
             // Remap it.
-            void* pointer = map(fileDescriptor, headerOnStack.fileSize, true);
+            void* pointer = map(fileDescriptor, headerOnStack.fileSize, true, false);
             ::close(fileDescriptor);
 
             // Figure out where the data and the header are.
@@ -640,6 +702,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
             isOpen = true;
             isOpenWithWriteAccess = true;
             fileName = name;
+            registerMapping(header, header->fileSize, fileName, false);
 
             // Call the constructor on the elements we added.
             for(size_t i=oldSize; i<newSize; i++) {
@@ -675,11 +738,13 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
     const Header headerOnStack(size(), capacity);
 
     // Resize the file as necessary.
+    // If it is shared with a snapshot, it must be copied first.
+    breakHardLink(name);
     const int fileDescriptor = openExisting(name, true);
     truncate(fileDescriptor, headerOnStack.fileSize);
 
     // Remap it.
-    void* pointer = map(fileDescriptor, headerOnStack.fileSize, true);
+    void* pointer = map(fileDescriptor, headerOnStack.fileSize, true, false);
     ::close(fileDescriptor);
 
     // Figure out where the data and the header are.
@@ -693,6 +758,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
     isOpen = true;
     isOpenWithWriteAccess = true;
     fileName = name;
+    registerMapping(header, header->fileSize, fileName, false);
 }
 
 
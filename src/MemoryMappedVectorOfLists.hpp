@@ -5,10 +5,13 @@
 
 // CZI.
 #include "MemoryMappedVector.hpp"
+#include "TaskScheduler.hpp"
 
 // Standard libraries.
 #include "algorithm.hpp"
 #include "cstdint.hpp"
+#include <cstdio>
+#include "fstream.hpp"
 #include <limits>
 #include "string.hpp"
 #include "utility.hpp"
@@ -35,8 +38,36 @@ public:
         freeSlots.createNew(name + ".freeSlots");
     }
 
+    // If a compaction was interrupted, this completes it
+    // or discards it (see compact).
     void accessExisting(const string& name, bool readWriteAccess)
     {
+        if(filesystem::exists(name + ".Compacting")) {
+            if(readWriteAccess) {
+                finishCompaction(name);
+            } else {
+
+                // We cannot complete the compaction, but we can use
+                // its results, whether or not they were already renamed.
+                // The free slots are stale, but they are
+                // only used when adding elements.
+                const auto newestFileName = [](const string& fileName)
+                {
+                    const string newFileName = compactedFileName(fileName);
+                    return filesystem::exists(newFileName) ? newFileName : fileName;
+                };
+                toc.accessExisting(newestFileName(name + ".toc"), false);
+                data.accessExisting(newestFileName(name + ".data"), false);
+                freeSlots.accessExisting(name + ".freeSlots", false);
+                return;
+            }
+        } else if(readWriteAccess) {
+            for(const string& fileName: {name + ".toc", name + ".data"}) {
+                if(filesystem::exists(fileName + "-Compacted")) {
+                    filesystem::remove(fileName + "-Compacted");
+                }
+            }
+        }
         toc.accessExisting(name + ".toc", readWriteAccess);
         data.accessExisting(name + ".data", readWriteAccess);
         freeSlots.accessExisting(name + ".freeSlots", readWriteAccess);
@@ -78,6 +109,15 @@ public:
         return toc.empty();
     }
 
+    // Keep only the first n lists.
+    // The nodes of the discarded lists are not reused
+    // until the next call to compact.
+    void truncate(size_t n)
+    {
+        CZI_ASSERT(n <= size());
+        toc.resize(n);
+    }
+
     // A list node stores an element of the list and an index offset, in the data vector,
     // to the previous and next node in the same list.
     // For each list we also store a "one past the end" Node.
@@ -310,6 +350,130 @@ public:
 
 
 
+    // Return a measure of fragmentation between 0 and 1:
+    // the fraction of slots of the data vector that are free
+    // or contain a list element not immediately following
+    // the previous node of the same list.
+    // When this is high, iterating over the lists causes random
+    // memory accesses. After compact, it is zero.
+    // This uses multiple threads.
+    double fragmentation() const
+    {
+        if(data.empty()) {
+            return 0.;
+        }
+        const size_t nonContiguousCount = parallelReduce(0, size(), size_t(0),
+            [this](size_t i)
+            {
+                size_t count = 0;
+                size_t previous = toc[i];
+                for(size_t slot=data[toc[i]].next; slot!=toc[i]; slot=data[slot].next) {
+                    if(slot != previous + 1) {
+                        ++count;
+                    }
+                    previous = slot;
+                }
+                return count;
+            },
+            [](size_t x, size_t y) {return x + y;});
+        return double(nonContiguousCount + freeSlots.size()) / double(data.size());
+    }
+
+
+
+    // Rewrite the data vector so the nodes of each list are contiguous,
+    // with lists in order and the end node of each list first,
+    // and discard the free slots. This uses multiple threads.
+    // All iterators are invalidated, and no other thread
+    // can access the VectorOfLists while this runs.
+    //
+    // The new data and toc vectors are written to separate files
+    // with names ending in "-Compacted", and synced to disk.
+    // Then a marker file with name ending in ".Compacting" is created,
+    // the new files are renamed over the old ones,
+    // the free slots are discarded, and the marker is removed.
+    // If this is interrupted, accessExisting discards the new files
+    // if the marker does not exist, and otherwise completes the compaction,
+    // so the toc and data vectors on disk are always consistent.
+    void compact()
+    {
+        CZI_ASSERT(data.isOpenWithWriteAccess);
+        const size_t listCount = size();
+
+        // The file names are the name passed to createNew
+        // or accessExisting followed by ".toc", ".data", and ".freeSlots".
+        const string name = toc.fileName.substr(0, toc.fileName.size() - string(".toc").size());
+
+        // Find the position of each list in the new data vector.
+        vector<size_t> listBegin(listCount + 1, 0);
+        parallelFor(0, listCount, [&](size_t i)
+        {
+            size_t nodeCount = 1;
+            for(size_t slot=data[toc[i]].next; slot!=toc[i]; slot=data[slot].next) {
+                ++nodeCount;
+            }
+            listBegin[i + 1] = nodeCount;
+        });
+        for(size_t i=0; i<listCount; i++) {
+            listBegin[i + 1] += listBegin[i];
+        }
+
+        // Write the new data vector.
+        const string newDataFileName = compactedFileName(name + ".data");
+        Vector<Node> newData;
+        newData.createNew(newDataFileName, listBegin.back());
+        parallelFor(0, listCount, [&](size_t i)
+        {
+            const size_t first = listBegin[i];
+            const size_t last = listBegin[i + 1] - 1;
+            newData[first].t = data[toc[i]].t;
+            size_t newSlot = first;
+            for(size_t slot=data[toc[i]].next; slot!=toc[i]; slot=data[slot].next) {
+                newData[++newSlot].t = data[slot].t;
+            }
+            for(size_t j=first; j<=last; j++) {
+                Node& node = newData[j];
+                node.previous = (j == first) ? last : j - 1;
+                node.next = (j == last) ? first : j + 1;
+            }
+        });
+        newData.close();
+
+        // Write the new toc vector.
+        const string newTocFileName = compactedFileName(name + ".toc");
+        Vector<size_t> newToc;
+        newToc.createNew(newTocFileName, listCount);
+        parallelFor(0, listCount, [&](size_t i)
+        {
+            newToc[i] = listBegin[i];
+        });
+        newToc.close();
+
+        // Make sure the new files are on disk before we commit to using them.
+        syncFile(newDataFileName);
+        syncFile(newTocFileName);
+        syncDirectoryEntry(newTocFileName);
+
+        // Create the marker, then replace the old files.
+        close();
+        const string markerFileName = name + ".Compacting";
+        {
+            ofstream marker(markerFileName);
+            if(!marker) {
+                throw runtime_error("Error creating " + markerFileName);
+            }
+        }
+        syncFile(markerFileName);
+        syncDirectoryEntry(markerFileName);
+        finishCompaction(name);
+
+        toc.accessExisting(name + ".toc", true);
+        data.accessExisting(name + ".data", true);
+        freeSlots.accessExisting(name + ".freeSlots", true);
+    }
+
+
+
     // Dump all internal data structures.
     void dump(ostream& s) const
     {
@@ -346,6 +510,41 @@ private:
 
 
 
+    // The name of the file written by compact
+    // to replace the file with the given name.
+    static string compactedFileName(const string& fileName)
+    {
+        return fileName + "-Compacted";
+    }
+
+    // Complete a compaction after its marker was created:
+    // rename the new toc and data files over the old ones (unless this
+    // was already done), discard the free slots, then remove the marker.
+    // The VectorOfLists must be closed.
+    void finishCompaction(const string& name)
+    {
+        for(const string& fileName: {name + ".toc", name + ".data"}) {
+            const string newFileName = compactedFileName(fileName);
+            if(filesystem::exists(newFileName)) {
+                if(std::rename(newFileName.c_str(), fileName.c_str()) != 0) {
+                    throw runtime_error("Error renaming " + newFileName + " to " + fileName);
+                }
+            }
+        }
+        const string freeSlotsFileName = name + ".freeSlots";
+        freeSlots.accessExisting(freeSlotsFileName, true);
+        freeSlots.resize(0);
+        freeSlots.close();
+        syncFile(freeSlotsFileName);
+        syncDirectoryEntry(freeSlotsFileName);
+
+        const string markerFileName = name + ".Compacting";
+        filesystem::remove(markerFileName);
+        syncDirectoryEntry(markerFileName);
+    }
+
+
+
     // Allocate a slot to be added to an existing list.
     // Use a free slot if we have one. Otherwise, increase by one the
     // size of the data vector.
@@ -414,6 +613,94 @@ inline void ChanZuckerberg::ExpressionMatrix2::testMemoryMappedVectorOfLists()
     cout << endl;
 
 
+    // Check the contents of a vector of lists.
+    vector< vector<int> > expectedContents = {{}, {10, 30, 40}, {50}};
+    const auto checkContents = [&expectedContents](const MemoryMapped::VectorOfLists<int>& v)
+    {
+        CZI_ASSERT(v.size() == expectedContents.size());
+        for(size_t i=0; i<v.size(); i++) {
+            vector<int> list;
+            for(const int x: v[i]) {
+                list.push_back(x);
+            }
+            CZI_ASSERT(list == expectedContents[i]);
+        }
+    };
+    checkContents(v);
+
+
+
+    // Compact it and check that the contents did not change.
+    CZI_ASSERT(v.fragmentation() > 0.);
+    v.compact();
+    CZI_ASSERT(v.fragmentation() == 0.);
+    checkContents(v);
+    CZI_ASSERT(!filesystem::exists("VectorOfLists.Compacting"));
+    CZI_ASSERT(!filesystem::exists("VectorOfLists.toc-Compacted"));
+    CZI_ASSERT(!filesystem::exists("VectorOfLists.data-Compacted"));
+
+    // The free slots were discarded, so adding elements still works.
+    v.push_back(0, 60);
+    v.push_back(1, 70);
+    expectedContents[0].push_back(60);
+    expectedContents[1].push_back(70);
+    checkContents(v);
+
+
+
+    // Simulate a compaction interrupted before it created its marker.
+    // The partially written file is discarded.
+    v.close();
+    {
+        ofstream file("VectorOfLists.data-Compacted");
+        file << "Partially written";
+    }
+    v.accessExisting("VectorOfLists", true);
+    CZI_ASSERT(!filesystem::exists("VectorOfLists.data-Compacted"));
+    checkContents(v);
+
+
+
+    // Simulate a compaction interrupted after it created its marker
+    // and renamed the new toc but not the new data.
+    // To get the new files, compact a copy of v.
+    v.erase(v.begin(1));
+    expectedContents[1].erase(expectedContents[1].begin());
+    MemoryMapped::VectorOfLists<int> w;
+    w.createNew("VectorOfListsCopy");
+    for(size_t i=0; i<v.size(); i++) {
+        w.push_back();
+        for(const int x: v[i]) {
+            w.push_back(i, x);
+        }
+    }
+    w.compact();
+    w.close();
+    v.close();
+    MemoryMapped::copyFile("VectorOfListsCopy.toc", "VectorOfLists.toc");
+    MemoryMapped::copyFile("VectorOfListsCopy.data", "VectorOfLists.data-Compacted");
+    {
+        ofstream file("VectorOfLists.Compacting");
+    }
+
+    // With read-only access, the new files are used,
+    // but the compaction is not completed.
+    v.accessExisting("VectorOfLists", false);
+    checkContents(v);
+    v.close();
+    CZI_ASSERT(filesystem::exists("VectorOfLists.Compacting"));
+
+    // With read-write access, the compaction is completed.
+    v.accessExisting("VectorOfLists", true);
+    CZI_ASSERT(!filesystem::exists("VectorOfLists.Compacting"));
+    CZI_ASSERT(!filesystem::exists("VectorOfLists.data-Compacted"));
+    CZI_ASSERT(v.fragmentation() == 0.);
+    checkContents(v);
+    v.push_back(2, 80);
+    expectedContents[2].push_back(80);
+    checkContents(v);
+
+
     // v.dump(cout);
 
     // Done.
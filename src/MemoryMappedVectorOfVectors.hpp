@@ -101,6 +101,29 @@ public:
     }
 
 
+    // Place the pages of the data on the NUMA nodes according to a policy
+    // (see numa.hpp). This has no effect on single node systems.
+    // For the partitioned policy, the partition is done by vector
+    // rather than by element, so the data of the vectors
+    // in each slice of [0, size()) end up on the same node.
+    // The table of contents is small and is interleaved.
+    // Returns the number of data pages placed on each node.
+    vector<size_t> applyNumaPolicy(numa::Policy policy) const
+    {
+        if(policy == numa::Policy::partitioned) {
+            toc.applyNumaPolicy(numa::Policy::interleave);
+            const size_t nodeCount = numa::nodeCount();
+            vector<const void*> boundaries;
+            for(size_t node=0; node<=nodeCount; node++) {
+                boundaries.push_back(begin() + toc[numa::partitionBegin(node, size(), nodeCount)]);
+            }
+            return numa::applyPartition(boundaries);
+        } else {
+            toc.applyNumaPolicy(policy);
+            return data.applyNumaPolicy(policy);
+        }
+    }
+
     // Return size/begin/end of the i-th vector.
     size_t size(size_t i) const
     {
@@ -154,6 +177,16 @@ public:
 
 
 
+    // Keep only the first n vectors.
+    void truncate(Int n)
+    {
+        CZI_ASSERT(n <= size());
+        toc.resize(n + 1);
+        data.resize(toc.back());
+    }
+
+
+
     // Operator[] return a MemoryAsContainer object.
     MemoryAsContainer<T> operator[](Int i)
     {
@@ -211,7 +244,7 @@ template<class T, class Int>
     for(Int i=0; i<n; i++) {
         toc[i+1] = toc[i] + count[i];
     }
-    const size_t  dataSize = toc.back() - 1ULL;
+    const size_t  dataSize = toc.back();
     data.reserve(dataSize);
     data.resize(dataSize);
 }
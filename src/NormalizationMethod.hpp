@@ -2,6 +2,7 @@
 #define CZI_EXPRESSION_MATRIX2_NORMALIZATION_METHOD_HPP
 
 #include "string.hpp"
+#include <cmath>
 
 namespace ChanZuckerberg {
     namespace ExpressionMatrix2 {
@@ -12,6 +13,12 @@ namespace ChanZuckerberg {
             none,       // Using None conflicts with Python use of None as a language keyword
             L1,
             L2,
+            log1p,              // log(1+x) of the raw counts.
+            CPM,                // Counts per million.
+            log1pCPM,           // log(1+x) of counts per million.
+            CP10k,              // Counts per 10 thousand.
+            log1pCP10k,         // log(1+x) of counts per 10 thousand.
+            PearsonResiduals,   // Analytic Pearson residuals (see normalizationKernels.hpp).
             Invalid
         };
 
@@ -21,7 +28,13 @@ namespace ChanZuckerberg {
         {
             NormalizationMethod::none,
             NormalizationMethod::L1,
-            NormalizationMethod::L2
+            NormalizationMethod::L2,
+            NormalizationMethod::log1p,
+            NormalizationMethod::CPM,
+            NormalizationMethod::log1pCPM,
+            NormalizationMethod::CP10k,
+            NormalizationMethod::log1pCP10k,
+            NormalizationMethod::PearsonResiduals
         };
 
 
@@ -36,21 +49,30 @@ namespace ChanZuckerberg {
                 return "L1";
             case NormalizationMethod::L2:
                 return "L2";
+            case NormalizationMethod::log1p:
+                return "log1p";
+            case NormalizationMethod::CPM:
+                return "CPM";
+            case NormalizationMethod::log1pCPM:
+                return "log1pCPM";
+            case NormalizationMethod::CP10k:
+                return "CP10k";
+            case NormalizationMethod::log1pCP10k:
+                return "log1pCP10k";
+            case NormalizationMethod::PearsonResiduals:
+                return "PearsonResiduals";
             default:
                 return "Invalid";
             }
         }
         inline NormalizationMethod normalizationMethodFromShortString(const string& s)
         {
-            if(s == "none") {
-                return NormalizationMethod::none;
-            } else if(s == "L1") {
-                return NormalizationMethod::L1;
-            } else if(s == "L2") {
-                return NormalizationMethod::L2;
-            } else {
-                return NormalizationMethod::Invalid;
+            for(const NormalizationMethod m: validNormalizationMethods) {
+                if(s == normalizationMethodToShortString(m)) {
+                    return m;
+                }
             }
+            return NormalizationMethod::Invalid;
         }
 
 
@@ -65,12 +87,60 @@ namespace ChanZuckerberg {
                 return "L1 normalization (fractional read count)";
             case NormalizationMethod::L2:
                 return "L2 normalization";
+            case NormalizationMethod::log1p:
+                return "log(1+x) of raw read count";
+            case NormalizationMethod::CPM:
+                return "counts per million";
+            case NormalizationMethod::log1pCPM:
+                return "log(1+x) of counts per million";
+            case NormalizationMethod::CP10k:
+                return "counts per 10 thousand";
+            case NormalizationMethod::log1pCP10k:
+                return "log(1+x) of counts per 10 thousand";
+            case NormalizationMethod::PearsonResiduals:
+                return "analytic Pearson residuals";
             default:
                 return "Invalid normalization";
             }
         }
 
 
+
+        // All normalization methods except PearsonResiduals map a zero count to zero,
+        // so they can be applied to sparse expression vectors.
+        // For those methods, the normalized value of a count x is f(scale*x),
+        // where f is either log(1+x) or the identity, and scale is computed
+        // from the sum and the sum of squares of the counts being normalized.
+        inline bool normalizationMethodPreservesZero(NormalizationMethod m)
+        {
+            return m != NormalizationMethod::PearsonResiduals && m != NormalizationMethod::Invalid;
+        }
+        inline bool normalizationMethodUsesLog1p(NormalizationMethod m)
+        {
+            return
+                m == NormalizationMethod::log1p ||
+                m == NormalizationMethod::log1pCPM ||
+                m == NormalizationMethod::log1pCP10k;
+        }
+        inline double normalizationMethodScale(NormalizationMethod m, double sum1, double sum2)
+        {
+            switch(m) {
+            case NormalizationMethod::L1:
+                return 1. / sum1;
+            case NormalizationMethod::L2:
+                return 1. / std::sqrt(sum2);
+            case NormalizationMethod::CPM:
+            case NormalizationMethod::log1pCPM:
+                return 1.e6 / sum1;
+            case NormalizationMethod::CP10k:
+            case NormalizationMethod::log1pCP10k:
+                return 1.e4 / sum1;
+            default:
+                return 1.;
+            }
+        }
+
+
     }
 }
 
@@ -0,0 +1,185 @@
+#include "Pipeline.hpp"
+#include "MurmurHash2.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <boost/property_tree/json_parser.hpp>
+
+#include <algorithm>
+#include <iomanip>
+#include "map.hpp"
+#include "sstream.hpp"
+
+
+
+// Sort the children of a property tree by key, recursively.
+// Children of arrays all have an empty key, and the sort is stable,
+// so the order of array elements is preserved.
+// This is used to make stage signatures independent of the order
+// in which parameters are written in the pipeline description.
+static void sortPropertyTree(boost::property_tree::ptree& propertyTree)
+{
+    propertyTree.sort([](
+        const boost::property_tree::ptree::value_type& x,
+        const boost::property_tree::ptree::value_type& y)
+        {
+            return x.first < y.first;
+        });
+    for(auto& child: propertyTree) {
+        sortPropertyTree(child.second);
+    }
+}
+
+
+
+Pipeline::Pipeline(const string& fileName)
+{
+    boost::property_tree::ptree propertyTree;
+    try {
+        boost::property_tree::read_json(fileName, propertyTree);
+    } catch(const boost::property_tree::json_parser_error& e) {
+        throw runtime_error("Error reading pipeline description " + fileName + ": " + e.what());
+    }
+    const auto stagesPropertyTree = propertyTree.get_child_optional("stages");
+    if(!stagesPropertyTree) {
+        throw runtime_error("Pipeline description " + fileName + " does not contain a list of stages.");
+    }
+
+
+
+    // Create the stages.
+    map<string, size_t> stageIndexes;
+    for(const auto& item: *stagesPropertyTree) {
+        const boost::property_tree::ptree& stagePropertyTree = item.second;
+        PipelineStage stage;
+        stage.name = stagePropertyTree.get<string>("name", "");
+        stage.function = stagePropertyTree.get<string>("function", "");
+        if(stage.name.empty() || stage.function.empty()) {
+            throw runtime_error("Each stage of pipeline " + fileName + " must specify a name and a function.");
+        }
+        if(!isSupportedFunction(stage.function, stage.isExclusive)) {
+            throw runtime_error("Pipeline stage " + stage.name + " uses unsupported function " + stage.function);
+        }
+        if(!stageIndexes.insert(make_pair(stage.name, stages.size())).second) {
+            throw runtime_error("Duplicate stage name " + stage.name + " in pipeline " + fileName);
+        }
+        const auto parameters = stagePropertyTree.get_child_optional("parameters");
+        if(parameters) {
+            stage.parameters = *parameters;
+        }
+        const auto dependsOn = stagePropertyTree.get_child_optional("dependsOn");
+        if(dependsOn) {
+            for(const auto& dependency: *dependsOn) {
+                stage.dependsOn.push_back(dependency.second.data());
+            }
+        }
+        stages.push_back(stage);
+    }
+
+
+
+    // Resolve the dependencies.
+    for(PipelineStage& stage: stages) {
+        for(const string& name: stage.dependsOn) {
+            const auto it = stageIndexes.find(name);
+            if(it == stageIndexes.end()) {
+                throw runtime_error("Pipeline stage " + stage.name + " depends on undefined stage " + name);
+            }
+            stage.dependencies.push_back(it->second);
+        }
+    }
+
+
+
+    // Compute the signatures in dependency order.
+    // If at some point no stage can be processed, there is a cycle.
+    vector<bool> isDone(stages.size(), false);
+    for(size_t doneCount=0; doneCount!=stages.size(); ) {
+        const size_t oldDoneCount = doneCount;
+        for(size_t i=0; i<stages.size(); i++) {
+            PipelineStage& stage = stages[i];
+            if(isDone[i] || !std::all_of(stage.dependencies.begin(), stage.dependencies.end(),
+                [&isDone](size_t j) {return isDone[j];})) {
+                continue;
+            }
+            boost::property_tree::ptree sortedParameters = stage.parameters;
+            sortPropertyTree(sortedParameters);
+            std::ostringstream s;
+            s << stage.function << "\n";
+            boost::property_tree::write_json(s, sortedParameters, false);
+            for(const size_t j: stage.dependencies) {
+                s << stages[j].signature << "\n";
+            }
+            const string description = s.str();
+            const uint64_t hash = MurmurHash64A(description.data(), int(description.size()), 231);
+            std::ostringstream signature;
+            signature << std::hex << std::setw(16) << std::setfill('0') << hash;
+            stage.signature = signature.str();
+            isDone[i] = true;
+            ++doneCount;
+        }
+        if(doneCount == oldDoneCount) {
+            throw runtime_error("The dependencies of the stages of pipeline " + fileName + " contain a cycle.");
+        }
+    }
+}
+
+
+
+bool Pipeline::isSupportedFunction(const string& function, bool& isExclusive)
+{
+    // Functions that only read the expression matrix
+    // and write their own files.
+    if(function == "computeLshSignatures" || function == "findSimilarPairs7") {
+        isExclusive = false;
+        return true;
+    }
+
+    // Functions that modify the expression matrix.
+    isExclusive = true;
+    return
+        function == "addCells" ||
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+        function == "addCellsFromHdf5" ||
+        function == "addCellsFromH5ad" ||
+        function == "addCellsFromLoom" ||
+#endif
+        function == "createGeneSetUsingInformationContent" ||
+        function == "createCellGraph" ||
+        function == "createClusterGraph" ||
+        function == "compactMetaData";
+}
+
+
+
+vector<int> PipelineStage::getIntegers(const string& parameterName) const
+{
+    const auto child = parameters.get_child_optional(parameterName);
+    if(!child) {
+        throw runtime_error("Pipeline stage " + name + " is missing parameter " + parameterName);
+    }
+    vector<int> values;
+    for(const auto& item: *child) {
+        try {
+            values.push_back(item.second.get_value<int>());
+        } catch(const boost::property_tree::ptree_error&) {
+            throw runtime_error("Invalid value " + item.second.data() + " for parameter " + parameterName +
+                " of pipeline stage " + name);
+        }
+    }
+    return values;
+}
+
+
+
+vector< pair<string, string> > PipelineStage::getMetaData(const string& parameterName) const
+{
+    vector< pair<string, string> > metaData;
+    const auto child = parameters.get_child_optional(parameterName);
+    if(child) {
+        for(const auto& item: *child) {
+            metaData.push_back(make_pair(item.first, item.second.data()));
+        }
+    }
+    return metaData;
+}
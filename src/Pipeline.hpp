@@ -0,0 +1,153 @@
+#ifndef CZI_EXPRESSION_MATRIX2_PIPELINE_HPP
+#define CZI_EXPRESSION_MATRIX2_PIPELINE_HPP
+
+
+
+/*******************************************************************************
+
+Class Pipeline describes a sequence of analysis steps (stages)
+to be run on an expression matrix by ExpressionMatrix::runPipeline.
+
+The pipeline is described by a JSON file like this:
+
+{
+    "stages": [
+        {
+            "name": "cells",
+            "function": "addCellsFromHdf5",
+            "parameters": {"fileName": "pbmc.h5", "totalExpressionCountThreshold": 1000}
+        },
+        {
+            "name": "genes",
+            "function": "createGeneSetUsingInformationContent",
+            "dependsOn": ["cells"],
+            "parameters": {"normalizationMethod": "L2",
+                "geneInformationContentThreshold": 2, "newGeneSetName": "HighInformationGenes"}
+        },
+        ...
+    ]
+}
+
+Each stage calls one ExpressionMatrix function, and its parameters
+have the same names and defaults as the corresponding Python function.
+Parameters that are lists of integers (lshSliceLengths) are JSON arrays.
+Cell meta data (cellMetaData, additionalCellMetaData) are JSON objects.
+The supported functions are:
+addCells, addCellsFromHdf5, addCellsFromH5ad, addCellsFromLoom,
+createGeneSetUsingInformationContent, computeLshSignatures,
+findSimilarPairs7, createCellGraph, createClusterGraph, compactMetaData.
+
+A stage only runs after all the stages listed in its dependsOn.
+Stages that only read the expression matrix and write their own files
+(computeLshSignatures, findSimilarPairs7) can run concurrently
+with each other, and their output lines are prefixed with the stage name.
+All other stages modify the expression matrix
+and run with no other stage running.
+
+Each stage has a signature, a hash of its function, its parameters,
+and the signatures of the stages it depends on. When a stage completes,
+its signature is recorded in the expression matrix directory,
+so a later run of the same pipeline can skip it if its outputs still exist.
+Stages that add cells also record the number of cells when they begin.
+If one of them is interrupted, a later run with the same signature
+skips the cells it already added, so they are not added twice.
+
+*******************************************************************************/
+
+#include <boost/property_tree/ptree.hpp>
+
+#include "stdexcept.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class Pipeline;
+        class PipelineStage;
+    }
+}
+
+
+
+// A stage of a Pipeline.
+class ChanZuckerberg::ExpressionMatrix2::PipelineStage {
+public:
+    string name;
+    string function;
+    boost::property_tree::ptree parameters;
+
+    // The names and indexes of the stages this stage depends on.
+    vector<string> dependsOn;
+    vector<size_t> dependencies;
+
+    // True if this stage modifies the expression matrix
+    // and so must run with no other stage running.
+    bool isExclusive;
+
+    // Hash of the function, parameters, and signatures of the dependencies,
+    // as a hexadecimal string.
+    string signature;
+
+    // Access a parameter, converted to the requested type.
+    // The first version throws if the parameter is missing.
+    template<class T> T get(const string& parameterName) const;
+    template<class T> T get(const string& parameterName, const T& defaultValue) const;
+
+    // Access a parameter that is a JSON array of integers.
+    vector<int> getIntegers(const string& parameterName) const;
+
+    // Access a parameter that is a JSON object of (name, value) pairs.
+    // Returns an empty vector if the parameter is missing.
+    vector< pair<string, string> > getMetaData(const string& parameterName) const;
+};
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::Pipeline {
+public:
+
+    // Read the pipeline description from a JSON file,
+    // check it, and compute the stage signatures.
+    explicit Pipeline(const string& fileName);
+
+    // The stages, in the order in which they appear in the file.
+    vector<PipelineStage> stages;
+
+private:
+
+    // Return true if the function is supported. If it is,
+    // also set isExclusive to indicate whether it modifies the expression matrix.
+    static bool isSupportedFunction(const string& function, bool& isExclusive);
+};
+
+
+
+template<class T> T ChanZuckerberg::ExpressionMatrix2::PipelineStage::get(
+    const string& parameterName) const
+{
+    if(!parameters.get_child_optional(parameterName)) {
+        throw runtime_error("Pipeline stage " + name + " is missing parameter " + parameterName);
+    }
+    return get<T>(parameterName, T());
+}
+
+
+
+template<class T> T ChanZuckerberg::ExpressionMatrix2::PipelineStage::get(
+    const string& parameterName,
+    const T& defaultValue) const
+{
+    const auto child = parameters.get_child_optional(parameterName);
+    if(!child) {
+        return defaultValue;
+    }
+    try {
+        return child->get_value<T>();
+    } catch(const boost::property_tree::ptree_error&) {
+        throw runtime_error("Invalid value " + child->data() + " for parameter " + parameterName +
+            " of pipeline stage " + name);
+    }
+}
+
+#endif
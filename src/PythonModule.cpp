@@ -14,10 +14,16 @@
 #include "ClusterGraph.hpp"
 #include "ExpressionMatrix.hpp"
 #include "ExpressionMatrixSubset.hpp"
+#include "ExpressionMatrixTest.hpp"
+#include "FederatedExpressionMatrix.hpp"
 #include "heap.hpp"
 #include "MemoryMappedVector.hpp"
 #include "MemoryMappedVectorOfLists.hpp"
 #include "multipleSetUnion.hpp"
+#include "normalizationKernels.hpp"
+#include "numa.hpp"
+#include "similarityKernels.hpp"
+#include "TaskScheduler.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
@@ -107,30 +113,18 @@ pybind11::array ExpressionMatrix::getDenseExpressionMatrix(
 
 
     // Create the data for the dense representation of this expression matrix subset.
+    if(normalizationMethod == NormalizationMethod::Invalid) {
+        throw runtime_error("Invalid normalization method.");
+    }
+    vector< vector<float> > v;
+    PearsonResidualsParameters pearsonResidualsParameters;
+    getPearsonResidualsParameters(geneSet, normalizationMethod, pearsonResidualsParameters);
+    expressionMatrixSubset.getDenseRepresentation(v, normalizationMethod, &pearsonResidualsParameters);
     vector<double> data(geneSet.size() * cellSet.size(), 0.);
     for(CellId cellId=0; cellId<cellSet.size(); cellId++) {
-
-        // Compute the normalization factor to be used for this cell.
-        float normalizationFactor;
-        switch(normalizationMethod) {
-        case NormalizationMethod::none:
-            normalizationFactor = 1.;
-            break;
-        case NormalizationMethod::L1:
-            normalizationFactor = float(1. / expressionMatrixSubset.sums[cellId].sum1);
-            break;
-        case NormalizationMethod::L2:
-            normalizationFactor = float(1. / sqrt(expressionMatrixSubset.sums[cellId].sum2));
-            break;
-        default:
-            throw runtime_error("Invalid normalization method.");
-        }
-
         const size_t offset = cellId * geneSet.size();
-        for(const pair<GeneId, float>& p: expressionMatrixSubset.cellExpressionCounts[cellId]) {
-            const GeneId geneId = p.first;
-            float count = normalizationFactor * p.second;
-            data[offset + geneId] = double(count);
+        for(GeneId geneId=0; geneId<geneSet.size(); geneId++) {
+            data[offset + geneId] = double(v[geneId][cellId]);
         }
     }
 
@@ -152,6 +146,86 @@ pybind11::array ExpressionMatrix::getDenseExpressionMatrix(
 
 
 
+// Python version of computeCellSimilarities.
+// The cell pairs are converted to a C-style numpy array of int64
+// (this makes a copy only if necessary), checked, and copied
+// to a vector of pairs while holding the global interpreter lock.
+// The lock is then released while the similarities are computed.
+pybind11::array ExpressionMatrix::computeCellSimilaritiesPython(
+    const string& geneSetName,
+    pybind11::array cellPairsArray,
+    SimilarityMetric similarityMetric) const
+{
+    typedef array_t<int64_t, array::c_style | array::forcecast> CellPairsArray;
+    const CellPairsArray a = CellPairsArray::ensure(cellPairsArray);
+    if(!a || a.ndim() != 2 || a.shape(1) != 2) {
+        throw runtime_error("The cell pairs must be an integer array with two columns.");
+    }
+    const size_t n = size_t(a.shape(0));
+    const int64_t* p = a.data();
+    vector< pair<CellId, CellId> > cellPairs(n);
+    for(size_t i=0; i<n; i++, p+=2) {
+        if(p[0] < 0 || p[0] >= int64_t(cellCount()) || p[1] < 0 || p[1] >= int64_t(cellCount())) {
+            throw runtime_error("Invalid cell id.");
+        }
+        cellPairs[i] = make_pair(CellId(p[0]), CellId(p[1]));
+    }
+
+    vector<float> similarities;
+    {
+        gil_scoped_release release;
+        computeCellSimilarities(geneSetName, cellPairs, similarityMetric, similarities);
+    }
+
+    array_t<float> similaritiesArray(n);
+    std::copy(similarities.begin(), similarities.end(), similaritiesArray.mutable_data());
+    return similaritiesArray;
+}
+
+
+
+// Python versions of getCellMetaDataValueIds and getCellMetaDataCodes.
+// The numpy arrays are allocated while holding the global interpreter lock,
+// then filled in place without holding it.
+pybind11::array ExpressionMatrix::getCellMetaDataValueIdsPython(
+    const string& cellSetName,
+    const vector<string>& metaDataNames) const
+{
+    const auto it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " not found.");
+    }
+    array_t<StringId> valueIds(std::vector<size_t>({it->second->size(), metaDataNames.size()}));
+    StringId* p = valueIds.mutable_data();
+    {
+        gil_scoped_release release;
+        getCellMetaDataValueIds(cellSetName, metaDataNames, p);
+    }
+    return valueIds;
+}
+
+
+
+pybind11::tuple ExpressionMatrix::getCellMetaDataCodesPython(
+    const string& cellSetName,
+    const string& metaDataName) const
+{
+    const auto it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " not found.");
+    }
+    array_t<int32_t> codes(it->second->size());
+    int32_t* p = codes.mutable_data();
+    vector<string> categories;
+    {
+        gil_scoped_release release;
+        getCellMetaDataCodes(cellSetName, metaDataName, p, categories);
+    }
+    return pybind11::make_tuple(codes, categories);
+}
+
+
+
 PYBIND11_MODULE(ExpressionMatrix2, module)
 {
     // Enum class NormalizationMethod.
@@ -162,17 +236,53 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
         "- none: no normalization.\n"
         "- L1: L1 normalization (sum of values is 1).\n"
         "- L2: L2 normalization (sum of squares of values is 1).\n"
+        "- log1p: log(1+x) of raw counts.\n"
+        "- CPM: counts per million.\n"
+        "- log1pCPM: log(1+x) of counts per million.\n"
+        "- CP10k: counts per 10 thousand.\n"
+        "- log1pCP10k: log(1+x) of counts per 10 thousand.\n"
+        "- PearsonResiduals: analytic Pearson residuals (dense).\n"
         "- Invalid: invalid normalization.\n"
         )
         .value(normalizationMethodToShortString(NormalizationMethod::none).c_str(),       NormalizationMethod::none)
         .value(normalizationMethodToShortString(NormalizationMethod::L1).c_str(),         NormalizationMethod::L1)
         .value(normalizationMethodToShortString(NormalizationMethod::L2).c_str(),         NormalizationMethod::L2)
+        .value(normalizationMethodToShortString(NormalizationMethod::log1p).c_str(),      NormalizationMethod::log1p)
+        .value(normalizationMethodToShortString(NormalizationMethod::CPM).c_str(),        NormalizationMethod::CPM)
+        .value(normalizationMethodToShortString(NormalizationMethod::log1pCPM).c_str(),   NormalizationMethod::log1pCPM)
+        .value(normalizationMethodToShortString(NormalizationMethod::CP10k).c_str(),      NormalizationMethod::CP10k)
+        .value(normalizationMethodToShortString(NormalizationMethod::log1pCP10k).c_str(), NormalizationMethod::log1pCP10k)
+        .value(normalizationMethodToShortString(NormalizationMethod::PearsonResiduals).c_str(), NormalizationMethod::PearsonResiduals)
         .value(normalizationMethodToShortString(NormalizationMethod::Invalid).c_str(),    NormalizationMethod::Invalid)
         .export_values()
         ;
 
 
 
+    // Enum class SimilarityMetric.
+    // Its values are not exported to the module scope,
+    // to avoid a conflict with NormalizationMethod.Invalid.
+    enum_<SimilarityMetric>(
+        module,
+        "SimilarityMetric",
+        "Metrics used to compute the exact similarity of two cells.\n\n"
+        "- Pearson: Pearson correlation coefficient of the expression counts.\n"
+        "- Cosine: cosine of the angle between the expression vectors.\n"
+        "- Spearman: Spearman rank correlation of the expression counts.\n"
+        "- WeightedJaccard: sum of min(x, y) divided by sum of max(x, y).\n"
+        "- Euclidean: 1/(1+d), where d is the Euclidean distance between the expression vectors.\n"
+        "- Invalid: invalid similarity metric.\n"
+        )
+        .value(similarityMetricToString(SimilarityMetric::Pearson).c_str(),         SimilarityMetric::Pearson)
+        .value(similarityMetricToString(SimilarityMetric::Cosine).c_str(),          SimilarityMetric::Cosine)
+        .value(similarityMetricToString(SimilarityMetric::Spearman).c_str(),        SimilarityMetric::Spearman)
+        .value(similarityMetricToString(SimilarityMetric::WeightedJaccard).c_str(), SimilarityMetric::WeightedJaccard)
+        .value(similarityMetricToString(SimilarityMetric::Euclidean).c_str(),       SimilarityMetric::Euclidean)
+        .value(similarityMetricToString(SimilarityMetric::Invalid).c_str(),         SimilarityMetric::Invalid)
+        ;
+
+
+
     // Class ExpressionMatrix.
     class_<ExpressionMatrix>(
         module,
@@ -302,6 +412,54 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("cellMetaData"),
            arg("totalExpressionCountThreshold")
        )
+       .def("exportToHdf5",
+           &ExpressionMatrix::exportToHdf5,
+           "Writes the expression counts for a gene set and cell set "
+           "to a file in HDF5 format, in the same format read by addCellsFromHdf5. "
+           "Data sets are chunked and compressed with the shuffle and gzip filters. "
+           "This functon is only available in a build that includes HDF5 support.",
+           arg("fileName"),
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("groupName") = "matrix",
+           arg("compressionLevel") = 4
+       )
+       .def("addCellsFromH5ad",
+           &ExpressionMatrix::addCellsFromH5ad,
+           "Adds cells from an AnnData h5ad file, as created by scanpy and anndata. "
+           "Obs columns become cell meta data and var columns become gene meta data. "
+           "This functon is only available in a build that includes HDF5 support.",
+           arg("fileName"),
+           arg("matrixName") = "X",
+           arg("cellNamePrefix") = "",
+           arg("cellMetaData") = vector< pair<string, string> >(),
+           arg("totalExpressionCountThreshold") = 0.
+       )
+       .def("exportToH5ad",
+           &ExpressionMatrix::exportToH5ad,
+           "Writes the expression counts, cell meta data, and cell graph layouts "
+           "for a gene set and cell set to an AnnData h5ad file. "
+           "This functon is only available in a build that includes HDF5 support.",
+           arg("fileName"),
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("metaDataNames") = vector<string>(),
+           arg("cellGraphNames") = vector<string>(),
+           arg("compressionLevel") = 4
+       )
+       .def("addCellsFromLoom",
+           &ExpressionMatrix::addCellsFromLoom,
+           "Adds cells from a loom file, as created by loompy. "
+           "Column attributes become cell meta data and row attributes become gene meta data. "
+           "This functon is only available in a build that includes HDF5 support.",
+           arg("fileName"),
+           arg("layerName") = "",
+           arg("cellNameAttribute") = "CellID",
+           arg("geneNameAttribute") = "Gene",
+           arg("cellNamePrefix") = "",
+           arg("cellMetaData") = vector< pair<string, string> >(),
+           arg("totalExpressionCountThreshold") = 0.
+       )
 #endif
        .def("addCellsFromBioHub1",
            &ExpressionMatrix::addCellsFromBioHub1,
@@ -342,6 +500,42 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "All cell names must already be present. ",
            arg("cellMetaDataFileName")
        )
+       .def("createExpressionMatrixFromSubset",
+           &ExpressionMatrix::createExpressionMatrixFromSubset,
+           "Create a new expression matrix in directory newDirectoryName, "
+           "containing only the cells of the specified cell set "
+           "and the genes of the specified gene set. "
+           "Only the cell meta data with the specified names are copied "
+           "(CellName is always copied). If metaDataNames is empty, "
+           "all cell meta data are copied. "
+           "The new expression matrix can be accessed with the ExpressionMatrix constructor. ",
+           arg("newDirectoryName"),
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("metaDataNames") = vector<string>()
+       )
+       .def_static("mergeExpressionMatrices",
+           &ExpressionMatrix::mergeExpressionMatrices,
+           "Create a new expression matrix in directory outputDirectoryName, "
+           "containing all the cells of the expression matrices in the input directories. "
+           "Genes and meta data are merged, and cell names must be unique across inputs. "
+           "If metaDataTag is not empty, each cell gets a meta data field with that name, "
+           "set to the name of its input directory. "
+           "The new expression matrix can be accessed with the ExpressionMatrix constructor. ",
+           arg("outputDirectoryName"),
+           arg("inputDirectoryNames"),
+           arg("metaDataTag") = ""
+       )
+       .def("runPipeline",
+           &ExpressionMatrix::runPipeline,
+           "Runs the stages of a pipeline described in a JSON file. "
+           "Independent stages that only read the expression matrix run concurrently. "
+           "Stages that completed in a previous run with the same parameters "
+           "are skipped if their outputs still exist, unless force is True. "
+           "See `here <../../../PythonApiReference.html#runPipeline>`__ for more information. ",
+           arg("fileName"),
+           arg("force") = false
+       )
 
 
 
@@ -384,6 +578,31 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "Each element in the returned list corresponds to the cell id at the same position in list cellIds. ",
            arg("cellIds")
        )
+       .def("getCellMetaDataValueIds",
+           &ExpressionMatrix::getCellMetaDataValueIdsPython,
+           "Returns a numpy array of uint32 with one row for each cell of a cell set "
+           "and one column for each of the given meta data names, "
+           "containing ids of meta data values, or invalidStringId for missing values. "
+           "Use getCellMetaDataValueStrings to get the corresponding strings. "
+           "The array is filled in parallel, without holding the Python global interpreter lock. ",
+           arg("cellSetName"),
+           arg("metaDataNames")
+       )
+       .def("getCellMetaDataCodes",
+           &ExpressionMatrix::getCellMetaDataCodesPython,
+           "Returns a tuple (codes, categories) for a meta data field and each cell of a cell set. "
+           "codes is a numpy array of int32 containing, for each cell, "
+           "an index in the list of categories, or -1 for missing values. "
+           "Use pandas.Categorical.from_codes(codes, categories) to create a pandas Categorical. ",
+           arg("cellSetName"),
+           arg("metaDataName")
+       )
+       .def("getCellMetaDataValueStrings",
+           &ExpressionMatrix::getCellMetaDataValueStrings,
+           "Returns the meta data values corresponding to a list of ids "
+           "returned by getCellMetaDataValueIds. ",
+           arg("valueIds")
+       )
        .def
        (
            "removeCellMetaData",
@@ -484,6 +703,34 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("cellIds"),
            arg("geneIds")
        )
+
+       // Expression layers.
+       .def("createExpressionLayer",
+           &ExpressionMatrix::createExpressionLayer,
+           "Creates a persistent expression layer containing normalized expression counts "
+           "for all cells. All normalization methods except PearsonResiduals can be used. "
+           "Valid precisions are float32, float16, bfloat16. "
+           "The layer is kept up to date as cells are added.",
+           arg("layerName"),
+           arg("normalizationMethod") = NormalizationMethod::L2,
+           arg("precision") = "float32"
+       )
+       .def("removeExpressionLayer",
+           &ExpressionMatrix::removeExpressionLayer,
+           "Removes an expression layer.",
+           arg("layerName")
+       )
+       .def("getExpressionLayerNames",
+           &ExpressionMatrix::getExpressionLayerNames,
+           "Returns the names of the existing expression layers."
+       )
+       .def("getCellExpressionLayerValues",
+           &ExpressionMatrix::getCellExpressionLayerValues,
+           "Returns the non-zero values stored in an expression layer for a given cell. "
+           "The returned list contains pairs of gene ids and the corresponding values.",
+           arg("cellId"),
+           arg("layerName")
+       )
        .def("getDenseExpressionMatrix",
            &ExpressionMatrix::getDenseExpressionMatrix,
            "Get a dense representation of a subset of the expression matrix "
@@ -741,19 +988,33 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        .def("computeCellSimilarity",
            (
                double (ExpressionMatrix::*)
-               (const string&, CellId, CellId) const
+               (const string&, CellId, CellId, SimilarityMetric) const
            )
            &ExpressionMatrix::computeCellSimilarity,
            "Returns the similarity between the expression vectors of two cells, "
            "specified by their cell ids. "
            "The similarity is computed taking into account only genes in the specifified gene set. "
-           "It is computed as the `Pearson correlation coefficient "
+           "By default, it is computed as the `Pearson correlation coefficient "
            "<https://en.wikipedia.org/wiki/Pearson_correlation_coefficient>`__ "
            "of the expression vectors of the two cells. "
-           "The computed similarity is always between -1 and 1, and it is rarely negative. ",
+           "The computed similarity is always between -1 and 1, and it is rarely negative. "
+           "Other similarity metrics can be selected using similarityMetric. ",
            arg("geneSetName") = "AllGenes",
            arg("cellId0"),
-           arg("cellId1")
+           arg("cellId1"),
+           arg("similarityMetric") = SimilarityMetric::Pearson
+       )
+       .def("computeCellSimilarities",
+           &ExpressionMatrix::computeCellSimilaritiesPython,
+           "Returns the similarities of many pairs of cells, "
+           "specified as an integer numpy array with two columns containing cell ids "
+           "and one row for each pair. "
+           "The similarities are returned as a numpy array of float32, "
+           "in the same order as the pairs. "
+           "They are computed in parallel, without holding the Python global interpreter lock. ",
+           arg("geneSetName"),
+           arg("cellPairs"),
+           arg("similarityMetric") = SimilarityMetric::Pearson
        )
 
 
@@ -762,7 +1023,7 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        .def("findSimilarPairs0",
            (
                void (ExpressionMatrix::*)
-               (const string&, const string&, const string&, size_t, double)
+               (const string&, const string&, const string&, size_t, double, SimilarityMetric)
            )
            &ExpressionMatrix::findSimilarPairs0,
            "Creates and stores a new object similarPairsName "
@@ -770,7 +1031,8 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "The computation is done by directly looping "
            "over all possible cell pairs with both cells in cellSetName "
            "and performing for each pair an exact computation of the cell similarity, "
-           "taking into account only genes in geneSetName. "
+           "taking into account only genes in geneSetName "
+           "and using the specified similarityMetric. "
            "For each cell, only the best (most similar) k or fewer similar cells are stored, "
            "among those that exceed the specified similarityThreshold. "
            "This computational cost of this function grows "
@@ -783,7 +1045,8 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("cellSetName") = "AllCells",
            arg("similarPairsName"),
            arg("k") = 100,
-           arg("similarityThreshold") = 0.2
+           arg("similarityThreshold") = 0.2,
+           arg("similarityMetric") = SimilarityMetric::Pearson
        )
        .def("findSimilarPairs4",
            (
@@ -832,14 +1095,16 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("lshCount") = 1024,
            arg("seed") = 231,
            arg("kernel") = 1,
-           arg("blockSize") = 16
+           arg("blockSize") = 16,
+           arg("lshBitCount") = 0
        )
 #endif
        .def("findSimilarPairs5",
            &ExpressionMatrix::findSimilarPairs5,
            "LSH-based computation of similar cell pairs "
            "without looping over all possible pairs of cells."
-           "Prototype code. Use findSimilarPairs4 instead.",
+           "Prototype code. Use findSimilarPairs4 instead."
+           " If lshBitCount is not zero, only the first lshBitCount bits of each LSH signature are used.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("lshName"),
@@ -847,13 +1112,15 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("k") = 100,
            arg("similarityThreshold") = 0.2,
            arg("lshSliceLength"),
-           arg("bucketOverflow") = 1000
+           arg("bucketOverflow") = 1000,
+           arg("lshBitCount") = 0
        )
        .def("findSimilarPairs6",
            &ExpressionMatrix::findSimilarPairs6,
            "Computation of similar cell pairs using LSH and the Charikar algorithm "
            "to avoid looping over all possible pairs of cells."
-           "Prototype code, see the code for details. Use findSimilarPairs4 instead.",
+           "Prototype code, see the code for details. Use findSimilarPairs4 instead."
+           " If lshBitCount is not zero, only the first lshBitCount bits of each LSH signature are used.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("lshName"),
@@ -863,13 +1130,20 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("permutationCount"),
            arg("searchCount"),
            arg("permutedBitCount") = 64,
-           arg("seed") = 231
+           arg("seed") = 231,
+           arg("lshBitCount") = 0
        )
        .def("findSimilarPairs7",
+           (
+               void (ExpressionMatrix::*)
+               (const string&, const string&, const string&, const string&,
+               size_t, double, const vector<int>&, CellId, size_t, size_t)
+           )
            &ExpressionMatrix::findSimilarPairs7,
            "LSH-based computation of similar cell pairs "
            "without looping over all possible pairs of cells."
-           "Prototype code. Use findSimilarPairs4 instead.",
+           "Prototype code. Use findSimilarPairs4 instead."
+           " If lshBitCount is not zero, only the first lshBitCount bits of each LSH signature are used.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("lshName"),
@@ -878,7 +1152,8 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("similarityThreshold") = 0.2,
            arg("lshSliceLengths"),
            arg("maxCheck"),
-           arg("log2BucketCount")
+           arg("log2BucketCount"),
+           arg("lshBitCount") = 0
        )
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
        .def("findSimilarPairs7Gpu",
@@ -895,7 +1170,8 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("lshSliceLengths"),
            arg("maxCheck"),
            arg("log2BucketCount"),
-           arg("blockSize")
+           arg("blockSize"),
+           arg("lshBitCount") = 0
        )
 #endif
        .def("writeSimilarPairs",
@@ -921,7 +1197,10 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        .def("compareSimilarPairs",
            &ExpressionMatrix::compareSimilarPairs,
            "Only intended to be used for testing. "
-           "See the source code in the ExpressionMatrix2/src directory for more information. "
+           "Returns True if all cells have identical similarities in the two SimilarPairs objects. "
+           "See the source code in the ExpressionMatrix2/src directory for more information. ",
+           arg("similarPairsName0"),
+           arg("similarPairsName1")
        )
        .def("analyzeLsh",
            &ExpressionMatrix::analyzeLsh,
@@ -930,12 +1209,91 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        )
        .def("computeLshSignatures",
            &ExpressionMatrix::computeLshSignatures,
-           "Compute cell LSH signatures and store them.",
+           "Compute cell LSH signatures and store them. "
+           "If layerName is not empty, the values of that expression layer are used "
+           "instead of the raw expression counts. Otherwise, cell expression vectors "
+           "are normalized using normalizationMethod.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("lshName"),
            arg("lshCount") = 1024,
-           arg("seed") = 231
+           arg("seed") = 231,
+           arg("layerName") = "",
+           arg("normalizationMethod") = NormalizationMethod::none
+       )
+       .def("gatherLshSignatures",
+           &ExpressionMatrix::gatherLshSignatures,
+           "Creates new LSH signatures containing a contiguous copy of the existing signatures "
+           "of the cells of a cell set contained in the cell set used to compute them.",
+           arg("cellSetName"),
+           arg("lshName"),
+           arg("newLshName")
+       )
+       .def("setNumaPolicy",
+           &ExpressionMatrix::setNumaPolicy,
+           "Sets the placement of a large data structure on NUMA nodes. "
+           "Valid container names are Cells, CellExpressionCounts, and Lsh-<lshName>. "
+           "Valid policies are none, interleave (pages spread round robin on all nodes), "
+           "and partitioned (one contiguous slice per node, processed by threads on that node). "
+           "The policy is also applied to Lsh objects created later with computeLshSignatures. "
+           "Has no effect on systems with a single NUMA node.",
+           arg("containerName"),
+           arg("policy")
+       )
+       .def("setDurabilityMode",
+           &ExpressionMatrix::setDurabilityMode,
+           "Sets when the data of this expression matrix are synced to disk. "
+           "Valid modes are strict (sync each data structure when it is closed or resized, the default), "
+           "async (start write-back without waiting for it), "
+           "and bulk (only sync in checkpoint).",
+           arg("mode")
+       )
+       .def("checkpoint",
+           &ExpressionMatrix::checkpoint,
+           "Syncs all data to disk and writes a checkpoint marker "
+           "containing the number of cells.")
+       .def("getCheckpointCellCount",
+           &ExpressionMatrix::getCheckpointCellCount,
+           "Returns the number of cells at the last checkpoint, or invalidCellId if there is none.")
+       .def("recoverFromCheckpoint",
+           &ExpressionMatrix::recoverFromCheckpoint,
+           "Discards the cells added after the last checkpoint, in place.")
+       .def("createSnapshot",
+           &ExpressionMatrix::createSnapshot,
+           "Creates a snapshot of the expression matrix that shares unchanged data structures with it.",
+           arg("snapshotName")
+       )
+       .def("getSnapshotNames",
+           &ExpressionMatrix::getSnapshotNames,
+           "Returns the names of the existing snapshots.")
+       .def("getSnapshotDirectoryName",
+           &ExpressionMatrix::getSnapshotDirectoryName,
+           "Returns the directory containing a snapshot.",
+           arg("snapshotName")
+       )
+       .def("openBranch",
+           &ExpressionMatrix::openBranch,
+           "Accesses a snapshot with write access, as a separate expression matrix.",
+           arg("snapshotName")
+       )
+       .def("removeSnapshot",
+           &ExpressionMatrix::removeSnapshot,
+           "Removes a snapshot.",
+           arg("snapshotName")
+       )
+       .def("getCellMetaDataFragmentation",
+           &ExpressionMatrix::getCellMetaDataFragmentation,
+           "Returns the fragmentation of the cell meta data, between 0 and 1.")
+       .def("getGeneMetaDataFragmentation",
+           &ExpressionMatrix::getGeneMetaDataFragmentation,
+           "Returns the fragmentation of the gene meta data, between 0 and 1.")
+       .def("compactMetaData",
+           &ExpressionMatrix::compactMetaData,
+           "Rewrites the cell and gene meta data contiguously, in cell and gene order.")
+       .def("compactMetaDataIfFragmented",
+           &ExpressionMatrix::compactMetaDataIfFragmented,
+           "Compacts the cell and/or gene meta data if their fragmentation is greater than the threshold.",
+           arg("threshold")
        )
        .def("analyzeLshSignatures",
            &ExpressionMatrix::analyzeLshSignatures,
@@ -946,6 +1304,40 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("lshCount") = 1024,
            arg("seed") = 231
        )
+       .def("estimateLshAccuracy",
+           &ExpressionMatrix::estimateLshAccuracy,
+           "Estimates the accuracy of the similarities computed by an existing Lsh object, "
+           "comparing them with exact Pearson similarities on a sample of cell pairs. "
+           "If lshBitCount is not zero, only that number of signature bits is used. "
+           "If referenceCellCount is zero, neighbors are looked for among all cells.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("lshName"),
+           arg("lshBitCount") = 0,
+           arg("randomPairCount") = 100000,
+           arg("queryCellCount") = 100,
+           arg("referenceCellCount") = 10000,
+           arg("k") = 10,
+           arg("binCount") = 20,
+           arg("seed") = 231
+       )
+       .def("tuneLsh",
+           &ExpressionMatrix::tuneLsh,
+           "Chooses parameters for findSimilarPairs5 and findSimilarPairs7 that achieve "
+           "the target recall@k at the lowest predicted cost, using an Lsh object "
+           "previously created by computeLshSignatures. "
+           "Recall and candidate counts are predicted using a sample of cells.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("lshName"),
+           arg("k") = 100,
+           arg("similarityThreshold") = 0.2,
+           arg("targetRecall") = 0.9,
+           arg("queryCellCount") = 100,
+           arg("exactCheckCount") = 0,
+           arg("referenceCellCount") = 10000,
+           arg("seed") = 231
+       )
 
 
        // Find pairs of similar genes.
@@ -1137,6 +1529,134 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
 
 
 
+    // Class FederatedExpressionMatrix.
+    class_<FederatedExpressionMatrix>(
+        module,
+        "FederatedExpressionMatrix",
+        "A read-only view of several existing ExpressionMatrix objects "
+        "as if they were a single expression matrix, without copying their data. "
+        "Cells of the members are concatenated in member order, "
+        "and genes are the union of the genes of all members. ")
+       .def(init<string, vector<string> >(),
+           "Creates a federated view of the expression matrices in the member directories. "
+           "Objects created by the federated view (Lsh and SimilarPairs objects) "
+           "are stored in directoryName, which is created if it does not exist. ",
+           arg("directoryName"),
+           arg("memberDirectoryNames")
+       )
+       .def("memberCount",
+           &FederatedExpressionMatrix::memberCount,
+           "Returns the number of member expression matrices."
+       )
+       .def("geneCount",
+           &FederatedExpressionMatrix::geneCount,
+           "Returns the number of genes (the union of the genes of all members)."
+       )
+       .def("cellCount",
+           &FederatedExpressionMatrix::cellCount,
+           "Returns the number of cells (the total for all members)."
+       )
+       .def("getMemberCellId",
+           &FederatedExpressionMatrix::getMemberCellId,
+           "Returns the index of the member containing a given cell, "
+           "and the cell id in that member.",
+           arg("cellId")
+       )
+       .def("geneName",
+           &FederatedExpressionMatrix::geneName,
+           "Returns the name of the gene with the given id.",
+           arg("geneId")
+       )
+       .def("geneIdFromName",
+           &FederatedExpressionMatrix::geneIdFromName,
+           "Returns the id of the gene with the given name, or invalidGeneId.",
+           arg("geneName")
+       )
+       .def("cellName",
+           &FederatedExpressionMatrix::cellName,
+           "Returns the name of the cell with the given id.",
+           arg("cellId")
+       )
+       .def("cellIdFromName",
+           &FederatedExpressionMatrix::cellIdFromName,
+           "Returns the id of the cell with the given name, or invalidCellId.",
+           arg("cellName")
+       )
+       .def
+       (
+           "getCellMetaDataValue",
+           (
+               string (FederatedExpressionMatrix::*)
+               (CellId, const string&) const
+           )
+           &FederatedExpressionMatrix::getCellMetaData,
+           "Returns the value of a meta data field for a given cell.",
+           arg("cellId"),
+           arg("name")
+       )
+       .def
+       (
+           "getCellMetaData",
+           (
+               vector< pair<string, string> > (FederatedExpressionMatrix::*)
+               (CellId) const
+           )
+           &FederatedExpressionMatrix::getCellMetaData,
+           "Returns all meta data pairs (name, value) for a given cell.",
+           arg("cellId")
+       )
+       .def("getCellExpressionCounts",
+           &FederatedExpressionMatrix::getCellExpressionCounts,
+           "Returns the non-zero expression counts (geneId, count) for a given cell.",
+           arg("cellId")
+       )
+       .def("getCellSetNames",
+           &FederatedExpressionMatrix::getCellSetNames,
+           "Returns the names of the cell sets that exist in all members."
+       )
+       .def("getCellSet",
+           &FederatedExpressionMatrix::getCellSet,
+           "Returns the cell ids of the union of the cell sets "
+           "with the given name in all members.",
+           arg("cellSetName")
+       )
+       .def("computeLshSignatures",
+           &FederatedExpressionMatrix::computeLshSignatures,
+           "Compute cell LSH signatures and store them. "
+           "The expression counts are read directly from the members.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("lshName"),
+           arg("lshCount") = 1024,
+           arg("seed") = 231
+       )
+       .def("findSimilarPairs7",
+           &FederatedExpressionMatrix::findSimilarPairs7,
+           "LSH-based computation of similar cell pairs, using an Lsh object "
+           "previously created by computeLshSignatures."
+           " If lshBitCount is not zero, only the first lshBitCount bits of each LSH signature are used.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("lshName"),
+           arg("similarPairsName"),
+           arg("k") = 100,
+           arg("similarityThreshold") = 0.2,
+           arg("lshSliceLengths"),
+           arg("maxCheck"),
+           arg("log2BucketCount"),
+           arg("lshBitCount") = 0
+       )
+       .def("getSimilarPairs",
+           &FederatedExpressionMatrix::getSimilarPairs,
+           "Returns the similar pairs (cellId, similarity) stored for a given cell "
+           "by findSimilarPairs7.",
+           arg("similarPairsName"),
+           arg("cellId")
+       )
+       ;
+
+
+
     // Class CellGraphVertexInfo.
     class_<CellGraphVertexInfo>(
         module,
@@ -1157,9 +1677,113 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
 
 
 
+    // Classes LshAccuracyBin and LshAccuracy.
+    class_<LshAccuracyBin>(
+        module,
+        "LshAccuracyBin",
+        "Accuracy of LSH similarity for the cell pairs with exact similarity in a given range, "
+        "as computed by ExpressionMatrix.estimateLshAccuracy.")
+        .def_readonly("minSimilarity", &LshAccuracyBin::minSimilarity)
+        .def_readonly("maxSimilarity", &LshAccuracyBin::maxSimilarity)
+        .def_readonly("pairCount", &LshAccuracyBin::pairCount)
+        .def_readonly("bias", &LshAccuracyBin::bias)
+        .def_readonly("biasLow", &LshAccuracyBin::biasLow)
+        .def_readonly("biasHigh", &LshAccuracyBin::biasHigh)
+        .def_readonly("rms", &LshAccuracyBin::rms)
+        .def_readonly("rmsLow", &LshAccuracyBin::rmsLow)
+        .def_readonly("rmsHigh", &LshAccuracyBin::rmsHigh)
+        .def_readonly("neighborCount", &LshAccuracyBin::neighborCount)
+        .def_readonly("foundNeighborCount", &LshAccuracyBin::foundNeighborCount)
+        .def_readonly("recall", &LshAccuracyBin::recall)
+        .def_readonly("recallLow", &LshAccuracyBin::recallLow)
+        .def_readonly("recallHigh", &LshAccuracyBin::recallHigh)
+        ;
+    class_<LshAccuracy>(
+        module,
+        "LshAccuracy",
+        "Results of ExpressionMatrix.estimateLshAccuracy.")
+        .def_readonly("lshBitCount", &LshAccuracy::lshBitCount)
+        .def_readonly("bins", &LshAccuracy::bins)
+        .def_readonly("total", &LshAccuracy::total)
+        ;
+
+
+
+    // Classes LshConfiguration and LshTuning.
+    class_<LshConfiguration>(
+        module,
+        "LshConfiguration",
+        "Parameters for findSimilarPairs5 or findSimilarPairs7, with predicted recall and cost, "
+        "as computed by ExpressionMatrix.tuneLsh.")
+        .def_readonly("algorithm", &LshConfiguration::algorithm)
+        .def_readonly("lshCount", &LshConfiguration::lshCount)
+        .def_readonly("lshSliceLengths", &LshConfiguration::lshSliceLengths)
+        .def_readonly("bucketOverflow", &LshConfiguration::bucketOverflow)
+        .def_readonly("maxCheck", &LshConfiguration::maxCheck)
+        .def_readonly("log2BucketCount", &LshConfiguration::log2BucketCount)
+        .def_readonly("recall", &LshConfiguration::recall)
+        .def_readonly("recallLow", &LshConfiguration::recallLow)
+        .def_readonly("recallHigh", &LshConfiguration::recallHigh)
+        .def_readonly("candidateCount", &LshConfiguration::candidateCount)
+        .def_readonly("cost", &LshConfiguration::cost)
+        ;
+    class_<LshTuning>(
+        module,
+        "LshTuning",
+        "Results of ExpressionMatrix.tuneLsh.")
+        .def_readonly("k", &LshTuning::k)
+        .def_readonly("targetRecall", &LshTuning::targetRecall)
+        .def_readonly("configurations", &LshTuning::configurations)
+        .def_readonly("targetRecallAchieved", &LshTuning::targetRecallAchieved)
+        .def_readonly("best", &LshTuning::best)
+        .def_readonly("recallIsOverestimated", &LshTuning::recallIsOverestimated)
+        ;
+
+
+
     // Constants
     module.attr("invalidGeneId") = pybind11::int_(invalidGeneId);
     module.attr("invalidCellId") = pybind11::int_(invalidCellId);
+    module.attr("invalidStringId") = pybind11::int_(invalidStringId);
+
+
+
+    // Control of the number of threads used for parallel computations.
+    // The thread count is shared by all ExpressionMatrix objects.
+    module.def("getThreadCount",
+        getThreadCount,
+        "Returns the number of threads used for parallel computations. "
+        "This is shared by all ExpressionMatrix objects in the process."
+        );
+    module.def("setThreadCount",
+        setThreadCount,
+        "Sets the number of threads used for parallel computations. "
+        "This is shared by all ExpressionMatrix objects in the process. "
+        "If threadCount is 0, the default is used: the value of environment variable "
+        "EXPRESSION_MATRIX2_THREAD_COUNT if defined, "
+        "or else the number of hardware threads. ",
+        arg("threadCount")
+        );
+    class_<ScopedThreadCount>(
+        module,
+        "ScopedThreadCount",
+        "Limits the number of threads used for parallel computations "
+        "by calls made inside a with statement. "
+        "For example, with ScopedThreadCount(4): e.computeLshSignatures(...) "
+        "computes LSH signatures using at most 4 threads. "
+        "This cannot increase the number of threads beyond the value returned by getThreadCount. "
+        "The limit takes effect when the with statement is entered, "
+        "and also applies to work done on other threads on behalf of those calls.")
+        .def(init<size_t, bool>(), arg("threadCount"), arg("apply") = false)
+        .def("__enter__", [](ScopedThreadCount& s) -> ScopedThreadCount& {s.apply(); return s;},
+            return_value_policy::reference)
+        .def("__exit__", [](ScopedThreadCount& s, object, object, object) {s.restore();})
+        ;
+    module.def("getNumaNodeCount",
+        numa::nodeCount,
+        "Returns the number of NUMA nodes. On systems with more than one node, "
+        "worker threads are pinned to the cpus of their node."
+        );
 
 
 
@@ -1200,6 +1824,53 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
         "See the source code in the ExpressionMatrix2/src directory for more information. "
         );
 
+    module.def("testTaskScheduler",
+        testTaskScheduler,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+    module.def("testNormalizationKernels",
+        testNormalizationKernels,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+    module.def("testSimilarityKernels",
+        testSimilarityKernels,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+    module.def("testExpressionMatrixCheckpoint",
+        testExpressionMatrixCheckpoint,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+    module.def("testExpressionMatrixSnapshots",
+        testExpressionMatrixSnapshots,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+    module.def("testExpressionMatrixMetaDataCompaction",
+        testExpressionMatrixMetaDataCompaction,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+#ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
+    module.def("testExpressionMatrixHdf5",
+        testExpressionMatrixHdf5,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+    module.def("testExpressionMatrixH5ad",
+        testExpressionMatrixH5ad,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+    module.def("testExpressionMatrixLoom",
+        testExpressionMatrixLoom,
+        "Only intended to be used for testing. "
+        "See the source code in the ExpressionMatrix2/src directory for more information. "
+        );
+#endif
 
 
 #if CZI_EXPRESSION_MATRIX2_TEST_FILESYSTEM
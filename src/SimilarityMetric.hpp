@@ -0,0 +1,88 @@
+#ifndef CZI_EXPRESSION_MATRIX2_SIMILARITY_METRIC_HPP
+#define CZI_EXPRESSION_MATRIX2_SIMILARITY_METRIC_HPP
+
+#include "string.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+
+
+
+        // The metrics that can be used to compute the exact similarity
+        // between the expression vectors of two cells.
+        enum class SimilarityMetric {
+            Pearson,            // Pearson correlation coefficient of the expression counts.
+            Cosine,             // Cosine of the angle between the expression vectors.
+            Spearman,           // Pearson correlation coefficient of the ranks of the expression counts.
+            WeightedJaccard,    // Sum of min(x, y) divided by sum of max(x, y).
+            Euclidean,          // 1/(1+d), where d is the Euclidean distance between the expression vectors.
+            Invalid
+        };
+
+        // This can be used to loop over the valid values of SimilarityMetric.
+        // The unused attribute is necessary to suppress compilation warnings (due to -Wall).
+        const auto validSimilarityMetrics __attribute__((unused)) =
+        {
+            SimilarityMetric::Pearson,
+            SimilarityMetric::Cosine,
+            SimilarityMetric::Spearman,
+            SimilarityMetric::WeightedJaccard,
+            SimilarityMetric::Euclidean
+        };
+
+
+
+        // Convert a SimilarityMetric to a string and vice versa.
+        inline string similarityMetricToString(SimilarityMetric m)
+        {
+            switch(m) {
+            case SimilarityMetric::Pearson:
+                return "Pearson";
+            case SimilarityMetric::Cosine:
+                return "Cosine";
+            case SimilarityMetric::Spearman:
+                return "Spearman";
+            case SimilarityMetric::WeightedJaccard:
+                return "WeightedJaccard";
+            case SimilarityMetric::Euclidean:
+                return "Euclidean";
+            default:
+                return "Invalid";
+            }
+        }
+        inline SimilarityMetric similarityMetricFromString(const string& s)
+        {
+            for(const SimilarityMetric m: validSimilarityMetrics) {
+                if(s == similarityMetricToString(m)) {
+                    return m;
+                }
+            }
+            return SimilarityMetric::Invalid;
+        }
+
+
+
+        // Convert a SimilarityMetric to a long descriptive string.
+        inline string similarityMetricToLongString(SimilarityMetric m)
+        {
+            switch(m) {
+            case SimilarityMetric::Pearson:
+                return "Pearson correlation";
+            case SimilarityMetric::Cosine:
+                return "cosine similarity";
+            case SimilarityMetric::Spearman:
+                return "Spearman rank correlation";
+            case SimilarityMetric::WeightedJaccard:
+                return "weighted Jaccard similarity";
+            case SimilarityMetric::Euclidean:
+                return "Euclidean similarity 1/(1+distance)";
+            default:
+                return "Invalid similarity metric";
+            }
+        }
+
+
+    }
+}
+
+#endif
@@ -0,0 +1,570 @@
+// Class TaskScheduler is a process-wide work-stealing scheduler
+// used to run compute intensive loops on multiple threads.
+// See TaskScheduler.hpp for details.
+
+#include "TaskScheduler.hpp"
+#include "numa.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "boost_lexical_cast.hpp"
+#include "CZI_ASSERT.hpp"
+#include "iostream.hpp"
+#include "stdexcept.hpp"
+#include "vector.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <limits>
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+
+        // The index of the queue owned by the current thread, if it is a worker.
+        thread_local size_t currentWorkerIndex = std::numeric_limits<size_t>::max();
+
+        // The thread count set by the innermost ScopedThreadCount
+        // of the current thread, or 0 if none is in effect.
+        thread_local size_t scopedThreadCount = 0;
+    }
+}
+
+
+
+TaskScheduler& TaskScheduler::instance()
+{
+    // Thread safe initialization is guaranteed by C++11.
+    static TaskScheduler scheduler;
+    return scheduler;
+}
+
+
+
+TaskScheduler::TaskScheduler() :
+    workerCount(0),
+    queuedCount(0),
+    stopping(false),
+    taskGroupCount(0)
+{
+    startWorkers(defaultThreadCount() - 1);
+}
+
+
+
+// A TaskGroup cannot be created while setThreadCount
+// is changing the worker threads, and prevents
+// setThreadCount from changing them while it exists.
+TaskScheduler::TaskGroup::TaskGroup() :
+    pendingCount(0)
+{
+    TaskScheduler& scheduler = TaskScheduler::instance();
+    std::lock_guard<std::mutex> lock(scheduler.configurationMutex);
+    ++scheduler.taskGroupCount;
+}
+TaskScheduler::TaskGroup::~TaskGroup()
+{
+    TaskScheduler& scheduler = TaskScheduler::instance();
+    std::lock_guard<std::mutex> lock(scheduler.configurationMutex);
+    --scheduler.taskGroupCount;
+}
+
+
+
+TaskScheduler::~TaskScheduler()
+{
+    stopWorkers();
+}
+
+
+
+// The default thread count, obtained from environment variable
+// EXPRESSION_MATRIX2_THREAD_COUNT or from the hardware.
+size_t TaskScheduler::defaultThreadCount()
+{
+    const char* environmentValue = std::getenv("EXPRESSION_MATRIX2_THREAD_COUNT");
+    if(environmentValue) {
+        try {
+            const size_t threadCount = lexical_cast<size_t>(environmentValue);
+            if(threadCount > 0) {
+                return threadCount;
+            }
+        } catch(const boost::bad_lexical_cast&) {
+        }
+        cout << "Ignoring invalid value of EXPRESSION_MATRIX2_THREAD_COUNT: " <<
+            environmentValue << endl;
+    }
+
+    // hardware_concurrency can return 0 if the information is not available.
+    return std::max(1U, std::thread::hardware_concurrency());
+}
+
+
+
+void TaskScheduler::setThreadCount(size_t threadCount)
+{
+    std::lock_guard<std::mutex> lock(configurationMutex);
+    if(threadCount == 0) {
+        threadCount = defaultThreadCount();
+    }
+    if(threadCount == this->threadCount()) {
+        return;
+    }
+    if(taskGroupCount != 0) {
+        throw runtime_error("The number of threads cannot be changed while parallel computations are running.");
+    }
+    stopWorkers();
+    startWorkers(threadCount - 1);
+}
+
+
+
+void TaskScheduler::startWorkers(size_t workerCount)
+{
+    CZI_ASSERT(workers.empty());
+    stopping = false;
+    queues.clear();
+    for(size_t i=0; i<workerCount+1; i++) {
+        queues.push_back(make_shared<WorkQueue>());
+    }
+
+    // Distribute the workers among the NUMA nodes in contiguous blocks.
+    // With fewer workers than nodes, some nodes get no workers.
+    const size_t nodeCount = numa::nodeCount();
+    nodeWorkers.clear();
+    nodeWorkers.resize(nodeCount);
+    nextNodeWorker.clear();
+    for(size_t node=0; node<nodeCount; node++) {
+        nextNodeWorker.push_back(make_shared< std::atomic<size_t> >(0));
+    }
+    for(size_t i=0; i<workerCount; i++) {
+        nodeWorkers[(i * nodeCount) / workerCount].push_back(i);
+    }
+
+    for(size_t i=0; i<workerCount; i++) {
+        workers.push_back(std::thread(&TaskScheduler::workerFunction, this, i));
+    }
+    this->workerCount = workerCount;
+}
+
+
+
+void TaskScheduler::stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    sleepCondition.notify_all();
+    for(std::thread& worker: workers) {
+        worker.join();
+    }
+    workers.clear();
+    workerCount = 0;
+}
+
+
+
+size_t TaskScheduler::nodeCount() const
+{
+    return numa::nodeCount();
+}
+
+
+
+size_t TaskScheduler::currentQueueIndex() const
+{
+    if(currentWorkerIndex < workerCount) {
+        return currentWorkerIndex;
+    } else {
+        return sharedQueueIndex();
+    }
+}
+
+
+
+void TaskScheduler::submit(TaskGroup& group, const Task& task)
+{
+    push(group, task, currentQueueIndex());
+}
+
+
+
+void TaskScheduler::submit(TaskGroup& group, const Task& task, size_t node)
+{
+    if(node >= nodeWorkers.size() || nodeWorkers[node].empty()) {
+        submit(group, task);
+        return;
+    }
+    const vector<size_t>& workerIndexes = nodeWorkers[node];
+    const size_t i = (*nextNodeWorker[node])++ % workerIndexes.size();
+    push(group, task, workerIndexes[i]);
+}
+
+
+
+void TaskScheduler::push(TaskGroup& group, const Task& task, size_t queueIndex)
+{
+    ++group.pendingCount;
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        ++queuedCount;
+    }
+    Item item;
+    item.task = task;
+    item.group = &group;
+    item.scopedThreadCount = scopedThreadCount;
+    queues[queueIndex]->push(item);
+
+    // Wake up a sleeping worker, if any.
+    sleepCondition.notify_one();
+}
+
+
+
+void TaskScheduler::wait(TaskGroup& group)
+{
+    const size_t queueIndex = currentQueueIndex();
+    Item item;
+    while(group.pendingCount != 0) {
+        if(findTask(queueIndex, item)) {
+            run(item);
+            continue;
+        }
+
+        // There is nothing to do. Sleep until a task is submitted
+        // or the group completes (see run).
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCondition.wait(lock, [this, &group]()
+            {
+                return group.pendingCount == 0 || queuedCount != 0;
+            });
+    }
+
+    if(group.exception) {
+        std::exception_ptr exception = group.exception;
+        group.exception = std::exception_ptr();
+        std::rethrow_exception(exception);
+    }
+}
+
+
+
+void TaskScheduler::workerFunction(size_t workerIndex)
+{
+    currentWorkerIndex = workerIndex;
+
+    // On NUMA systems, keep the worker on the cpus of its node.
+    if(nodeWorkers.size() > 1) {
+        for(size_t node=0; node<nodeWorkers.size(); node++) {
+            const vector<size_t>& workerIndexes = nodeWorkers[node];
+            if(std::find(workerIndexes.begin(), workerIndexes.end(), workerIndex) != workerIndexes.end()) {
+                numa::pinCurrentThreadToNode(node);
+            }
+        }
+    }
+
+    Item item;
+    while(true) {
+        if(findTask(workerIndex, item)) {
+            run(item);
+            continue;
+        }
+
+        // There is nothing to do. Sleep until a task is submitted.
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCondition.wait(lock, [this]()
+            {
+                return stopping || queuedCount != 0;
+            });
+        if(stopping) {
+            return;
+        }
+    }
+}
+
+
+
+bool TaskScheduler::findTask(size_t queueIndex, Item& item)
+{
+    bool found = false;
+
+    // First, look in our own queue, newest task first.
+    if(queues[queueIndex]->popBack(item)) {
+        found = true;
+    }
+
+    // Then look in the shared queue.
+    else if(queueIndex != sharedQueueIndex() && queues[sharedQueueIndex()]->popFront(item)) {
+        found = true;
+    }
+
+    // Then try to steal the oldest task from one of the other workers,
+    // starting with our neighbor to spread contention.
+    else {
+        const size_t workerCount = queues.size() - 1;
+        for(size_t i=1; i<=workerCount; i++) {
+            const size_t victim = (queueIndex + i) % (workerCount + 1);
+            if(victim != queueIndex && victim != sharedQueueIndex() && queues[victim]->popFront(item)) {
+                found = true;
+                break;
+            }
+        }
+    }
+
+    if(found) {
+        --queuedCount;
+    }
+    return found;
+}
+
+
+
+void TaskScheduler::run(Item& item)
+{
+    TaskGroup& group = *item.group;
+
+    // Run the task with the ScopedThreadCount limit
+    // that was in effect when it was submitted.
+    const size_t savedScopedThreadCount = scopedThreadCount;
+    scopedThreadCount = item.scopedThreadCount;
+    try {
+        item.task();
+    } catch(...) {
+        std::lock_guard<std::mutex> lock(group.exceptionMutex);
+        if(!group.exception) {
+            group.exception = std::current_exception();
+        }
+    }
+    scopedThreadCount = savedScopedThreadCount;
+
+    // Release the task before signaling completion, as its
+    // function object can refer to data owned by the waiting thread.
+    item.task = Task();
+
+    // If this was the last task of the group, wake up the thread waiting for it.
+    // Locking the mutex guarantees that the waiting thread is either
+    // not yet checking its wait condition, or already sleeping.
+    // The group can be destroyed as soon as its pending count is zero,
+    // so we must not access it after that.
+    if(--group.pendingCount == 0) {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        sleepCondition.notify_all();
+    }
+}
+
+
+
+void TaskScheduler::WorkQueue::push(const Item& item)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    items.push_back(item);
+}
+bool TaskScheduler::WorkQueue::popBack(Item& item)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(items.empty()) {
+        return false;
+    }
+    item = items.back();
+    items.pop_back();
+    return true;
+}
+bool TaskScheduler::WorkQueue::popFront(Item& item)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(items.empty()) {
+        return false;
+    }
+    item = items.front();
+    items.pop_front();
+    return true;
+}
+
+
+
+size_t ChanZuckerberg::ExpressionMatrix2::getThreadCount()
+{
+    return TaskScheduler::instance().threadCount();
+}
+void ChanZuckerberg::ExpressionMatrix2::setThreadCount(size_t threadCount)
+{
+    TaskScheduler::instance().setThreadCount(threadCount);
+}
+
+
+
+// Return the number of threads that a parallel function
+// called from the current thread would use.
+size_t ChanZuckerberg::ExpressionMatrix2::getEffectiveThreadCount()
+{
+    const size_t threadCount = getThreadCount();
+    if(scopedThreadCount == 0) {
+        return threadCount;
+    } else {
+        return std::min(threadCount, scopedThreadCount);
+    }
+}
+
+
+
+ScopedThreadCount::ScopedThreadCount(size_t threadCount, bool apply) :
+    threadCount(threadCount),
+    previousThreadCount(0),
+    isActive(false)
+{
+    if(threadCount == 0) {
+        throw runtime_error("Invalid thread count 0.");
+    }
+    if(apply) {
+        this->apply();
+    }
+}
+ScopedThreadCount::~ScopedThreadCount()
+{
+    restore();
+}
+void ScopedThreadCount::apply()
+{
+    if(isActive) {
+        return;
+    }
+    previousThreadCount = scopedThreadCount;
+    isActive = true;
+
+    // Nested objects can further reduce the thread count, but not increase it.
+    if(scopedThreadCount == 0) {
+        scopedThreadCount = threadCount;
+    } else {
+        scopedThreadCount = std::min(scopedThreadCount, threadCount);
+    }
+}
+void ScopedThreadCount::restore()
+{
+    if(isActive) {
+        scopedThreadCount = previousThreadCount;
+        isActive = false;
+    }
+}
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace {
+
+            // The checks done by testTaskScheduler, with the thread count set to 4.
+            void checkParallelFunctions()
+            {
+                // Each index is processed exactly once, also by nested loops.
+                const size_t n = 1000;
+                vector< std::atomic<int> > visitCounts(n * n);
+                for(auto& visitCount: visitCounts) {
+                    visitCount = 0;
+                }
+                parallelFor(0, n, [&](size_t i)
+                    {
+                        parallelFor(0, n, [&](size_t j)
+                            {
+                                ++visitCounts[i*n + j];
+                            });
+                    }, 1);
+                for(const auto& visitCount: visitCounts) {
+                    CZI_ASSERT(visitCount == 1);
+                }
+
+                // With a non-zero grain size, floating point reductions
+                // don't depend on the number of threads.
+                const auto reduce = [](size_t threadCount)
+                {
+                    ScopedThreadCount scopedThreadCount(threadCount);
+                    return parallelReduce(0, 100000, 0.,
+                        [](size_t i) {return 1. / double(i + 1);},
+                        [](double x, double y) {return x + y;}, 1000);
+                };
+                const double sum = reduce(1);
+                CZI_ASSERT(reduce(2) == sum);
+                CZI_ASSERT(reduce(4) == sum);
+                CZI_ASSERT(std::abs(sum - 12.0901461298634) < 1.e-9);
+
+                // Sort.
+                vector<size_t> v(100000);
+                for(size_t i=0; i<v.size(); i++) {
+                    v[i] = (i * 7919) % v.size();
+                }
+                parallelSort(v.begin(), v.end());
+                for(size_t i=0; i<v.size(); i++) {
+                    CZI_ASSERT(v[i] == i);
+                }
+
+                // An exception thrown by a task is rethrown to the caller.
+                // Chunks that did not start yet are skipped,
+                // so we don't know how many of the other indexes were processed.
+                std::atomic<size_t> completedCount(0);
+                bool exceptionWasThrown = false;
+                try {
+                    parallelFor(0, 100, [&](size_t i)
+                        {
+                            if(i == 17) {
+                                throw runtime_error("Test exception.");
+                            }
+                            ++completedCount;
+                        }, 1);
+                } catch(const runtime_error&) {
+                    exceptionWasThrown = true;
+                }
+                CZI_ASSERT(exceptionWasThrown);
+                CZI_ASSERT(completedCount <= 99);
+
+                // A ScopedThreadCount applies to the calling thread
+                // and to the work done on other threads on its behalf,
+                // and nested objects can reduce the thread count but not increase it.
+                {
+                    ScopedThreadCount scopedThreadCount(2);
+                    CZI_ASSERT(getEffectiveThreadCount() == 2);
+                    std::atomic<size_t> wrongCount(0);
+                    parallelFor(0, 64, [&](size_t)
+                        {
+                            if(getEffectiveThreadCount() != 2) {
+                                ++wrongCount;
+                            }
+                        }, 1);
+                    CZI_ASSERT(wrongCount == 0);
+                    {
+                        ScopedThreadCount nestedScopedThreadCount(3);
+                        CZI_ASSERT(getEffectiveThreadCount() == 2);
+                    }
+                    {
+                        ScopedThreadCount nestedScopedThreadCount(1, false);
+                        CZI_ASSERT(getEffectiveThreadCount() == 2);
+                        nestedScopedThreadCount.apply();
+                        CZI_ASSERT(getEffectiveThreadCount() == 1);
+                        nestedScopedThreadCount.restore();
+                        CZI_ASSERT(getEffectiveThreadCount() == 2);
+                    }
+                }
+                CZI_ASSERT(getEffectiveThreadCount() == 4);
+            }
+        }
+    }
+}
+
+
+
+// The thread count is restored even if a check fails.
+void ChanZuckerberg::ExpressionMatrix2::testTaskScheduler()
+{
+    const size_t threadCount = getThreadCount();
+    setThreadCount(4);
+    try {
+        checkParallelFunctions();
+    } catch(...) {
+        setThreadCount(threadCount);
+        throw;
+    }
+    setThreadCount(threadCount);
+    cout << "testTaskScheduler completed successfully." << endl;
+}
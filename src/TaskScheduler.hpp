@@ -0,0 +1,547 @@
+// Class TaskScheduler is a process-wide work-stealing scheduler
+// used to run compute intensive loops on multiple threads.
+
+#ifndef CZI_EXPRESSION_MATRIX2_TASK_SCHEDULER_HPP
+#define CZI_EXPRESSION_MATRIX2_TASK_SCHEDULER_HPP
+
+/*******************************************************************************
+
+There is only one TaskScheduler in the process, shared by all
+ExpressionMatrix objects. This way, several analyses running
+in the same process don't oversubscribe the available cores.
+
+The number of threads used by the scheduler (the thread budget)
+includes the thread that calls one of the parallel functions below,
+which always participates in the computation.
+It is determined as follows, in order of decreasing priority:
+- The last call to setThreadCount, which can also be done from Python
+  or via ServerParameters::threadCount.
+- Environment variable EXPRESSION_MATRIX2_THREAD_COUNT,
+  read the first time the scheduler is used.
+- The number of hardware threads reported by the system.
+
+A ScopedThreadCount object can be used to further reduce the
+number of threads used by parallel functions called
+from the current thread while the ScopedThreadCount object is alive.
+This can be used to pin the thread count for an individual call.
+It can never increase the number of threads beyond the thread budget.
+The limit also applies to parallel functions called by tasks
+submitted while it is in effect, on whichever thread they run,
+so nested parallel functions also respect it.
+
+The thread budget cannot be changed while any TaskGroup exists.
+Creating a TaskGroup waits for a change of the thread budget
+in progress to complete, and setThreadCount throws
+if a TaskGroup exists, so worker threads and their queues are never
+changed while tasks can be submitted.
+
+Each worker thread owns a double ended queue of tasks.
+A worker pops tasks from the back of its own queue
+and, when its own queue is empty, steals tasks from the front
+of the queues of other workers. Tasks submitted by threads
+that are not workers go to a separate shared queue.
+A thread waiting for a group of tasks to complete
+executes pending tasks while it waits, so parallel
+functions can be safely nested.
+
+On systems with more than one NUMA node (see numa.hpp),
+worker threads are distributed in contiguous blocks among the nodes
+and pinned to the cpus of their node. Function parallelForChunksByNode
+divides its range into one slice per node, consistently with
+numa::Policy::partitioned, and processes each slice
+preferentially with the workers of the corresponding node.
+
+*******************************************************************************/
+
+#include "CZI_ASSERT.hpp"
+#include "numa.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include "cstddef.hpp"
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include "memory.hpp"
+#include <mutex>
+#include <thread>
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class ScopedThreadCount;
+        class TaskScheduler;
+
+        // Get or set the thread budget of the process-wide TaskScheduler.
+        // Calling setThreadCount with 0 resets the thread count to
+        // the default value (see above).
+        size_t getThreadCount();
+        void setThreadCount(size_t);
+
+        // Return the number of threads that a parallel function
+        // called from the current thread would use.
+        // This takes into account any ScopedThreadCount in effect.
+        size_t getEffectiveThreadCount();
+
+        // Call f(chunkBegin, chunkEnd) for consecutive, non-overlapping
+        // chunks covering [begin, end), using multiple threads.
+        // If grainSize is not zero, all chunks have grainSize elements
+        // (except possibly the last one), regardless of the number of threads.
+        // If grainSize is zero, the chunk size is chosen automatically.
+        // If f throws, the exception is rethrown to the caller after
+        // all the chunks that were started complete.
+        // Chunks that were not started yet may be skipped.
+        template<class F> void parallelForChunks(
+            size_t begin, size_t end, const F& f, size_t grainSize = 0);
+
+        // Same as parallelForChunks, but the range is divided into
+        // one contiguous slice per NUMA node, and the chunks of each slice
+        // are processed preferentially by workers pinned to that node.
+        // Use this to process data placed with numa::Policy::partitioned.
+        // Threads that run out of work on their own slice help with
+        // the other slices, so load is still balanced.
+        // On single node systems this is the same as parallelForChunks.
+        template<class F> void parallelForChunksByNode(
+            size_t begin, size_t end, const F& f, size_t grainSize = 0);
+
+        // Call f(i) for each i in [begin, end), using multiple threads.
+        template<class F> void parallelFor(
+            size_t begin, size_t end, const F& f, size_t grainSize = 0);
+
+        // Compute reduce(... reduce(reduce(identity, map(begin)), map(begin+1)) ..., map(end-1))
+        // using multiple threads. The reduce function must be associative.
+        // Partial results of each chunk are combined in chunk order,
+        // so the result is reproducible for a given chunking.
+        // For floating point results that must not depend
+        // on the number of threads, specify a non-zero grainSize.
+        template<class T, class Map, class Reduce> T parallelReduce(
+            size_t begin, size_t end,
+            const T& identity,
+            const Map& map,
+            const Reduce& reduce,
+            size_t grainSize = 0);
+
+        // Sort a range using multiple threads.
+        // Like std::sort, this is not stable.
+        template<class Iterator, class Comparator> void parallelSort(
+            Iterator begin, Iterator end, const Comparator&);
+        template<class Iterator> void parallelSort(Iterator begin, Iterator end);
+
+        // Check the parallel functions, including nested calls,
+        // exceptions, and ScopedThreadCount.
+        void testTaskScheduler();
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::TaskScheduler {
+public:
+
+    // A Task is just a function to be called without arguments.
+    using Task = std::function<void()>;
+
+    // A TaskGroup keeps track of a set of tasks whose
+    // completion can be waited for using TaskScheduler::wait.
+    class TaskGroup {
+    public:
+        TaskGroup();
+        ~TaskGroup();
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+    private:
+        std::atomic<size_t> pendingCount;
+
+        // The first exception thrown by a task of the group, if any.
+        // It is rethrown by TaskScheduler::wait.
+        std::mutex exceptionMutex;
+        std::exception_ptr exception;
+
+        friend class TaskScheduler;
+    };
+
+    // Access the process-wide TaskScheduler.
+    // The first call creates it and starts the worker threads.
+    static TaskScheduler& instance();
+
+    // Return the total number of threads used by the scheduler,
+    // including the calling thread.
+    size_t threadCount() const
+    {
+        return workerCount + 1;
+    }
+
+    // Change the number of threads. This stops and restarts
+    // all worker threads, so it throws if any TaskGroup exists.
+    void setThreadCount(size_t);
+
+    // Submit a task belonging to the specified group.
+    void submit(TaskGroup&, const Task&);
+
+    // Submit a task to be run preferentially by
+    // a worker pinned to the specified NUMA node.
+    void submit(TaskGroup&, const Task&, size_t node);
+
+    // The number of NUMA nodes the workers are distributed on.
+    size_t nodeCount() const;
+
+    // Wait for all tasks in a group to complete,
+    // running pending tasks while waiting, and sleeping
+    // when there are none.
+    // If any of the tasks threw an exception, the first one is rethrown here.
+    void wait(TaskGroup&);
+
+    ~TaskScheduler();
+
+private:
+    TaskScheduler();
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    class Item {
+    public:
+        Task task;
+        TaskGroup* group;
+
+        // The ScopedThreadCount limit in effect when the task was submitted.
+        // It is also in effect while the task runs.
+        size_t scopedThreadCount;
+    };
+
+    // A queue of tasks, protected by a mutex.
+    // The owner pushes and pops at the back, thieves steal from the front.
+    class WorkQueue {
+    public:
+        std::mutex mutex;
+        std::deque<Item> items;
+        void push(const Item&);
+        bool popBack(Item&);
+        bool popFront(Item&);
+    };
+
+    // One queue for each worker thread, plus one more (the last one)
+    // for tasks submitted by threads that are not workers.
+    vector< shared_ptr<WorkQueue> > queues;
+    size_t sharedQueueIndex() const
+    {
+        return queues.size() - 1;
+    }
+
+    // The worker threads.
+    vector<std::thread> workers;
+    std::atomic<size_t> workerCount;
+
+    // The workers assigned to each NUMA node, and the index
+    // of the next one to receive a task submitted to that node.
+    vector< vector<size_t> > nodeWorkers;
+    vector< shared_ptr< std::atomic<size_t> > > nextNodeWorker;
+    void workerFunction(size_t workerIndex);
+    void startWorkers(size_t workerCount);
+    void stopWorkers();
+
+    // Add an item to the specified queue and wake up a worker.
+    void push(TaskGroup&, const Task&, size_t queueIndex);
+
+    // Find a task to run, looking first in the queue
+    // with the given index, then in the shared queue,
+    // then stealing from the other queues.
+    bool findTask(size_t queueIndex, Item&);
+
+    // Run a task and update its group.
+    void run(Item&);
+
+    // The number of tasks currently in all queues.
+    // Idle workers sleep on the condition variable until this is not zero.
+    // Threads waiting for a group also sleep on it, until this is not zero
+    // or their group completes.
+    std::atomic<size_t> queuedCount;
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+    bool stopping;
+
+    // The number of TaskGroup objects that currently exist.
+    // Protected by configurationMutex, which is also held
+    // by setThreadCount while it changes the worker threads.
+    size_t taskGroupCount;
+    std::mutex configurationMutex;
+
+    // The default thread count, obtained from environment variable
+    // EXPRESSION_MATRIX2_THREAD_COUNT or from the hardware.
+    static size_t defaultThreadCount();
+
+    // Index of the queue owned by the current thread,
+    // or the shared queue index for threads that are not workers.
+    size_t currentQueueIndex() const;
+};
+
+
+
+// Class used to reduce, for the lifetime of the object,
+// the number of threads used by parallel functions called from the current thread.
+// If apply is false, the thread count is only applied when apply() is called
+// (the Python with statement does this in __enter__).
+class ChanZuckerberg::ExpressionMatrix2::ScopedThreadCount {
+public:
+    explicit ScopedThreadCount(size_t threadCount, bool apply=true);
+    ~ScopedThreadCount();
+    ScopedThreadCount(const ScopedThreadCount&) = delete;
+    ScopedThreadCount& operator=(const ScopedThreadCount&) = delete;
+
+    // Apply the thread count to the current thread.
+    // Calling this while it is already applied has no effect.
+    void apply();
+
+    // Restore the previous thread count before the object is destroyed.
+    // Calling this more than once has no effect.
+    void restore();
+
+private:
+    size_t threadCount;
+    size_t previousThreadCount;
+    bool isActive;
+};
+
+
+
+template<class F> void ChanZuckerberg::ExpressionMatrix2::parallelForChunks(
+    size_t begin, size_t end, const F& f, size_t grainSize)
+{
+    if(end <= begin) {
+        return;
+    }
+    const size_t n = end - begin;
+    const size_t threadCount = getEffectiveThreadCount();
+
+    // Choose the chunk size. When chosen automatically, use a few
+    // chunks per thread for load balancing.
+    if(grainSize == 0) {
+        grainSize = std::max(size_t(1), n / (4 * threadCount));
+    }
+    const size_t chunkCount = (n - 1) / grainSize + 1;
+
+    // If there is nothing to parallelize, just do it on the calling thread.
+    if(threadCount == 1 || chunkCount == 1) {
+        for(size_t chunk=0; chunk<chunkCount; chunk++) {
+            const size_t chunkBegin = begin + chunk * grainSize;
+            f(chunkBegin, std::min(end, chunkBegin + grainSize));
+        }
+        return;
+    }
+
+    // Chunks are assigned dynamically to the calling thread and to at most
+    // threadCount-1 helper tasks, which can run on any worker.
+    // This keeps load balanced and bounds the number of threads used by this call.
+    std::atomic<size_t> nextChunk(0);
+    const auto processChunks = [&]()
+    {
+        while(true) {
+            const size_t chunk = nextChunk++;
+            if(chunk >= chunkCount) {
+                return;
+            }
+            const size_t chunkBegin = begin + chunk * grainSize;
+            f(chunkBegin, std::min(end, chunkBegin + grainSize));
+        }
+    };
+    TaskScheduler& scheduler = TaskScheduler::instance();
+    TaskScheduler::TaskGroup group;
+    const size_t helperCount = std::min(threadCount, chunkCount) - 1;
+    for(size_t i=0; i<helperCount; i++) {
+        scheduler.submit(group, processChunks);
+    }
+    try {
+        processChunks();
+    } catch(...) {
+        // Make sure no helper is still using our local variables.
+        nextChunk = chunkCount;
+        try {
+            scheduler.wait(group);
+        } catch(...) {
+        }
+        throw;
+    }
+    scheduler.wait(group);
+}
+
+
+
+template<class F> void ChanZuckerberg::ExpressionMatrix2::parallelForChunksByNode(
+    size_t begin, size_t end, const F& f, size_t grainSize)
+{
+    TaskScheduler& scheduler = TaskScheduler::instance();
+    const size_t nodeCount = scheduler.nodeCount();
+    const size_t threadCount = getEffectiveThreadCount();
+    if(nodeCount == 1 || threadCount == 1 || end <= begin) {
+        parallelForChunks(begin, end, f, grainSize);
+        return;
+    }
+    const size_t n = end - begin;
+    if(grainSize == 0) {
+        grainSize = std::max(size_t(1), n / (4 * threadCount));
+    }
+
+    // Divide the range into one slice per node, with the same
+    // slicing used by numa::Policy::partitioned, and each slice into chunks.
+    vector<size_t> sliceBegin(nodeCount + 1);
+    vector<size_t> chunkCount(nodeCount);
+    std::unique_ptr<std::atomic<size_t>[]> nextChunk(new std::atomic<size_t>[nodeCount]);
+    for(size_t node=0; node<=nodeCount; node++) {
+        sliceBegin[node] = begin + numa::partitionBegin(node, n, nodeCount);
+    }
+    for(size_t node=0; node<nodeCount; node++) {
+        const size_t sliceSize = sliceBegin[node+1] - sliceBegin[node];
+        chunkCount[node] = (sliceSize == 0) ? 0 : ((sliceSize - 1) / grainSize + 1);
+        nextChunk[node] = 0;
+    }
+
+    // Process the chunks of our own slice first, then help with the others.
+    const auto processChunks = [&](size_t homeNode)
+    {
+        for(size_t i=0; i<nodeCount; i++) {
+            const size_t node = (homeNode + i) % nodeCount;
+            while(true) {
+                const size_t chunk = nextChunk[node]++;
+                if(chunk >= chunkCount[node]) {
+                    break;
+                }
+                const size_t chunkBegin = sliceBegin[node] + chunk * grainSize;
+                f(chunkBegin, std::min(sliceBegin[node+1], chunkBegin + grainSize));
+            }
+        }
+    };
+
+    // Submit threadCount-1 helper tasks, distributed round robin among the nodes.
+    // The calling thread starts from the slice of the last node,
+    // which receives the fewest helpers.
+    TaskScheduler::TaskGroup group;
+    for(size_t i=0; i<threadCount-1; i++) {
+        const size_t node = i % nodeCount;
+        scheduler.submit(group, [&processChunks, node]()
+            {
+                processChunks(node);
+            }, node);
+    }
+    try {
+        processChunks(nodeCount - 1);
+    } catch(...) {
+        // Make sure no helper is still using our local variables.
+        for(size_t node=0; node<nodeCount; node++) {
+            nextChunk[node] = chunkCount[node];
+        }
+        try {
+            scheduler.wait(group);
+        } catch(...) {
+        }
+        throw;
+    }
+    scheduler.wait(group);
+}
+
+
+
+template<class F> void ChanZuckerberg::ExpressionMatrix2::parallelFor(
+    size_t begin, size_t end, const F& f, size_t grainSize)
+{
+    parallelForChunks(begin, end,
+        [&f](size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t i=chunkBegin; i!=chunkEnd; ++i) {
+                f(i);
+            }
+        },
+        grainSize);
+}
+
+
+
+template<class T, class Map, class Reduce> T ChanZuckerberg::ExpressionMatrix2::parallelReduce(
+    size_t begin, size_t end,
+    const T& identity,
+    const Map& map,
+    const Reduce& reduce,
+    size_t grainSize)
+{
+    if(end <= begin) {
+        return identity;
+    }
+    const size_t n = end - begin;
+    if(grainSize == 0) {
+        grainSize = std::max(size_t(1), n / (4 * getEffectiveThreadCount()));
+    }
+    const size_t chunkCount = (n - 1) / grainSize + 1;
+
+    // Compute a partial result for each chunk.
+    vector<T> partialResults(chunkCount, identity);
+    parallelForChunks(0, chunkCount,
+        [&](size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t chunk=chunkBegin; chunk!=chunkEnd; ++chunk) {
+                const size_t iBegin = begin + chunk * grainSize;
+                const size_t iEnd = std::min(end, iBegin + grainSize);
+                T& partialResult = partialResults[chunk];
+                for(size_t i=iBegin; i!=iEnd; ++i) {
+                    partialResult = reduce(partialResult, map(i));
+                }
+            }
+        },
+        1);
+
+    // Combine the partial results in chunk order.
+    T result = identity;
+    for(const T& partialResult: partialResults) {
+        result = reduce(result, partialResult);
+    }
+    return result;
+}
+
+
+
+template<class Iterator, class Comparator> void ChanZuckerberg::ExpressionMatrix2::parallelSort(
+    Iterator begin, Iterator end, const Comparator& comparator)
+{
+    const size_t n = size_t(end - begin);
+    const size_t threadCount = getEffectiveThreadCount();
+
+    // Small ranges are not worth the overhead.
+    const size_t minimumParallelSize = 1<<14;
+    if(threadCount == 1 || n < minimumParallelSize) {
+        std::sort(begin, end, comparator);
+        return;
+    }
+
+    // Sort threadCount blocks independently.
+    const size_t blockCount = std::min(threadCount, n / (minimumParallelSize / 2));
+    const size_t blockSize = (n - 1) / blockCount + 1;
+    parallelFor(0, blockCount,
+        [&](size_t block)
+        {
+            const size_t blockBegin = block * blockSize;
+            const size_t blockEnd = std::min(n, blockBegin + blockSize);
+            std::sort(begin + blockBegin, begin + blockEnd, comparator);
+        }, 1);
+
+    // Merge pairs of adjacent sorted runs, doubling the run length at each pass.
+    for(size_t runSize=blockSize; runSize<n; runSize*=2) {
+        const size_t mergeCount = (n - 1) / (2 * runSize) + 1;
+        parallelFor(0, mergeCount,
+            [&](size_t merge)
+            {
+                const size_t mergeBegin = merge * 2 * runSize;
+                const size_t mergeMiddle = std::min(n, mergeBegin + runSize);
+                const size_t mergeEnd = std::min(n, mergeBegin + 2 * runSize);
+                if(mergeMiddle < mergeEnd) {
+                    std::inplace_merge(begin + mergeBegin, begin + mergeMiddle, begin + mergeEnd, comparator);
+                }
+            }, 1);
+    }
+}
+template<class Iterator> void ChanZuckerberg::ExpressionMatrix2::parallelSort(Iterator begin, Iterator end)
+{
+    parallelSort(begin, end, std::less<typename std::iterator_traits<Iterator>::value_type>());
+}
+
+
+
+#endif
@@ -77,6 +77,32 @@ void ChanZuckerberg::ExpressionMatrix2::filesystem::remove(const string& path)
 
 
 
+// Remove the specified empty directory. In case of failure, throw an exception.
+void ChanZuckerberg::ExpressionMatrix2::filesystem::removeDirectory(const string& path)
+{
+    if(::rmdir(path.c_str()) == -1) {
+        throw runtime_error("Unable to remove directory " + path);
+    }
+}
+
+
+
+// Remove the specified directory and everything it contains.
+// In case of failure, throw an exception.
+void ChanZuckerberg::ExpressionMatrix2::filesystem::removeDirectoryTree(const string& path)
+{
+    for(const string& name: directoryContents(path)) {
+        if(isDirectory(name)) {
+            removeDirectoryTree(name);
+        } else {
+            remove(name);
+        }
+    }
+    removeDirectory(path);
+}
+
+
+
 // Return the contents of a directory. In case of failure, throw an exception.
 vector<string> ChanZuckerberg::ExpressionMatrix2::filesystem::directoryContents(const string& path)
 {
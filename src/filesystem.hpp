@@ -37,6 +37,13 @@ namespace ChanZuckerberg {
             // Remove the specified path. In case of failure, throw an exception.
             void remove(const string&);
 
+            // Remove the specified empty directory. In case of failure, throw an exception.
+            void removeDirectory(const string&);
+
+            // Remove the specified directory and everything it contains.
+            // In case of failure, throw an exception.
+            void removeDirectoryTree(const string&);
+
             // Return the contents of a directory. In case of failure, throw an exception.
             vector<string> directoryContents(const string&);
 
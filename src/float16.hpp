@@ -0,0 +1,96 @@
+#ifndef CZI_EXPRESSION_MATRIX2_FLOAT16_HPP
+#define CZI_EXPRESSION_MATRIX2_FLOAT16_HPP
+
+// Conversions between float and two 16 bit floating point formats,
+// each stored in a uint16_t:
+// - float16: IEEE 754 half precision (5 exponent bits, 10 mantissa bits).
+//   About 3 significant digits, and a maximum value of 65504.
+// - bfloat16: the top 16 bits of a float (8 exponent bits, 7 mantissa bits).
+//   About 2 significant digits, with the same range as float.
+// Conversions from float round to the nearest representable value,
+// with ties to even. They are done in software, so they
+// don't require the F16C instruction set.
+
+#include "cstdint.hpp"
+#include <cmath>
+#include <cstring>
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+
+        inline uint16_t floatToFloat16(float f)
+        {
+            uint32_t x;
+            std::memcpy(&x, &f, sizeof(x));
+            const uint32_t sign = (x >> 16) & 0x8000;
+            const uint32_t absoluteValue = x & 0x7fffffff;
+
+            // Infinity and NaN.
+            if(absoluteValue >= 0x7f800000) {
+                return uint16_t(sign | 0x7c00 | ((absoluteValue > 0x7f800000) ? 0x200 : 0));
+            }
+
+            // Values that round to infinity (65520 and above).
+            if(absoluteValue >= 0x477ff000) {
+                return uint16_t(sign | 0x7c00);
+            }
+
+            // Values below 2^-14 become subnormal, in units of 2^-24.
+            // The multiplication by a power of two is exact.
+            if(absoluteValue < 0x38800000) {
+                float a;
+                std::memcpy(&a, &absoluteValue, sizeof(a));
+                return uint16_t(sign | uint32_t(std::nearbyint(a * 16777216.f)));
+            }
+
+            // Normal values. Rounding up can carry into the exponent, which is correct.
+            uint32_t h = ((((absoluteValue >> 23) - 112) << 10) | ((absoluteValue >> 13) & 0x3ff));
+            const uint32_t remainder = absoluteValue & 0x1fff;
+            if(remainder > 0x1000 || (remainder == 0x1000 && (h & 1))) {
+                ++h;
+            }
+            return uint16_t(sign | h);
+        }
+
+        inline float float16ToFloat(uint16_t h)
+        {
+            const uint32_t sign = uint32_t(h & 0x8000) << 16;
+            const uint32_t exponent = (h >> 10) & 0x1f;
+            const uint32_t mantissa = h & 0x3ff;
+            if(exponent == 0) {
+                const float f = float(mantissa) * 5.9604644775390625e-8f;   // 2^-24
+                return sign ? -f : f;
+            }
+            uint32_t x;
+            if(exponent == 31) {
+                x = sign | 0x7f800000 | (mantissa << 13);
+            } else {
+                x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+            }
+            float f;
+            std::memcpy(&f, &x, sizeof(f));
+            return f;
+        }
+
+        inline uint16_t floatToBfloat16(float f)
+        {
+            uint32_t x;
+            std::memcpy(&x, &f, sizeof(x));
+            if((x & 0x7fffffff) > 0x7f800000) {
+                return uint16_t((x >> 16) | 0x40);  // Keep NaN a NaN.
+            }
+            return uint16_t((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+        }
+
+        inline float bfloat16ToFloat(uint16_t h)
+        {
+            const uint32_t x = uint32_t(h) << 16;
+            float f;
+            std::memcpy(&f, &x, sizeof(f));
+            return f;
+        }
+
+    }
+}
+
+#endif
@@ -1,6 +1,6 @@
 #ifndef CZI_EXPRESSION_MATRIX2_SKIP_HDF5
-// Functions used to read hdf5 files containing expression matrices
-// created by the 10X Genomics pipeline.
+// Functions used to read and write hdf5 files containing expression matrices
+// in the format created by the 10X Genomics pipeline.
 
 // See hdf5.hpp for more information.
 
@@ -9,14 +9,81 @@ using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 using namespace hdf5;
 
+#include "algorithm.hpp"
+#include "boost_lexical_cast.hpp"
 #include "iostream.hpp"
 
+#include <cmath>
+#include <sstream>
+
+
+
+// Decode n strings read from a data set or attribute.
+// The read function is called to fill a buffer using a given memory type.
+// For variable length strings the buffer contains pointers to strings
+// allocated by the hdf5 library, which we free after copying them.
+template<class ReadFunction> static void decodeStrings(
+    const StrType& strType,
+    size_t n,
+    const ReadFunction& readFunction,
+    vector<string>& data)
+{
+    data.resize(n);
+    if(n == 0) {
+        return;
+    }
+
+    if(strType.isVariableStr()) {
+        vector<char*> pointers(n, 0);
+        readFunction(&pointers.front(), strType);
+        for(size_t i=0; i<n; i++) {
+            if(pointers[i]) {
+                data[i] = pointers[i];
+                H5free_memory(pointers[i]);
+            } else {
+                data[i].clear();
+            }
+        }
+        return;
+    }
+
+    // Fixed length strings.
+    const size_t stringMaximumLength = strType.getSize();
+    vector<char> buffer(n * stringMaximumLength);
+    readFunction(&buffer.front(), strType);
+    const char* bufferBegin = &buffer.front();
+    for(size_t i=0; i<n; i++) {
+        const char* address = bufferBegin + stringMaximumLength*i;
+        string& s = data[i];
+
+        // The string in the buffer is not null terminated
+        // if it is of maximum length (Fortran style), so we have to be a bit careful.
+        s = string(address, stringMaximumLength);
+        const auto nullPosition = s.find(char(0));
+        if(nullPosition != string::npos) {
+            s.resize(nullPosition);
+        }
+    }
+}
+
 
 
 // Read a vector of strings from an hdf5 data set with rank 1.
 void hdf5::read(
 	const H5::DataSet& dataSet,
     vector<string>& data)
+{
+    read(dataSet, 0, size(dataSet), data);
+}
+
+
+
+// Read a vector of strings from a portion of an hdf5 data set with rank 1.
+void hdf5::read(
+    const H5::DataSet& dataSet,
+    hsize_t offset,
+    hsize_t n,
+    vector<string>& data)
 {
     // Check that the data set contains strings.
     if(dataSet.getTypeClass() != H5T_STRING) {
@@ -24,42 +91,311 @@ void hdf5::read(
     }
 
     // Get the data space.
-    const DataSpace dataSpace = dataSet.getSpace();
+    DataSpace dataSpace = dataSet.getSpace();
 
     // Check that the data space has rank 1 (contains a vector).
     if(dataSpace.getSimpleExtentNdims() != 1) {
         throw runtime_error("Unexpected rank while reading strings from hdf5 data set.");
     }
 
-    // Get the number of strings.
+    if(n == 0) {
+        data.clear();
+        return;
+    }
+
+    // Define the hyperslab we want to read, and a memory data space for the entire buffer.
+    dataSpace.selectHyperslab(H5S_SELECT_SET, &n, &offset);
+    const DataSpace memoryDataSpace(1, &n);
+
+    const StrType strType(dataSet);
+    decodeStrings(strType, n, [&](void* buffer, const StrType& memoryType)
+        {
+            dataSet.read(buffer, memoryType, memoryDataSpace, dataSpace);
+        }, data);
+}
+
+
+
+// Read a portion of an hdf5 data set with rank 1 as strings.
+// Numbers are formatted, and missing floating point values (NaN)
+// are returned as empty strings.
+void hdf5::readAsStrings(
+    const DataSet& dataSet,
+    hsize_t offset,
+    hsize_t n,
+    vector<string>& values)
+{
+    switch(dataSet.getTypeClass()) {
+
+    case H5T_STRING:
+        read(dataSet, offset, n, values);
+        return;
+
+    case H5T_INTEGER:
+        {
+            vector<int64_t> numbers;
+            readAndConvert(dataSet, offset, n, numbers);
+            values.resize(n);
+            for(size_t i=0; i<n; i++) {
+                values[i] = lexical_cast<string>(numbers[i]);
+            }
+            return;
+        }
+
+    case H5T_FLOAT:
+        {
+            // Use the number of digits that represents the stored precision
+            // without showing rounding noise.
+            const int precision = (dataSet.getFloatType().getSize() == 4) ? 7 : 15;
+            vector<double> numbers;
+            readAndConvert(dataSet, offset, n, numbers);
+            values.resize(n);
+            for(size_t i=0; i<n; i++) {
+                if(std::isnan(numbers[i])) {
+                    values[i].clear();
+                } else {
+                    std::ostringstream s;
+                    s.precision(precision);
+                    s << numbers[i];
+                    values[i] = s.str();
+                }
+            }
+            return;
+        }
+
+    case H5T_ENUM:
+        {
+            // This includes booleans, which h5py stores as an enumerated type
+            // with values FALSE and TRUE.
+            const EnumType enumType = dataSet.getEnumType();
+            const size_t valueSize = enumType.getSize();
+            values.resize(n);
+            if(n == 0) {
+                return;
+            }
+            DataSpace dataSpace = dataSet.getSpace();
+            dataSpace.selectHyperslab(H5S_SELECT_SET, &n, &offset);
+            const DataSpace memoryDataSpace(1, &n);
+            vector<char> buffer(n * valueSize);
+            dataSet.read(&buffer.front(), enumType, memoryDataSpace, dataSpace);
+            for(size_t i=0; i<n; i++) {
+                values[i] = enumType.nameOf(&buffer[i*valueSize], 256);
+            }
+            return;
+        }
+
+    default:
+        throw runtime_error("Unsupported type class while reading hdf5 data set as strings.");
+    }
+}
+
+
+
+// Return the number of elements in an hdf5 data set with rank 1.
+hsize_t hdf5::size(const H5::DataSet& dataSet)
+{
+    const DataSpace dataSpace = dataSet.getSpace();
+    if(dataSpace.getSimpleExtentNdims() != 1) {
+        throw runtime_error("Unexpected rank for hdf5 data set.");
+    }
     hsize_t n;
     dataSpace.getSimpleExtentDims(&n, 0);
+    return n;
+}
 
-    // Get the string type and its maximum length.
-    const StrType strType(dataSet);
-    const size_t stringMaximumLength = strType.getSize();
 
-    // Now we know how many bytes to allocate and we can read the data in.
-    vector<char> buffer(n * stringMaximumLength);
-    dataSet.read(&buffer[0], strType);
 
-    // Store the strings.
-    data.resize(n);
-    const char* bufferBegin = &buffer.front();
+// Return true if a group contains an object with the given name.
+// We use the C API for compatibility with older versions of the C++ API.
+bool hdf5::exists(const H5::Group& group, const string& name)
+{
+    return H5Lexists(group.getId(), name.c_str(), H5P_DEFAULT) > 0;
+}
+
+
+
+bool hdf5::hasAttribute(const H5::H5Object& object, const string& name)
+{
+    return H5Aexists(object.getId(), name.c_str()) > 0;
+}
+
+
+
+// Read a string attribute. Returns an empty string if the attribute does not exist.
+string hdf5::readStringAttribute(const H5::H5Object& object, const string& name)
+{
+    const vector<string> strings = readStringsAttribute(object, name);
+    if(strings.size() > 1) {
+        throw runtime_error("Unexpected size of hdf5 attribute " + name);
+    }
+    return strings.empty() ? string() : strings.front();
+}
+
+
+
+// Read an attribute containing a string or a vector of strings.
+// Returns an empty vector if the attribute does not exist or is empty.
+vector<string> hdf5::readStringsAttribute(const H5::H5Object& object, const string& name)
+{
+    vector<string> data;
+    if(!hasAttribute(object, name)) {
+        return data;
+    }
+    const Attribute attribute = object.openAttribute(name);
+    const size_t n = size_t(attribute.getSpace().getSimpleExtentNpoints());
+
+    // An empty attribute can have any type (h5py uses double for empty lists).
+    if(n == 0) {
+        return data;
+    }
+    if(attribute.getTypeClass() != H5T_STRING) {
+        throw runtime_error("Unexpected type class while reading strings from hdf5 attribute " + name);
+    }
+    const StrType strType = attribute.getStrType();
+    decodeStrings(strType, n, [&](void* buffer, const StrType& memoryType)
+        {
+            attribute.read(memoryType, buffer);
+        }, data);
+    return data;
+}
+
+
+
+// Write a scalar string attribute.
+void hdf5::writeAttribute(H5::H5Object& object, const string& name, const string& value)
+{
+    StrType strType(PredType::C_S1, H5T_VARIABLE);
+    strType.setCset(H5T_CSET_UTF8);
+    const Attribute attribute = object.createAttribute(name, strType, DataSpace(H5S_SCALAR));
+    const char* pointer = value.c_str();
+    attribute.write(strType, &pointer);
+}
+
+
+
+// Write an attribute containing a vector of strings.
+void hdf5::writeAttribute(H5::H5Object& object, const string& name, const vector<string>& value)
+{
+    StrType strType(PredType::C_S1, H5T_VARIABLE);
+    strType.setCset(H5T_CSET_UTF8);
+    const hsize_t n = value.size();
+    const Attribute attribute = object.createAttribute(name, strType, DataSpace(1, &n));
+    if(n == 0) {
+        return;
+    }
+    vector<const char*> pointers;
+    for(const string& s: value) {
+        pointers.push_back(s.c_str());
+    }
+    attribute.write(strType, &pointers.front());
+}
+
+
+
+// Write an attribute containing a vector of integers.
+void hdf5::writeAttribute(H5::H5Object& object, const string& name, const vector<int64_t>& value)
+{
+    const hsize_t n = value.size();
+    const Attribute attribute = object.createAttribute(name, PredType::NATIVE_INT64, DataSpace(1, &n));
+    if(n == 0) {
+        return;
+    }
+    attribute.write(PredType::NATIVE_INT64, &value.front());
+}
+
+
+
+// Write a boolean attribute, using the enumerated type used by h5py for booleans.
+void hdf5::writeBooleanAttribute(H5::H5Object& object, const string& name, bool value)
+{
+    EnumType enumType(IntType(PredType::NATIVE_INT8));
+    int8_t enumValue = 0;
+    enumType.insert("FALSE", &enumValue);
+    enumValue = 1;
+    enumType.insert("TRUE", &enumValue);
+    enumValue = value ? 1 : 0;
+    const Attribute attribute = object.createAttribute(name, enumType, DataSpace(H5S_SCALAR));
+    attribute.write(enumType, &enumValue);
+}
+
+
+
+// Write a vector of strings to a new hdf5 data set with rank 1,
+// using fixed length strings padded with nulls.
+void hdf5::write(
+    H5::Group& group,
+    const string& name,
+    const vector<string>& data,
+    hsize_t chunkSize,
+    int compressionLevel)
+{
+    // All strings are stored with the length of the longest one.
+    size_t stringMaximumLength = 1;
+    for(const string& s: data) {
+        stringMaximumLength = std::max(stringMaximumLength, s.size());
+    }
+    StrType strType(PredType::C_S1, stringMaximumLength);
+    strType.setStrpad(H5T_STR_NULLPAD);
+
+    // Create the data set.
+    const hsize_t n = data.size();
+    const hsize_t actualChunkSize = std::max(hsize_t(1), std::min(chunkSize, n));
+    DSetCreatPropList properties;
+    properties.setChunk(1, &actualChunkSize);
+    if(compressionLevel > 0) {
+        properties.setShuffle();
+        properties.setDeflate(compressionLevel);
+    }
+    const hsize_t maximumSize = H5S_UNLIMITED;
+    const DataSpace dataSpace(1, &n, &maximumSize);
+    const DataSet dataSet = group.createDataSet(name, strType, dataSpace, properties);
+
+    // Fill a buffer and write it.
+    if(n == 0) {
+        return;
+    }
+    vector<char> buffer(n * stringMaximumLength, char(0));
     for(size_t i=0; i<n; i++) {
-        const char* address = bufferBegin + stringMaximumLength*i;
-        string& s = data[i];
+        copy(data[i].begin(), data[i].end(), buffer.begin() + i*stringMaximumLength);
+    }
+    dataSet.write(&buffer.front(), strType);
+}
+
 
-        // The string in the buffer is not null terminated
-        // if it is of maximum length (Fortran style), so we have to be a bit careful.
-        s = string(address, stringMaximumLength);
-        const auto nullPosition = s.find(char(0));
-        if(nullPosition != string::npos) {
-            s.resize(nullPosition);
-        }
 
+// Write a vector of strings to a new hdf5 data set with rank 1,
+// using variable length UTF-8 strings.
+void hdf5::writeVariableLength(
+    H5::Group& group,
+    const string& name,
+    const vector<string>& data,
+    hsize_t chunkSize,
+    int compressionLevel)
+{
+    StrType strType(PredType::C_S1, H5T_VARIABLE);
+    strType.setCset(H5T_CSET_UTF8);
+
+    // Create the data set. Only the references to the strings
+    // are compressed, so we don't use the shuffle filter.
+    const hsize_t n = data.size();
+    const hsize_t actualChunkSize = std::max(hsize_t(1), std::min(chunkSize, n));
+    DSetCreatPropList properties;
+    properties.setChunk(1, &actualChunkSize);
+    if(compressionLevel > 0) {
+        properties.setDeflate(compressionLevel);
     }
+    const hsize_t maximumSize = H5S_UNLIMITED;
+    const DataSpace dataSpace(1, &n, &maximumSize);
+    const DataSet dataSet = group.createDataSet(name, strType, dataSpace, properties);
 
+    if(n == 0) {
+        return;
+    }
+    vector<const char*> pointers;
+    for(const string& s: data) {
+        pointers.push_back(s.c_str());
+    }
+    dataSet.write(&pointers.front(), strType);
 }
 
 
@@ -5,8 +5,8 @@
 
 /*******************************************************************************
 
-Functions used to read hdf5 files containing expression matrices
-created by the 10X Genomics pipeline.
+Functions used to read and write hdf5 files containing expression matrices
+in the format created by the 10X Genomics pipeline.
 
 See here for information on the hdf5 C++ API:
 https://support.hdfgroup.org/HDF5/doc/cpplus_RM/index.html
@@ -49,6 +49,8 @@ Cell names (or rather the corresponding barcodes) are in data set barcodes.
 
 *******************************************************************************/
 
+#include "algorithm.hpp"
+#include "cstdint.hpp"
 #include "stdexcept.hpp"
 #include "string.hpp"
 #include "vector.hpp"
@@ -86,10 +88,105 @@ namespace ChanZuckerberg {
 			vector<Int>& data);
 
 		// Read a vector of strings from an hdf5 data set with rank 1.
+		// Both fixed length and variable length strings are supported.
 		void read(
 			const H5::DataSet&,
 			vector<string>& data);
 
+		// Read a vector of strings from a portion of an hdf5 data set with rank 1.
+		void read(
+			const H5::DataSet&,
+			hsize_t offset,
+			hsize_t n,
+			vector<string>& data);
+
+		// Read a portion of an hdf5 data set with rank 1 containing
+		// integers or floating point numbers of any size,
+		// letting the hdf5 library convert them to type T.
+		template<class T> inline void readAndConvert(
+			const H5::DataSet&,
+			hsize_t offset,
+			hsize_t n,
+			vector<T>& data);
+
+		// Read a portion of an hdf5 data set with rank 1 as strings.
+		// Numbers are formatted, enumerated values (including booleans stored by h5py)
+		// are returned as their names, and missing floating point values (NaN)
+		// are returned as empty strings.
+		void readAsStrings(
+			const H5::DataSet&,
+			hsize_t offset,
+			hsize_t n,
+			vector<string>& data);
+
+		// Return the number of elements in an hdf5 data set with rank 1.
+		hsize_t size(const H5::DataSet&);
+
+		// Return true if a group contains an object with the given name.
+		bool exists(const H5::Group&, const string& name);
+
+		// Functions to read and write attributes of groups and data sets.
+		// Strings are written as variable length UTF-8 strings.
+		// Reading a string attribute that does not exist returns an empty string.
+		bool hasAttribute(const H5::H5Object&, const string& name);
+		string readStringAttribute(const H5::H5Object&, const string& name);
+		vector<string> readStringsAttribute(const H5::H5Object&, const string& name);
+		void writeAttribute(H5::H5Object&, const string& name, const string& value);
+		void writeAttribute(H5::H5Object&, const string& name, const vector<string>& value);
+		void writeAttribute(H5::H5Object&, const string& name, const vector<int64_t>& value);
+
+		// Write a boolean attribute, using the enumerated type used by h5py for booleans.
+		void writeBooleanAttribute(H5::H5Object&, const string& name, bool value);
+
+		// Return the native hdf5 type corresponding to an arithmetic type.
+		template<class T> inline const H5::PredType& nativeType();
+
+		// Create an hdf5 data set with rank 1 containing n elements of type T.
+		// The data set is stored in chunks of (at most) chunkSize elements,
+		// compressed using the shuffle and gzip filters with the given
+		// compression level (0 to 9, 0 means no compression).
+		// Like the data sets created by the 10X Genomics pipeline,
+		// the data set has unlimited maximum size.
+		template<class T> inline H5::DataSet createDataSet(
+			H5::Group&,
+			const string& name,
+			hsize_t n,
+			hsize_t chunkSize,
+			int compressionLevel);
+
+		// Write a vector to a portion of an hdf5 data set with rank 1,
+		// starting at the given offset.
+		template<class T> inline void write(
+			const H5::DataSet&,
+			hsize_t offset,
+			const vector<T>& data);
+
+		// Write a vector of strings to a new hdf5 data set with rank 1,
+		// using fixed length strings padded with nulls.
+		void write(
+			H5::Group&,
+			const string& name,
+			const vector<string>& data,
+			hsize_t chunkSize,
+			int compressionLevel);
+
+		// Write a vector of strings to a new hdf5 data set with rank 1,
+		// using variable length UTF-8 strings.
+		void writeVariableLength(
+			H5::Group&,
+			const string& name,
+			const vector<string>& data,
+			hsize_t chunkSize,
+			int compressionLevel);
+
+		// Write a matrix stored by rows to a new hdf5 data set with rank 2.
+		template<class T> inline void write(
+			H5::Group&,
+			const string& name,
+			const vector<T>& data,
+			hsize_t rowCount,
+			hsize_t columnCount);
+
 		}
 	}
 }
@@ -181,4 +278,138 @@ template<class Int> inline void ChanZuckerberg::ExpressionMatrix2::hdf5::read(
 
 
 
+// Read a portion of an hdf5 data set with rank 1 containing
+// integers or floating point numbers, converting them to type T.
+template<class T> inline void ChanZuckerberg::ExpressionMatrix2::hdf5::readAndConvert(
+    const H5::DataSet& dataSet,
+    hsize_t offset,
+    hsize_t n,
+    vector<T>& data)
+{
+    // Check that the data set contains numbers.
+    const H5T_class_t typeClass = dataSet.getTypeClass();
+    if(typeClass != H5T_INTEGER && typeClass != H5T_FLOAT) {
+        throw runtime_error("Unexpected type class while reading numbers from hdf5 data set.");
+    }
+
+    // Check that the data space has rank 1 (contains a vector).
+    DataSpace dataSpace = dataSet.getSpace();
+    if(dataSpace.getSimpleExtentNdims() != 1) {
+        throw runtime_error("Unexpected rank while reading numbers from hdf5 data set.");
+    }
+
+    data.resize(n);
+    if(n == 0) {
+        return;
+    }
+
+    // Read the hyperslab, letting the hdf5 library do the conversion.
+    dataSpace.selectHyperslab(H5S_SELECT_SET, &n, &offset);
+    const DataSpace memoryDataSpace(1, &n);
+    dataSet.read(&data.front(), nativeType<T>(), memoryDataSpace, dataSpace);
+}
+
+
+
+template<> inline const H5::PredType& ChanZuckerberg::ExpressionMatrix2::hdf5::nativeType<int8_t>()
+{
+    return PredType::NATIVE_INT8;
+}
+template<> inline const H5::PredType& ChanZuckerberg::ExpressionMatrix2::hdf5::nativeType<int32_t>()
+{
+    return PredType::NATIVE_INT32;
+}
+template<> inline const H5::PredType& ChanZuckerberg::ExpressionMatrix2::hdf5::nativeType<uint32_t>()
+{
+    return PredType::NATIVE_UINT32;
+}
+template<> inline const H5::PredType& ChanZuckerberg::ExpressionMatrix2::hdf5::nativeType<int64_t>()
+{
+    return PredType::NATIVE_INT64;
+}
+template<> inline const H5::PredType& ChanZuckerberg::ExpressionMatrix2::hdf5::nativeType<uint64_t>()
+{
+    return PredType::NATIVE_UINT64;
+}
+template<> inline const H5::PredType& ChanZuckerberg::ExpressionMatrix2::hdf5::nativeType<float>()
+{
+    return PredType::NATIVE_FLOAT;
+}
+template<> inline const H5::PredType& ChanZuckerberg::ExpressionMatrix2::hdf5::nativeType<double>()
+{
+    return PredType::NATIVE_DOUBLE;
+}
+
+
+
+// Create a chunked, compressed hdf5 data set with rank 1.
+template<class T> inline H5::DataSet ChanZuckerberg::ExpressionMatrix2::hdf5::createDataSet(
+    H5::Group& group,
+    const string& name,
+    hsize_t n,
+    hsize_t chunkSize,
+    int compressionLevel)
+{
+    // The chunk size must be positive, and there is no point in making it
+    // larger than the data set.
+    const hsize_t actualChunkSize = std::max(hsize_t(1), std::min(chunkSize, n));
+    DSetCreatPropList properties;
+    properties.setChunk(1, &actualChunkSize);
+    if(compressionLevel > 0) {
+        properties.setShuffle();
+        properties.setDeflate(compressionLevel);
+    }
+
+    const hsize_t maximumSize = H5S_UNLIMITED;
+    const DataSpace dataSpace(1, &n, &maximumSize);
+    return group.createDataSet(name, nativeType<T>(), dataSpace, properties);
+}
+
+
+
+// Write a vector to a portion of an hdf5 data set with rank 1.
+template<class T> inline void ChanZuckerberg::ExpressionMatrix2::hdf5::write(
+    const H5::DataSet& dataSet,
+    hsize_t offset,
+    const vector<T>& data)
+{
+    hsize_t n = data.size();
+    if(n == 0) {
+        return;
+    }
+
+    // Define the hyperslab we want to write.
+    DataSpace dataSpace = dataSet.getSpace();
+    dataSpace.selectHyperslab(H5S_SELECT_SET, &n, &offset);
+
+    // Define the memory data space that covers the entire vector.
+    const DataSpace memoryDataSpace(1, &n);
+
+    dataSet.write(data.data(), nativeType<T>(), memoryDataSpace, dataSpace);
+}
+
+
+
+
+// Write a matrix stored by rows to a new hdf5 data set with rank 2.
+template<class T> inline void ChanZuckerberg::ExpressionMatrix2::hdf5::write(
+    H5::Group& group,
+    const string& name,
+    const vector<T>& data,
+    hsize_t rowCount,
+    hsize_t columnCount)
+{
+    if(data.size() != rowCount * columnCount) {
+        throw runtime_error("Inconsistent matrix size while writing hdf5 data set " + name);
+    }
+    const hsize_t dimensions[2] = {rowCount, columnCount};
+    const DataSpace dataSpace(2, dimensions);
+    const DataSet dataSet = group.createDataSet(name, nativeType<T>(), dataSpace);
+    if(!data.empty()) {
+        dataSet.write(data.data(), nativeType<T>());
+    }
+}
+
+
+
 #endif
@@ -9,6 +9,7 @@ namespace ChanZuckerberg {
     namespace ExpressionMatrix2 {
         using std::make_shared;
         using std::shared_ptr;
+        using std::unique_ptr;
     }
 }
 
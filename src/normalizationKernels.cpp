@@ -0,0 +1,331 @@
+#include "normalizationKernels.hpp"
+#include "CZI_ASSERT.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <algorithm>
+#include <cmath>
+#include "iostream.hpp"
+#include <random>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+
+// Each operation is a class with a scalar operator() and,
+// if SSE2 is available, an operator() that processes four floats at a time.
+// The loops below apply an operation to contiguous floats
+// or to the counts of pairs(GeneId, count).
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace {
+
+            class ScaleOperation {
+            public:
+                float scale;
+                ScaleOperation(float scale) : scale(scale) {}
+                float operator()(float x) const
+                {
+                    return scale * x;
+                }
+#ifdef __SSE2__
+                __m128 operator()(__m128 x) const
+                {
+                    return _mm_mul_ps(x, _mm_set1_ps(scale));
+                }
+#endif
+            };
+
+
+
+            class Log1pOperation {
+            public:
+                float scale;
+                Log1pOperation(float scale) : scale(scale) {}
+                float operator()(float x) const
+                {
+                    return float(std::log1p(double(scale * x)));
+                }
+#ifdef __SSE2__
+                // log(1+y) for y=scale*x>=0, computed as log(u) + (y-(u-1))/u, where u=1+y.
+                // The second term corrects for the rounding error in computing u.
+                // log(u) uses the polynomial approximation of the Cephes library.
+                __m128 operator()(__m128 x) const
+                {
+                    const __m128 one = _mm_set1_ps(1.f);
+                    const __m128 y = _mm_mul_ps(x, _mm_set1_ps(scale));
+                    const __m128 u = _mm_add_ps(one, y);
+                    const __m128 correction = _mm_div_ps(_mm_sub_ps(y, _mm_sub_ps(u, one)), u);
+
+                    // Write u = m * 2^e, with m in [0.5, 1).
+                    const __m128i bits = _mm_castps_si128(u);
+                    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)));
+                    __m128 m = _mm_or_ps(
+                        _mm_and_ps(u, _mm_castsi128_ps(_mm_set1_epi32(0x007fffff))),
+                        _mm_set1_ps(0.5f));
+
+                    // If m < sqrt(1/2), use 2m and e-1, so the polynomial
+                    // is evaluated for m-1 in [sqrt(1/2)-1, sqrt(2)-1).
+                    const __m128 mask = _mm_cmplt_ps(m, _mm_set1_ps(0.707106781186547524f));
+                    e = _mm_sub_ps(e, _mm_and_ps(one, mask));
+                    m = _mm_add_ps(_mm_sub_ps(m, one), _mm_and_ps(m, mask));
+
+                    const __m128 z = _mm_mul_ps(m, m);
+                    __m128 p = _mm_set1_ps(7.0376836292e-2f);
+                    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.1514610310e-1f));
+                    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(1.1676998740e-1f));
+                    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.2420140846e-1f));
+                    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(1.4249322787e-1f));
+                    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.6668057665e-1f));
+                    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(2.0000714765e-1f));
+                    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-2.4999993993e-1f));
+                    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(3.3333331174e-1f));
+                    p = _mm_mul_ps(_mm_mul_ps(p, m), z);
+                    p = _mm_add_ps(p, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+                    p = _mm_sub_ps(p, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+                    __m128 logu = _mm_add_ps(m, p);
+                    logu = _mm_add_ps(logu, _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+
+                    return _mm_add_ps(logu, correction);
+                }
+#endif
+            };
+
+
+
+            template<class Operation> void applyToValues(
+                float* values, size_t n, const Operation& operation)
+            {
+                size_t i = 0;
+#ifdef __SSE2__
+                for(; i+4<=n; i+=4) {
+                    _mm_storeu_ps(values + i, operation(_mm_loadu_ps(values + i)));
+                }
+#endif
+                for(; i<n; i++) {
+                    values[i] = operation(values[i]);
+                }
+            }
+
+
+
+            // Each pair(GeneId, count) occupies two floats, so two loads give
+            // four gene ids and four counts, which are separated by shuffles
+            // and recombined after the counts are processed.
+            template<class Operation> void applyToExpressionCounts(
+                pair<GeneId, float>* counts, size_t n, const Operation& operation)
+            {
+                static_assert(sizeof(pair<GeneId, float>) == 2*sizeof(float),
+                    "Unexpected layout of expression counts.");
+                size_t i = 0;
+#ifdef __SSE2__
+                float* p = reinterpret_cast<float*>(counts);
+                for(; i+4<=n; i+=4, p+=8) {
+                    const __m128 a = _mm_loadu_ps(p);
+                    const __m128 b = _mm_loadu_ps(p + 4);
+                    const __m128 geneIds = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+                    const __m128 values = operation(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+                    _mm_storeu_ps(p, _mm_unpacklo_ps(geneIds, values));
+                    _mm_storeu_ps(p + 4, _mm_unpackhi_ps(geneIds, values));
+                }
+#endif
+                for(; i<n; i++) {
+                    counts[i].second = operation(counts[i].second);
+                }
+            }
+        }
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::scaleValues(float* values, size_t n, float scale)
+{
+    applyToValues(values, n, ScaleOperation(scale));
+}
+
+void ChanZuckerberg::ExpressionMatrix2::log1pValues(float* values, size_t n, float scale)
+{
+    applyToValues(values, n, Log1pOperation(scale));
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::normalizeValues(
+    NormalizationMethod normalizationMethod,
+    float* values,
+    size_t n,
+    double sum1,
+    double sum2)
+{
+    CZI_ASSERT(normalizationMethodPreservesZero(normalizationMethod));
+    if(n == 0) {
+        return;
+    }
+    const float scale = float(normalizationMethodScale(normalizationMethod, sum1, sum2));
+    if(normalizationMethodUsesLog1p(normalizationMethod)) {
+        applyToValues(values, n, Log1pOperation(scale));
+    } else if(normalizationMethod != NormalizationMethod::none) {
+        applyToValues(values, n, ScaleOperation(scale));
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::normalizeExpressionCounts(
+    NormalizationMethod normalizationMethod,
+    pair<GeneId, float>* begin,
+    pair<GeneId, float>* end,
+    double sum1,
+    double sum2)
+{
+    CZI_ASSERT(normalizationMethodPreservesZero(normalizationMethod));
+    const size_t n = size_t(end - begin);
+    if(n == 0) {
+        return;
+    }
+    const float scale = float(normalizationMethodScale(normalizationMethod, sum1, sum2));
+    if(normalizationMethodUsesLog1p(normalizationMethod)) {
+        applyToExpressionCounts(begin, n, Log1pOperation(scale));
+    } else if(normalizationMethod != NormalizationMethod::none) {
+        applyToExpressionCounts(begin, n, ScaleOperation(scale));
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::computePearsonResiduals(
+    const float* counts,
+    const float* geneFractions,
+    float* residuals,
+    size_t geneCount,
+    float cellTotal,
+    float clip)
+{
+    const float inverseTheta = 1.f / pearsonResidualsTheta;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 s = _mm_set1_ps(cellTotal);
+    const __m128 c = _mm_set1_ps(clip);
+    const __m128 minusC = _mm_set1_ps(-clip);
+    const __m128 t = _mm_set1_ps(inverseTheta);
+    const __m128 zero = _mm_setzero_ps();
+    for(; i+4<=geneCount; i+=4) {
+        const __m128 mu = _mm_mul_ps(s, _mm_loadu_ps(geneFractions + i));
+        const __m128 variance = _mm_add_ps(mu, _mm_mul_ps(_mm_mul_ps(mu, mu), t));
+        const __m128 nonZero = _mm_cmpgt_ps(mu, zero);
+        __m128 r = _mm_div_ps(
+            _mm_sub_ps(_mm_loadu_ps(counts + i), mu),
+            _mm_sqrt_ps(_mm_or_ps(variance, _mm_andnot_ps(nonZero, _mm_set1_ps(1.f)))));
+        r = _mm_min_ps(c, _mm_max_ps(minusC, r));
+        _mm_storeu_ps(residuals + i, _mm_and_ps(r, nonZero));
+    }
+#endif
+    for(; i<geneCount; i++) {
+        const float mu = cellTotal * geneFractions[i];
+        if(mu > 0.f) {
+            const float r = (counts[i] - mu) / std::sqrt(mu + mu * mu * inverseTheta);
+            residuals[i] = std::min(clip, std::max(-clip, r));
+        } else {
+            residuals[i] = 0.f;
+        }
+    }
+}
+
+
+
+// Check the kernels against scalar computations in double precision,
+// for vector lengths that exercise both the SSE2 loops and the remainder loops.
+void ChanZuckerberg::ExpressionMatrix2::testNormalizationKernels()
+{
+    std::mt19937 randomGenerator(231);
+    std::uniform_int_distribution<int> countDistribution(0, 1000);
+    std::uniform_real_distribution<float> fractionDistribution(0.f, 0.01f);
+
+    // The maximum relative error allowed for values computed in float.
+    const double tolerance = 1.e-6;
+    const auto checkValue = [tolerance](double value, double expectedValue)
+    {
+        CZI_ASSERT(std::abs(value - expectedValue) <= tolerance * std::max(1., std::abs(expectedValue)));
+    };
+
+    for(size_t n=0; n<20; n++) {
+
+        // Generate random counts, some of them zero.
+        vector<float> counts(n);
+        double sum1 = 0.;
+        double sum2 = 0.;
+        for(float& count: counts) {
+            count = float(std::max(0, countDistribution(randomGenerator) - 300));
+            sum1 += count;
+            sum2 += count * count;
+        }
+        if(sum1 == 0.) {
+            counts.push_back(1.f);
+            sum1 = 1.;
+            sum2 = 1.;
+        }
+
+        // Check all the methods that preserve zero, on contiguous values
+        // and on expression counts.
+        for(const NormalizationMethod method: validNormalizationMethods) {
+            if(!normalizationMethodPreservesZero(method)) {
+                continue;
+            }
+            const double scale = double(float(normalizationMethodScale(method, sum1, sum2)));
+            vector<float> values = counts;
+            normalizeValues(method, values.data(), values.size(), sum1, sum2);
+            vector< pair<GeneId, float> > expressionCounts;
+            for(size_t i=0; i<counts.size(); i++) {
+                expressionCounts.push_back(make_pair(GeneId(3*i), counts[i]));
+            }
+            normalizeExpressionCounts(method, expressionCounts.data(),
+                expressionCounts.data() + expressionCounts.size(), sum1, sum2);
+            for(size_t i=0; i<counts.size(); i++) {
+                const double x = (method == NormalizationMethod::none) ? counts[i] : scale * counts[i];
+                const double expectedValue = normalizationMethodUsesLog1p(method) ? std::log1p(x) : x;
+                checkValue(values[i], expectedValue);
+                CZI_ASSERT(expressionCounts[i].first == GeneId(3*i));
+                checkValue(expressionCounts[i].second, expectedValue);
+                if(counts[i] == 0.f) {
+                    CZI_ASSERT(values[i] == 0.f);
+                }
+            }
+        }
+
+        // Check the Pearson residuals, including genes with a zero fraction
+        // and residuals that are clipped.
+        vector<float> geneFractions(counts.size());
+        for(size_t i=0; i<geneFractions.size(); i++) {
+            geneFractions[i] = (i%5 == 1) ? 0.f : fractionDistribution(randomGenerator);
+        }
+        const float clip = 3.f;
+        vector<float> residuals(counts.size());
+        computePearsonResiduals(counts.data(), geneFractions.data(), residuals.data(),
+            counts.size(), float(sum1), clip);
+        for(size_t i=0; i<counts.size(); i++) {
+            const double mu = double(float(sum1) * geneFractions[i]);
+            double expectedValue = 0.;
+            if(mu > 0.) {
+                expectedValue = (counts[i] - mu) / std::sqrt(mu + mu * mu / pearsonResidualsTheta);
+                expectedValue = std::min(double(clip), std::max(-double(clip), expectedValue));
+            }
+            checkValue(residuals[i], expectedValue);
+        }
+    }
+
+    // Check log(1+x) over a wide range of values.
+    vector<float> x;
+    for(double value=0.; value<1.e7; value=value*1.01+1.e-6) {
+        x.push_back(float(value));
+    }
+    vector<float> y = x;
+    log1pValues(y.data(), y.size(), 1.f);
+    for(size_t i=0; i<x.size(); i++) {
+        checkValue(y[i], std::log1p(double(x[i])));
+    }
+
+    cout << "testNormalizationKernels completed successfully." << endl;
+}
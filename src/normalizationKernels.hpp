@@ -0,0 +1,78 @@
+#ifndef CZI_EXPRESSION_MATRIX2_NORMALIZATION_KERNELS_HPP
+#define CZI_EXPRESSION_MATRIX2_NORMALIZATION_KERNELS_HPP
+
+// Kernels that apply a NormalizationMethod to expression counts.
+// They process four values at a time using SSE2 instructions
+// (the build uses -msse4.2), with a scalar loop for the remainder
+// and a scalar fallback if SSE2 is not available.
+// log(1+x) uses a polynomial approximation with a relative error
+// of a few units in the last place of a float.
+
+// Analytic Pearson residuals (Lause, Berens, Kobak, Genome Biology 2021)
+// model count x for gene g in cell c as negative binomial with
+// mean mu = s*p and overdispersion theta, where s is the total count for the cell
+// and p the fraction of all counts that belong to the gene.
+// The residual is (x - mu) / sqrt(mu + mu^2/theta),
+// clipped to [-sqrt(n), sqrt(n)], where n is the number of cells.
+// Residuals are non-zero for zero counts, so they can only be computed
+// for dense expression vectors.
+
+#include "Ids.hpp"
+#include "NormalizationMethod.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+#include "cstddef.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+
+        // Replace each value x with scale*x.
+        void scaleValues(float* values, size_t n, float scale);
+
+        // Replace each value x with log(1+scale*x). The values must be non-negative.
+        void log1pValues(float* values, size_t n, float scale);
+
+        // Apply a normalization method that preserves zero to
+        // a set of values, given the sum and sum of squares
+        // of the counts used for normalization.
+        void normalizeValues(NormalizationMethod, float* values, size_t n, double sum1, double sum2);
+
+        // Same, for the values of expression counts stored as pairs(GeneId, count).
+        // The gene ids are not changed.
+        void normalizeExpressionCounts(
+            NormalizationMethod,
+            pair<GeneId, float>* begin,
+            pair<GeneId, float>* end,
+            double sum1,
+            double sum2);
+
+        // The quantities that analytic Pearson residuals for the genes of a gene set
+        // depend on, other than the counts of the cell.
+        // They are the same for all cells (see ExpressionMatrix::getPearsonResidualsParameters),
+        // so they are computed once before normalizing many cells.
+        class PearsonResidualsParameters {
+        public:
+            vector<float> geneFractions;    // The fraction p of all counts for each gene of the gene set.
+            float clip = 0.f;               // The square root of the number of cells.
+        };
+
+        // Compute the analytic Pearson residuals for the dense expression
+        // vector of a cell. Genes with a zero fraction get a residual of zero.
+        void computePearsonResiduals(
+            const float* counts,            // The counts of the cell for each gene.
+            const float* geneFractions,     // The fraction p of all counts for each gene.
+            float* residuals,               // The computed residuals for each gene.
+            size_t geneCount,
+            float cellTotal,                // The total count s for the cell.
+            float clip);                    // Residuals are clipped to [-clip, clip].
+
+        // The overdispersion used for analytic Pearson residuals.
+        const float pearsonResidualsTheta = 100.f;
+
+        // Check the kernels against scalar computations in double precision.
+        void testNormalizationKernels();
+    }
+}
+
+#endif
@@ -0,0 +1,364 @@
+// Minimal support for NUMA (non-uniform memory access) systems.
+// See numa.hpp for details.
+
+#include "numa.hpp"
+#include "CZI_ASSERT.hpp"
+#include "fstream.hpp"
+#include "stdexcept.hpp"
+#include "TaskScheduler.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "boost_lexical_cast.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Flag for move_pages, from linux/mempolicy.h.
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1<<1)
+#endif
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace numa {
+
+            // The NUMA topology, read from /sys/devices/system/node
+            // the first time it is needed.
+            class Topology {
+            public:
+                // The kernel node id of each node we use.
+                vector<int> nodeIds;
+
+                // The cpus of each node.
+                vector< vector<int> > cpus;
+
+                Topology();
+            };
+            const Topology& topology();
+
+            // Parse a list in the format used by the kernel in /sys,
+            // for example "0-3,8,10-11".
+            vector<int> parseList(const string&);
+
+            // Read the first line of a file, or return an empty string
+            // if the file cannot be read.
+            string readFirstLine(const string& fileName);
+
+            // Make resident each page in [begin, end) and move it
+            // to the node given by nodeIndex(pageIndex).
+            template<class NodeIndex> vector<size_t> placePages(
+                const void* begin, const void* end, const NodeIndex&);
+        }
+    }
+}
+
+
+
+string numa::readFirstLine(const string& fileName)
+{
+    ifstream file(fileName);
+    string line;
+    if(file) {
+        std::getline(file, line);
+    }
+    return line;
+}
+
+
+
+vector<int> numa::parseList(const string& s)
+{
+    vector<int> values;
+    size_t position = 0;
+    while(position < s.size()) {
+        size_t next = s.find(',', position);
+        if(next == string::npos) {
+            next = s.size();
+        }
+        const string item = s.substr(position, next - position);
+        position = next + 1;
+        if(item.empty()) {
+            continue;
+        }
+        const size_t dash = item.find('-');
+        try {
+            if(dash == string::npos) {
+                values.push_back(lexical_cast<int>(item));
+            } else {
+                const int first = lexical_cast<int>(item.substr(0, dash));
+                const int last = lexical_cast<int>(item.substr(dash + 1));
+                for(int value=first; value<=last; value++) {
+                    values.push_back(value);
+                }
+            }
+        } catch(const boost::bad_lexical_cast&) {
+            return vector<int>();
+        }
+    }
+    return values;
+}
+
+
+
+numa::Topology::Topology()
+{
+    // Only use nodes that have cpus, because memory-only nodes
+    // cannot run the threads that process their data.
+    const string directoryName = "/sys/devices/system/node";
+    for(const int nodeId: parseList(readFirstLine(directoryName + "/online"))) {
+        const vector<int> nodeCpus = parseList(
+            readFirstLine(directoryName + "/node" + lexical_cast<string>(nodeId) + "/cpulist"));
+        if(!nodeCpus.empty()) {
+            nodeIds.push_back(nodeId);
+            cpus.push_back(nodeCpus);
+        }
+    }
+
+    // If the information is not available, behave as a single node system.
+    if(nodeIds.empty()) {
+        nodeIds.push_back(0);
+        cpus.resize(1);
+    }
+}
+
+
+
+const numa::Topology& numa::topology()
+{
+    // Thread safe initialization is guaranteed by C++11.
+    static Topology topology;
+    return topology;
+}
+
+
+
+size_t numa::nodeCount()
+{
+    return topology().nodeIds.size();
+}
+
+
+
+const vector<int>& numa::nodeCpus(size_t node)
+{
+    CZI_ASSERT(node < nodeCount());
+    return topology().cpus[node];
+}
+
+
+
+void numa::pinCurrentThreadToNode(size_t node)
+{
+    const vector<int>& cpus = nodeCpus(node);
+    if(cpus.empty()) {
+        return;
+    }
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for(const int cpu: cpus) {
+        if(cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &cpuSet);
+        }
+    }
+
+    // This can fail if the process is restricted to a subset of the cpus.
+    // In that case, just leave the thread unpinned.
+    ::sched_setaffinity(0, sizeof(cpuSet), &cpuSet);
+}
+
+
+
+string numa::policyToString(Policy policy)
+{
+    switch(policy) {
+    case Policy::none:          return "none";
+    case Policy::interleave:    return "interleave";
+    case Policy::partitioned:   return "partitioned";
+    }
+    CZI_ASSERT(0);
+}
+numa::Policy numa::policyFromString(const string& s)
+{
+    if(s == "none") {
+        return Policy::none;
+    }
+    if(s == "interleave") {
+        return Policy::interleave;
+    }
+    if(s == "partitioned") {
+        return Policy::partitioned;
+    }
+    throw runtime_error("Invalid NUMA policy " + s + ". Valid values are none, interleave, partitioned.");
+}
+
+
+
+template<class NodeIndex> vector<size_t> numa::placePages(
+    const void* begin, const void* end, const NodeIndex& nodeIndex)
+{
+    const size_t n = nodeCount();
+    vector<size_t> pageCountPerNode(n, 0);
+    if(n == 1 || end <= begin) {
+        return pageCountPerNode;
+    }
+
+    // Find the pages that intersect [begin, end).
+    const uintptr_t pageSize = uintptr_t(::sysconf(_SC_PAGESIZE));
+    const uintptr_t firstPage = reinterpret_cast<uintptr_t>(begin) & ~(pageSize - 1);
+    const uintptr_t lastPage = (reinterpret_cast<uintptr_t>(end) - 1) & ~(pageSize - 1);
+    const size_t pageCount = (lastPage - firstPage) / pageSize + 1;
+
+    // Make all pages resident, so move_pages can find them.
+    // Reading one byte per page is sufficient.
+    parallelForChunks(0, pageCount, [&](size_t pageBegin, size_t pageEnd)
+        {
+            for(size_t page=pageBegin; page!=pageEnd; ++page) {
+                const volatile char* p = reinterpret_cast<const volatile char*>(firstPage + page * pageSize);
+                (void) *p;
+            }
+        });
+
+    // Move the pages in batches.
+    const vector<int>& nodeIds = topology().nodeIds;
+    const size_t batchSize = 1 << 16;
+    vector<void*> pages;
+    vector<int> nodes;
+    vector<int> status;
+    for(size_t batchBegin=0; batchBegin<pageCount; batchBegin+=batchSize) {
+        const size_t batchEnd = std::min(pageCount, batchBegin + batchSize);
+        pages.clear();
+        nodes.clear();
+        for(size_t page=batchBegin; page!=batchEnd; ++page) {
+            pages.push_back(reinterpret_cast<void*>(firstPage + page * pageSize));
+            nodes.push_back(nodeIds[nodeIndex(page, pageCount)]);
+        }
+        status.resize(pages.size());
+        const long result = ::syscall(SYS_move_pages, 0, pages.size(),
+            pages.data(), nodes.data(), status.data(), MPOL_MF_MOVE);
+        if(result < 0) {
+            cout << "Unable to place memory on NUMA nodes: " << std::strerror(errno) << endl;
+            return pageCountPerNode;
+        }
+
+        // Pages that could not be moved (for example because they are mapped
+        // by other processes) have a negative status and are not counted.
+        for(const int nodeId: status) {
+            const auto it = std::find(nodeIds.begin(), nodeIds.end(), nodeId);
+            if(it != nodeIds.end()) {
+                ++pageCountPerNode[it - nodeIds.begin()];
+            }
+        }
+    }
+    return pageCountPerNode;
+}
+
+
+
+vector<size_t> numa::applyPolicy(const void* begin, const void* end, Policy policy)
+{
+    const size_t n = nodeCount();
+    switch(policy) {
+    case Policy::none:
+        return vector<size_t>(n, 0);
+    case Policy::interleave:
+        return placePages(begin, end, [n](size_t page, size_t)
+            {
+                return page % n;
+            });
+    case Policy::partitioned:
+        return placePages(begin, end, [n](size_t page, size_t pageCount)
+            {
+                // Same slicing as partitionBegin.
+                return (page * n) / pageCount;
+            });
+    }
+    CZI_ASSERT(0);
+}
+
+
+
+vector<size_t> numa::applyPartition(const vector<const void*>& boundaries)
+{
+    const size_t n = nodeCount();
+    CZI_ASSERT(boundaries.size() == n + 1);
+    vector<size_t> pageCountPerNode(n, 0);
+    for(size_t node=0; node<n; node++) {
+        const vector<size_t> nodePageCount = placePages(boundaries[node], boundaries[node+1],
+            [node](size_t, size_t)
+            {
+                return node;
+            });
+        for(size_t i=0; i<n; i++) {
+            pageCountPerNode[i] += nodePageCount[i];
+        }
+    }
+    return pageCountPerNode;
+}
+
+
+
+void numa::writePlacement(ostream& s, const vector<size_t>& pageCountPerNode)
+{
+    s << "Pages on each NUMA node:";
+    for(const size_t pageCount: pageCountPerNode) {
+        s << " " << pageCount;
+    }
+    s << endl;
+}
+
+
+
+numa::AllocationStatistics::AllocationStatistics()
+{
+    for(const int nodeId: topology().nodeIds) {
+        NodeAllocationStatistics nodeStatistics;
+        ifstream file("/sys/devices/system/node/node" + lexical_cast<string>(nodeId) + "/numastat");
+        string key;
+        uint64_t value;
+        while(file >> key >> value) {
+            if(key == "numa_hit") {
+                nodeStatistics.numaHit = value;
+            } else if(key == "numa_miss") {
+                nodeStatistics.numaMiss = value;
+            } else if(key == "numa_foreign") {
+                nodeStatistics.numaForeign = value;
+            } else if(key == "interleave_hit") {
+                nodeStatistics.interleaveHit = value;
+            } else if(key == "local_node") {
+                nodeStatistics.localNode = value;
+            } else if(key == "other_node") {
+                nodeStatistics.otherNode = value;
+            }
+        }
+        nodes.push_back(nodeStatistics);
+    }
+}
+
+
+
+void numa::AllocationStatistics::writeChanges(ostream& s, const AllocationStatistics& earlier) const
+{
+    CZI_ASSERT(nodes.size() == earlier.nodes.size());
+    uint64_t totalLocal = 0;
+    uint64_t totalOther = 0;
+    for(size_t node=0; node<nodes.size(); node++) {
+        const NodeAllocationStatistics& now = nodes[node];
+        const NodeAllocationStatistics& then = earlier.nodes[node];
+        const uint64_t local = now.localNode - then.localNode;
+        const uint64_t other = now.otherNode - then.otherNode;
+        s << "NUMA node " << node << ": " << local << " local and " << other <<
+            " remote page allocations, " << now.numaMiss - then.numaMiss << " allocation misses." << endl;
+        totalLocal += local;
+        totalOther += other;
+    }
+    if(totalLocal + totalOther > 0) {
+        s << "Fraction of remote page allocations: " <<
+            double(totalOther) / double(totalLocal + totalOther) << endl;
+    }
+}
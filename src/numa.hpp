@@ -0,0 +1,112 @@
+// Minimal support for NUMA (non-uniform memory access) systems.
+
+#ifndef CZI_EXPRESSION_MATRIX2_NUMA_HPP
+#define CZI_EXPRESSION_MATRIX2_NUMA_HPP
+
+/*******************************************************************************
+
+On machines with more than one NUMA node, memory attached to
+one socket is slower to access from the cores of the other sockets.
+Without intervention, the pages of our memory mapped containers
+end up on the node of the thread that first touched them,
+which is typically the single thread that created the container.
+All other threads then access them remotely.
+
+The functions here control where the pages of a memory range are placed:
+- Interleave: pages are placed round robin on all nodes.
+  Good for data that is accessed randomly by all threads.
+- Partitioned: the range is divided into one contiguous slice per node,
+  and the pages of each slice are placed on that node. Used together
+  with parallelForChunksByNode (see TaskScheduler.hpp), which
+  processes each slice with worker threads pinned to the same node.
+
+Our containers are MAP_SHARED file mappings, for which the kernel ignores
+memory policies set with mbind, so placement is done by migrating the
+pages with the move_pages system call after making them resident.
+Pages stay in the page cache where we put them, so placement
+persists until they are evicted.
+
+We use system calls and the information in /sys/devices/system/node
+directly instead of linking with libnuma. This avoids introducing
+a runtime dependency. On systems with a single NUMA node
+(or where the information is not available) everything here is a no-op.
+
+*******************************************************************************/
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "iostream.hpp"
+#include "string.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace numa {
+
+            // The number of NUMA nodes. This is 1 on non-NUMA systems.
+            size_t nodeCount();
+
+            // The cpus belonging to a node. The node is specified
+            // as an index between 0 and nodeCount()-1.
+            const vector<int>& nodeCpus(size_t node);
+
+            // Restrict the current thread to run on the cpus of the specified node.
+            void pinCurrentThreadToNode(size_t node);
+
+            // Memory placement policies.
+            enum class Policy {none, interleave, partitioned};
+            string policyToString(Policy);
+            Policy policyFromString(const string&);  // Throws for invalid strings.
+
+            // The first element of slice k when n elements are divided
+            // into nodeCount contiguous slices of nearly equal size.
+            // Used by both memory placement and parallelForChunksByNode,
+            // so the two always agree.
+            inline size_t partitionBegin(size_t k, size_t n, size_t nodeCount)
+            {
+                return (k * n + nodeCount - 1) / nodeCount;
+            }
+
+            // Place the pages of [begin, end) according to a policy.
+            // Returns the number of pages placed on each node after the operation.
+            vector<size_t> applyPolicy(const void* begin, const void* end, Policy);
+
+            // Place pages explicitly: the pages in [boundaries[k], boundaries[k+1])
+            // are placed on node k. There must be nodeCount()+1 boundaries.
+            // Returns the number of pages placed on each node after the operation.
+            vector<size_t> applyPartition(const vector<const void*>& boundaries);
+
+            // Write a one line summary of page placement returned by the above functions.
+            void writePlacement(ostream&, const vector<size_t>& pageCountPerNode);
+
+            // Page allocation statistics, as maintained by the kernel in
+            // /sys/devices/system/node/node*/numastat.
+            // These count pages allocated on each node (otherNode counts
+            // pages allocated on a node for a process running on another node),
+            // not memory accesses, so they don't measure cross-node
+            // memory traffic. That requires hardware performance counters.
+            class NodeAllocationStatistics {
+            public:
+                uint64_t numaHit = 0;
+                uint64_t numaMiss = 0;
+                uint64_t numaForeign = 0;
+                uint64_t interleaveHit = 0;
+                uint64_t localNode = 0;
+                uint64_t otherNode = 0;
+            };
+            class AllocationStatistics {
+            public:
+
+                // Construct a snapshot of the current statistics.
+                AllocationStatistics();
+
+                vector<NodeAllocationStatistics> nodes;
+
+                // Write the changes since an earlier snapshot.
+                void writeChanges(ostream&, const AllocationStatistics& earlier) const;
+            };
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,410 @@
+#include "similarityKernels.hpp"
+#include "CZI_ASSERT.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include <algorithm>
+#include <cmath>
+#include "iostream.hpp"
+#include <random>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace {
+
+            inline bool isMember(const uint64_t* membership, size_t membershipWordCount, GeneId geneId)
+            {
+                const size_t word = geneId >> 6;
+                return (word < membershipWordCount) && ((membership[word] >> (geneId & 63)) & 1);
+            }
+
+#ifdef __SSE2__
+            // Compare the four gene ids of block 0 with the gene ids of block 1
+            // rotated as specified by the shuffle control, and accumulate products and minima
+            // of the values that match. Because gene ids in a block are distinct,
+            // each lane of block 0 matches at most once over the four rotations,
+            // so the accumulated values are exact and aligned with block 0.
+            template<int rotation> inline void intersectRotated(
+                __m128i geneIds0, __m128 values0,
+                __m128i geneIds1, __m128 values1,
+                __m128& products, __m128& minima, __m128& matches)
+            {
+                const __m128 match = _mm_castsi128_ps(_mm_cmpeq_epi32(
+                    geneIds0, _mm_shuffle_epi32(geneIds1, rotation)));
+                const __m128 rotatedValues1 = _mm_castsi128_ps(_mm_shuffle_epi32(
+                    _mm_castps_si128(values1), rotation));
+                products = _mm_add_ps(products, _mm_and_ps(match, _mm_mul_ps(values0, rotatedValues1)));
+                minima = _mm_add_ps(minima, _mm_and_ps(match, _mm_min_ps(values0, rotatedValues1)));
+                matches = _mm_or_ps(matches, match);
+            }
+
+            // Add the four floats to two accumulators of two doubles each.
+            inline void accumulate(__m128 x, __m128d& low, __m128d& high)
+            {
+                low = _mm_add_pd(low, _mm_cvtps_pd(x));
+                high = _mm_add_pd(high, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+            }
+
+            inline double horizontalSum(__m128d low, __m128d high)
+            {
+                const __m128d s = _mm_add_pd(low, high);
+                return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+            }
+#endif
+        }
+    }
+}
+
+
+
+// Each pair(GeneId, count) occupies two 32-bit words, so two loads give
+// four gene ids and four counts, which are separated by shuffles.
+// After comparing a block of four from each vector, we advance the block
+// with the smaller last gene id, or both if they are equal.
+// A match can only occur between blocks that are current at the same time,
+// so each match is found exactly once.
+SparseIntersectionSums ChanZuckerberg::ExpressionMatrix2::computeSparseIntersectionSums(
+    const pair<GeneId, float>* begin0,
+    const pair<GeneId, float>* end0,
+    const pair<GeneId, float>* begin1,
+    const pair<GeneId, float>* end1,
+    const uint64_t* membership,
+    size_t membershipWordCount)
+{
+    static_assert(sizeof(pair<GeneId, float>) == 2*sizeof(float),
+        "Unexpected layout of expression counts.");
+    SparseIntersectionSums sums;
+    const pair<GeneId, float>* it0 = begin0;
+    const pair<GeneId, float>* it1 = begin1;
+
+#ifdef __SSE2__
+    __m128d sum01Low = _mm_setzero_pd();
+    __m128d sum01High = _mm_setzero_pd();
+    __m128d sumMinLow = _mm_setzero_pd();
+    __m128d sumMinHigh = _mm_setzero_pd();
+    while(it0+4 <= end0 && it1+4 <= end1) {
+        const float* p0 = reinterpret_cast<const float*>(it0);
+        const float* p1 = reinterpret_cast<const float*>(it1);
+        const __m128 a0 = _mm_loadu_ps(p0);
+        const __m128 b0 = _mm_loadu_ps(p0 + 4);
+        const __m128 a1 = _mm_loadu_ps(p1);
+        const __m128 b1 = _mm_loadu_ps(p1 + 4);
+        const __m128i geneIds0 = _mm_castps_si128(_mm_shuffle_ps(a0, b0, _MM_SHUFFLE(2, 0, 2, 0)));
+        const __m128i geneIds1 = _mm_castps_si128(_mm_shuffle_ps(a1, b1, _MM_SHUFFLE(2, 0, 2, 0)));
+        const __m128 values0 = _mm_shuffle_ps(a0, b0, _MM_SHUFFLE(3, 1, 3, 1));
+        const __m128 values1 = _mm_shuffle_ps(a1, b1, _MM_SHUFFLE(3, 1, 3, 1));
+
+        __m128 products = _mm_setzero_ps();
+        __m128 minima = _mm_setzero_ps();
+        __m128 matches = _mm_setzero_ps();
+        intersectRotated<_MM_SHUFFLE(3, 2, 1, 0)>(geneIds0, values0, geneIds1, values1, products, minima, matches);
+        intersectRotated<_MM_SHUFFLE(0, 3, 2, 1)>(geneIds0, values0, geneIds1, values1, products, minima, matches);
+        intersectRotated<_MM_SHUFFLE(1, 0, 3, 2)>(geneIds0, values0, geneIds1, values1, products, minima, matches);
+        intersectRotated<_MM_SHUFFLE(2, 1, 0, 3)>(geneIds0, values0, geneIds1, values1, products, minima, matches);
+
+        const int matchMask = _mm_movemask_ps(matches);
+        if(matchMask) {
+            if(membership) {
+                // Only keep the lanes for genes in the gene set.
+                const __m128 memberMask = _mm_castsi128_ps(_mm_set_epi32(
+                    -int(isMember(membership, membershipWordCount, it0[3].first)),
+                    -int(isMember(membership, membershipWordCount, it0[2].first)),
+                    -int(isMember(membership, membershipWordCount, it0[1].first)),
+                    -int(isMember(membership, membershipWordCount, it0[0].first))));
+                products = _mm_and_ps(products, memberMask);
+                minima = _mm_and_ps(minima, memberMask);
+            }
+            accumulate(products, sum01Low, sum01High);
+            accumulate(minima, sumMinLow, sumMinHigh);
+        }
+
+        const GeneId last0 = it0[3].first;
+        const GeneId last1 = it1[3].first;
+        it0 += (last0 <= last1) ? 4 : 0;
+        it1 += (last1 <= last0) ? 4 : 0;
+    }
+    sums.sum01 = horizontalSum(sum01Low, sum01High);
+    sums.sumMin = horizontalSum(sumMinLow, sumMinHigh);
+#endif
+
+    // Scalar merge for the remainder.
+    while((it0 != end0) && (it1 != end1)) {
+        const GeneId geneId0 = it0->first;
+        const GeneId geneId1 = it1->first;
+        if(geneId0 < geneId1) {
+            ++it0;
+        } else if(geneId1 < geneId0) {
+            ++it1;
+        } else {
+            if(!membership || isMember(membership, membershipWordCount, geneId0)) {
+                sums.sum01 += it0->second * it1->second;
+                sums.sumMin += std::min(it0->second, it1->second);
+            }
+            ++it0;
+            ++it1;
+        }
+    }
+
+    return sums;
+}
+
+
+
+double ChanZuckerberg::ExpressionMatrix2::computeSimilarityFromSums(
+    SimilarityMetric similarityMetric,
+    double n,
+    double sum0, double sum00,
+    double sum1, double sum11,
+    const SparseIntersectionSums& sums)
+{
+    switch(similarityMetric) {
+
+    // Correlation coefficient.
+    // See, for example, https://en.wikipedia.org/wiki/Correlation_and_dependence
+    case SimilarityMetric::Pearson:
+    case SimilarityMetric::Spearman:
+        return (n*sums.sum01 - sum0*sum1) /
+            std::sqrt((n*sum00 - sum0*sum0) * (n*sum11 - sum1*sum1));
+
+    case SimilarityMetric::Cosine:
+        return sums.sum01 / std::sqrt(sum00 * sum11);
+
+    // Sum of max(x, y) is sum0 + sum1 - sum of min(x, y).
+    case SimilarityMetric::WeightedJaccard:
+        return sums.sumMin / (sum0 + sum1 - sums.sumMin);
+
+    case SimilarityMetric::Euclidean:
+        return 1. / (1. + std::sqrt(std::max(0., sum00 + sum11 - 2.*sums.sum01)));
+
+    default:
+        CZI_ASSERT(0);
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::computeSparseRanks(
+    const pair<GeneId, float>* begin,
+    const pair<GeneId, float>* end,
+    size_t n,
+    vector< pair<GeneId, float> >& ranks,
+    double& sum1,
+    double& sum2)
+{
+    // Only keep non-zero counts.
+    ranks.clear();
+    for(const pair<GeneId, float>* it=begin; it!=end; ++it) {
+        if(it->second > 0.f) {
+            ranks.push_back(*it);
+        }
+    }
+    const size_t k = ranks.size();
+    CZI_ASSERT(k <= n);
+
+    // Sort the positions of the non-zero counts by count.
+    vector<size_t> order(k);
+    for(size_t i=0; i<k; i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(),
+        [&ranks](size_t i, size_t j) { return ranks[i].second < ranks[j].second; });
+
+    // The n-k zero counts have ranks 1 through n-k, with average (n-k+1)/2.
+    // The non-zero count with rank r among the non-zero counts
+    // has rank n-k+r, which becomes r+(n-k-1)/2 after subtracting
+    // the average rank of the zero counts.
+    // Tied counts get the average of their ranks.
+    const double shift = 0.5 * (double(n) - double(k) - 1.);
+    sum1 = 0.;
+    sum2 = 0.;
+    for(size_t i=0; i<k; ) {
+        size_t j = i + 1;
+        while(j<k && ranks[order[j]].second == ranks[order[i]].second) {
+            ++j;
+        }
+        const double rank = 0.5 * double(i + 1 + j) + shift;
+        for(size_t l=i; l<j; l++) {
+            ranks[order[l]].second = float(rank);
+        }
+        sum1 += double(j - i) * rank;
+        sum2 += double(j - i) * rank * rank;
+        i = j;
+    }
+}
+
+
+
+// Check the kernels against computations on dense expression vectors,
+// for all similarity metrics, with and without a membership bitmap.
+// Counts are small integers, so there are many ties for Spearman.
+void ChanZuckerberg::ExpressionMatrix2::testSimilarityKernels()
+{
+    std::mt19937 randomGenerator(231);
+    std::uniform_int_distribution<int> countDistribution(-8, 4);
+    const GeneId geneCount = 300;
+
+    // The genes with an odd GeneId or a GeneId less than 10.
+    vector<uint64_t> membership((geneCount + 63) / 64, 0);
+    for(GeneId geneId=0; geneId<geneCount; geneId++) {
+        if(geneId%2 == 1 || geneId < 10) {
+            membership[geneId >> 6] |= (uint64_t(1) << (geneId & 63));
+        }
+    }
+
+    // Return the ranks of a dense vector, with ties getting their average rank.
+    const auto computeDenseRanks = [](const vector<double>& x)
+    {
+        const size_t n = x.size();
+        vector<size_t> order(n);
+        for(size_t i=0; i<n; i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&x](size_t i, size_t j) { return x[i] < x[j]; });
+        vector<double> ranks(n);
+        for(size_t i=0; i<n; ) {
+            size_t j = i + 1;
+            while(j<n && x[order[j]] == x[order[i]]) {
+                ++j;
+            }
+            for(size_t k=i; k<j; k++) {
+                ranks[order[k]] = 0.5 * double(i + 1 + j);
+            }
+            i = j;
+        }
+        return ranks;
+    };
+
+    for(int useMembership=0; useMembership<2; useMembership++) {
+        const uint64_t* membershipPointer = useMembership ? membership.data() : 0;
+        const size_t membershipWordCount = useMembership ? membership.size() : 0;
+        const auto isMemberGene = [&](GeneId geneId)
+        {
+            return !useMembership || isMember(membershipPointer, membershipWordCount, geneId);
+        };
+        size_t n = 0;
+        for(GeneId geneId=0; geneId<geneCount; geneId++) {
+            if(isMemberGene(geneId)) {
+                ++n;
+            }
+        }
+
+        for(int iteration=0; iteration<100; iteration++) {
+
+            // Generate two random sparse vectors, and the corresponding
+            // dense vectors for the member genes.
+            vector< pair<GeneId, float> > x[2];
+            vector<double> dense[2];
+            double sum[2] = {0., 0.};
+            double sumSquares[2] = {0., 0.};
+            for(int k=0; k<2; k++) {
+                for(GeneId geneId=0; geneId<geneCount; geneId++) {
+                    const int count = std::max(0, countDistribution(randomGenerator));
+                    if(count > 0) {
+                        x[k].push_back(make_pair(geneId, float(count)));
+                    }
+                    if(isMemberGene(geneId)) {
+                        dense[k].push_back(double(count));
+                        sum[k] += count;
+                        sumSquares[k] += count * count;
+                    }
+                }
+            }
+            if(sum[0] == 0. || sum[1] == 0.) {
+                continue;
+            }
+
+            // Check the intersection sums.
+            const SparseIntersectionSums sums = computeSparseIntersectionSums(
+                x[0].data(), x[0].data() + x[0].size(),
+                x[1].data(), x[1].data() + x[1].size(),
+                membershipPointer, membershipWordCount);
+            double expectedSum01 = 0.;
+            double expectedSumMin = 0.;
+            double expectedSumMax = 0.;
+            double expectedDistance2 = 0.;
+            for(size_t i=0; i<n; i++) {
+                expectedSum01 += dense[0][i] * dense[1][i];
+                expectedSumMin += std::min(dense[0][i], dense[1][i]);
+                expectedSumMax += std::max(dense[0][i], dense[1][i]);
+                expectedDistance2 += (dense[0][i] - dense[1][i]) * (dense[0][i] - dense[1][i]);
+            }
+            CZI_ASSERT(sums.sum01 == expectedSum01);
+            CZI_ASSERT(sums.sumMin == expectedSumMin);
+
+            // Check the similarity for each metric.
+            const auto pearson = [n](const vector<double>& a, const vector<double>& b)
+            {
+                double meanA = 0.;
+                double meanB = 0.;
+                for(size_t i=0; i<n; i++) {
+                    meanA += a[i];
+                    meanB += b[i];
+                }
+                meanA /= double(n);
+                meanB /= double(n);
+                double ab = 0.;
+                double aa = 0.;
+                double bb = 0.;
+                for(size_t i=0; i<n; i++) {
+                    ab += (a[i] - meanA) * (b[i] - meanB);
+                    aa += (a[i] - meanA) * (a[i] - meanA);
+                    bb += (b[i] - meanB) * (b[i] - meanB);
+                }
+                return ab / std::sqrt(aa * bb);
+            };
+            for(const SimilarityMetric metric: validSimilarityMetrics) {
+                double similarity = 0.;
+                double expectedSimilarity = 0.;
+                if(metric == SimilarityMetric::Spearman) {
+                    vector< pair<GeneId, float> > memberCounts[2];
+                    vector< pair<GeneId, float> > ranks[2];
+                    double rankSum[2];
+                    double rankSumSquares[2];
+                    for(int k=0; k<2; k++) {
+                        for(const auto& p: x[k]) {
+                            if(isMemberGene(p.first)) {
+                                memberCounts[k].push_back(p);
+                            }
+                        }
+                        computeSparseRanks(memberCounts[k].data(), memberCounts[k].data() + memberCounts[k].size(),
+                            n, ranks[k], rankSum[k], rankSumSquares[k]);
+                    }
+                    const SparseIntersectionSums rankSums = computeSparseIntersectionSums(
+                        ranks[0].data(), ranks[0].data() + ranks[0].size(),
+                        ranks[1].data(), ranks[1].data() + ranks[1].size(), 0, 0);
+                    similarity = computeSimilarityFromSums(metric, double(n),
+                        rankSum[0], rankSumSquares[0], rankSum[1], rankSumSquares[1], rankSums);
+                    expectedSimilarity = pearson(computeDenseRanks(dense[0]), computeDenseRanks(dense[1]));
+                } else {
+                    similarity = computeSimilarityFromSums(metric, double(n),
+                        sum[0], sumSquares[0], sum[1], sumSquares[1], sums);
+                    switch(metric) {
+                    case SimilarityMetric::Pearson:
+                        expectedSimilarity = pearson(dense[0], dense[1]);
+                        break;
+                    case SimilarityMetric::Cosine:
+                        expectedSimilarity = expectedSum01 / std::sqrt(sumSquares[0] * sumSquares[1]);
+                        break;
+                    case SimilarityMetric::WeightedJaccard:
+                        expectedSimilarity = expectedSumMin / expectedSumMax;
+                        break;
+                    case SimilarityMetric::Euclidean:
+                        expectedSimilarity = 1. / (1. + std::sqrt(expectedDistance2));
+                        break;
+                    default:
+                        CZI_ASSERT(0);
+                    }
+                }
+                CZI_ASSERT(std::abs(similarity - expectedSimilarity) < 1.e-6);
+            }
+        }
+    }
+
+    cout << "testSimilarityKernels completed successfully." << endl;
+}
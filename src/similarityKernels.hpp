@@ -0,0 +1,80 @@
+#ifndef CZI_EXPRESSION_MATRIX2_SIMILARITY_KERNELS_HPP
+#define CZI_EXPRESSION_MATRIX2_SIMILARITY_KERNELS_HPP
+
+// Kernels used to compute the exact similarity of two cells
+// for any SimilarityMetric.
+
+// All metrics are computed from the sum and sum of squares of the
+// expression counts of each cell (which are cached), plus sums
+// over the genes that are present in both cells.
+// These sums are computed by intersecting the two sparse
+// expression vectors, sorted by GeneId.
+// The intersection uses SSE2 instructions to compare blocks of four
+// gene ids from each cell all against all, without branches,
+// and falls back to a scalar merge for the remainder.
+
+// For SimilarityMetric::Spearman, the expression counts
+// of each cell are first replaced by their ranks. Genes with a zero count
+// all get the same average rank, and all ranks are shifted so that
+// average rank becomes zero. This keeps the ranks sparse, and does not
+// change the correlation coefficient.
+
+#include "Ids.hpp"
+#include "SimilarityMetric.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+
+        // Sums over the genes present in both of two sparse expression vectors.
+        class SparseIntersectionSums {
+        public:
+            double sum01 = 0.;      // Sum of x*y.
+            double sumMin = 0.;     // Sum of min(x, y).
+        };
+
+        // Compute the SparseIntersectionSums of two sparse expression vectors
+        // sorted by GeneId. If membership is not zero, only genes with the corresponding
+        // bit set in the membership bitmap (see GeneSet::contains) contribute.
+        SparseIntersectionSums computeSparseIntersectionSums(
+            const pair<GeneId, float>* begin0,
+            const pair<GeneId, float>* end0,
+            const pair<GeneId, float>* begin1,
+            const pair<GeneId, float>* end1,
+            const uint64_t* membership,
+            size_t membershipWordCount);
+
+        // Compute a similarity given the number of genes n,
+        // the sum and sum of squares of the expression counts of each of the two cells,
+        // and the SparseIntersectionSums of the two cells.
+        // For SimilarityMetric::Spearman, all values must refer to ranks
+        // as computed by computeSparseRanks.
+        double computeSimilarityFromSums(
+            SimilarityMetric,
+            double n,
+            double sum0, double sum00,
+            double sum1, double sum11,
+            const SparseIntersectionSums&);
+
+        // Compute the shifted ranks used for SimilarityMetric::Spearman
+        // for a sparse expression vector sorted by GeneId, containing only
+        // genes in a set of n genes. Counts must be non-negative.
+        // The ranks are stored sorted by GeneId, and only for non-zero counts.
+        void computeSparseRanks(
+            const pair<GeneId, float>* begin,
+            const pair<GeneId, float>* end,
+            size_t n,
+            vector< pair<GeneId, float> >& ranks,
+            double& sum1,   // The sum of the ranks.
+            double& sum2);  // The sum of squares of the ranks.
+
+        // Check the kernels against computations on dense expression vectors.
+        void testSimilarityKernels();
+    }
+}
+
+#endif
@@ -0,0 +1,66 @@
+#!/usr/bin/python3
+
+# Check the OpenCL computation of similar pairs against the CPU computation.
+# This requires a build with BUILD_WITH_OPENCL and any OpenCL device
+# (a CPU implementation such as PoCL is sufficient).
+# The script exits with a non-zero status if the results differ.
+
+# Import the shared library, which behaves as a Python module.
+import ExpressionMatrix2
+import json
+import random
+import sys
+
+
+
+# Create the expression matrix.
+e = ExpressionMatrix2.ExpressionMatrix(
+    directoryName = 'data', 
+    geneCapacity = 1<<18,                # Maximum number of genes.
+    cellCapacity = 1<<16,                # Maximum number of cells.           
+    cellMetaDataNameCapacity = 1<<12,    # Maximum number of distinct cell meta data name strings.
+    cellMetaDataValueCapacity = 1<<20    # Maximum number of distinct cell meta data value strings.
+    )
+
+# Add random cells from a few cell types, so there are
+# pairs of cells with high similarity.
+random.seed(231)
+geneCount = 200
+typeCount = 5
+cellCount = 500
+types = [[random.random() for g in range(geneCount)] for t in range(typeCount)]
+for cellId in range(cellCount):
+    t = cellId % typeCount
+    expressionCounts = {}
+    for g in range(geneCount):
+        count = int(10. * types[t][g] * random.random())
+        if count:
+            expressionCounts['gene%i' % g] = count
+    cell = {'metaData': {'CellName': 'cell%i' % cellId, 'Type': 'type%i' % t}, 'expressionCounts': expressionCounts}
+    e.addCellFromJson(jsonString = json.dumps(cell))
+print('There are %i genes and %i cells.' % (e.geneCount(), e.cellCount()))
+
+
+
+# Find pairs of similar cells on the CPU.
+lshCount = 1024
+seed = 231
+e.findSimilarPairs4(similarPairsName = 'Cpu', lshCount = lshCount, seed = seed)
+
+# Find them again using OpenCL with each of the kernels
+# and the same LSH vectors, and check that the results agree.
+e.computeLshSignatures(lshName = 'Lsh', lshCount = lshCount, seed = seed)
+failed = False
+for kernel in range(3):
+    similarPairsName = 'Gpu%i' % kernel
+    e.findSimilarPairs4Gpu(
+        lshName = 'Lsh', similarPairsName = similarPairsName,
+        lshCount = lshCount, seed = seed, kernel = kernel)
+    if e.compareSimilarPairs(similarPairsName0 = 'Cpu', similarPairsName1 = similarPairsName):
+        print('Kernel %i: OK.' % kernel)
+    else:
+        print('Kernel %i: results differ from the CPU computation.' % kernel)
+        failed = True
+
+if failed:
+    sys.exit(1)